@@ -0,0 +1,442 @@
+/**
+ * Password Verification for the File Transfer Server
+ *
+ * The workers share one queue. A session and the worker serving its
+ * login each hold a reference to the job, so a session that closes before
+ * its verdict arrives just drops its reference and the worker frees the
+ * job when it's done. The queue is bounded; a flood of logins is told to
+ * come back later rather than piling up behind the hashes.
+ *
+ * A token is the expiry, in milliseconds on this process's monotonic
+ * clock, as 16 hex digits, then the HMAC-SHA256 of the username and that
+ * expiry in hex.
+ */
+
+ #define _GNU_SOURCE              // crypt_r(), explicit_bzero()
+
+ #include <stdio.h>
+ #include <stdlib.h>
+ #include <string.h>
+ #include <unistd.h>
+ #include <errno.h>
+ #include <pthread.h>
+ #include <pwd.h>
+
+ #ifdef HAVE_PAM
+ #include <security/pam_appl.h>
+ #else
+ #include <crypt.h>
+ #include <shadow.h>
+ #endif
+
+ #ifdef HAVE_OPENSSL
+ #include <openssl/crypto.h>
+ #include <openssl/evp.h>
+ #include <openssl/hmac.h>
+ #include <openssl/rand.h>
+ #endif
+
+ #include "auth.h"
+ #include "session.h"
+ #include "log.h"
+
+ #define AUTH_BUFFER_SIZE 16384       // For the getpwnam_r()/getspnam_r() entries
+ #define AUTH_KEY_SIZE 32
+ #define AUTH_MAC_SIZE 32             // SHA-256
+
+ static auth_job_t *queue_head;
+ static auth_job_t *queue_tail;
+ static int queued;
+ static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+ static pthread_cond_t queue_ready = PTHREAD_COND_INITIALIZER;
+ static int workers_running;      // Guarded by queue_lock, like the counts below
+ static int workers_wanted;
+
+ #ifdef HAVE_OPENSSL
+ static unsigned char token_key[AUTH_KEY_SIZE];
+ static int have_key;
+ static pthread_rwlock_t key_lock = PTHREAD_RWLOCK_INITIALIZER;
+ #endif
+
+ static void *auth_worker(void *arg);
+ #ifdef HAVE_PAM
+ static int pam_conversation(int count, const struct pam_message **messages,
+                             struct pam_response **responses, void *data);
+ #else
+ static const char *stored_hash(const char *username, char *buffer, size_t size);
+ #endif
+ #ifdef HAVE_OPENSSL
+ static int token_mac(const char *username, uint64_t expires_ms, char hex[2 * AUTH_MAC_SIZE + 1]);
+ #endif
+
+ /**
+  * Starts the auth workers and picks the first token key
+  */
+ int auth_start(int workers) {
+     auth_rotate_key();
+     return auth_set_workers(workers);
+ }
+
+ /**
+  * Grows or shrinks the pool to the given number of workers; a surplus
+  * worker leaves once it has finished the login in hand
+  */
+ int auth_set_workers(int workers) {
+     pthread_mutex_lock(&queue_lock);
+     workers_wanted = workers;
+     while (workers_running < workers_wanted) {
+         pthread_t thread_id;
+         int err = pthread_create(&thread_id, NULL, auth_worker, NULL);
+         if (err != 0) {
+             pthread_mutex_unlock(&queue_lock);
+             log_event(LOG_LEVEL_ERROR, "Auth worker creation failed", "error=%s", strerror(err));
+             return -1;
+         }
+         pthread_detach(thread_id);
+         workers_running++;
+     }
+     pthread_cond_broadcast(&queue_ready);
+     pthread_mutex_unlock(&queue_lock);
+     return 0;
+ }
+
+ /**
+  * Checks a password against the account database; blocks for as long as
+  * the hash takes
+  *
+  * Returns 0 if the password is right.
+  */
+ #ifdef HAVE_PAM
+ int auth_check_password(const char *username, const char *password) {
+     struct pam_conv conv = { pam_conversation, (void *)password };
+     pam_handle_t *pamh = NULL;
+
+     int status = pam_start(AUTH_PAM_SERVICE, username, &conv, &pamh);
+     if (status == PAM_SUCCESS) {
+         status = pam_authenticate(pamh, PAM_SILENT | PAM_DISALLOW_NULL_AUTHTOK);
+     }
+     if (status == PAM_SUCCESS) {
+         status = pam_acct_mgmt(pamh, PAM_SILENT);
+     }
+     if (status != PAM_SUCCESS && status != PAM_AUTH_ERR && status != PAM_USER_UNKNOWN) {
+         log_event(LOG_LEVEL_WARN, "PAM check failed", "user=%s error=\"%s\"", username,
+                   pam_strerror(pamh, status));
+     }
+     pam_end(pamh, status);
+
+     return (status == PAM_SUCCESS) ? 0 : -1;
+ }
+ #else
+ int auth_check_password(const char *username, const char *password) {
+     char buffer[AUTH_BUFFER_SIZE];
+     const char *hash = stored_hash(username, buffer, sizeof(buffer));
+
+     // Locked ("!..."), disabled ("*") and empty hashes never match
+     if (hash == NULL || hash[0] == '\0' || hash[0] == '!' || hash[0] == '*') {
+         return -1;
+     }
+
+     struct crypt_data *data = calloc(1, sizeof(struct crypt_data));
+     if (data == NULL) {
+         return -1;
+     }
+     const char *computed = crypt_r(password, hash, data);
+
+     // Compare the whole string whatever it holds, so timing says nothing of where it differs
+     int differs = (computed == NULL || computed[0] == '*' || strlen(computed) != strlen(hash));
+     if (!differs) {
+         unsigned char diff = 0;
+         for (size_t i = 0; hash[i] != '\0'; i++) {
+             diff |= (unsigned char)(computed[i] ^ hash[i]);
+         }
+         differs = (diff != 0);
+     }
+
+     explicit_bzero(data, sizeof(*data));
+     free(data);
+     explicit_bzero(buffer, sizeof(buffer));
+     return differs ? -1 : 0;
+ }
+ #endif
+
+ /**
+  * Queues a login for the workers
+  *
+  * Returns NULL if the queue is full. Have auth_notify() say when
+  * auth_done() will be true, then call auth_release() once the result has
+  * been read, or to give up on it.
+  * A NULL password means a session token has proven the user, who only
+  * needs resolving.
+  */
+ auth_job_t *auth_submit(const char *username, const char *password) {
+     auth_job_t *job = calloc(1, sizeof(auth_job_t));
+     if (job == NULL) {
+         return NULL;
+     }
+     snprintf(job->username, sizeof(job->username), "%s", username);
+     if (password != NULL) {
+         snprintf(job->password, sizeof(job->password), "%s", password);
+     }
+     job->token_login = (password == NULL);
+     atomic_init(&job->done, 0);
+     atomic_init(&job->refs, 2);
+
+     pthread_mutex_lock(&queue_lock);
+     if (queued >= AUTH_QUEUE_MAX) {
+         pthread_mutex_unlock(&queue_lock);
+         explicit_bzero(job->password, sizeof(job->password));
+         free(job);
+         return NULL;
+     }
+     if (queue_tail != NULL) {
+         queue_tail->next = job;
+     } else {
+         queue_head = job;
+     }
+     queue_tail = job;
+     queued++;
+     pthread_cond_signal(&queue_ready);
+     pthread_mutex_unlock(&queue_lock);
+
+     return job;
+ }
+
+ /**
+  * Whether a worker has reached a verdict on a job
+  */
+ int auth_done(auth_job_t *job) {
+     pthread_mutex_lock(&queue_lock);
+     int done = atomic_load(&job->done);
+     pthread_mutex_unlock(&queue_lock);
+     return done;
+ }
+
+ /**
+  * Has the worker call wake(ctx) once it reaches a verdict on a job
+  *
+  * Returns 1 if it will, or 0 if the verdict is in already. wake() is
+  * called on the worker's thread, with the queue locked, so it must not
+  * block; auth_release() or auth_done() seeing the verdict means the call
+  * is over.
+  */
+ int auth_notify(auth_job_t *job, void (*wake)(void *ctx), void *ctx) {
+     pthread_mutex_lock(&queue_lock);
+     int notified = !atomic_load(&job->done);
+     if (notified) {
+         job->wake = wake;
+         job->wake_ctx = ctx;
+     }
+     pthread_mutex_unlock(&queue_lock);
+     return notified;
+ }
+
+ /**
+  * Drops the session's hold on a job; it's freed once the worker has let
+  * go as well
+  */
+ void auth_release(auth_job_t *job) {
+     // The session is going; the worker must not wake it
+     pthread_mutex_lock(&queue_lock);
+     job->wake = NULL;
+     pthread_mutex_unlock(&queue_lock);
+
+     if (atomic_fetch_sub(&job->refs, 1) == 1) {
+         free(job);
+     }
+ }
+
+ /**
+  * Auth worker: checks queued logins one at a time
+  */
+ static void *auth_worker(void *arg) {
+     (void)arg;
+
+     while (1) {
+         pthread_mutex_lock(&queue_lock);
+         while (queue_head == NULL && workers_running <= workers_wanted) {
+             pthread_cond_wait(&queue_ready, &queue_lock);
+         }
+         if (workers_running > workers_wanted) {
+             workers_running--;
+             pthread_mutex_unlock(&queue_lock);
+             return NULL;
+         }
+         auth_job_t *job = queue_head;
+         queue_head = job->next;
+         if (queue_head == NULL) {
+             queue_tail = NULL;
+         }
+         queued--;
+         pthread_mutex_unlock(&queue_lock);
+
+         // Nobody is waiting on a login whose session has closed
+         if (atomic_load(&job->refs) > 1) {
+             job->status = verify_user(job->username, job->token_login ? NULL : job->password, &job->auth_info,
+                                       job->response, sizeof(job->response));
+         }
+         explicit_bzero(job->password, sizeof(job->password));
+
+         pthread_mutex_lock(&queue_lock);
+         atomic_store(&job->done, 1);
+         if (job->wake != NULL) {
+             job->wake(job->wake_ctx);
+         }
+         pthread_mutex_unlock(&queue_lock);
+
+         if (atomic_fetch_sub(&job->refs, 1) == 1) {
+             free(job);
+         }
+     }
+
+     return NULL;
+ }
+
+ #ifdef HAVE_PAM
+ /**
+  * Answers PAM's password prompt with the password being checked
+  */
+ static int pam_conversation(int count, const struct pam_message **messages,
+                             struct pam_response **responses, void *data) {
+     struct pam_response *replies = calloc(count, sizeof(struct pam_response));
+     if (replies == NULL) {
+         return PAM_BUF_ERR;
+     }
+
+     for (int i = 0; i < count; i++) {
+         if (messages[i]->msg_style == PAM_PROMPT_ECHO_OFF) {
+             replies[i].resp = strdup((const char *)data);
+         }
+     }
+
+     *responses = replies;
+     return PAM_SUCCESS;
+ }
+ #else
+ /**
+  * The user's password hash: the shadow entry if there is one, else the
+  * passwd field
+  */
+ static const char *stored_hash(const char *username, char *buffer, size_t size) {
+     struct spwd sp, *sp_result = NULL;
+     if (getspnam_r(username, &sp, buffer, size, &sp_result) == 0 && sp_result != NULL) {
+         return sp.sp_pwdp;
+     }
+
+     struct passwd pwd, *pw_result = NULL;
+     if (getpwnam_r(username, &pwd, buffer, size, &pw_result) == 0 && pw_result != NULL &&
+         strcmp(pwd.pw_passwd, "x") != 0) {
+         return pwd.pw_passwd;
+     }
+     return NULL;
+ }
+ #endif
+
+ #ifdef HAVE_OPENSSL
+ /**
+  * Writes a token proving the user logged in, good for AUTH_TOKEN_TTL
+  * seconds; returns -1 if tokens aren't available
+  */
+ int auth_token_issue(const char *username, char *token, size_t size) {
+     uint64_t expires_ms = monotonic_ms() + AUTH_TOKEN_TTL * 1000;
+     char mac[2 * AUTH_MAC_SIZE + 1];
+
+     if (token_mac(username, expires_ms, mac) != 0) {
+         return -1;
+     }
+     int n = snprintf(token, size, "%016llx%s", (unsigned long long)expires_ms, mac);
+     return (n > 0 && (size_t)n < size) ? 0 : -1;
+ }
+
+ /**
+  * Whether a token was issued to this user by this process and hasn't
+  * expired
+  */
+ int auth_token_valid(const char *username, const char *token) {
+     char mac[2 * AUTH_MAC_SIZE + 1];
+     char digits[17];
+
+     if (strlen(token) != 16 + 2 * AUTH_MAC_SIZE) {
+         return 0;
+     }
+     memcpy(digits, token, 16);
+     digits[16] = '\0';
+     char *end;
+     uint64_t expires_ms = strtoull(digits, &end, 16);
+     if (*end != '\0' || monotonic_ms() >= expires_ms) {
+         return 0;
+     }
+
+     if (token_mac(username, expires_ms, mac) != 0) {
+         return 0;
+     }
+     return CRYPTO_memcmp(mac, token + 16, 2 * AUTH_MAC_SIZE) == 0;
+ }
+
+ /**
+  * Picks a new token key, retiring every token issued under the old one
+  */
+ void auth_rotate_key(void) {
+     unsigned char key[AUTH_KEY_SIZE];
+     int ok = (RAND_bytes(key, sizeof(key)) == 1);
+
+     pthread_rwlock_wrlock(&key_lock);
+     if (ok) {
+         memcpy(token_key, key, sizeof(key));
+     }
+     have_key = ok;
+     pthread_rwlock_unlock(&key_lock);
+
+     explicit_bzero(key, sizeof(key));
+     if (!ok) {
+         log_event(LOG_LEVEL_WARN, "No random key for session tokens", "tokens=off");
+     }
+ }
+
+ /**
+  * The HMAC of a username and expiry under the current key, in hex
+  */
+ static int token_mac(const char *username, uint64_t expires_ms, char hex[2 * AUTH_MAC_SIZE + 1]) {
+     unsigned char message[MAX_USERNAME_LENGTH + sizeof(uint64_t)];
+     unsigned char mac[EVP_MAX_MD_SIZE];
+     unsigned int mac_len = 0;
+
+     // The name's terminator keeps "ab" + expiry from ever reading as "a" + other bytes
+     size_t name_len = strlen(username) + 1;
+     if (name_len > MAX_USERNAME_LENGTH) {
+         return -1;
+     }
+     memcpy(message, username, name_len);
+     for (int i = 0; i < 8; i++) {
+         message[name_len + i] = (unsigned char)(expires_ms >> (56 - 8 * i));
+     }
+
+     pthread_rwlock_rdlock(&key_lock);
+     int ok = have_key && HMAC(EVP_sha256(), token_key, sizeof(token_key), message, name_len + 8,
+                               mac, &mac_len) != NULL;
+     pthread_rwlock_unlock(&key_lock);
+     if (!ok || mac_len != AUTH_MAC_SIZE) {
+         return -1;
+     }
+
+     for (int i = 0; i < AUTH_MAC_SIZE; i++) {
+         snprintf(hex + 2 * i, 3, "%02x", mac[i]);
+     }
+     return 0;
+ }
+ #else
+ int auth_token_issue(const char *username, char *token, size_t size) {
+     (void)username;
+     (void)token;
+     (void)size;
+     return -1;
+ }
+
+ int auth_token_valid(const char *username, const char *token) {
+     (void)username;
+     (void)token;
+     return 0;
+ }
+
+ void auth_rotate_key(void) {
+ }
+ #endif
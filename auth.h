@@ -0,0 +1,62 @@
+/**
+ * Password Verification for the File Transfer Server
+ *
+ * Checks passwords against the system's account database: through PAM
+ * when built with it (HAVE_PAM), otherwise by hashing with crypt() and
+ * comparing against the shadow entry. A modern hash takes around 100ms by
+ * design, so sessions never check a password themselves; they hand it to
+ * a small pool of auth workers, which wake them with the verdict the way
+ * the committer in durable.c wakes uploads.
+ *
+ * A successful login is answered with a session token: an expiry time
+ * and an HMAC of it and the username, under a key that lives only in this
+ * process. A client that presents a valid token with its next login skips
+ * the hash, and if its identity is cached, the auth workers too. SIGUSR1
+ * replaces the key, so changing a password and sending SIGUSR1 retires
+ * every token issued before. Tokens need OpenSSL; built without it, every
+ * login is hashed.
+ */
+
+ #ifndef AUTH_H
+ #define AUTH_H
+
+ #include <stdatomic.h>
+
+ #include "server.h"
+
+ #define AUTH_DEFAULT_WORKERS 4
+ #define AUTH_QUEUE_MAX 1024          // Logins waiting for a worker before new ones are turned away
+ #define AUTH_RETRY_MS 200            // Retry-after suggested when the queue is full
+ #define AUTH_TOKEN_TTL 900           // Seconds a session token stays valid
+ #define AUTH_PAM_SERVICE "ftserver"  // /etc/pam.d entry consulted with PAM
+
+ // A login waiting for, or done with, a worker
+ typedef struct auth_job {
+     char username[MAX_USERNAME_LENGTH];
+     char password[MAX_PASSWORD_LENGTH];  // Wiped once checked
+     int token_login;             // A session token stood in for the password
+     int status;                  // verify_user() result
+     auth_info_t auth_info;
+     char response[BUFFER_SIZE];
+
+     // Owned by the pool
+     atomic_int done;
+     atomic_int refs;             // The session and the worker each hold one
+     void (*wake)(void *ctx);     // Set by auth_notify(); called as the verdict is in
+     void *wake_ctx;
+     struct auth_job *next;
+ } auth_job_t;
+
+ int auth_start(int workers);
+ int auth_set_workers(int workers);
+ int auth_check_password(const char *username, const char *password);
+ auth_job_t *auth_submit(const char *username, const char *password);
+ int auth_done(auth_job_t *job);
+ int auth_notify(auth_job_t *job, void (*wake)(void *ctx), void *ctx);
+ void auth_release(auth_job_t *job);
+
+ int auth_token_issue(const char *username, char *token, size_t size);
+ int auth_token_valid(const char *username, const char *token);
+ void auth_rotate_key(void);
+
+ #endif
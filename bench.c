@@ -0,0 +1,439 @@
+/**
+ * Load Generator for the File Transfer Server
+ *
+ * Opens many framed sessions at once, each of which authenticates and
+ * uploads a mix of small and large files one after another, then reports
+ * throughput and connect, auth and transfer latency percentiles as text
+ * or JSON. File bodies come from memory, so the client side costs little
+ * more than the socket writes.
+ *
+ * Every session runs on its own thread with a small stack; all of them
+ * wait at a barrier and start together, so the connects arrive at the
+ * server as one burst.
+ */
+
+ #include <stdio.h>
+ #include <stdlib.h>
+ #include <string.h>
+ #include <unistd.h>
+ #include <errno.h>
+ #include <time.h>
+ #include <pthread.h>
+ #include <sys/socket.h>
+ #include <sys/resource.h>
+ #include <netinet/in.h>
+ #include <netinet/tcp.h>
+ #include <arpa/inet.h>
+
+ #include "protocol.h"
+ #include "server.h"
+
+ #define BENCH_DEFAULT_SESSIONS 100
+ #define BENCH_DEFAULT_FILES 10
+ #define BENCH_DEFAULT_SMALL 4096
+ #define BENCH_DEFAULT_LARGE (1024 * 1024)
+ #define BENCH_DEFAULT_LARGE_PERCENT 10
+ #define BENCH_STACK_SIZE (256 * 1024)
+ #define BENCH_REPLY_SIZE 1024
+ #define NO_SAMPLE UINT64_MAX
+
+ // What to run, from the command line
+ typedef struct {
+     struct sockaddr_in server;
+     const char *username;
+     const char *password;
+     const char *department;
+     const char *label;        // Engine or run name copied into the report
+     int sessions;
+     int files;                // Per session
+     uint64_t small_size;
+     uint64_t large_size;
+     int large_percent;
+     int json;
+ } bench_config_t;
+
+ // One session's results; latencies are in microseconds
+ typedef struct {
+     int id;
+     pthread_t thread;
+     uint64_t connect_us;
+     uint64_t auth_us;
+     uint64_t *transfer_us;    // One per file, NO_SAMPLE if it failed
+     uint64_t bytes;
+     int uploaded;
+     int failed;
+     int busy;
+     int session_ok;
+ } session_result_t;
+
+ // Latency percentiles of one stage, in microseconds
+ typedef struct {
+     size_t count;
+     uint64_t p50;
+     uint64_t p99;
+     uint64_t p999;
+     uint64_t max;
+ } latency_t;
+
+ static bench_config_t config;
+ static const char *body;              // Large enough for the large files
+ static pthread_barrier_t start_barrier;
+
+ static void usage(const char *prog);
+ static uint64_t now_us(void);
+ static void *run_session(void *arg);
+ static int upload(int sock, session_result_t *r, uint32_t request_id, uint64_t size);
+ static int read_reply(int sock, ft_header_t *hdr);
+ static int compare_u64(const void *a, const void *b);
+ static void summarise(uint64_t *samples, size_t count, latency_t *lat);
+ static void report(session_result_t *results, double elapsed);
+
+ int main(int argc, char *argv[]) {
+     const char *host = "127.0.0.1";
+     int port = PORT;
+     int opt;
+
+     config.username = "manufacturing_user1";
+     config.password = "password1";
+     config.department = "Manufacturing";
+     config.label = "";
+     config.sessions = BENCH_DEFAULT_SESSIONS;
+     config.files = BENCH_DEFAULT_FILES;
+     config.small_size = BENCH_DEFAULT_SMALL;
+     config.large_size = BENCH_DEFAULT_LARGE;
+     config.large_percent = BENCH_DEFAULT_LARGE_PERCENT;
+
+     while ((opt = getopt(argc, argv, "H:p:c:n:s:S:m:u:P:d:e:j")) != -1) {
+         switch (opt) {
+         case 'H':
+             host = optarg;
+             break;
+         case 'p':
+             port = atoi(optarg);
+             break;
+         case 'c':
+             config.sessions = atoi(optarg);
+             break;
+         case 'n':
+             config.files = atoi(optarg);
+             break;
+         case 's':
+             config.small_size = strtoull(optarg, NULL, 10);
+             break;
+         case 'S':
+             config.large_size = strtoull(optarg, NULL, 10);
+             break;
+         case 'm':
+             config.large_percent = atoi(optarg);
+             break;
+         case 'u':
+             config.username = optarg;
+             break;
+         case 'P':
+             config.password = optarg;
+             break;
+         case 'd':
+             config.department = optarg;
+             break;
+         case 'e':
+             config.label = optarg;
+             break;
+         case 'j':
+             config.json = 1;
+             break;
+         default:
+             usage(argv[0]);
+             return EXIT_FAILURE;
+         }
+     }
+
+     if (config.sessions < 1 || config.files < 0 || config.large_percent < 0 || config.large_percent > 100) {
+         usage(argv[0]);
+         return EXIT_FAILURE;
+     }
+
+     config.server.sin_family = AF_INET;
+     config.server.sin_port = htons(port);
+     if (inet_pton(AF_INET, host, &config.server.sin_addr) <= 0) {
+         fprintf(stderr, "Invalid server address '%s'\n", host);
+         return EXIT_FAILURE;
+     }
+
+     // Every session is a descriptor, so take whatever the hard limit allows
+     struct rlimit rl;
+     if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+         rl.rlim_cur = rl.rlim_max;
+         setrlimit(RLIMIT_NOFILE, &rl);
+     }
+
+     // Incompressible-looking data, in case the server ever looks at it
+     uint64_t body_size = (config.large_size > config.small_size) ? config.large_size : config.small_size;
+     char *data = malloc(body_size + 1);
+     session_result_t *results = calloc(config.sessions, sizeof(session_result_t));
+     uint64_t *transfers = malloc(((size_t)config.sessions * config.files + 1) * sizeof(uint64_t));
+     if (data == NULL || results == NULL || transfers == NULL) {
+         perror("Failed to allocate benchmark state");
+         return EXIT_FAILURE;
+     }
+     uint64_t x = 0x9E3779B97F4A7C15ULL;
+     for (uint64_t i = 0; i < body_size; i++) {
+         x ^= x << 13;
+         x ^= x >> 7;
+         x ^= x << 17;
+         data[i] = (char)x;
+     }
+     body = data;
+
+     pthread_attr_t attr;
+     pthread_attr_init(&attr);
+     pthread_attr_setstacksize(&attr, BENCH_STACK_SIZE);
+     pthread_barrier_init(&start_barrier, NULL, config.sessions + 1);
+
+     int started = 0;
+     for (int i = 0; i < config.sessions; i++) {
+         results[i].id = i;
+         results[i].transfer_us = transfers + (size_t)i * config.files;
+         int err = pthread_create(&results[i].thread, &attr, run_session, &results[i]);
+         if (err != 0) {
+             fprintf(stderr, "Could only start %d sessions: %s\n", i, strerror(err));
+             return EXIT_FAILURE;
+         }
+         started++;
+     }
+
+     pthread_barrier_wait(&start_barrier);
+     uint64_t start = now_us();
+     for (int i = 0; i < started; i++) {
+         pthread_join(results[i].thread, NULL);
+     }
+     double elapsed = (now_us() - start) / 1e6;
+
+     report(results, elapsed);
+
+     pthread_barrier_destroy(&start_barrier);
+     pthread_attr_destroy(&attr);
+     free(transfers);
+     free(results);
+     free(data);
+     return 0;
+ }
+
+ static void usage(const char *prog) {
+     fprintf(stderr, "Usage: %s [-H host] [-p port] [-c sessions] [-n files_per_session] "
+             "[-s small_size] [-S large_size] [-m large_percent] [-u user] [-P password] "
+             "[-d department] [-e label] [-j]\n", prog);
+ }
+
+ /**
+  * Microseconds on the monotonic clock
+  */
+ static uint64_t now_us(void) {
+     struct timespec ts;
+     clock_gettime(CLOCK_MONOTONIC, &ts);
+     return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+ }
+
+ /**
+  * One session: connect, authenticate, upload its files, say goodbye
+  */
+ static void *run_session(void *arg) {
+     session_result_t *r = arg;
+     uint8_t payload[FT_MAX_PAYLOAD];
+     unsigned seed = (unsigned)r->id * 2654435761u + 1;
+     ft_header_t hdr = { 0 };
+     ft_buf_t out;
+
+     r->connect_us = r->auth_us = NO_SAMPLE;
+     for (int i = 0; i < config.files; i++) {
+         r->transfer_us[i] = NO_SAMPLE;
+     }
+
+     pthread_barrier_wait(&start_barrier);
+
+     uint64_t t0 = now_us();
+     int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+     if (sock < 0 || connect(sock, (struct sockaddr *)&config.server, sizeof(config.server)) < 0) {
+         if (sock >= 0) {
+             close(sock);
+         }
+         r->failed = config.files;
+         return NULL;
+     }
+     r->connect_us = now_us() - t0;
+
+     int nodelay = 1;
+     setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+     t0 = now_us();
+     ft_buf_init(&out, payload, sizeof(payload));
+     ft_put_str(&out, config.username);
+     ft_put_str(&out, config.password);
+     if (ft_send_frame(sock, FT_MSG_AUTH, 0, 0, payload, out.pos) != 0 || read_reply(sock, &hdr) != 0 ||
+         hdr.type != FT_MSG_OK) {
+         r->busy = (hdr.type == FT_MSG_BUSY);
+         r->failed = config.files;
+         close(sock);
+         return NULL;
+     }
+     r->auth_us = now_us() - t0;
+     r->session_ok = 1;
+
+     for (int i = 0; i < config.files; i++) {
+         int large = (int)(rand_r(&seed) % 100) < config.large_percent;
+         uint64_t size = large ? config.large_size : config.small_size;
+
+         t0 = now_us();
+         int status = upload(sock, r, i + 1, size);
+         if (status == FT_MSG_OK) {
+             r->transfer_us[i] = now_us() - t0;
+             r->uploaded++;
+             r->bytes += size;
+         } else {
+             r->failed++;
+             if (status < 0) {
+                 r->failed += config.files - i - 1;
+                 close(sock);
+                 return NULL;
+             }
+         }
+     }
+
+     ft_send_frame(sock, FT_MSG_BYE, 0, config.files + 1, NULL, 0);
+     close(sock);
+     return NULL;
+ }
+
+ /**
+  * Sends one file and waits for its reply; returns the reply type or -1
+  */
+ static int upload(int sock, session_result_t *r, uint32_t request_id, uint64_t size) {
+     uint8_t payload[FT_MAX_PAYLOAD];
+     char filename[64];
+     ft_header_t hdr;
+     ft_buf_t out;
+
+     snprintf(filename, sizeof(filename), "bench-%d-%u.dat", r->id, request_id);
+     ft_buf_init(&out, payload, sizeof(payload));
+     if (ft_put_u64(&out, size) != 0 || ft_put_str(&out, config.department) != 0 ||
+         ft_put_str(&out, filename) != 0) {
+         return -1;
+     }
+
+     if (ft_send_frame(sock, FT_MSG_PUT, 0, request_id, payload, out.pos) != 0 ||
+         ft_send_all(sock, body, size) != 0 || read_reply(sock, &hdr) != 0) {
+         return -1;
+     }
+
+     return hdr.type;
+ }
+
+ /**
+  * Reads a reply frame, discarding its text
+  */
+ static int read_reply(int sock, ft_header_t *hdr) {
+     char reply[BENCH_REPLY_SIZE];
+
+     hdr->type = 0;
+     return ft_recv_frame(sock, hdr, reply, sizeof(reply));
+ }
+
+ static int compare_u64(const void *a, const void *b) {
+     uint64_t x = *(const uint64_t *)a;
+     uint64_t y = *(const uint64_t *)b;
+     return (x > y) - (x < y);
+ }
+
+ /**
+  * Nearest-rank percentiles of the samples that were taken
+  */
+ static void summarise(uint64_t *samples, size_t count, latency_t *lat) {
+     size_t n = 0;
+     for (size_t i = 0; i < count; i++) {
+         if (samples[i] != NO_SAMPLE) {
+             samples[n++] = samples[i];
+         }
+     }
+
+     memset(lat, 0, sizeof(*lat));
+     lat->count = n;
+     if (n == 0) {
+         return;
+     }
+
+     qsort(samples, n, sizeof(uint64_t), compare_u64);
+     lat->p50 = samples[(n * 500 + 999) / 1000 - 1];
+     lat->p99 = samples[(n * 990 + 999) / 1000 - 1];
+     lat->p999 = samples[(n * 999 + 999) / 1000 - 1];
+     lat->max = samples[n - 1];
+ }
+
+ /**
+  * Prints the totals and latency percentiles, as text or JSON
+  */
+ static void report(session_result_t *results, double elapsed) {
+     static const char *stages[] = { "connect", "auth", "transfer" };
+     uint64_t *connects = malloc(config.sessions * sizeof(uint64_t));
+     uint64_t *auths = malloc(config.sessions * sizeof(uint64_t));
+     uint64_t bytes = 0;
+     int uploaded = 0, failed = 0, busy = 0, sessions_ok = 0;
+     latency_t lat[3];
+
+     if (connects == NULL || auths == NULL) {
+         perror("Failed to allocate report");
+         free(connects);
+         free(auths);
+         return;
+     }
+
+     for (int i = 0; i < config.sessions; i++) {
+         connects[i] = results[i].connect_us;
+         auths[i] = results[i].auth_us;
+         bytes += results[i].bytes;
+         uploaded += results[i].uploaded;
+         failed += results[i].failed;
+         busy += results[i].busy;
+         sessions_ok += results[i].session_ok;
+     }
+
+     summarise(connects, config.sessions, &lat[0]);
+     summarise(auths, config.sessions, &lat[1]);
+     // The per-file samples are one array, laid out session by session
+     summarise(results[0].transfer_us, (size_t)config.sessions * config.files, &lat[2]);
+
+     double files_per_s = (elapsed > 0) ? uploaded / elapsed : 0;
+     double bytes_per_s = (elapsed > 0) ? bytes / elapsed : 0;
+
+     if (config.json) {
+         printf("{\"label\":\"%s\",\"sessions\":%d,\"sessions_ok\":%d,\"busy\":%d,"
+                "\"files_per_session\":%d,\"small_size\":%llu,\"large_size\":%llu,\"large_percent\":%d,"
+                "\"uploaded\":%d,\"failed\":%d,\"bytes\":%llu,\"elapsed_s\":%.6f,"
+                "\"files_per_s\":%.2f,\"bytes_per_s\":%.0f,\"latency_ms\":{",
+                config.label, config.sessions, sessions_ok, busy, config.files,
+                (unsigned long long)config.small_size, (unsigned long long)config.large_size,
+                config.large_percent, uploaded, failed, (unsigned long long)bytes, elapsed,
+                files_per_s, bytes_per_s);
+         for (int s = 0; s < 3; s++) {
+             printf("%s\"%s\":{\"count\":%zu,\"p50\":%.3f,\"p99\":%.3f,\"p999\":%.3f,\"max\":%.3f}",
+                    (s > 0) ? "," : "", stages[s], lat[s].count, lat[s].p50 / 1000.0,
+                    lat[s].p99 / 1000.0, lat[s].p999 / 1000.0, lat[s].max / 1000.0);
+         }
+         printf("}}\n");
+     } else {
+         if (config.label[0] != '\0') {
+             printf("Run: %s\n", config.label);
+         }
+         printf("Sessions: %d started, %d authenticated, %d refused busy\n",
+                config.sessions, sessions_ok, busy);
+         printf("Files: %d uploaded, %d failed, %.1f MiB in %.2f s\n",
+                uploaded, failed, bytes / (1024.0 * 1024.0), elapsed);
+         printf("Throughput: %.1f files/s, %.1f MiB/s\n", files_per_s, bytes_per_s / (1024.0 * 1024.0));
+         printf("%-10s %8s %10s %10s %10s %10s\n", "Latency", "count", "p50 ms", "p99 ms", "p999 ms", "max ms");
+         for (int s = 0; s < 3; s++) {
+             printf("%-10s %8zu %10.3f %10.3f %10.3f %10.3f\n", stages[s], lat[s].count,
+                    lat[s].p50 / 1000.0, lat[s].p99 / 1000.0, lat[s].p999 / 1000.0, lat[s].max / 1000.0);
+         }
+     }
+
+     free(connects);
+     free(auths);
+ }
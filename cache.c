@@ -0,0 +1,382 @@
+/**
+ * Hot File Cache for the File Transfer Server
+ *
+ * Files are found by department and name, and an entry is only used while
+ * the file's inode, size and mtime still match: uploads are published by
+ * rename(), so a new version is always a new inode and the old entry is
+ * dropped from the table on the next lookup. Downloads still holding the
+ * old entry finish sending the old version from it.
+ *
+ * A miss is sent straight from a descriptor opened for it, and a second
+ * descriptor is handed to the fill thread, which maps the file, prefaults
+ * it and, where RLIMIT_MEMLOCK allows, locks it before adding it to the
+ * table; no engine thread waits on reading it in. A cached file stays in
+ * memory until it is evicted. Downloads are sent from the entry's
+ * descriptor with sendfile(), which reads the same pages.
+ */
+
+ #define _GNU_SOURCE              // MAP_POPULATE
+
+ #include <stdio.h>
+ #include <stdlib.h>
+ #include <string.h>
+ #include <unistd.h>
+ #include <fcntl.h>
+ #include <errno.h>
+ #include <pthread.h>
+ #include <sys/stat.h>
+ #include <sys/mman.h>
+
+ #include "cache.h"
+
+ static cached_file_t *buckets[CACHE_BUCKETS];
+ static cached_file_t *lru_head;      // Most recently used
+ static cached_file_t *lru_tail;
+ static uint64_t cache_capacity = (uint64_t)CACHE_DEFAULT_MB * 1024 * 1024;
+ static uint64_t cache_bytes;
+ static unsigned cache_entries;
+ static uint64_t cache_hits;
+ static uint64_t cache_misses;
+ static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+ static pthread_cond_t fill_ready = PTHREAD_COND_INITIALIZER;
+ static cached_file_t *fill_head;     // Waiting to be read in, oldest first; linked by hash_next
+ static cached_file_t *fill_tail;
+ static cached_file_t *filling;       // Being read in now
+ static unsigned fill_count;
+ static int fill_running;
+
+ static unsigned cache_hash(int dept_id, const char *name);
+ static int same_version(const cached_file_t *f, const struct stat *st);
+ static void lru_unlink(cached_file_t *f);
+ static void lru_push(cached_file_t *f);
+ static void queue_fill(const cached_file_t *f);
+ static int fill_pending(const cached_file_t *f);
+ static void *fill_thread(void *arg);
+ static int insert_entry(cached_file_t *f);
+ static void remove_entry(cached_file_t *f);
+ static void free_file(cached_file_t *f);
+
+ /**
+  * Sets the cap on bytes mapped by cached files; 0 turns caching off
+  */
+ void cache_init(uint64_t max_bytes) {
+     cache_capacity = max_bytes;
+ }
+
+ /**
+  * Starts the thread that reads missed files into the cache
+  */
+ int cache_start(void) {
+     pthread_t thread_id;
+
+     if (cache_capacity == 0) {
+         return 0;
+     }
+     if (pthread_create(&thread_id, NULL, fill_thread, NULL) != 0) {
+         perror("Cache fill thread creation failed");
+         return -1;
+     }
+     pthread_detach(thread_id);
+
+     pthread_mutex_lock(&cache_lock);
+     fill_running = 1;
+     pthread_mutex_unlock(&cache_lock);
+     return 0;
+ }
+
+ /**
+  * Opens a department file for download, from the cache if it's there
+  *
+  * Returns NULL with errno set if the file can't be opened. The caller
+  * sends the file and then gives it back with cache_release().
+  */
+ cached_file_t *cache_open(int dir_fd, int dept_id, const char *name) {
+     struct stat st;
+     unsigned bucket = cache_hash(dept_id, name);
+
+     if (fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+         return NULL;
+     }
+     if (!S_ISREG(st.st_mode)) {
+         errno = EISDIR;
+         return NULL;
+     }
+
+     pthread_mutex_lock(&cache_lock);
+     for (cached_file_t *f = buckets[bucket]; f != NULL; f = f->hash_next) {
+         if (f->dept_id != dept_id || strcmp(f->name, name) != 0) {
+             continue;
+         }
+         if (!same_version(f, &st)) {
+             // Replaced since it was cached
+             remove_entry(f);
+             break;
+         }
+
+         f->refs++;
+         lru_unlink(f);
+         lru_push(f);
+         cache_hits++;
+         pthread_mutex_unlock(&cache_lock);
+         return f;
+     }
+     cache_misses++;
+     pthread_mutex_unlock(&cache_lock);
+
+     cached_file_t *f = calloc(1, sizeof(*f));
+     if (f == NULL) {
+         return NULL;
+     }
+     f->fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+     if (f->fd < 0 || fstat(f->fd, &st) != 0) {
+         int saved_errno = errno;
+         free_file(f);
+         errno = saved_errno;
+         return NULL;
+     }
+     f->size = st.st_size;
+     f->mtime = st.st_mtim;
+     f->dev = st.st_dev;
+     f->ino = st.st_ino;
+     f->dept_id = dept_id;
+     f->refs = 1;
+     snprintf(f->name, sizeof(f->name), "%s", name);
+
+     if (f->size > 0 && f->size <= cache_capacity / CACHE_MAX_FILE_SHARE) {
+         queue_fill(f);
+     }
+     return f;
+ }
+
+ /**
+  * Gives back a file from cache_open()
+  */
+ void cache_release(cached_file_t *f) {
+     pthread_mutex_lock(&cache_lock);
+     int unused = (--f->refs == 0 && !f->cached);
+     pthread_mutex_unlock(&cache_lock);
+
+     if (unused) {
+         free_file(f);
+     }
+ }
+
+ /**
+  * Copies the current counters into stats
+  */
+ void cache_get_stats(cache_stats_t *stats) {
+     pthread_mutex_lock(&cache_lock);
+     stats->hits = cache_hits;
+     stats->misses = cache_misses;
+     stats->bytes = cache_bytes;
+     stats->capacity = cache_capacity;
+     stats->entries = cache_entries;
+     pthread_mutex_unlock(&cache_lock);
+ }
+
+ /**
+  * Picks the bucket for a department file (FNV-1a hash)
+  */
+ static unsigned cache_hash(int dept_id, const char *name) {
+     uint32_t hash = (2166136261u ^ (uint32_t)dept_id) * 16777619u;
+
+     for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+         hash ^= *p;
+         hash *= 16777619u;
+     }
+
+     return hash & (CACHE_BUCKETS - 1);
+ }
+
+ static int same_version(const cached_file_t *f, const struct stat *st) {
+     return f->dev == st->st_dev && f->ino == st->st_ino && f->size == (uint64_t)st->st_size &&
+            f->mtime.tv_sec == st->st_mtim.tv_sec && f->mtime.tv_nsec == st->st_mtim.tv_nsec;
+ }
+
+ static void lru_unlink(cached_file_t *f) {
+     if (f->lru_prev != NULL) {
+         f->lru_prev->lru_next = f->lru_next;
+     } else {
+         lru_head = f->lru_next;
+     }
+     if (f->lru_next != NULL) {
+         f->lru_next->lru_prev = f->lru_prev;
+     } else {
+         lru_tail = f->lru_prev;
+     }
+     f->lru_prev = f->lru_next = NULL;
+ }
+
+ static void lru_push(cached_file_t *f) {
+     f->lru_next = lru_head;
+     if (lru_head != NULL) {
+         lru_head->lru_prev = f;
+     }
+     lru_head = f;
+     if (lru_tail == NULL) {
+         lru_tail = f;
+     }
+ }
+
+ /**
+  * Hands the fill thread a copy of a file just opened for a download, to
+  * be read in and cached, unless it's already on its way
+  */
+ static void queue_fill(const cached_file_t *f) {
+     pthread_mutex_lock(&cache_lock);
+     int wanted = fill_running && fill_count < CACHE_FILL_QUEUE_MAX && !fill_pending(f);
+     pthread_mutex_unlock(&cache_lock);
+     if (!wanted) {
+         return;
+     }
+
+     cached_file_t *entry = malloc(sizeof(*entry));
+     if (entry == NULL) {
+         return;
+     }
+     *entry = *f;
+     entry->refs = 0;
+     entry->fd = fcntl(f->fd, F_DUPFD_CLOEXEC, 0);
+     if (entry->fd < 0) {
+         free(entry);
+         return;
+     }
+
+     pthread_mutex_lock(&cache_lock);
+     if (fill_tail != NULL) {
+         fill_tail->hash_next = entry;
+     } else {
+         fill_head = entry;
+     }
+     fill_tail = entry;
+     fill_count++;
+     pthread_cond_signal(&fill_ready);
+     pthread_mutex_unlock(&cache_lock);
+ }
+
+ /**
+  * Whether the same version of a file is already waiting to be read in;
+  * the caller holds cache_lock
+  */
+ static int fill_pending(const cached_file_t *f) {
+     struct stat st = { .st_dev = f->dev, .st_ino = f->ino, .st_size = f->size, .st_mtim = f->mtime };
+
+     if (filling != NULL && filling->dept_id == f->dept_id && strcmp(filling->name, f->name) == 0 &&
+         same_version(filling, &st)) {
+         return 1;
+     }
+     for (cached_file_t *p = fill_head; p != NULL; p = p->hash_next) {
+         if (p->dept_id == f->dept_id && strcmp(p->name, f->name) == 0 && same_version(p, &st)) {
+             return 1;
+         }
+     }
+     return 0;
+ }
+
+ /**
+  * Reads queued files in, one at a time, and adds them to the table
+  */
+ static void *fill_thread(void *arg) {
+     (void)arg;
+
+     pthread_mutex_lock(&cache_lock);
+     while (1) {
+         while (fill_head == NULL) {
+             pthread_cond_wait(&fill_ready, &cache_lock);
+         }
+
+         cached_file_t *f = fill_head;
+         fill_head = f->hash_next;
+         if (fill_head == NULL) {
+             fill_tail = NULL;
+         }
+         fill_count--;
+         f->hash_next = NULL;
+         filling = f;
+         pthread_mutex_unlock(&cache_lock);
+
+         // Read the file in once, then keep it resident
+         void *data = mmap(NULL, f->size, PROT_READ, MAP_SHARED | MAP_POPULATE, f->fd, 0);
+         if (data != MAP_FAILED) {
+             mlock(data, f->size);
+             f->data = data;
+         }
+
+         pthread_mutex_lock(&cache_lock);
+         filling = NULL;
+         if (f->data == NULL || insert_entry(f) != 0) {
+             free_file(f);
+         }
+     }
+
+     return NULL;
+ }
+
+ /**
+  * Adds a file that has been read in to the table, making room for it
+  * from files nobody is sending; the caller holds cache_lock
+  *
+  * Returns -1 if it doesn't fit.
+  */
+ static int insert_entry(cached_file_t *f) {
+     unsigned bucket = cache_hash(f->dept_id, f->name);
+
+     // Oldest first
+     for (cached_file_t *victim = lru_tail; victim != NULL && cache_bytes + f->size > cache_capacity; ) {
+         cached_file_t *prev = victim->lru_prev;
+         if (victim->refs == 0) {
+             remove_entry(victim);
+         }
+         victim = prev;
+     }
+
+     if (cache_bytes + f->size > cache_capacity) {
+         return -1;
+     }
+
+     // An older version may have been cached meanwhile; the newest wins
+     for (cached_file_t *dup = buckets[bucket]; dup != NULL; dup = dup->hash_next) {
+         if (dup->dept_id == f->dept_id && strcmp(dup->name, f->name) == 0) {
+             remove_entry(dup);
+             break;
+         }
+     }
+
+     f->cached = 1;
+     f->hash_next = buckets[bucket];
+     buckets[bucket] = f;
+     lru_push(f);
+     cache_bytes += f->size;
+     cache_entries++;
+     return 0;
+ }
+
+ /**
+  * Takes an entry out of the table, freeing it unless a download holds it;
+  * the caller holds cache_lock
+  */
+ static void remove_entry(cached_file_t *f) {
+     cached_file_t **link = &buckets[cache_hash(f->dept_id, f->name)];
+     while (*link != f) {
+         link = &(*link)->hash_next;
+     }
+     *link = f->hash_next;
+     lru_unlink(f);
+
+     f->cached = 0;
+     cache_bytes -= f->size;
+     cache_entries--;
+     if (f->refs == 0) {
+         free_file(f);
+     }
+ }
+
+ static void free_file(cached_file_t *f) {
+     if (f->data != NULL) {
+         munmap((void *)f->data, f->size);
+     }
+     if (f->fd >= 0) {
+         close(f->fd);
+     }
+     free(f);
+ }
@@ -0,0 +1,59 @@
+/**
+ * Hot File Cache for the File Transfer Server
+ *
+ * Keeps recently downloaded files open and mapped, so a file that many
+ * clients fetch at once is looked up once, read from disk once and then
+ * served to all of them out of the same page cache pages. Entries are
+ * kept in LRU order under a cap on the bytes mapped; files that don't fit
+ * are still served, straight from a descriptor opened for the request.
+ */
+
+ #ifndef CACHE_H
+ #define CACHE_H
+
+ #include <stdint.h>
+ #include <time.h>
+ #include <sys/types.h>
+
+ #include "server.h"
+
+ #define CACHE_DEFAULT_MB 256
+ #define CACHE_BUCKETS 1024           // Must be a power of two
+ #define CACHE_MAX_FILE_SHARE 4       // No one file may take more than 1/4 of the cache
+ #define CACHE_FILL_QUEUE_MAX 64      // Files waiting to be read in before more misses go uncached
+
+ // A file opened for download; shared by every download of that version
+ typedef struct cached_file {
+     int fd;
+     uint64_t size;
+     struct timespec mtime;
+     const void *data;            // The whole file mapped, or NULL if it isn't cached
+
+     // Owned by the cache
+     int dept_id;
+     char name[MAX_FILEPATH_LENGTH];
+     dev_t dev;
+     ino_t ino;
+     int refs;
+     int cached;                  // Still in the table
+     struct cached_file *hash_next;
+     struct cached_file *lru_prev;
+     struct cached_file *lru_next;
+ } cached_file_t;
+
+ // Snapshot of the cache's counters
+ typedef struct {
+     uint64_t hits;
+     uint64_t misses;
+     uint64_t bytes;              // Mapped by cached files
+     uint64_t capacity;
+     unsigned entries;
+ } cache_stats_t;
+
+ void cache_init(uint64_t max_bytes);
+ int cache_start(void);
+ cached_file_t *cache_open(int dir_fd, int dept_id, const char *name);
+ void cache_release(cached_file_t *f);
+ void cache_get_stats(cache_stats_t *stats);
+
+ #endif
@@ -14,7 +14,24 @@
  #include <sys/stat.h>
  #include <fcntl.h>
  #include <netinet/in.h>
+ #include <netinet/tcp.h>
  #include <errno.h>
+ #include <limits.h>
+ #include <dirent.h>
+ #include <getopt.h>
+ #include <signal.h>
+ #include <time.h>
+ #include <sys/sendfile.h>
+ #include <sys/mman.h>
+ #include <pthread.h>
+ #include <stdatomic.h>
+ 
+ #include "protocol.h"
+ #include "xxhash.h"
+ #include "digest.h"
+ #include "compress.h"
+ #include "delta.h"
+ #include "tls.h"
  
  #define SERVER_IP "127.0.0.1"
  #define PORT 8080
@@ -23,17 +40,412 @@
  #define MAX_PASSWORD_LENGTH 32
  #define MAX_FILEPATH_LENGTH 256
  #define MAX_DEPT_LENGTH 32
+ #define DEFAULT_WINDOW 8         // Pipelined uploads kept in flight in batch mode
+ #define MAX_WINDOW 1024
+ #define MAX_RETRIES 5            // Reconnects when the server is overloaded or a resumable upload drops
+ #define RESUME_DELAY_MS 1000     // Pause before reconnecting to resume an upload
+ #define RESUME_CHUNK_SIZE (1024 * 1024)  // Data covered by each checksum of a resumable upload
+ #define MAX_STREAMS 64
+ #define MIN_RANGE_SIZE (16 * 1024 * 1024)  // Smallest range worth its own connection
+ #define SENDFILE_CHUNK (8 * 1024 * 1024)  // Bytes handed to each sendfile() call
+ #define COPY_BUFFER_SIZE 65536   // Read buffer when sendfile() isn't available
+ #define PROGRESS_INTERVAL_MS 200
+ #define DEFAULT_PARALLEL 4       // Sender connections when uploading paths given on the command line
+ #define MAX_PARALLEL 64
+ #define SCAN_QUEUE_MAX 4096      // Files found by the scan but not yet read ahead
+ #define READAHEAD_BYTES (64 * 1024 * 1024)  // How far the read-ahead stage may get ahead of the senders
+ #define PASSWORD_ENV "FT_PASSWORD"
+ 
+ // Returned by transfer_file() and transfer_directory() when the server was too busy
+ #define TRANSFER_BUSY 1
+ // Returned by offer_hash() and send_delta() when the server wants the file itself
+ #define TRANSFER_NEED 2
+ // Returned by transfer_file() when a resumable upload lost its connection
+ #define TRANSFER_DROPPED 3
+ 
+ // Outcomes of send_file()
+ #define SEND_OK 0
+ #define SEND_SKIPPED -1          // Nothing was sent; the session is still usable
+ #define SEND_BROKEN -2
+ 
+ // An upload that has been sent but not yet acknowledged
+ typedef struct {
+     uint32_t request_id;
+     int have;                    // Sent as a HAVE; a NEED reply is followed by the PUT
+     uint64_t checksum;           // Hash the server should confirm, with -verify
+     char filepath[MAX_FILEPATH_LENGTH];
+ } pending_t;
+
+ // Offer each file's hash before sending it (-dedup)
+ static int dedup;
+ // Upload so that a dropped transfer can carry on where it stopped (-resume)
+ static int resume;
+ // Connections to spread a large file over (-streams)
+ static int streams = 1;
+ // Codec asked for with -compress, or COMPRESS_AUTO to choose by network
+ static int compress_mode = CODEC_NONE;
+ #define COMPRESS_AUTO -1
+ // Send only what changed since the server's copy (-delta)
+ static int delta;
+ // Have the server check each upload against the file's hash before keeping it (-verify)
+ static int verify;
+ // File to fetch instead of uploading (-get), or list the department (-list)
+ static const char *get_name;
+ static int list_only;
+ // List only what changed after this sequence number (-changes)
+ static int changes_only;
+ static uint64_t changes_since;
+ // Connect over TLS (-tls), trusting this CA (-ca) and keeping the session ticket here (-tls-session)
+ static int use_tls;
+ static const char *ca_file;
+ static const char *session_file;
+ // Account and department given on the command line (-user, -dept), skipping the prompts
+ static const char *login_user;
+ static const char *login_dept;
+ // File holding the password (-password-file); otherwise FT_PASSWORD, otherwise a prompt
+ static const char *password_file;
+ // Print a progress line while each upload is sent; off when several go at once
+ static int show_progress = 1;
+ // Token from the server at the last login; later logins present it to skip the password check
+ static char session_token[FT_TOKEN_MAX];
+ static pthread_mutex_t session_token_lock = PTHREAD_MUTEX_INITIALIZER;
+
+ // Where delta_encode() output goes: through the encoder if compressing, then out as chunks
+ typedef struct {
+     int sock;
+     codec_t *encoder;
+ } delta_out_t;
+
+ // One range of a file, sent over its own connection by range_worker()
+ typedef struct {
+     const char *username;
+     const char *password;
+     const char *filepath;
+     const char *department;
+     uint64_t upload_id;
+     uint64_t start;
+     uint64_t end;
+     atomic_uint_least64_t sent;  // Progress of the current attempt
+     atomic_int done;
+     int status;
+ } range_job_t;
+
+ // A file found by the scan, on its way to a sender
+ typedef struct submit_file {
+     char filepath[MAX_FILEPATH_LENGTH];
+     uint64_t size;
+     struct submit_file *next;
+ } submit_file_t;
+
+ // Hands files from one stage of the submit pipeline to the next
+ typedef struct {
+     pthread_mutex_t lock;
+     pthread_cond_t changed;
+     submit_file_t *head;
+     submit_file_t *tail;
+     int count;
+     uint64_t bytes;
+     int max_count;
+     uint64_t max_bytes;
+     int closed;                  // The producer has finished
+     int aborted;                 // The consumers have given up
+ } file_queue_t;
+
+ // Uploads the paths given on the command line: scan -> read-ahead -> senders
+ typedef struct {
+     char *const *paths;
+     int path_count;
+     const char *username;
+     const char *password;
+     const char *department;
+     int window;
+     file_queue_t scanned;        // Found and stat()ed
+     file_queue_t ready;          // Asked into the page cache
+     atomic_int found;
+     atomic_uint_least64_t found_bytes;
+     atomic_int skipped;          // Paths the scan couldn't read
+     atomic_int transferred;
+     atomic_int senders;          // Still running; the last one out aborts the pipeline
+ } submit_t;
  
  // Function prototypes
- int authenticate(int sock);
- int transfer_file(int sock, const char *filepath, const char *department);
+ int connect_to_server();
+ void read_credentials(char *username, char *password);
+ int read_password(char *password);
+ void choose_department(char *department);
+ int authenticate(int sock, const char *username, const char *password, uint64_t *retry_after_ms,
+                  uint64_t *caps);
+ int put_credentials(ft_buf_t *out, const char *username, const char *password, uint16_t *flags);
+ int transfer_directory(int sock, const char *username, const char *password,
+                        const char *dir, const char *department, int window,
+                        uint64_t *retry_after_ms);
+ int start_upload(int sock, uint32_t request_id, const char *filepath, const char *department, int codec,
+                  pending_t *pending, int *in_flight, int *failed);
+ int collect_reply(int sock, const char *department, int codec, pending_t *pending, int *in_flight,
+                   int *transferred, int *failed);
+ int submit_paths(char *const *paths, int path_count, const char *username, const char *password,
+                  const char *department, int parallel, int window);
+ void *scan_worker(void *arg);
+ int scan_path(submit_t *submit, const char *path);
+ void *readahead_worker(void *arg);
+ void *submit_worker(void *arg);
+ void queue_init(file_queue_t *queue, int max_count, uint64_t max_bytes);
+ int queue_push(file_queue_t *queue, submit_file_t *file);
+ submit_file_t *queue_pop(file_queue_t *queue);
+ void queue_close(file_queue_t *queue);
+ void queue_abort(file_queue_t *queue);
+ void queue_destroy(file_queue_t *queue);
+ int transfer_file(int sock, const char *username, const char *password,
+                   const char *filepath, const char *department, uint64_t *retry_after_ms);
+ int offer_hash(int sock, const char *username, const char *password,
+                const char *filepath, const char *department, uint64_t *retry_after_ms, uint64_t *caps);
+ int send_file(int sock, uint32_t request_id, const char *username, const char *password,
+               const char *filepath, const char *department, int codec, uint64_t *checksum);
+ int send_compressed(int sock, int file_fd, codec_t *encoder, off_t size, xxh64_state_t *hash);
+ int send_chunk(void *ctx, const void *data, size_t len);
+ int pick_codec(uint64_t caps);
+ int is_lan_address(const char *ip);
+ int send_have(int sock, uint32_t request_id, const char *filepath, const char *department);
+ int send_delta(int sock, uint32_t request_id, const char *filepath, const char *department, int codec,
+                uint64_t *checksum);
+ int fetch_signatures(int sock, uint32_t request_id, const char *filepath, const char *department,
+                      delta_sigs_t *sigs);
+ int send_delta_data(void *ctx, const void *data, size_t len);
+ int transfer_resumable(int sock, const char *username, const char *password,
+                        const char *filepath, const char *department, uint64_t *retry_after_ms);
+ int send_resumable(int sock, uint32_t request_id, const char *filepath, const char *department,
+                    uint64_t upload_id, uint64_t offset, uint64_t end, uint16_t flags,
+                    atomic_uint_least64_t *sent);
+ int transfer_parallel(int sock, const char *username, const char *password,
+                       const char *filepath, const char *department, uint64_t *retry_after_ms);
+ void *range_worker(void *arg);
+ uint64_t resume_id(const char *filepath, const struct stat *file_stat);
+ int digest_file(const char *filepath, char digest[DIGEST_HEX_SIZE], uint64_t *size);
+ int read_reply(int sock, ft_header_t *hdr, char *response, size_t response_size);
+ int check_busy(const ft_header_t *hdr, const char *response, uint64_t *retry_after_ms);
+ int send_chunked(int sock, int file_fd, xxh64_state_t *hash);
+ int send_checksum(int sock, xxh64_state_t *hash, uint64_t *checksum);
+ void unmap_file(const char *mapped, off_t size);
+ int check_checksum(const ft_header_t *hdr, const char *response, uint64_t checksum);
+ int download_file(int sock, const char *username, const char *password,
+                   const char *name, const char *department, uint64_t *retry_after_ms);
+ int receive_body(int sock, int file_fd, uint64_t size);
+ int list_department(int sock, const char *username, const char *password,
+                     const char *department, uint64_t *retry_after_ms);
+ int print_entries(const ft_header_t *hdr, const char *payload, char *last_name, size_t size);
+ uint64_t monotonic_ms(void);
  
- int main() {
-     int sock = 0;
-     struct sockaddr_in serv_addr;
+ int main(int argc, char *argv[]) {
+     char username[MAX_USERNAME_LENGTH];
+     char password[MAX_PASSWORD_LENGTH];
      char filepath[MAX_FILEPATH_LENGTH];
      char department[MAX_DEPT_LENGTH];
-     int choice;
+     const char *batch_dir = NULL;
+     int window = DEFAULT_WINDOW;
+     int parallel = DEFAULT_PARALLEL;
+     
+     static const struct option options[] = {
+         { "batch", required_argument, NULL, 'b' },
+         { "window", required_argument, NULL, 'w' },
+         { "dedup", no_argument, NULL, 'D' },
+         { "resume", no_argument, NULL, 'R' },
+         { "streams", required_argument, NULL, 's' },
+         { "compress", required_argument, NULL, 'c' },
+         { "delta", no_argument, NULL, 'd' },
+         { "verify", no_argument, NULL, 'V' },
+         { "get", required_argument, NULL, 'g' },
+         { "list", no_argument, NULL, 'l' },
+         { "changes", required_argument, NULL, 'C' },
+         { "tls", no_argument, NULL, 'T' },
+         { "ca", required_argument, NULL, 'A' },
+         { "tls-session", required_argument, NULL, 'S' },
+         { "user", required_argument, NULL, 'u' },
+         { "password-file", required_argument, NULL, 'P' },
+         { "dept", required_argument, NULL, 'e' },
+         { "parallel", required_argument, NULL, 'p' },
+         { NULL, 0, NULL, 0 }
+     };
+     
+     int opt;
+     while ((opt = getopt_long_only(argc, argv, "", options, NULL)) != -1) {
+         switch (opt) {
+         case 'b':
+             batch_dir = optarg;
+             break;
+         case 'w':
+             window = atoi(optarg);
+             if (window < 1 || window > MAX_WINDOW) {
+                 printf("Window must be between 1 and %d\n", MAX_WINDOW);
+                 return -1;
+             }
+             break;
+         case 'D':
+             dedup = 1;
+             break;
+         case 'R':
+             resume = 1;
+             break;
+         case 's':
+             streams = atoi(optarg);
+             if (streams < 1 || streams > MAX_STREAMS) {
+                 printf("Streams must be between 1 and %d\n", MAX_STREAMS);
+                 return -1;
+             }
+             break;
+         case 'c':
+             if (strcmp(optarg, "zstd") == 0) {
+                 compress_mode = CODEC_ZSTD;
+             } else if (strcmp(optarg, "lz4") == 0) {
+                 compress_mode = CODEC_LZ4;
+             } else if (strcmp(optarg, "auto") == 0) {
+                 compress_mode = COMPRESS_AUTO;
+             } else if (strcmp(optarg, "none") == 0) {
+                 compress_mode = CODEC_NONE;
+             } else {
+                 printf("Compression must be zstd, lz4, auto or none\n");
+                 return -1;
+             }
+             break;
+         case 'd':
+             delta = 1;
+             break;
+         case 'V':
+             verify = 1;
+             break;
+         case 'g':
+             get_name = optarg;
+             break;
+         case 'l':
+             list_only = 1;
+             break;
+         case 'C':
+             list_only = changes_only = 1;
+             changes_since = strtoull(optarg, NULL, 10);
+             break;
+         case 'T':
+             use_tls = 1;
+             break;
+         case 'A':
+             use_tls = 1;
+             ca_file = optarg;
+             break;
+         case 'S':
+             use_tls = 1;
+             session_file = optarg;
+             break;
+         case 'u':
+             login_user = optarg;
+             break;
+         case 'P':
+             password_file = optarg;
+             break;
+         case 'e':
+             login_dept = optarg;
+             break;
+         case 'p':
+             parallel = atoi(optarg);
+             if (parallel < 1 || parallel > MAX_PARALLEL) {
+                 printf("Parallel must be between 1 and %d\n", MAX_PARALLEL);
+                 return -1;
+             }
+             break;
+         default:
+             printf("Usage: %s [-batch <dir>] [-window <n>] [-dedup] [-resume] [-streams <n>] "
+                    "[-compress zstd|lz4|auto|none] [-delta] [-verify] [-get <file>] [-list] [-changes <seq>] "
+                    "[-tls] [-ca <file>] [-tls-session <file>] [-user <name>] [-password-file <file>] "
+                    "[-dept <name>] [-parallel <n>] [<path>...]\n", argv[0]);
+             return -1;
+         }
+     }
+     
+     // sendfile() can't suppress SIGPIPE; a closed connection is reported as EPIPE instead
+     signal(SIGPIPE, SIG_IGN);
+     
+     if (use_tls && tls_client_init(ca_file, session_file) != 0) {
+         return -1;
+     }
+     
+     // Files and directories on the command line go up over their own connections
+     if (optind < argc) {
+         read_credentials(username, password);
+         choose_department(department);
+         return submit_paths(argv + optind, argc - optind, username, password, department, parallel, window);
+     }
+     
+     int sock = connect_to_server();
+     if (sock < 0) {
+         return -1;
+     }
+     
+     // Credentials travel with the upload request itself
+     read_credentials(username, password);
+     
+     if (batch_dir == NULL && get_name == NULL && !list_only) {
+         // Get file path from user
+         printf("Enter the file path to transfer: ");
+         fgets(filepath, sizeof(filepath), stdin);
+         filepath[strcspn(filepath, "\n")] = 0; // Remove newline
+     }
+     
+     choose_department(department);
+     
+     int status;
+     for (int attempt = 0; ; attempt++) {
+         uint64_t retry_after_ms = 0;
+         
+         if (list_only) {
+             status = list_department(sock, username, password, department, &retry_after_ms);
+         } else if (get_name != NULL) {
+             status = download_file(sock, username, password, get_name, department, &retry_after_ms);
+         } else if (batch_dir != NULL) {
+             status = transfer_directory(sock, username, password, batch_dir, department, window,
+                                         &retry_after_ms);
+         } else {
+             status = transfer_file(sock, username, password, filepath, department, &retry_after_ms);
+         }
+         tls_close(sock);
+         
+         if (status != TRANSFER_BUSY && status != TRANSFER_DROPPED) {
+             break;
+         }
+         if (attempt == MAX_RETRIES) {
+             printf("Giving up after %d attempts.\n", attempt + 1);
+             return -1;
+         }
+         
+         // Back off as long as the server asked before trying again
+         if (status == TRANSFER_DROPPED) {
+             retry_after_ms = RESUME_DELAY_MS;
+             printf("Connection lost, resuming in %llu ms...\n", (unsigned long long)retry_after_ms);
+         } else {
+             printf("Server busy, retrying in %llu ms...\n", (unsigned long long)retry_after_ms);
+         }
+         usleep(retry_after_ms * 1000);
+         
+         if ((sock = connect_to_server()) < 0) {
+             return -1;
+         }
+     }
+     
+     if (batch_dir != NULL || list_only) {
+         return status;
+     }
+     
+     if (status != 0) {
+         printf("File transfer failed.\n");
+     } else {
+         printf("File transfer completed successfully.\n");
+     }
+     
+     return 0;
+ }
+ 
+ /**
+  * Opens a connection to the server
+  */
+ int connect_to_server() {
+     int sock = 0;
+     struct sockaddr_in serv_addr;
      
      // Create socket
      if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
@@ -48,6 +460,7 @@
      // Convert IPv4 address from text to binary form
      if (inet_pton(AF_INET, SERVER_IP, &serv_addr.sin_addr) <= 0) {
          printf("Invalid address or address not supported\n");
+         close(sock);
          return -1;
      }
      
@@ -55,189 +468,2105 @@
      printf("Connecting to server at %s:%d...\n", SERVER_IP, PORT);
      if (connect(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
          printf("Connection failed: %s\n", strerror(errno));
+         close(sock);
          return -1;
      }
      
-     printf("Connected to server.\n");
+     // Requests are written as whole frames, so don't let Nagle hold them back
+     int nodelay = 1;
+     setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
      
-     // Authenticate user
-     if (authenticate(sock) != 0) {
-         printf("Authentication failed.\n");
-         close(sock);
-         return -1;
+     if (tls_client_enabled()) {
+         if (tls_connect(sock, SERVER_IP) != 0) {
+             close(sock);
+             return -1;
+         }
+         char tls[96];
+         printf("Connected to server over %s.\n", tls_describe(tls_get(sock), tls, sizeof(tls)));
+         return sock;
      }
      
-     // Get file path from user
-     printf("Enter the file path to transfer: ");
-     fgets(filepath, sizeof(filepath), stdin);
-     filepath[strcspn(filepath, "\n")] = 0; // Remove newline
+     printf("Connected to server.\n");
+     return sock;
+ }
+ 
+ /**
+  * Prompts for the destination department, unless -dept named it
+  *
+  * Any department the server knows can be entered by name; the two
+  * listed ones can also be picked by number.
+  */
+ void choose_department(char *department) {
+     char choice[MAX_DEPT_LENGTH];
+     
+     if (login_dept != NULL) {
+         snprintf(department, MAX_DEPT_LENGTH, "%s", login_dept);
+         return;
+     }
      
-     // Choose department
      do {
          printf("\nSelect destination department:\n");
          printf("1. Manufacturing\n");
          printf("2. Distribution\n");
-         printf("Choice: ");
-         scanf("%d", &choice);
-         getchar(); // Consume newline
+         printf("Choice (or department name): ");
+         if (fgets(choice, sizeof(choice), stdin) == NULL) {
+             printf("\nNo department chosen\n");
+             exit(EXIT_FAILURE);
+         }
+         choice[strcspn(choice, "\n")] = 0; // Remove newline
          
-         if (choice == 1) {
+         if (strcmp(choice, "1") == 0) {
              strcpy(department, "Manufacturing");
              break;
-         } else if (choice == 2) {
+         } else if (strcmp(choice, "2") == 0) {
              strcpy(department, "Distribution");
              break;
+         } else if (choice[0] != '\0' && (choice[0] < '0' || choice[0] > '9')) {
+             strcpy(department, choice);
+             break;
          } else {
              printf("Invalid choice. Please try again.\n");
          }
      } while (1);
-     
-     // Transfer file
-     if (transfer_file(sock, filepath, department) != 0) {
-         printf("File transfer failed.\n");
-     } else {
-         printf("File transfer completed successfully.\n");
-     }
-     
-     // Close socket
-     close(sock);
-     return 0;
  }
  
  /**
-  * Authenticate with the server
+  * Authenticates a session with a bare AUTH request
+  *
+  * Returns TRANSFER_BUSY, with the server's suggested delay in
+  * retry_after_ms, if the server turned the session away.
   */
- int authenticate(int sock) {
-     char username[MAX_USERNAME_LENGTH];
-     char password[MAX_PASSWORD_LENGTH];
+ int authenticate(int sock, const char *username, const char *password, uint64_t *retry_after_ms,
+                  uint64_t *caps) {
+     uint8_t payload[FT_MAX_PAYLOAD];
      char response[BUFFER_SIZE];
-     int bytes_received;
-     
-     // Get username
-     printf("Username: ");
-     fgets(username, sizeof(username), stdin);
-     username[strcspn(username, "\n")] = 0; // Remove newline
-     
-     // Get password
-     printf("Password: ");
-     fgets(password, sizeof(password), stdin);
-     password[strcspn(password, "\n")] = 0; // Remove newline
+     ft_header_t hdr;
+     ft_buf_t out, in;
+     uint16_t flags = 0;
      
-     // Send username to server
-     if (send(sock, username, strlen(username), 0) < 0) {
-         perror("Send username failed");
+     ft_buf_init(&out, payload, sizeof(payload));
+     if (put_credentials(&out, username, password, &flags) != 0) {
+         printf("Error: Credentials too long\n");
          return -1;
      }
      
-     // Add a small delay to ensure messages are separated
-     sleep(1);
-     
-     // Send password to server
-     if (send(sock, password, strlen(password), 0) < 0) {
-         perror("Send password failed");
+     if (ft_send_frame(sock, FT_MSG_AUTH, flags, 0, payload, out.pos) != 0 ||
+         read_reply(sock, &hdr, response, sizeof(response)) != 0) {
+         printf("Error receiving response from server\n");
          return -1;
      }
      
-     // Receive authentication response
-     memset(response, 0, sizeof(response));
-     bytes_received = recv(sock, response, sizeof(response) - 1, 0);
-     if (bytes_received <= 0) {
-         printf("Error receiving response from server\n");
-         return -1;
+     if (check_busy(&hdr, response, retry_after_ms)) {
+         return TRANSFER_BUSY;
      }
      
      printf("Server response: %s\n", response);
      
-     // Check if authentication was successful
-     if (strstr(response, "Authentication successful") == NULL) {
-         return -1;
+     // The codecs the server can decode follow the message, then a token; older servers send neither
+     char text[BUFFER_SIZE];
+     char token[FT_TOKEN_MAX];
+     uint64_t server_caps = 0;
+     ft_buf_init(&in, response, hdr.length);
+     if (hdr.type == FT_MSG_OK && ft_get_str(&in, text, sizeof(text)) == 0 &&
+         ft_get_u64(&in, &server_caps) == 0 && ft_get_str(&in, token, sizeof(token)) == 0 && token[0] != '\0') {
+         pthread_mutex_lock(&session_token_lock);
+         memcpy(session_token, token, sizeof(token));
+         pthread_mutex_unlock(&session_token_lock);
      }
+     if (caps != NULL) {
+         *caps = server_caps;
+     }
+     
+     return (hdr.type == FT_MSG_OK) ? 0 : -1;
+ }
+ 
+ /**
+  * Writes the credentials of an AUTH or AUTH_PUT, adding the session token
+  * from an earlier login if there is one
+  */
+ int put_credentials(ft_buf_t *out, const char *username, const char *password, uint16_t *flags) {
+     char token[FT_TOKEN_MAX];
      
+     pthread_mutex_lock(&session_token_lock);
+     memcpy(token, session_token, sizeof(token));
+     pthread_mutex_unlock(&session_token_lock);
+     
+     if (ft_put_str(out, username) != 0 || ft_put_str(out, password) != 0) {
+         return -1;
+     }
+     if (token[0] != '\0') {
+         *flags |= FT_FLAG_TOKEN;
+         return ft_put_str(out, token);
+     }
      return 0;
  }
  
  /**
-  * Transfer a file to the server
+  * Uploads every regular file in a directory over one session
+  *
+  * Up to window uploads are kept in flight; replies are matched back to
+  * their upload by request ID since the server may answer in any order.
   */
- int transfer_file(int sock, const char *filepath, const char *department) {
-     char buffer[BUFFER_SIZE];
+ int transfer_directory(int sock, const char *username, const char *password,
+                        const char *dir, const char *department, int window,
+                        uint64_t *retry_after_ms) {
+     struct dirent **entries;
+     char filepath[MAX_FILEPATH_LENGTH];
      char response[BUFFER_SIZE];
-     int bytes_read, bytes_received;
-     struct stat file_stat;
+     ft_header_t hdr;
+     int transferred = 0, failed = 0;
+     int in_flight = 0;
+     uint32_t next_id = 1;
+     int broken = 0;
      
-     // Check if file exists
-     if (stat(filepath, &file_stat) != 0) {
-         printf("Error: Cannot access file '%s': %s\n", filepath, strerror(errno));
+     int count = scandir(dir, &entries, NULL, alphasort);
+     if (count < 0) {
+         printf("Error: Cannot read directory '%s': %s\n", dir, strerror(errno));
          return -1;
      }
      
-     // Send department to server
-     send(sock, department, strlen(department), 0);
+     pending_t *pending = calloc(window, sizeof(pending_t));
+     uint64_t caps = 0;
+     int auth_status = (pending != NULL) ? authenticate(sock, username, password, retry_after_ms, &caps) : -1;
+     int codec = pick_codec(caps);
+     if (auth_status == TRANSFER_BUSY) {
+         // Nothing has been sent yet, so the whole batch can be retried
+         for (int i = 0; i < count; i++) {
+             free(entries[i]);
+         }
+         free(entries);
+         free(pending);
+         return TRANSFER_BUSY;
+     }
+     if (auth_status != 0) {
+         printf("Authentication failed.\n");
+         broken = 1;
+     }
      
-     // Add a small delay between messages
-     sleep(1);
+     for (int i = 0; i < count; i++) {
+         struct stat file_stat;
+         int len = snprintf(filepath, sizeof(filepath), "%s/%s", dir, entries[i]->d_name);
+         free(entries[i]);
+         
+         if (broken || len >= (int)sizeof(filepath) || stat(filepath, &file_stat) != 0 ||
+             !S_ISREG(file_stat.st_mode)) {
+             continue;
+         }
+         
+         // Wait for room in the window
+         while (in_flight >= window && !broken) {
+             broken = collect_reply(sock, department, codec, pending, &in_flight, &transferred, &failed) != 0;
+         }
+         if (broken) {
+             continue;
+         }
+         
+         broken = start_upload(sock, next_id++, filepath, department, codec, pending, &in_flight, &failed) != 0;
+     }
+     free(entries);
      
-     // Send filepath to server
-     send(sock, filepath, strlen(filepath), 0);
+     // Drain the replies still outstanding
+     while (in_flight > 0 && !broken) {
+         broken = collect_reply(sock, department, codec, pending, &in_flight, &transferred, &failed) != 0;
+     }
+     failed += in_flight;
+     free(pending);
      
-     // Add a small delay between messages
-     sleep(1);
+     // Close the session cleanly
+     if (!broken && ft_send_frame(sock, FT_MSG_BYE, 0, next_id, NULL, 0) == 0) {
+         read_reply(sock, &hdr, response, sizeof(response));
+     }
      
-     // Send file size to server
-     uint32_t file_size = htonl(file_stat.st_size);
-     send(sock, &file_size, sizeof(file_size), 0);
+     printf("Batch complete: %d transferred, %d failed\n", transferred, failed);
+     return (failed == 0 && !broken) ? 0 : -1;
+ }
+ 
+ /**
+  * Sends one upload of a batch, or just its hash with -dedup, and adds it
+  * to the in-flight table
+  *
+  * Returns -1 if the session can't be used any more.
+  */
+ int start_upload(int sock, uint32_t request_id, const char *filepath, const char *department, int codec,
+                  pending_t *pending, int *in_flight, int *failed) {
+     printf("%s\n", filepath);
+     uint64_t checksum = 0;
+     int have = dedup;
+     int status = have ? send_have(sock, request_id, filepath, department) : SEND_SKIPPED;
+     if (status == SEND_SKIPPED) {
+         have = 0;
+         status = send_file(sock, request_id, NULL, NULL, filepath, department, codec, verify ? &checksum : NULL);
+     }
+     if (status != SEND_OK) {
+         (*failed)++;
+         return (status == SEND_BROKEN) ? -1 : 0;
+     }
      
-     // Open file for reading
-     int file_fd = open(filepath, O_RDONLY);
-     if (file_fd < 0) {
-         printf("Error opening file '%s': %s\n", filepath, strerror(errno));
+     pending[*in_flight].request_id = request_id;
+     pending[*in_flight].have = have;
+     pending[*in_flight].checksum = checksum;
+     strcpy(pending[*in_flight].filepath, filepath);
+     (*in_flight)++;
+     return 0;
+ }
+ 
+ /**
+  * Waits for one reply and retires the upload it belongs to
+  *
+  * A NEED reply to a HAVE sends the file under the same request ID, which
+  * stays in flight until the PUT is answered.
+  */
+ int collect_reply(int sock, const char *department, int codec, pending_t *pending, int *in_flight,
+                   int *transferred, int *failed) {
+     char response[BUFFER_SIZE];
+     ft_header_t hdr;
+     
+     if (read_reply(sock, &hdr, response, sizeof(response)) != 0) {
+         printf("Error receiving response from server\n");
          return -1;
      }
      
-     // Send file data
-     int total_sent = 0;
-     while (total_sent < file_stat.st_size) {
-         bytes_read = read(file_fd, buffer, sizeof(buffer));
-         if (bytes_read <= 0) {
-             if (bytes_read < 0) {
-                 printf("Error reading file: %s\n", strerror(errno));
-             }
-             break;
+     for (int i = 0; i < *in_flight; i++) {
+         if (pending[i].request_id != hdr.request_id) {
+             continue;
          }
          
-         int bytes_sent = send(sock, buffer, bytes_read, 0);
-         if (bytes_sent < 0) {
-             printf("Error sending file data: %s\n", strerror(errno));
-             close(file_fd);
-             return -1;
+         if (pending[i].have && hdr.type == FT_MSG_NEED) {
+             pending[i].have = 0;
+             int status = send_file(sock, hdr.request_id, NULL, NULL, pending[i].filepath, department, codec,
+                                    verify ? &pending[i].checksum : NULL);
+             if (status == SEND_OK) {
+                 return 0;
+             }
+             if (status == SEND_BROKEN) {
+                 return -1;
+             }
+             (*failed)++;
+             pending[i] = pending[--(*in_flight)];
+             return 0;
          }
          
-         total_sent += bytes_sent;
+         printf("Server response for '%s': %s\n", pending[i].filepath, response);
          
-         // Show progress
-         float progress = (float)total_sent / file_stat.st_size * 100;
-         printf("\rTransferring: %.2f%% complete", progress);
-         fflush(stdout);
+         // A file the server already held was never sent, so there is nothing to confirm
+         if (hdr.type == FT_MSG_OK && (!verify || pending[i].have ||
+                                       check_checksum(&hdr, response, pending[i].checksum) == 0)) {
+             (*transferred)++;
+         } else {
+             (*failed)++;
+         }
+         
+         // Keep the in-flight table packed
+         pending[i] = pending[--(*in_flight)];
+         return 0;
      }
      
-     // Close file
-     close(file_fd);
-     printf("\n");
+     printf("Server response for unknown request %u: %s\n", hdr.request_id, response);
+     return -1;
+ }
+ 
+ /**
+  * Uploads files and whole directory trees named on the command line
+  *
+  * A scan thread walks the paths, a read-ahead thread asks the kernel to
+  * start reading each file while it waits its turn, and parallel sender
+  * connections each keep a window of uploads in flight, so a tree of
+  * small files goes at disk or network speed rather than one round trip
+  * at a time. Files keep only their name on the server, as with -batch.
+  */
+ int submit_paths(char *const *paths, int path_count, const char *username, const char *password,
+                  const char *department, int parallel, int window) {
+     submit_t submit = {
+         .paths = paths,
+         .path_count = path_count,
+         .username = username,
+         .password = password,
+         .department = department,
+         .window = window,
+     };
+     pthread_t scanner, reader;
+     pthread_t senders[MAX_PARALLEL];
+     int started = 0;
      
-     // Receive transfer response
-     memset(response, 0, sizeof(response));
-     bytes_received = recv(sock, response, sizeof(response) - 1, 0);
-     if (bytes_received <= 0) {
-         printf("Error receiving response from server\n");
+     queue_init(&submit.scanned, SCAN_QUEUE_MAX, UINT64_MAX);
+     queue_init(&submit.ready, SCAN_QUEUE_MAX, READAHEAD_BYTES);
+     atomic_init(&submit.senders, parallel);
+     
+     // Interleaved progress lines from several uploads would be noise
+     show_progress = 0;
+     uint64_t start_ms = monotonic_ms();
+     
+     if (pthread_create(&scanner, NULL, scan_worker, &submit) != 0) {
+         printf("Error: Cannot start the scan\n");
+         return -1;
+     }
+     if (pthread_create(&reader, NULL, readahead_worker, &submit) != 0) {
+         printf("Error: Cannot start the read-ahead\n");
+         queue_abort(&submit.scanned);
+         pthread_join(scanner, NULL);
          return -1;
      }
+     for (; started < parallel; started++) {
+         if (pthread_create(&senders[started], NULL, submit_worker, &submit) != 0) {
+             break;
+         }
+     }
      
-     printf("Server response: %s\n", response);
+     // Count in the senders that couldn't be started as already finished
+     if (started < parallel && atomic_fetch_sub(&submit.senders, parallel - started) == parallel - started) {
+         queue_abort(&submit.ready);
+     }
+     for (int i = 0; i < started; i++) {
+         pthread_join(senders[i], NULL);
+     }
+     pthread_join(reader, NULL);
+     pthread_join(scanner, NULL);
      
-     // Check if transfer was successful
-     if (strstr(response, "successfully transferred") == NULL) {
-         return -1;
+     // Anything found but not acknowledged failed, as did what the scan couldn't read
+     int found = atomic_load(&submit.found);
+     int transferred = atomic_load(&submit.transferred);
+     int failed = found - transferred + atomic_load(&submit.skipped);
+     double seconds = (monotonic_ms() - start_ms) / 1000.0;
+     double megabytes = atomic_load(&submit.found_bytes) / (1024.0 * 1024.0);
+     
+     printf("Submit complete: %d transferred, %d failed, %.1f MB in %.1f s (%.1f MB/s over %d connections)\n",
+            transferred, failed, megabytes, seconds, seconds > 0 ? megabytes / seconds : 0.0, parallel);
+     
+     queue_destroy(&submit.scanned);
+     queue_destroy(&submit.ready);
+     return (failed == 0) ? 0 : -1;
+ }
+ 
+ /**
+  * First stage of the submit pipeline: finds the files to upload
+  */
+ void *scan_worker(void *arg) {
+     submit_t *submit = arg;
+     
+     for (int i = 0; i < submit->path_count; i++) {
+         if (scan_path(submit, submit->paths[i]) != 0) {
+             break;
+         }
+     }
+     
+     queue_close(&submit->scanned);
+     return NULL;
+ }
+ 
+ /**
+  * Queues a regular file, or every regular file under a directory
+  *
+  * Symbolic links to files are followed, links to directories are not, so
+  * the walk can't loop. Returns -1 once the rest of the pipeline has gone.
+  */
+ int scan_path(submit_t *submit, const char *path) {
+     struct stat file_stat;
+     
+     if (lstat(path, &file_stat) != 0) {
+         printf("Error: Cannot access '%s': %s\n", path, strerror(errno));
+         atomic_fetch_add(&submit->skipped, 1);
+         return 0;
+     }
+     
+     if (S_ISDIR(file_stat.st_mode)) {
+         DIR *dir = opendir(path);
+         if (dir == NULL) {
+             printf("Error: Cannot read directory '%s': %s\n", path, strerror(errno));
+             atomic_fetch_add(&submit->skipped, 1);
+             return 0;
+         }
+     
+         char child[MAX_FILEPATH_LENGTH];
+         struct dirent *entry;
+         int status = 0;
+         while (status == 0 && (entry = readdir(dir)) != NULL) {
+             if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+                 continue;
+             }
+             int len = snprintf(child, sizeof(child), "%s%s%s", path,
+                                path[strlen(path) - 1] == '/' ? "" : "/", entry->d_name);
+             if (len >= (int)sizeof(child)) {
+                 printf("Error: Path too long: %s/%s\n", path, entry->d_name);
+                 atomic_fetch_add(&submit->skipped, 1);
+                 continue;
+             }
+             status = scan_path(submit, child);
+         }
+         closedir(dir);
+         return status;
+     }
+     
+     if (S_ISLNK(file_stat.st_mode) && stat(path, &file_stat) != 0) {
+         printf("Error: Cannot access '%s': %s\n", path, strerror(errno));
+         atomic_fetch_add(&submit->skipped, 1);
+         return 0;
+     }
+     if (!S_ISREG(file_stat.st_mode)) {
+         return 0;
+     }
+     
+     submit_file_t *file = malloc(sizeof(submit_file_t));
+     if (file == NULL || strlen(path) >= sizeof(file->filepath)) {
+         printf("Error: Cannot queue '%s'\n", path);
+         atomic_fetch_add(&submit->skipped, 1);
+         free(file);
+         return 0;
      }
+     strcpy(file->filepath, path);
+     file->size = file_stat.st_size;
      
+     if (queue_push(&submit->scanned, file) != 0) {
+         free(file);
+         return -1;
+     }
+     atomic_fetch_add(&submit->found, 1);
+     atomic_fetch_add(&submit->found_bytes, file->size);
      return 0;
- }
\ No newline at end of file
+ }
+ 
+ /**
+  * Second stage of the submit pipeline: starts reading files into the page
+  * cache ahead of the senders
+  *
+  * The ready queue holds at most READAHEAD_BYTES, so files aren't read in
+  * so far ahead that they're evicted again before they're sent.
+  */
+ void *readahead_worker(void *arg) {
+     submit_t *submit = arg;
+     submit_file_t *file;
+     
+     while ((file = queue_pop(&submit->scanned)) != NULL) {
+         // Asynchronous; the pages stay cached after the descriptor is closed
+         int file_fd = open(file->filepath, O_RDONLY);
+         if (file_fd >= 0) {
+             off_t ahead = (file->size < READAHEAD_BYTES) ? (off_t)file->size : READAHEAD_BYTES;
+             posix_fadvise(file_fd, 0, ahead, POSIX_FADV_WILLNEED);
+             close(file_fd);
+         }
+     
+         if (queue_push(&submit->ready, file) != 0) {
+             free(file);
+             queue_abort(&submit->scanned);
+             break;
+         }
+     }
+     
+     queue_close(&submit->ready);
+     return NULL;
+ }
+ 
+ /**
+  * Last stage of the submit pipeline: one sender connection
+  *
+  * Keeps up to the window of uploads in flight, like -batch. A connection
+  * that breaks loses only its uploads in flight; the sender reconnects and
+  * carries on with the queue.
+  */
+ void *submit_worker(void *arg) {
+     submit_t *submit = arg;
+     pending_t *pending = calloc(submit->window, sizeof(pending_t));
+     // Only what's acknowledged is counted; anything else the scan found failed
+     int transferred = 0, failed = 0;
+     
+     for (int attempt = 0; pending != NULL && attempt <= MAX_RETRIES; attempt++) {
+         char response[BUFFER_SIZE];
+         ft_header_t hdr;
+         uint64_t retry_after_ms = RESUME_DELAY_MS;
+         uint64_t caps = 0;
+     
+         int sock = connect_to_server();
+         if (sock < 0) {
+             break;
+         }
+     
+         int status = authenticate(sock, submit->username, submit->password, &retry_after_ms, &caps);
+         if (status != 0) {
+             tls_close(sock);
+             if (status != TRANSFER_BUSY) {
+                 printf("Authentication failed.\n");
+                 break;
+             }
+             usleep(retry_after_ms * 1000);
+             continue;
+         }
+     
+         int codec = pick_codec(caps);
+         int in_flight = 0;
+         uint32_t next_id = 1;
+         int broken = 0;
+         submit_file_t *file;
+     
+         while (!broken && (file = queue_pop(&submit->ready)) != NULL) {
+             // Wait for room in the window
+             while (in_flight >= submit->window && !broken) {
+                 broken = collect_reply(sock, submit->department, codec, pending, &in_flight,
+                                        &transferred, &failed) != 0;
+             }
+             if (!broken) {
+                 broken = start_upload(sock, next_id++, file->filepath, submit->department, codec,
+                                       pending, &in_flight, &failed) != 0;
+             }
+             free(file);
+         }
+     
+         // Drain the replies still outstanding
+         while (in_flight > 0 && !broken) {
+             broken = collect_reply(sock, submit->department, codec, pending, &in_flight,
+                                    &transferred, &failed) != 0;
+         }
+     
+         if (!broken && ft_send_frame(sock, FT_MSG_BYE, 0, next_id, NULL, 0) == 0) {
+             read_reply(sock, &hdr, response, sizeof(response));
+         }
+         tls_close(sock);
+     
+         if (!broken) {
+             break;
+         }
+         printf("Connection lost, reconnecting in %d ms...\n", RESUME_DELAY_MS);
+         usleep(RESUME_DELAY_MS * 1000);
+     }
+     free(pending);
+     
+     atomic_fetch_add(&submit->transferred, transferred);
+     
+     // With no senders left, nothing will drain the queue
+     if (atomic_fetch_sub(&submit->senders, 1) == 1) {
+         queue_abort(&submit->ready);
+     }
+     return NULL;
+ }
+ 
+ /**
+  * Sets up an empty queue holding at most max_count files of max_bytes
+  * in all; a single file over max_bytes is let in on its own
+  */
+ void queue_init(file_queue_t *queue, int max_count, uint64_t max_bytes) {
+     memset(queue, 0, sizeof(*queue));
+     pthread_mutex_init(&queue->lock, NULL);
+     pthread_cond_init(&queue->changed, NULL);
+     queue->max_count = max_count;
+     queue->max_bytes = max_bytes;
+ }
+ 
+ /**
+  * Adds a file, waiting while the queue is full
+  *
+  * Returns -1 if the consumers have given up; the file is still the caller's.
+  */
+ int queue_push(file_queue_t *queue, submit_file_t *file) {
+     pthread_mutex_lock(&queue->lock);
+     while (!queue->aborted && queue->count > 0 &&
+            (queue->count >= queue->max_count || queue->bytes + file->size > queue->max_bytes)) {
+         pthread_cond_wait(&queue->changed, &queue->lock);
+     }
+     if (queue->aborted) {
+         pthread_mutex_unlock(&queue->lock);
+         return -1;
+     }
+     
+     file->next = NULL;
+     if (queue->tail != NULL) {
+         queue->tail->next = file;
+     } else {
+         queue->head = file;
+     }
+     queue->tail = file;
+     queue->count++;
+     queue->bytes += file->size;
+     
+     pthread_cond_broadcast(&queue->changed);
+     pthread_mutex_unlock(&queue->lock);
+     return 0;
+ }
+ 
+ /**
+  * Takes the next file, waiting for one; NULL once the producer has
+  * finished and the queue is empty, or the pipeline was aborted
+  */
+ submit_file_t *queue_pop(file_queue_t *queue) {
+     pthread_mutex_lock(&queue->lock);
+     while (queue->head == NULL && !queue->closed && !queue->aborted) {
+         pthread_cond_wait(&queue->changed, &queue->lock);
+     }
+     
+     submit_file_t *file = queue->aborted ? NULL : queue->head;
+     if (file != NULL) {
+         queue->head = file->next;
+         if (queue->head == NULL) {
+             queue->tail = NULL;
+         }
+         queue->count--;
+         queue->bytes -= file->size;
+         pthread_cond_broadcast(&queue->changed);
+     }
+     
+     pthread_mutex_unlock(&queue->lock);
+     return file;
+ }
+ 
+ /**
+  * Marks the end of the producer's files
+  */
+ void queue_close(file_queue_t *queue) {
+     pthread_mutex_lock(&queue->lock);
+     queue->closed = 1;
+     pthread_cond_broadcast(&queue->changed);
+     pthread_mutex_unlock(&queue->lock);
+ }
+ 
+ /**
+  * Stops the queue from both ends; producers and consumers waiting on it
+  * give up
+  */
+ void queue_abort(file_queue_t *queue) {
+     pthread_mutex_lock(&queue->lock);
+     queue->aborted = 1;
+     pthread_cond_broadcast(&queue->changed);
+     pthread_mutex_unlock(&queue->lock);
+ }
+ 
+ /**
+  * Frees the queue and any files left in it
+  */
+ void queue_destroy(file_queue_t *queue) {
+     while (queue->head != NULL) {
+         submit_file_t *file = queue->head;
+         queue->head = file->next;
+         free(file);
+     }
+     pthread_cond_destroy(&queue->changed);
+     pthread_mutex_destroy(&queue->lock);
+ }
+ 
+ /**
+  * Prompts for the username and password, except for what the command
+  * line already supplied
+  */
+ void read_credentials(char *username, char *password) {
+     // Get username
+     if (login_user != NULL) {
+         snprintf(username, MAX_USERNAME_LENGTH, "%s", login_user);
+     } else {
+         printf("Username: ");
+         fgets(username, MAX_USERNAME_LENGTH, stdin);
+         username[strcspn(username, "\n")] = 0; // Remove newline
+     }
+     
+     // Get password
+     int status = read_password(password);
+     if (status < 0) {
+         exit(EXIT_FAILURE);
+     }
+     if (status > 0) {
+         printf("Password: ");
+         fgets(password, MAX_PASSWORD_LENGTH, stdin);
+         password[strcspn(password, "\n")] = 0; // Remove newline
+     }
+ }
+ 
+ /**
+  * Reads the password from -password-file, or from FT_PASSWORD
+  *
+  * Returns 1 if neither was given, so it has to be asked for.
+  */
+ int read_password(char *password) {
+     if (password_file == NULL) {
+         const char *env = getenv(PASSWORD_ENV);
+         if (env == NULL) {
+             return 1;
+         }
+         snprintf(password, MAX_PASSWORD_LENGTH, "%s", env);
+         return 0;
+     }
+     
+     FILE *file = fopen(password_file, "r");
+     if (file == NULL) {
+         printf("Error: Cannot read password file '%s': %s\n", password_file, strerror(errno));
+         return -1;
+     }
+     if (fgets(password, MAX_PASSWORD_LENGTH, file) == NULL) {
+         password[0] = '\0';
+     }
+     fclose(file);
+     password[strcspn(password, "\r\n")] = 0; // Only the first line counts
+     return 0;
+ }
+ 
+ /**
+  * Receives a reply frame and NUL-terminates its text
+  */
+ int read_reply(int sock, ft_header_t *hdr, char *response, size_t response_size) {
+     if (ft_recv_frame(sock, hdr, response, response_size - 1) != 0) {
+         return -1;
+     }
+     
+     response[hdr->length] = '\0';
+     return 0;
+ }
+ 
+ /**
+  * Checks for a BUSY reply and pulls out the server's suggested delay
+  */
+ int check_busy(const ft_header_t *hdr, const char *response, uint64_t *retry_after_ms) {
+     char text[BUFFER_SIZE];
+     ft_buf_t in;
+     
+     if (hdr->type != FT_MSG_BUSY) {
+         return 0;
+     }
+     
+     ft_buf_init(&in, (void *)response, hdr->length);
+     if (ft_get_str(&in, text, sizeof(text)) != 0 || ft_get_u64(&in, retry_after_ms) != 0) {
+         *retry_after_ms = 1000;
+     }
+     
+     return 1;
+ }
+ 
+ /**
+  * Milliseconds on the monotonic clock
+  */
+ uint64_t monotonic_ms(void) {
+     struct timespec ts;
+     clock_gettime(CLOCK_MONOTONIC, &ts);
+     return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+ }
+ 
+ /**
+  * Transfer a file to the server and wait for the reply
+  */
+ int transfer_file(int sock, const char *username, const char *password,
+                   const char *filepath, const char *department, uint64_t *retry_after_ms) {
+     char response[BUFFER_SIZE];
+     ft_header_t hdr;
+     uint32_t request_id = 1;
+     
+     struct stat file_stat;
+     if (streams > 1 && stat(filepath, &file_stat) == 0 && S_ISREG(file_stat.st_mode) &&
+         file_stat.st_size >= 2 * MIN_RANGE_SIZE) {
+         return transfer_parallel(sock, username, password, filepath, department, retry_after_ms);
+     }
+     
+     if (resume) {
+         return transfer_resumable(sock, username, password, filepath, department, retry_after_ms);
+     }
+     
+     // Compression is agreed at login, and deltas need a session, so log in before sending
+     uint64_t caps = 0;
+     if (dedup || delta || compress_mode != CODEC_NONE) {
+         int status = dedup ? offer_hash(sock, username, password, filepath, department, retry_after_ms, &caps)
+                            : authenticate(sock, username, password, retry_after_ms, &caps);
+         if (status != (dedup ? TRANSFER_NEED : 0)) {
+             return status;
+         }
+         
+         // The session is authenticated now, so a plain PUT follows
+         username = NULL;
+         password = NULL;
+         request_id = 2;
+     }
+     
+     int codec = pick_codec(caps);
+     uint64_t checksum = 0;
+     int status = delta ? send_delta(sock, request_id++, filepath, department, codec, verify ? &checksum : NULL)
+                        : TRANSFER_NEED;
+     if (status == SEND_OK) {
+         if (read_reply(sock, &hdr, response, sizeof(response)) != 0) {
+             printf("Error receiving response from server\n");
+             return -1;
+         }
+         
+         // The server's copy changed after it sent the signatures
+         if (hdr.type == FT_MSG_NEED) {
+             printf("Server response: %s\n", response);
+             status = TRANSFER_NEED;
+         }
+     } else if (status != TRANSFER_NEED) {
+         return -1;
+     }
+     
+     if (status == TRANSFER_NEED) {
+         if (send_file(sock, request_id, username, password, filepath, department, codec,
+                       verify ? &checksum : NULL) == SEND_SKIPPED) {
+             return -1;
+         }
+         
+         // Receive transfer response
+         if (read_reply(sock, &hdr, response, sizeof(response)) != 0) {
+             printf("Error receiving response from server\n");
+             return -1;
+         }
+     }
+     
+     if (check_busy(&hdr, response, retry_after_ms)) {
+         return TRANSFER_BUSY;
+     }
+     
+     printf("Server response: %s\n", response);
+     
+     // Check if transfer was successful
+     if (hdr.type != FT_MSG_OK || (verify && check_checksum(&hdr, response, checksum) != 0)) {
+         return -1;
+     }
+     
+     return 0;
+ }
+ 
+ /**
+  * Logs in and asks whether the server already holds the file's content
+  *
+  * Returns 0 if the server stored the file from content it had, or
+  * TRANSFER_NEED if the file must be sent.
+  */
+ int offer_hash(int sock, const char *username, const char *password,
+                const char *filepath, const char *department, uint64_t *retry_after_ms, uint64_t *caps) {
+     char response[BUFFER_SIZE];
+     ft_header_t hdr;
+     
+     int status = authenticate(sock, username, password, retry_after_ms, caps);
+     if (status != 0) {
+         return status;
+     }
+     
+     status = send_have(sock, 1, filepath, department);
+     if (status == SEND_SKIPPED) {
+         return TRANSFER_NEED;
+     }
+     if (status != SEND_OK || read_reply(sock, &hdr, response, sizeof(response)) != 0) {
+         printf("Error receiving response from server\n");
+         return -1;
+     }
+     
+     if (hdr.type == FT_MSG_NEED) {
+         return TRANSFER_NEED;
+     }
+     
+     printf("Server response: %s\n", response);
+     return (hdr.type == FT_MSG_OK) ? 0 : -1;
+ }
+ 
+ /**
+  * Sends an upload request followed by the file body
+  *
+  * Authentication and the upload request go out as a single AUTH_PUT frame,
+  * immediately followed by the file body, so the upload costs one round trip.
+  * Pass a NULL username to send a plain PUT on an authenticated session.
+  * The reply is left for the caller to collect.
+  *
+  * Anything that isn't a regular file (a pipe or FIFO fed by tar, say) has
+  * no size up front, so it is streamed as a chunked body instead. With a
+  * codec, a regular file whose first block looks compressible is sent as a
+  * chunked compressed stream; anything else goes as it is.
+  *
+  * Given a checksum, the file is hashed as it goes out and the hash sent
+  * after the body for the server to check; it is also stored in checksum.
+  */
+ int send_file(int sock, uint32_t request_id, const char *username, const char *password,
+               const char *filepath, const char *department, int codec, uint64_t *checksum) {
+     char buffer[COPY_BUFFER_SIZE];
+     uint8_t payload[FT_MAX_PAYLOAD];
+     struct stat file_stat;
+     ft_buf_t out;
+     
+     // Check if file exists
+     if (stat(filepath, &file_stat) != 0) {
+         printf("Error: Cannot access file '%s': %s\n", filepath, strerror(errno));
+         return SEND_SKIPPED;
+     }
+     
+     // Open file for reading
+     int file_fd = open(filepath, O_RDONLY);
+     if (file_fd < 0) {
+         printf("Error opening file '%s': %s\n", filepath, strerror(errno));
+         return SEND_SKIPPED;
+     }
+     
+     int chunked = !S_ISREG(file_stat.st_mode);
+     
+     // Skip compression for data that wouldn't shrink (media, archives)
+     codec_t *encoder = NULL;
+     if (codec != CODEC_NONE && !chunked) {
+         ssize_t sampled = pread(file_fd, buffer, CODEC_SAMPLE_SIZE, 0);
+         if (sampled > 0 && codec_worth_compressing(buffer, sampled)) {
+             encoder = codec_new(codec, 1);
+         }
+     }
+     
+     // Build the upload request, with credentials in front if needed
+     ft_buf_init(&out, payload, sizeof(payload));
+     uint8_t type = (username != NULL) ? FT_MSG_AUTH_PUT : FT_MSG_PUT;
+     uint16_t flags = chunked ? FT_FLAG_CHUNKED : 0;
+     if (encoder != NULL) {
+         flags = FT_FLAG_CHUNKED | codec_flag(codec);
+     }
+     if (checksum != NULL) {
+         flags |= FT_FLAG_CHECKSUM;
+     }
+     if ((username != NULL && put_credentials(&out, username, password, &flags) != 0) ||
+         ft_put_u64(&out, (flags & FT_FLAG_CHUNKED) ? 0 : (uint64_t)file_stat.st_size) != 0 ||
+         ft_put_str(&out, department) != 0 ||
+         ft_put_str(&out, filepath) != 0) {
+         printf("Error: Request too large\n");
+         codec_free(encoder);
+         close(file_fd);
+         return SEND_SKIPPED;
+     }
+     
+     if (ft_send_frame(sock, type, flags, request_id, payload, out.pos) != 0) {
+         printf("Error sending request: %s\n", strerror(errno));
+         codec_free(encoder);
+         close(file_fd);
+         return SEND_BROKEN;
+     }
+     
+     xxh64_state_t hash;
+     xxh64_state_t *hashing = (checksum != NULL) ? &hash : NULL;
+     xxh64_init(&hash, 0);
+     
+     if (encoder != NULL) {
+         int status = send_compressed(sock, file_fd, encoder, file_stat.st_size, hashing);
+         codec_free(encoder);
+         close(file_fd);
+         return (status == SEND_OK) ? send_checksum(sock, hashing, checksum) : status;
+     }
+     
+     if (chunked) {
+         int status = send_chunked(sock, file_fd, hashing);
+         close(file_fd);
+         return (status == SEND_OK) ? send_checksum(sock, hashing, checksum) : status;
+     }
+     
+     // sendfile() never shows us the data, so what it sent is hashed from a mapping of the file
+     const char *mapped = NULL;
+     if (hashing != NULL && file_stat.st_size > 0) {
+         void *map = mmap(NULL, file_stat.st_size, PROT_READ, MAP_SHARED, file_fd, 0);
+         if (map != MAP_FAILED) {
+             madvise(map, file_stat.st_size, MADV_SEQUENTIAL);
+             mapped = map;
+         }
+     }
+     
+     // Send file data, straight from the page cache where the kernel allows it
+     off_t total_sent = 0;
+     int use_sendfile = (hashing == NULL || mapped != NULL);
+     uint64_t next_progress_ms = 0;
+     while (total_sent < file_stat.st_size) {
+         off_t remaining = file_stat.st_size - total_sent;
+         ssize_t sent;
+         
+         if (use_sendfile) {
+             off_t start = total_sent;
+             sent = tls_send_file(sock, file_fd, &total_sent, (remaining < SENDFILE_CHUNK) ? remaining : SENDFILE_CHUNK);
+             if (mapped != NULL && total_sent > start) {
+                 xxh64_update(hashing, mapped + start, total_sent - start);
+             }
+             if (sent < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                 // Not supported for this file; copy it through a buffer instead
+                 use_sendfile = 0;
+                 continue;
+             }
+             if (sent < 0 && errno == EINTR) {
+                 continue;
+             }
+             if (sent < 0 && errno != EPIPE && errno != ECONNRESET) {
+                 printf("\nError sending file: %s\n", strerror(errno));
+                 unmap_file(mapped, file_stat.st_size);
+                 close(file_fd);
+                 return SEND_BROKEN;
+             }
+         } else {
+             size_t to_read = (remaining < (off_t)sizeof(buffer)) ? (size_t)remaining : sizeof(buffer);
+             sent = pread(file_fd, buffer, to_read, total_sent);
+             if (sent < 0) {
+                 printf("\nError reading file: %s\n", strerror(errno));
+                 unmap_file(mapped, file_stat.st_size);
+                 close(file_fd);
+                 return SEND_BROKEN;
+             }
+             if (sent > 0 && hashing != NULL) {
+                 xxh64_update(hashing, buffer, sent);
+             }
+             if (sent > 0 && ft_send_all(sock, buffer, sent) != 0) {
+                 sent = -1;
+             } else {
+                 total_sent += sent;
+             }
+         }
+         
+         if (sent == 0) {
+             printf("\nError: File shrank while it was being sent\n");
+             unmap_file(mapped, file_stat.st_size);
+             close(file_fd);
+             return SEND_BROKEN;
+         }
+         
+         // A server that rejected the request may stop reading; its reply is still worth showing
+         if (sent < 0) {
+             printf("\nError sending file data: %s\n", strerror(errno));
+             break;
+         }
+         
+         // Show progress a few times a second rather than on every chunk
+         uint64_t now = monotonic_ms();
+         if (show_progress && (now >= next_progress_ms || total_sent == file_stat.st_size)) {
+             double progress = (double)total_sent / file_stat.st_size * 100;
+             printf("\rTransferring: %.2f%% complete", progress);
+             fflush(stdout);
+             next_progress_ms = now + PROGRESS_INTERVAL_MS;
+         }
+     }
+     
+     // Close file
+     unmap_file(mapped, file_stat.st_size);
+     close(file_fd);
+     if (show_progress) {
+         printf("\n");
+     }
+     
+     return send_checksum(sock, hashing, checksum);
+ }
+ 
+ /**
+  * Uploads a file so that a dropped connection can be resumed
+  *
+  * The server is asked how much of the upload it already holds and only
+  * the rest is sent. Returns TRANSFER_DROPPED if the connection failed
+  * part way, in which case calling again on a new connection resumes it.
+  */
+ int transfer_resumable(int sock, const char *username, const char *password,
+                        const char *filepath, const char *department, uint64_t *retry_after_ms) {
+     uint8_t payload[FT_MAX_PAYLOAD];
+     char response[BUFFER_SIZE];
+     struct stat file_stat;
+     ft_header_t hdr;
+     ft_buf_t out, in;
+     uint64_t offset;
+     
+     if (stat(filepath, &file_stat) != 0 || !S_ISREG(file_stat.st_mode)) {
+         printf("Error: '%s' is not a regular file and can't be resumed\n", filepath);
+         return -1;
+     }
+     uint64_t upload_id = resume_id(filepath, &file_stat);
+     
+     int status = authenticate(sock, username, password, retry_after_ms, NULL);
+     if (status != 0) {
+         return status;
+     }
+     
+     // Find out where to carry on from
+     ft_buf_init(&out, payload, sizeof(payload));
+     if (ft_put_u64(&out, upload_id) != 0 ||
+         ft_put_str(&out, department) != 0 ||
+         ft_put_str(&out, filepath) != 0) {
+         printf("Error: Request too large\n");
+         return -1;
+     }
+     if (ft_send_frame(sock, FT_MSG_RESUME, 0, 1, payload, out.pos) != 0 ||
+         read_reply(sock, &hdr, response, sizeof(response)) != 0) {
+         printf("Error receiving response from server\n");
+         return TRANSFER_DROPPED;
+     }
+     if (hdr.type != FT_MSG_OFFSET) {
+         printf("Server response: %s\n", response);
+         return -1;
+     }
+     ft_buf_init(&in, response, hdr.length);
+     if (ft_get_u64(&in, &offset) != 0 || offset > (uint64_t)file_stat.st_size) {
+         offset = 0;
+     }
+     if (offset > 0) {
+         printf("Resuming upload after %.1f MB\n", offset / (1024.0 * 1024.0));
+     }
+     
+     status = send_resumable(sock, 2, filepath, department, upload_id, offset, file_stat.st_size,
+                             FT_FLAG_RESUMABLE, NULL);
+     if (status == SEND_SKIPPED) {
+         return -1;
+     }
+     
+     if (read_reply(sock, &hdr, response, sizeof(response)) != 0) {
+         printf("Error receiving response from server\n");
+         return TRANSFER_DROPPED;
+     }
+     
+     printf("Server response: %s\n", response);
+     if (hdr.type == FT_MSG_OK) {
+         return 0;
+     }
+     
+     // The server hangs up on a corrupted chunk; what came before it is kept
+     return (status == SEND_BROKEN) ? TRANSFER_DROPPED : -1;
+ }
+ 
+ /**
+  * Sends a resumable or range upload request and the file from offset to end
+  *
+  * The body goes out in chunks of RESUME_CHUNK_SIZE, each preceded by its
+  * length and checksum. Progress is added to sent if given, and printed
+  * otherwise.
+  */
+ int send_resumable(int sock, uint32_t request_id, const char *filepath, const char *department,
+                    uint64_t upload_id, uint64_t offset, uint64_t end, uint16_t flags,
+                    atomic_uint_least64_t *sent) {
+     uint8_t payload[FT_MAX_PAYLOAD];
+     struct stat file_stat;
+     ft_buf_t out;
+     
+     int file_fd = open(filepath, O_RDONLY);
+     if (file_fd < 0 || fstat(file_fd, &file_stat) != 0) {
+         printf("Error opening file '%s': %s\n", filepath, strerror(errno));
+         if (file_fd >= 0) {
+             close(file_fd);
+         }
+         return SEND_SKIPPED;
+     }
+     
+     // Room for the chunk header in front of the data
+     char *buffer = malloc(FT_CHUNK_SUM_HEADER_SIZE + RESUME_CHUNK_SIZE);
+     
+     ft_buf_init(&out, payload, sizeof(payload));
+     if (buffer == NULL ||
+         ft_put_u64(&out, (uint64_t)file_stat.st_size) != 0 ||
+         ft_put_str(&out, department) != 0 ||
+         ft_put_str(&out, filepath) != 0 ||
+         ft_put_u64(&out, upload_id) != 0 ||
+         ft_put_u64(&out, offset) != 0) {
+         printf("Error: Request too large\n");
+         free(buffer);
+         close(file_fd);
+         return SEND_SKIPPED;
+     }
+     
+     if (ft_send_frame(sock, FT_MSG_PUT, flags, request_id, payload, out.pos) != 0) {
+         printf("Error sending request: %s\n", strerror(errno));
+         free(buffer);
+         close(file_fd);
+         return SEND_BROKEN;
+     }
+     
+     int status = SEND_OK;
+     uint64_t next_progress_ms = 0;
+     while (1) {
+         size_t to_read = (end - offset < RESUME_CHUNK_SIZE) ? end - offset : RESUME_CHUNK_SIZE;
+         ssize_t bytes_read = (to_read > 0) ? pread(file_fd, buffer + FT_CHUNK_SUM_HEADER_SIZE, to_read, offset) : 0;
+         if (bytes_read < 0) {
+             if (errno == EINTR) {
+                 continue;
+             }
+             printf("\nError reading file: %s\n", strerror(errno));
+             status = SEND_BROKEN;
+             break;
+         }
+         
+         // A zero-length chunk marks the end of the body
+         uint32_t length = htonl((uint32_t)bytes_read);
+         memcpy(buffer, &length, sizeof(length));
+         ft_buf_init(&out, buffer + sizeof(length), sizeof(uint64_t));
+         ft_put_u64(&out, xxh64(buffer + FT_CHUNK_SUM_HEADER_SIZE, bytes_read, 0));
+         if (ft_send_all(sock, buffer, FT_CHUNK_SUM_HEADER_SIZE + bytes_read) != 0) {
+             printf("\nError sending file data: %s\n", strerror(errno));
+             status = SEND_BROKEN;
+             break;
+         }
+         
+         offset += bytes_read;
+         
+         uint64_t now = monotonic_ms();
+         if (sent != NULL) {
+             atomic_fetch_add(sent, bytes_read);
+         } else if (now >= next_progress_ms || bytes_read == 0) {
+             double progress = file_stat.st_size ? (double)offset / file_stat.st_size * 100 : 100;
+             printf("\rTransferring: %.2f%% complete", progress);
+             fflush(stdout);
+             next_progress_ms = now + PROGRESS_INTERVAL_MS;
+         }
+         
+         if (bytes_read == 0) {
+             break;
+         }
+     }
+     
+     free(buffer);
+     close(file_fd);
+     if (sent == NULL) {
+         printf("\n");
+     }
+     return status;
+ }
+ 
+ /**
+  * Uploads a large file as ranges over several connections at once
+  *
+  * Each range goes over its own connection and is retried on its own if
+  * that connection fails. Once all of them are in, a COMMIT on a fresh
+  * connection has the server publish the file.
+  */
+ int transfer_parallel(int sock, const char *username, const char *password,
+                       const char *filepath, const char *department, uint64_t *retry_after_ms) {
+     uint8_t payload[FT_MAX_PAYLOAD];
+     char response[BUFFER_SIZE];
+     struct stat file_stat;
+     pthread_t threads[MAX_STREAMS];
+     range_job_t *jobs;
+     ft_header_t hdr;
+     ft_buf_t out;
+     
+     if (stat(filepath, &file_stat) != 0) {
+         printf("Error: Cannot access file '%s': %s\n", filepath, strerror(errno));
+         return -1;
+     }
+     uint64_t size = file_stat.st_size;
+     uint64_t upload_id = resume_id(filepath, &file_stat);
+     
+     // Check the credentials once before opening a connection per range
+     int status = authenticate(sock, username, password, retry_after_ms, NULL);
+     if (status != 0) {
+         return status;
+     }
+     if (ft_send_frame(sock, FT_MSG_BYE, 0, 1, NULL, 0) == 0) {
+         read_reply(sock, &hdr, response, sizeof(response));
+     }
+     
+     // Whole checksum chunks per range, and no range smaller than MIN_RANGE_SIZE
+     int count = streams;
+     if (size / MIN_RANGE_SIZE < (uint64_t)count) {
+         count = size / MIN_RANGE_SIZE;
+     }
+     uint64_t range = (size + count - 1) / count;
+     range = (range + RESUME_CHUNK_SIZE - 1) / RESUME_CHUNK_SIZE * RESUME_CHUNK_SIZE;
+     count = (size + range - 1) / range;
+     
+     jobs = calloc(count, sizeof(range_job_t));
+     if (jobs == NULL) {
+         return -1;
+     }
+     
+     int started = 0;
+     for (int i = 0; i < count; i++) {
+         range_job_t *job = &jobs[i];
+         job->username = username;
+         job->password = password;
+         job->filepath = filepath;
+         job->department = department;
+         job->upload_id = upload_id;
+         job->start = i * range;
+         job->end = (job->start + range < size) ? job->start + range : size;
+         job->status = -1;
+         if (pthread_create(&threads[i], NULL, range_worker, job) != 0) {
+             break;
+         }
+         started++;
+     }
+     
+     // Report overall progress while the ranges are in flight
+     int finished = 0;
+     while (finished < started) {
+         uint64_t total = 0;
+         finished = 0;
+         for (int i = 0; i < started; i++) {
+             total += jobs[i].status == 0 && atomic_load(&jobs[i].done) ? jobs[i].end - jobs[i].start
+                                                                        : atomic_load(&jobs[i].sent);
+             finished += atomic_load(&jobs[i].done);
+         }
+         printf("\rTransferring: %.2f%% complete over %d streams", (double)total / size * 100, started);
+         fflush(stdout);
+         if (finished < started) {
+             usleep(PROGRESS_INTERVAL_MS * 1000);
+         }
+     }
+     printf("\n");
+     
+     int failed = count - started;
+     for (int i = 0; i < started; i++) {
+         pthread_join(threads[i], NULL);
+         if (jobs[i].status != 0) {
+             failed++;
+         }
+     }
+     free(jobs);
+     
+     if (failed > 0) {
+         printf("Error: %d of %d ranges could not be sent\n", failed, count);
+         return -1;
+     }
+     
+     // Every range is in; have the server put the file together
+     int commit_sock = connect_to_server();
+     if (commit_sock < 0) {
+         return -1;
+     }
+     status = authenticate(commit_sock, username, password, retry_after_ms, NULL);
+     if (status != 0) {
+         tls_close(commit_sock);
+         return -1;
+     }
+     
+     ft_buf_init(&out, payload, sizeof(payload));
+     if (ft_put_u64(&out, size) != 0 ||
+         ft_put_str(&out, department) != 0 ||
+         ft_put_str(&out, filepath) != 0 ||
+         ft_put_u64(&out, upload_id) != 0 ||
+         ft_send_frame(commit_sock, FT_MSG_COMMIT, 0, 1, payload, out.pos) != 0 ||
+         read_reply(commit_sock, &hdr, response, sizeof(response)) != 0) {
+         printf("Error receiving response from server\n");
+         tls_close(commit_sock);
+         return -1;
+     }
+     tls_close(commit_sock);
+     
+     printf("Server response: %s\n", response);
+     return (hdr.type == FT_MSG_OK) ? 0 : -1;
+ }
+ 
+ /**
+  * Sends one range, reconnecting and starting the range again on failure
+  */
+ void *range_worker(void *arg) {
+     range_job_t *job = arg;
+     char response[BUFFER_SIZE];
+     ft_header_t hdr;
+     uint64_t delay_ms = 0;
+     
+     for (int attempt = 0; attempt <= MAX_RETRIES; attempt++) {
+         usleep(delay_ms * 1000);
+         delay_ms = RESUME_DELAY_MS;
+         atomic_store(&job->sent, 0);
+         
+         int sock = connect_to_server();
+         if (sock < 0) {
+             continue;
+         }
+         
+         int status = authenticate(sock, job->username, job->password, &delay_ms, NULL);
+         if (status == TRANSFER_BUSY) {
+             tls_close(sock);
+             continue;
+         }
+         if (status != 0) {
+             tls_close(sock);
+             break;
+         }
+         
+         status = send_resumable(sock, 1, job->filepath, job->department, job->upload_id,
+                                 job->start, job->end, FT_FLAG_RANGE, &job->sent);
+         if (status != SEND_SKIPPED && read_reply(sock, &hdr, response, sizeof(response)) == 0) {
+             tls_close(sock);
+             if (hdr.type != FT_MSG_OK) {
+                 printf("\nServer response: %s\n", response);
+                 break;
+             }
+             job->status = 0;
+             break;
+         }
+         tls_close(sock);
+         if (status == SEND_SKIPPED) {
+             break;
+         }
+     }
+     
+     atomic_store(&job->done, 1);
+     return NULL;
+ }
+ 
+ /**
+  * Derives the upload ID for a file
+  *
+  * The same file gives the same ID on every run, so a later run picks up
+  * an upload an earlier one left unfinished. A file that has changed
+  * since gets a new ID and starts over.
+  */
+ uint64_t resume_id(const char *filepath, const struct stat *file_stat) {
+     char path[PATH_MAX];
+     xxh64_state_t state;
+     
+     if (realpath(filepath, path) == NULL) {
+         snprintf(path, sizeof(path), "%s", filepath);
+     }
+     
+     xxh64_init(&state, 0);
+     xxh64_update(&state, path, strlen(path));
+     xxh64_update(&state, &file_stat->st_size, sizeof(file_stat->st_size));
+     xxh64_update(&state, &file_stat->st_mtime, sizeof(file_stat->st_mtime));
+     return xxh64_digest(&state);
+ }
+ 
+ /**
+  * Sends a file as a delta against the server's copy of it
+  *
+  * Returns SEND_OK with the reply left to collect, TRANSFER_NEED if the
+  * file must be sent whole (the server has no copy, or this isn't a
+  * regular file), or SEND_BROKEN. Given a checksum, the hash of the whole
+  * file follows the delta, as for send_file().
+  */
+ int send_delta(int sock, uint32_t request_id, const char *filepath, const char *department, int codec,
+                uint64_t *checksum) {
+     uint8_t payload[FT_MAX_PAYLOAD];
+     delta_sigs_t sigs;
+     struct stat file_stat;
+     ft_buf_t out;
+     
+     int file_fd = open(filepath, O_RDONLY);
+     if (file_fd < 0 || fstat(file_fd, &file_stat) != 0 || !S_ISREG(file_stat.st_mode) ||
+         file_stat.st_size == 0) {
+         if (file_fd >= 0) {
+             close(file_fd);
+         }
+         return TRANSFER_NEED;
+     }
+     
+     int status = fetch_signatures(sock, request_id, filepath, department, &sigs);
+     if (status != SEND_OK) {
+         close(file_fd);
+         return status;
+     }
+     
+     void *data = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, file_fd, 0);
+     close(file_fd);
+     if (data == MAP_FAILED) {
+         printf("Error mapping file '%s': %s\n", filepath, strerror(errno));
+         delta_sigs_free(&sigs);
+         return SEND_BROKEN;
+     }
+     madvise(data, file_stat.st_size, MADV_SEQUENTIAL);
+     
+     delta_out_t sink = { sock, (codec != CODEC_NONE) ? codec_new(codec, 1) : NULL };
+     uint16_t flags = FT_FLAG_CHUNKED | FT_FLAG_DELTA | (sink.encoder != NULL ? codec_flag(codec) : 0);
+     if (checksum != NULL) {
+         flags |= FT_FLAG_CHECKSUM;
+     }
+     
+     ft_buf_init(&out, payload, sizeof(payload));
+     ft_put_u64(&out, 0);
+     ft_put_str(&out, department);
+     ft_put_str(&out, filepath);
+     ft_put_u64(&out, sigs.tag);
+     
+     uint64_t matched = 0;
+     status = SEND_OK;
+     if (ft_send_frame(sock, FT_MSG_PUT, flags, request_id, payload, out.pos) != 0) {
+         printf("Error sending request: %s\n", strerror(errno));
+         status = SEND_BROKEN;
+     } else if (delta_encode(data, file_stat.st_size, &sigs, send_delta_data, &sink, &matched) != 0 ||
+                (sink.encoder != NULL && codec_finish(sink.encoder, send_chunk, &sock) != 0) ||
+                send_chunk(&sock, NULL, 0) != 0) {
+         // Whatever the server made of it is still worth reading
+         printf("Error sending file data: %s\n", strerror(errno));
+     } else {
+         printf("Delta: sent %llu of %llu bytes; the rest was already on the server\n",
+                (unsigned long long)(file_stat.st_size - matched), (unsigned long long)file_stat.st_size);
+     }
+     
+     // The server checks the file it rebuilt, so the hash covers all of it
+     if (status == SEND_OK && checksum != NULL) {
+         xxh64_state_t hash;
+         xxh64_init(&hash, 0);
+         xxh64_update(&hash, data, file_stat.st_size);
+         send_checksum(sock, &hash, checksum);
+     }
+     
+     codec_free(sink.encoder);
+     munmap(data, file_stat.st_size);
+     delta_sigs_free(&sigs);
+     return status;
+ }
+ 
+ /**
+  * Asks for the block signatures of the server's copy of a file
+  *
+  * Returns SEND_OK with sigs filled in, TRANSFER_NEED if the server has no
+  * copy, SEND_SKIPPED if it refused, or SEND_BROKEN.
+  */
+ int fetch_signatures(int sock, uint32_t request_id, const char *filepath, const char *department,
+                      delta_sigs_t *sigs) {
+     uint8_t payload[FT_MAX_PAYLOAD + 1];
+     ft_header_t hdr;
+     ft_buf_t out, in;
+     
+     ft_buf_init(&out, payload, sizeof(payload));
+     if (ft_put_str(&out, department) != 0 || ft_put_str(&out, filepath) != 0) {
+         printf("Error: Request too large\n");
+         return SEND_SKIPPED;
+     }
+     if (ft_send_frame(sock, FT_MSG_SIGS, 0, request_id, payload, out.pos) != 0) {
+         printf("Error sending request: %s\n", strerror(errno));
+         return SEND_BROKEN;
+     }
+     
+     uint64_t filled = 0;
+     sigs->count = 0;
+     sigs->weak = NULL;
+     sigs->strong = NULL;
+     do {
+         uint64_t block_size, size, tag;
+         
+         if (ft_recv_frame(sock, &hdr, payload, sizeof(payload) - 1) != 0) {
+             printf("Error receiving response from server\n");
+             delta_sigs_free(sigs);
+             return SEND_BROKEN;
+         }
+         if (hdr.type != FT_MSG_BLOCKS) {
+             payload[hdr.length] = '\0';
+             printf("Server response: %s\n", (char *)payload);
+             delta_sigs_free(sigs);
+             return (hdr.type == FT_MSG_NEED) ? TRANSFER_NEED : SEND_SKIPPED;
+         }
+         
+         ft_buf_init(&in, payload, hdr.length);
+         if (ft_get_u64(&in, &block_size) != 0 || ft_get_u64(&in, &size) != 0 ||
+             ft_get_u64(&in, &tag) != 0) {
+             break;
+         }
+         
+         // The first frame says how many blocks to expect
+         if (sigs->weak == NULL &&
+             (block_size < DELTA_MIN_BLOCK || size / block_size > DELTA_MAX_BLOCKS ||
+              delta_sigs_init(sigs, block_size, size, tag) != 0)) {
+             break;
+         }
+         
+         uint64_t weak, strong;
+         while (filled < sigs->count && ft_get_u64(&in, &weak) == 0 && ft_get_u64(&in, &strong) == 0) {
+             sigs->weak[filled] = (uint32_t)weak;
+             sigs->strong[filled] = strong;
+             filled++;
+         }
+     } while (filled < sigs->count);
+     
+     if (sigs->weak == NULL || filled < sigs->count) {
+         printf("Error: Malformed signatures from server\n");
+         delta_sigs_free(sigs);
+         return SEND_BROKEN;
+     }
+     
+     return SEND_OK;
+ }
+ 
+ /**
+  * delta_encode() sink: compresses if asked to, and sends the result as chunks
+  */
+ int send_delta_data(void *ctx, const void *data, size_t len) {
+     delta_out_t *sink = ctx;
+     const char *p = data;
+     
+     if (sink->encoder != NULL) {
+         return codec_update(sink->encoder, data, len, send_chunk, &sink->sock);
+     }
+     
+     // Literal runs can be far longer than a chunk should be
+     while (len > 0) {
+         size_t step = (len < COPY_BUFFER_SIZE) ? len : COPY_BUFFER_SIZE;
+         if (send_chunk(&sink->sock, p, step) != 0) {
+             return -1;
+         }
+         p += step;
+         len -= step;
+     }
+     
+     return 0;
+ }
+ 
+ /**
+  * Sends a HAVE request carrying the file's SHA-256
+  *
+  * Returns SEND_SKIPPED, with nothing sent, for files that can't be
+  * digested up front (or at all, without OpenSSL); those go straight to a
+  * PUT.
+  */
+ int send_have(int sock, uint32_t request_id, const char *filepath, const char *department) {
+     uint8_t payload[FT_MAX_PAYLOAD];
+     char digest[DIGEST_HEX_SIZE];
+     uint64_t size;
+     ft_buf_t out;
+     
+     if (digest_file(filepath, digest, &size) != 0) {
+         return SEND_SKIPPED;
+     }
+     
+     ft_buf_init(&out, payload, sizeof(payload));
+     if (ft_put_u64(&out, size) != 0 ||
+         ft_put_str(&out, department) != 0 ||
+         ft_put_str(&out, filepath) != 0 ||
+         ft_put_str(&out, digest) != 0) {
+         return SEND_SKIPPED;
+     }
+     
+     if (ft_send_frame(sock, FT_MSG_HAVE, 0, request_id, payload, out.pos) != 0) {
+         printf("Error sending request: %s\n", strerror(errno));
+         return SEND_BROKEN;
+     }
+     
+     return SEND_OK;
+ }
+ 
+ /**
+  * Computes the SHA-256 of a regular file
+  */
+ int digest_file(const char *filepath, char digest[DIGEST_HEX_SIZE], uint64_t *size) {
+     char buffer[COPY_BUFFER_SIZE];
+     struct stat file_stat;
+     ssize_t n;
+     
+     digest_t *state = digest_new();
+     if (state == NULL) {
+         return -1;
+     }
+     int fd = open(filepath, O_RDONLY);
+     if (fd < 0) {
+         digest_free(state);
+         return -1;
+     }
+     if (fstat(fd, &file_stat) != 0 || !S_ISREG(file_stat.st_mode)) {
+         close(fd);
+         digest_free(state);
+         return -1;
+     }
+     
+     *size = 0;
+     while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+         digest_update(state, buffer, n);
+         *size += n;
+     }
+     close(fd);
+     
+     digest_final(state, digest);
+     digest_free(state);
+     return (n < 0 || digest[0] == '\0') ? -1 : 0;
+ }
+ 
+ /**
+  * Streams a file through an encoder as a chunked body
+  *
+  * Each block the encoder produces goes out as one chunk, ended by the
+  * usual zero-length chunk. The file's own bytes are added to hash, if
+  * given.
+  */
+ int send_compressed(int sock, int file_fd, codec_t *encoder, off_t size, xxh64_state_t *hash) {
+     char buffer[COPY_BUFFER_SIZE];
+     uint64_t total_read = 0;
+     uint64_t next_progress_ms = 0;
+     
+     while (1) {
+         ssize_t bytes_read = read(file_fd, buffer, sizeof(buffer));
+         if (bytes_read < 0) {
+             if (errno == EINTR) {
+                 continue;
+             }
+             printf("\nError reading file: %s\n", strerror(errno));
+             return SEND_BROKEN;
+         }
+         if (bytes_read > 0 && hash != NULL) {
+             xxh64_update(hash, buffer, bytes_read);
+         }
+         
+         int status = (bytes_read > 0) ? codec_update(encoder, buffer, bytes_read, send_chunk, &sock)
+                                       : codec_finish(encoder, send_chunk, &sock);
+         if (status != 0 || (bytes_read == 0 && send_chunk(&sock, NULL, 0) != 0)) {
+             // Whatever the server made of it is still worth reading
+             printf("\nError sending file data: %s\n", strerror(errno));
+             break;
+         }
+         
+         total_read += bytes_read;
+         
+         uint64_t now = monotonic_ms();
+         if (show_progress && (now >= next_progress_ms || bytes_read == 0)) {
+             printf("\rTransferring: %.2f%% complete", size > 0 ? total_read * 100.0 / size : 100.0);
+             fflush(stdout);
+             next_progress_ms = now + PROGRESS_INTERVAL_MS;
+         }
+         
+         if (bytes_read == 0) {
+             break;
+         }
+     }
+     
+     if (show_progress) {
+         printf("\n");
+     }
+     return SEND_OK;
+ }
+ 
+ /**
+  * Encoder sink sending each block as a chunk; ctx points at the socket
+  */
+ int send_chunk(void *ctx, const void *data, size_t len) {
+     int sock = *(int *)ctx;
+     uint32_t length = htonl((uint32_t)len);
+     
+     if (ft_send_all(sock, &length, sizeof(length)) != 0) {
+         return -1;
+     }
+     return (len > 0) ? ft_send_all(sock, data, len) : 0;
+ }
+ 
+ /**
+  * Settles on a codec from -compress and what the server can decode
+  *
+  * In auto mode lz4 is preferred on loopback and private networks, where
+  * CPU rather than bandwidth is the limit, and zstd elsewhere.
+  */
+ int pick_codec(uint64_t caps) {
+     caps &= codec_caps();
+     
+     if (compress_mode == COMPRESS_AUTO) {
+         int lan = is_lan_address(SERVER_IP);
+         int first = lan ? CODEC_LZ4 : CODEC_ZSTD;
+         int second = lan ? CODEC_ZSTD : CODEC_LZ4;
+         if (caps & codec_cap(first)) {
+             return first;
+         }
+         return (caps & codec_cap(second)) ? second : CODEC_NONE;
+     }
+     
+     if (compress_mode != CODEC_NONE && !(caps & codec_cap(compress_mode))) {
+         printf("Server can't decode %s; sending uncompressed\n", codec_name(compress_mode));
+         return CODEC_NONE;
+     }
+     
+     return compress_mode;
+ }
+ 
+ /**
+  * Whether an IPv4 address is loopback or in a private (RFC 1918) range
+  */
+ int is_lan_address(const char *ip) {
+     struct in_addr addr;
+     
+     if (inet_pton(AF_INET, ip, &addr) != 1) {
+         return 0;
+     }
+     
+     uint32_t a = ntohl(addr.s_addr);
+     return (a >> 24) == 127 || (a >> 24) == 10 || (a >> 20) == 0xAC1 || (a >> 16) == 0xC0A8;
+ }
+ 
+ /**
+  * Streams a body of unknown length as chunks until end of file, adding
+  * the data to hash if given
+  */
+ int send_chunked(int sock, int file_fd, xxh64_state_t *hash) {
+     // Room for the chunk header in front of the data
+     char buffer[FT_CHUNK_HEADER_SIZE + COPY_BUFFER_SIZE];
+     uint64_t total_sent = 0;
+     uint64_t next_progress_ms = 0;
+     
+     while (1) {
+         ssize_t bytes_read = read(file_fd, buffer + FT_CHUNK_HEADER_SIZE, COPY_BUFFER_SIZE);
+         if (bytes_read < 0) {
+             if (errno == EINTR) {
+                 continue;
+             }
+             printf("\nError reading input: %s\n", strerror(errno));
+             return SEND_BROKEN;
+         }
+         if (bytes_read > 0 && hash != NULL) {
+             xxh64_update(hash, buffer + FT_CHUNK_HEADER_SIZE, bytes_read);
+         }
+         
+         // A zero-length chunk marks the end of the body
+         uint32_t length = htonl((uint32_t)bytes_read);
+         memcpy(buffer, &length, sizeof(length));
+         if (ft_send_all(sock, buffer, FT_CHUNK_HEADER_SIZE + bytes_read) != 0) {
+             printf("\nError sending file data: %s\n", strerror(errno));
+             break;
+         }
+         
+         total_sent += bytes_read;
+         
+         uint64_t now = monotonic_ms();
+         if (show_progress && (now >= next_progress_ms || bytes_read == 0)) {
+             printf("\rTransferring: %.1f MB sent", total_sent / (1024.0 * 1024.0));
+             fflush(stdout);
+             next_progress_ms = now + PROGRESS_INTERVAL_MS;
+         }
+         
+         if (bytes_read == 0) {
+             break;
+         }
+     }
+     
+     if (show_progress) {
+         printf("\n");
+     }
+     return SEND_OK;
+ }
+ 
+ /**
+  * Ends a checksummed body with the hash of what was sent, leaving it in
+  * checksum; does nothing if hash is NULL
+  */
+ int send_checksum(int sock, xxh64_state_t *hash, uint64_t *checksum) {
+     uint8_t trailer[sizeof(uint64_t)];
+     ft_buf_t out;
+     
+     if (hash == NULL) {
+         return SEND_OK;
+     }
+     
+     *checksum = xxh64_digest(hash);
+     ft_buf_init(&out, trailer, sizeof(trailer));
+     ft_put_u64(&out, *checksum);
+     
+     // Like a failed body, a failed trailer leaves the server's reply worth reading
+     if (ft_send_all(sock, trailer, sizeof(trailer)) != 0) {
+         printf("Error sending checksum: %s\n", strerror(errno));
+     }
+     return SEND_OK;
+ }
+ 
+ /**
+  * Checks that an upload's OK names the hash it was sent with
+  *
+  * A server that ignored FT_FLAG_CHECKSUM would not echo it, so the file
+  * can't be taken as verified.
+  */
+ int check_checksum(const ft_header_t *hdr, const char *response, uint64_t checksum) {
+     char text[BUFFER_SIZE];
+     uint64_t confirmed;
+     ft_buf_t in;
+     
+     ft_buf_init(&in, (void *)response, hdr->length);
+     if (ft_get_str(&in, text, sizeof(text)) != 0 || ft_get_u64(&in, &confirmed) != 0 ||
+         confirmed != checksum) {
+         printf("Error: Server did not confirm checksum %016llx\n", (unsigned long long)checksum);
+         return -1;
+     }
+     
+     return 0;
+ }
+ 
+ /**
+  * Releases a mapping taken to hash a file; mapped may be NULL
+  */
+ void unmap_file(const char *mapped, off_t size) {
+     if (mapped != NULL) {
+         munmap((void *)mapped, size);
+     }
+ }
+
+ /**
+  * Fetches a file from a department into the current directory
+  *
+  * The file is written under a ".part" name and renamed once it's whole,
+  * keeping the server's mtime.
+  */
+ int download_file(int sock, const char *username, const char *password,
+                   const char *name, const char *department, uint64_t *retry_after_ms) {
+     uint8_t payload[FT_MAX_PAYLOAD];
+     char response[BUFFER_SIZE];
+     char part_path[MAX_FILEPATH_LENGTH + 8];
+     ft_header_t hdr;
+     ft_buf_t out, in;
+     uint64_t size, mtime;
+     
+     int auth_status = authenticate(sock, username, password, retry_after_ms, NULL);
+     if (auth_status != 0) {
+         if (auth_status != TRANSFER_BUSY) {
+             printf("Authentication failed.\n");
+         }
+         return auth_status;
+     }
+     
+     ft_buf_init(&out, payload, sizeof(payload));
+     if (ft_put_str(&out, department) != 0 || ft_put_str(&out, name) != 0) {
+         printf("Error: File name too long\n");
+         return -1;
+     }
+     if (ft_send_frame(sock, FT_MSG_GET, 0, 1, payload, out.pos) != 0 ||
+         read_reply(sock, &hdr, response, sizeof(response)) != 0) {
+         printf("Error receiving response from server\n");
+         return -1;
+     }
+     
+     if (hdr.type != FT_MSG_FILE) {
+         printf("Server response: %s\n", response);
+         return -1;
+     }
+     ft_buf_init(&in, response, hdr.length);
+     if (ft_get_u64(&in, &size) != 0 || ft_get_u64(&in, &mtime) != 0) {
+         printf("Error: Malformed reply from server\n");
+         return -1;
+     }
+     
+     // Save under the file's own name, whatever path it was asked for by
+     const char *base = strrchr(name, '/');
+     base = (base != NULL) ? base + 1 : name;
+     snprintf(part_path, sizeof(part_path), "%s.part", base);
+     
+     int file_fd = open(part_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+     if (file_fd < 0) {
+         printf("Error: Cannot create '%s': %s\n", part_path, strerror(errno));
+         return -1;
+     }
+     
+     int status = receive_body(sock, file_fd, size);
+     struct timespec times[2] = { { .tv_nsec = UTIME_NOW }, { .tv_sec = mtime } };
+     if (status == 0 && (futimens(file_fd, times) != 0 || close(file_fd) != 0 ||
+                         rename(part_path, base) != 0)) {
+         printf("Error: Cannot save '%s': %s\n", base, strerror(errno));
+         unlink(part_path);
+         return -1;
+     }
+     if (status != 0) {
+         close(file_fd);
+         unlink(part_path);
+         return -1;
+     }
+     
+     printf("Saved %s (%llu bytes)\n", base, (unsigned long long)size);
+     if (ft_send_frame(sock, FT_MSG_BYE, 0, 2, NULL, 0) == 0) {
+         read_reply(sock, &hdr, response, sizeof(response));
+     }
+     
+     return 0;
+ }
+ 
+ /**
+  * Copies a downloaded file's bytes from the socket into file_fd
+  */
+ int receive_body(int sock, int file_fd, uint64_t size) {
+     char buffer[COPY_BUFFER_SIZE];
+     uint64_t received = 0;
+     uint64_t next_progress_ms = 0;
+     
+     while (received < size) {
+         size_t want = (size - received < sizeof(buffer)) ? size - received : sizeof(buffer);
+         ssize_t n = tls_recv(sock, buffer, want);
+         if (n < 0 && errno == EINTR) {
+             continue;
+         }
+         if (n <= 0) {
+             printf("\nError receiving file data: %s\n", (n == 0) ? "Connection closed" : strerror(errno));
+             return -1;
+         }
+         if (write(file_fd, buffer, n) != n) {
+             printf("\nError writing file: %s\n", strerror(errno));
+             return -1;
+         }
+         received += n;
+         
+         uint64_t now = monotonic_ms();
+         if (now >= next_progress_ms || received == size) {
+             printf("\rReceiving: %.1f MB of %.1f MB", received / (1024.0 * 1024.0), size / (1024.0 * 1024.0));
+             fflush(stdout);
+             next_progress_ms = now + PROGRESS_INTERVAL_MS;
+         }
+     }
+     
+     printf("\n");
+     return 0;
+ }
+ 
+ /**
+  * Prints the files a department holds that this user may fetch, a page
+  * at a time, or with -changes those changed since a sequence number
+  */
+ int list_department(int sock, const char *username, const char *password,
+                     const char *department, uint64_t *retry_after_ms) {
+     uint8_t payload[FT_MAX_PAYLOAD];
+     char response[FT_MAX_PAYLOAD + 1];
+     char text[BUFFER_SIZE];
+     char after[MAX_FILEPATH_LENGTH] = "";
+     ft_header_t hdr;
+     ft_buf_t out, in;
+     uint64_t seq = changes_since, more = 1;
+     unsigned total = 0;
+     uint32_t request_id = 1;
+     
+     int auth_status = authenticate(sock, username, password, retry_after_ms, NULL);
+     if (auth_status != 0) {
+         if (auth_status != TRANSFER_BUSY) {
+             printf("Authentication failed.\n");
+         }
+         return auth_status;
+     }
+     
+     while (more) {
+         ft_buf_init(&out, payload, sizeof(payload));
+         ft_put_str(&out, department);
+         if (changes_only) {
+             ft_put_u64(&out, seq);
+         } else {
+             ft_put_str(&out, after);
+         }
+         ft_put_u64(&out, 0);
+         if (ft_send_frame(sock, changes_only ? FT_MSG_CHANGES : FT_MSG_LIST, 0, request_id++,
+                           payload, out.pos) != 0) {
+             printf("Error sending request to server\n");
+             return -1;
+         }
+         
+         // ENTRIES or CHANGED frames until the OK or ERROR that ends the page
+         while (1) {
+             if (read_reply(sock, &hdr, response, sizeof(response)) != 0) {
+                 printf("Error receiving response from server\n");
+                 return -1;
+             }
+             if (hdr.type != FT_MSG_ENTRIES && hdr.type != FT_MSG_CHANGED) {
+                 break;
+             }
+             total += print_entries(&hdr, response, after, sizeof(after));
+         }
+         
+         if (hdr.type != FT_MSG_OK) {
+             printf("Server response: %s\n", response);
+             return -1;
+         }
+         
+         // Servers without paging send the whole list and no position
+         ft_buf_init(&in, response, hdr.length);
+         if (ft_get_str(&in, text, sizeof(text)) != 0 || ft_get_u64(&in, &seq) != 0 ||
+             ft_get_u64(&in, &more) != 0) {
+             more = 0;
+         }
+     }
+     
+     if (changes_only) {
+         printf("%u changes; next from %llu\n", total, (unsigned long long)seq);
+     } else {
+         printf("%u files; latest change %llu\n", total, (unsigned long long)seq);
+     }
+     
+     if (ft_send_frame(sock, FT_MSG_BYE, 0, request_id, NULL, 0) == 0) {
+         read_reply(sock, &hdr, response, sizeof(response));
+     }
+     
+     return 0;
+ }
+ 
+ /**
+  * Prints the records of one ENTRIES or CHANGED frame, returning how many
+  * there were; the last file name is kept in last_name
+  */
+ int print_entries(const ft_header_t *hdr, const char *payload, char *last_name, size_t size) {
+     char name[MAX_FILEPATH_LENGTH];
+     char owner[MAX_USERNAME_LENGTH] = "";
+     uint64_t file_size, mtime, hash = 0, seq = 0;
+     int changed = (hdr->type == FT_MSG_CHANGED);
+     int count = 0;
+     ft_buf_t in;
+     
+     ft_buf_init(&in, (void *)payload, hdr->length);
+     while (ft_get_str(&in, name, sizeof(name)) == 0) {
+         if ((changed && ft_get_str(&in, owner, sizeof(owner)) != 0) ||
+             ft_get_u64(&in, &file_size) != 0 || ft_get_u64(&in, &mtime) != 0 ||
+             (changed && (ft_get_u64(&in, &hash) != 0 || ft_get_u64(&in, &seq) != 0))) {
+             break;
+         }
+         
+         time_t when = (time_t)mtime;
+         char stamp[32];
+         strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M", localtime(&when));
+         if (changed) {
+             printf("%20llu  %12llu  %s  %-16s %016llx  %s\n", (unsigned long long)seq,
+                    (unsigned long long)file_size, stamp, owner, (unsigned long long)hash, name);
+         } else {
+             printf("%12llu  %s  %s\n", (unsigned long long)file_size, stamp, name);
+         }
+         snprintf(last_name, size, "%s", name);
+         count++;
+     }
+     
+     return count;
+ }
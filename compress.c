@@ -0,0 +1,391 @@
+/**
+ * Streaming Compression for the File Transfer System
+ *
+ * Input of any size is fed through codec_update() and the codec hands its
+ * output to a sink as it goes, so neither side ever holds a whole file.
+ * Both directions produce or expect a single standard frame (a zstd frame
+ * or an LZ4 frame), readable by the zstd and lz4 tools.
+ */
+
+ #include <stdlib.h>
+ #include <string.h>
+ #include <math.h>
+
+ #ifdef HAVE_ZSTD
+ #include <zstd.h>
+ #endif
+ #ifdef HAVE_LZ4
+ #include <lz4frame.h>
+ #endif
+
+ #include "compress.h"
+ #include "protocol.h"
+
+ #define CODEC_BLOCK_SIZE 65536       // Input handed to the lz4 encoder per call
+ #define ENTROPY_LIMIT 7.5            // Bits per byte above which data is taken as incompressible
+ #define MIN_COMPRESS_SIZE 256        // Smaller files gain nothing from a frame
+
+ struct codec {
+     int codec;
+     int compress;
+     int started;                 // lz4: frame header written
+     int complete;                // Decoder has seen the end of the frame
+     void *out;
+     size_t out_size;
+ #ifdef HAVE_ZSTD
+     ZSTD_CCtx *zc;
+     ZSTD_DCtx *zd;
+ #endif
+ #ifdef HAVE_LZ4
+     LZ4F_cctx *lc;
+     LZ4F_dctx *ld;
+ #endif
+ };
+
+ // Leading bytes of formats that are already compressed
+ static const struct {
+     size_t offset;
+     size_t len;
+     const char *magic;
+ } compressed_formats[] = {
+     { 0, 2, "\x1f\x8b" },                  // gzip
+     { 0, 4, "\x28\xb5\x2f\xfd" },          // zstd
+     { 0, 4, "\x04\x22\x4d\x18" },          // lz4
+     { 0, 6, "\xfd" "7zXZ\x00" },           // xz
+     { 0, 3, "BZh" },                       // bzip2
+     { 0, 6, "7z\xbc\xaf\x27\x1c" },        // 7-Zip
+     { 0, 4, "PK\x03\x04" },                // zip, and the office formats built on it
+     { 0, 8, "\x89PNG\r\n\x1a\n" },         // png
+     { 0, 3, "\xff\xd8\xff" },              // jpeg
+     { 4, 4, "ftyp" },                      // mp4, mov
+ };
+
+ /**
+  * Capability bits (FT_CAP_*) for the codecs this build supports
+  */
+ uint64_t codec_caps(void) {
+     uint64_t caps = 0;
+
+ #ifdef HAVE_ZSTD
+     caps |= FT_CAP_ZSTD;
+ #endif
+ #ifdef HAVE_LZ4
+     caps |= FT_CAP_LZ4;
+ #endif
+
+     return caps;
+ }
+
+ /**
+  * The codec a PUT's flags ask for
+  */
+ int codec_from_flags(uint16_t flags) {
+     if (flags & FT_FLAG_ZSTD) {
+         return CODEC_ZSTD;
+     }
+     if (flags & FT_FLAG_LZ4) {
+         return CODEC_LZ4;
+     }
+     return CODEC_NONE;
+ }
+
+ /**
+  * The PUT flag for a codec
+  */
+ uint16_t codec_flag(int codec) {
+     switch (codec) {
+     case CODEC_ZSTD:
+         return FT_FLAG_ZSTD;
+     case CODEC_LZ4:
+         return FT_FLAG_LZ4;
+     default:
+         return 0;
+     }
+ }
+
+ /**
+  * The capability bit for a codec
+  */
+ uint64_t codec_cap(int codec) {
+     switch (codec) {
+     case CODEC_ZSTD:
+         return FT_CAP_ZSTD;
+     case CODEC_LZ4:
+         return FT_CAP_LZ4;
+     default:
+         return 0;
+     }
+ }
+
+ const char *codec_name(int codec) {
+     switch (codec) {
+     case CODEC_ZSTD:
+         return "zstd";
+     case CODEC_LZ4:
+         return "lz4";
+     default:
+         return "none";
+     }
+ }
+
+ /**
+  * Creates an encoder (compress set) or decoder
+  *
+  * Returns NULL if the codec isn't built in or memory ran out.
+  */
+ codec_t *codec_new(int codec, int compress) {
+     codec_t *c = calloc(1, sizeof(*c));
+     if (c == NULL) {
+         return NULL;
+     }
+     c->codec = codec;
+     c->compress = compress;
+
+     switch (codec) {
+ #ifdef HAVE_ZSTD
+     case CODEC_ZSTD:
+         if (compress) {
+             c->zc = ZSTD_createCCtx();
+             c->out_size = ZSTD_CStreamOutSize();
+             if (c->zc != NULL) {
+                 ZSTD_CCtx_setParameter(c->zc, ZSTD_c_compressionLevel, CODEC_ZSTD_LEVEL);
+             }
+         } else {
+             c->zd = ZSTD_createDCtx();
+             c->out_size = ZSTD_DStreamOutSize();
+         }
+         if (c->zc == NULL && c->zd == NULL) {
+             codec_free(c);
+             return NULL;
+         }
+         break;
+ #endif
+ #ifdef HAVE_LZ4
+     case CODEC_LZ4:
+         if (compress) {
+             c->out_size = LZ4F_compressBound(CODEC_BLOCK_SIZE, NULL) + LZ4F_HEADER_SIZE_MAX;
+             if (LZ4F_isError(LZ4F_createCompressionContext(&c->lc, LZ4F_VERSION))) {
+                 c->lc = NULL;
+             }
+         } else {
+             c->out_size = CODEC_BLOCK_SIZE;
+             if (LZ4F_isError(LZ4F_createDecompressionContext(&c->ld, LZ4F_VERSION))) {
+                 c->ld = NULL;
+             }
+         }
+         if (c->lc == NULL && c->ld == NULL) {
+             codec_free(c);
+             return NULL;
+         }
+         break;
+ #endif
+     default:
+         free(c);
+         return NULL;
+     }
+
+     c->out = malloc(c->out_size);
+     if (c->out == NULL) {
+         codec_free(c);
+         return NULL;
+     }
+
+     return c;
+ }
+
+ /**
+  * Feeds input through the codec, passing whatever it produces to sink
+  *
+  * Returns -1 if the data is corrupt (when decoding) or the sink failed.
+  */
+ int codec_update(codec_t *c, const void *data, size_t len, codec_sink_t sink, void *ctx) {
+ #ifdef HAVE_ZSTD
+     if (c->codec == CODEC_ZSTD) {
+         ZSTD_inBuffer in = { data, len, 0 };
+         ZSTD_outBuffer out;
+
+         // Run until the input is used up and the last call had room to spare
+         do {
+             out.dst = c->out;
+             out.size = c->out_size;
+             out.pos = 0;
+
+             size_t r = c->compress ? ZSTD_compressStream2(c->zc, &out, &in, ZSTD_e_continue)
+                                    : ZSTD_decompressStream(c->zd, &out, &in);
+             if (ZSTD_isError(r)) {
+                 return -1;
+             }
+             if (!c->compress) {
+                 c->complete = (r == 0);
+             }
+             if (out.pos > 0 && sink(ctx, c->out, out.pos) != 0) {
+                 return -1;
+             }
+         } while (in.pos < in.size || out.pos == out.size);
+
+         return 0;
+     }
+ #endif
+ #ifdef HAVE_LZ4
+     if (c->codec == CODEC_LZ4 && c->compress) {
+         const char *p = data;
+
+         if (!c->started) {
+             size_t n = LZ4F_compressBegin(c->lc, c->out, c->out_size, NULL);
+             if (LZ4F_isError(n) || sink(ctx, c->out, n) != 0) {
+                 return -1;
+             }
+             c->started = 1;
+         }
+
+         while (len > 0) {
+             size_t step = (len < CODEC_BLOCK_SIZE) ? len : CODEC_BLOCK_SIZE;
+             size_t n = LZ4F_compressUpdate(c->lc, c->out, c->out_size, p, step, NULL);
+             if (LZ4F_isError(n) || (n > 0 && sink(ctx, c->out, n) != 0)) {
+                 return -1;
+             }
+             p += step;
+             len -= step;
+         }
+
+         return 0;
+     }
+     if (c->codec == CODEC_LZ4) {
+         const char *p = data;
+         size_t out_len;
+
+         do {
+             size_t in_len = len;
+             out_len = c->out_size;
+
+             size_t r = LZ4F_decompress(c->ld, c->out, &out_len, p, &in_len, NULL);
+             if (LZ4F_isError(r)) {
+                 return -1;
+             }
+             c->complete = (r == 0);
+             if (out_len > 0 && sink(ctx, c->out, out_len) != 0) {
+                 return -1;
+             }
+             p += in_len;
+             len -= in_len;
+         } while (len > 0 || out_len == c->out_size);
+
+         return 0;
+     }
+ #endif
+
+     (void)c;
+     (void)data;
+     (void)len;
+     (void)sink;
+     (void)ctx;
+     return -1;
+ }
+
+ /**
+  * Ends the stream
+  *
+  * An encoder writes out the rest of its frame. A decoder checks that the
+  * frame was complete, so a truncated upload is caught. Returns -1 on
+  * failure.
+  */
+ int codec_finish(codec_t *c, codec_sink_t sink, void *ctx) {
+     if (!c->compress) {
+         return c->complete ? 0 : -1;
+     }
+
+ #ifdef HAVE_ZSTD
+     if (c->codec == CODEC_ZSTD) {
+         ZSTD_inBuffer in = { NULL, 0, 0 };
+         size_t r;
+
+         do {
+             ZSTD_outBuffer out = { c->out, c->out_size, 0 };
+             r = ZSTD_compressStream2(c->zc, &out, &in, ZSTD_e_end);
+             if (ZSTD_isError(r) || (out.pos > 0 && sink(ctx, c->out, out.pos) != 0)) {
+                 return -1;
+             }
+         } while (r != 0);
+
+         return 0;
+     }
+ #endif
+ #ifdef HAVE_LZ4
+     if (c->codec == CODEC_LZ4) {
+         // An empty input still makes a valid (empty) frame
+         if (!c->started && codec_update(c, NULL, 0, sink, ctx) != 0) {
+             return -1;
+         }
+
+         size_t n = LZ4F_compressEnd(c->lc, c->out, c->out_size, NULL);
+         if (LZ4F_isError(n) || sink(ctx, c->out, n) != 0) {
+             return -1;
+         }
+
+         return 0;
+     }
+ #endif
+
+     (void)sink;
+     (void)ctx;
+     return -1;
+ }
+
+ void codec_free(codec_t *c) {
+     if (c == NULL) {
+         return;
+     }
+
+ #ifdef HAVE_ZSTD
+     ZSTD_freeCCtx(c->zc);
+     ZSTD_freeDCtx(c->zd);
+ #endif
+ #ifdef HAVE_LZ4
+     if (c->lc != NULL) {
+         LZ4F_freeCompressionContext(c->lc);
+     }
+     if (c->ld != NULL) {
+         LZ4F_freeDecompressionContext(c->ld);
+     }
+ #endif
+
+     free(c->out);
+     free(c);
+ }
+
+ /**
+  * Guesses from the start of a file whether compressing it would pay off
+  *
+  * Known compressed formats are recognised by their magic number, and
+  * anything else is judged by the byte entropy of the sample.
+  */
+ int codec_worth_compressing(const void *sample, size_t len) {
+     const unsigned char *p = sample;
+     size_t counts[256] = { 0 };
+
+     if (len < MIN_COMPRESS_SIZE) {
+         return 0;
+     }
+
+     for (size_t i = 0; i < sizeof(compressed_formats) / sizeof(compressed_formats[0]); i++) {
+         size_t offset = compressed_formats[i].offset;
+         if (len >= offset + compressed_formats[i].len &&
+             memcmp(p + offset, compressed_formats[i].magic, compressed_formats[i].len) == 0) {
+             return 0;
+         }
+     }
+
+     for (size_t i = 0; i < len; i++) {
+         counts[p[i]]++;
+     }
+
+     double entropy = 0;
+     for (int i = 0; i < 256; i++) {
+         if (counts[i] > 0) {
+             double f = (double)counts[i] / len;
+             entropy -= f * log2(f);
+         }
+     }
+
+     return entropy < ENTROPY_LIMIT;
+ }
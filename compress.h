@@ -0,0 +1,41 @@
+/**
+ * Streaming Compression for the File Transfer System
+ *
+ * A thin layer over zstd and lz4 frame streams, shared by the client
+ * (compressing file bodies) and the server (decompressing them straight
+ * into the destination file). Each codec is only available when its
+ * library was found at build time (HAVE_ZSTD, HAVE_LZ4).
+ */
+
+ #ifndef COMPRESS_H
+ #define COMPRESS_H
+
+ #include <stdint.h>
+ #include <stddef.h>
+
+ #define CODEC_NONE 0
+ #define CODEC_ZSTD 1
+ #define CODEC_LZ4 2
+
+ #define CODEC_ZSTD_LEVEL 3
+ #define CODEC_SAMPLE_SIZE 65536  // Bytes looked at to decide whether a file is worth compressing
+
+ // Receives output; returns 0 to carry on
+ typedef int (*codec_sink_t)(void *ctx, const void *data, size_t len);
+
+ typedef struct codec codec_t;
+
+ uint64_t codec_caps(void);
+ int codec_from_flags(uint16_t flags);
+ uint16_t codec_flag(int codec);
+ uint64_t codec_cap(int codec);
+ const char *codec_name(int codec);
+
+ codec_t *codec_new(int codec, int compress);
+ int codec_update(codec_t *c, const void *data, size_t len, codec_sink_t sink, void *ctx);
+ int codec_finish(codec_t *c, codec_sink_t sink, void *ctx);
+ void codec_free(codec_t *c);
+
+ int codec_worth_compressing(const void *sample, size_t len);
+
+ #endif
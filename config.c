@@ -0,0 +1,152 @@
+/**
+ * Runtime Configuration for the File Transfer Server
+ *
+ * The file has one setting per line:
+ *
+ *     <key> = <value>
+ *
+ * Blank lines and lines starting with '#' are ignored, as is anything
+ * after a '#' on a line. Keys not given keep the value they had, so the
+ * file only needs what differs from the defaults.
+ */
+
+ #include <stdio.h>
+ #include <stdlib.h>
+ #include <string.h>
+ #include <errno.h>
+ #include <limits.h>
+
+ #include "config.h"
+ #include "server.h"
+ #include "log.h"
+ #include "auth.h"
+ #include "pool.h"
+ #include "quota.h"
+ #include "upgrade.h"
+
+ static int set_option(server_config_t *config, const char *key, const char *value);
+ static int parse_int(const char *value, int min, int max, int *out);
+ static char *trim(char *s);
+
+ /**
+  * Fills config with the compiled-in defaults
+  */
+ void config_defaults(server_config_t *config) {
+     config->port = PORT;
+     config->log_level = LOG_LEVEL_INFO;
+     config->idle_timeout = SESSION_IDLE_TIMEOUT;
+     config->max_in_flight = SESSION_MAX_IN_FLIGHT;
+     config->socket_buffer = 0;
+     config->auth_workers = AUTH_DEFAULT_WORKERS;
+     config->pool_workers = POOL_DEFAULT_WORKERS;
+     config->max_rate = 0;
+     config->max_transfers = 0;
+     config->drain_timeout = UPGRADE_DRAIN_TIMEOUT;
+ }
+
+ /**
+  * Applies the settings in path on top of config
+  *
+  * Returns 0 on success, or -1 with config unchanged if the file can't be
+  * read or has an error.
+  */
+ int config_load(const char *path, server_config_t *config) {
+     server_config_t loaded = *config;
+     char line[512];
+     int line_no = 0;
+
+     FILE *f = fopen(path, "r");
+     if (f == NULL) {
+         fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+         return -1;
+     }
+
+     while (fgets(line, sizeof(line), f) != NULL) {
+         line_no++;
+         line[strcspn(line, "#\n")] = '\0';
+
+         char *key = trim(line);
+         if (*key == '\0') {
+             continue;
+         }
+
+         char *value = strchr(key, '=');
+         if (value == NULL) {
+             fprintf(stderr, "%s:%d: expected <key> = <value>\n", path, line_no);
+             fclose(f);
+             return -1;
+         }
+         *value++ = '\0';
+         key = trim(key);
+         value = trim(value);
+
+         if (set_option(&loaded, key, value) != 0) {
+             fprintf(stderr, "%s:%d: invalid setting %s = '%s'\n", path, line_no, key, value);
+             fclose(f);
+             return -1;
+         }
+     }
+
+     fclose(f);
+     *config = loaded;
+     return 0;
+ }
+
+ static int set_option(server_config_t *config, const char *key, const char *value) {
+     if (strcmp(key, "port") == 0) {
+         return parse_int(value, 1, 65535, &config->port);
+     }
+     if (strcmp(key, "log_level") == 0) {
+         config->log_level = log_parse_level(value);
+         return (config->log_level < 0) ? -1 : 0;
+     }
+     if (strcmp(key, "idle_timeout") == 0) {
+         return parse_int(value, 1, INT_MAX / 1000, &config->idle_timeout);
+     }
+     if (strcmp(key, "max_in_flight") == 0) {
+         return parse_int(value, 1, INT_MAX, &config->max_in_flight);
+     }
+     if (strcmp(key, "socket_buffer") == 0) {
+         uint64_t bytes;
+         if (quota_parse_rate(value, &bytes) != 0 || bytes > INT_MAX) {
+             return -1;
+         }
+         config->socket_buffer = bytes;
+         return 0;
+     }
+     if (strcmp(key, "auth_workers") == 0) {
+         return parse_int(value, 1, 1024, &config->auth_workers);
+     }
+     if (strcmp(key, "pool_workers") == 0) {
+         return parse_int(value, 1, 65536, &config->pool_workers);
+     }
+     if (strcmp(key, "max_rate") == 0) {
+         return quota_parse_rate(value, &config->max_rate);
+     }
+     if (strcmp(key, "max_transfers") == 0) {
+         return parse_int(value, 0, INT_MAX, &config->max_transfers);
+     }
+     if (strcmp(key, "drain_timeout") == 0) {
+         return parse_int(value, 0, INT_MAX / 1000, &config->drain_timeout);
+     }
+     return -1;
+ }
+
+ static int parse_int(const char *value, int min, int max, int *out) {
+     char *end;
+     long n = strtol(value, &end, 10);
+     if (*value == '\0' || *end != '\0' || n < min || n > max) {
+         return -1;
+     }
+     *out = n;
+     return 0;
+ }
+
+ static char *trim(char *s) {
+     s += strspn(s, " \t");
+     size_t len = strlen(s);
+     while (len > 0 && (s[len - 1] == ' ' || s[len - 1] == '\t' || s[len - 1] == '\r')) {
+         s[--len] = '\0';
+     }
+     return s;
+ }
@@ -0,0 +1,33 @@
+/**
+ * Runtime Configuration for the File Transfer Server
+ *
+ * Tunables read from a file given with -c; the command line's settings
+ * win over the file's. SIGHUP reads the file again and applies whatever can change
+ * in a running server; the port only changes through an upgrade (see
+ * upgrade.h).
+ */
+
+ #ifndef CONFIG_H
+ #define CONFIG_H
+
+ #include <stdint.h>
+
+ #define CONFIG_DEFAULT_FILE "server.conf"
+
+ typedef struct {
+     int port;
+     int log_level;
+     int idle_timeout;            // Seconds
+     int max_in_flight;           // Unanswered pipelined requests per session
+     int socket_buffer;           // SO_RCVBUF and SO_SNDBUF for new connections; 0 leaves the kernel's
+     int auth_workers;
+     int pool_workers;
+     uint64_t max_rate;           // Server-wide bytes per second; 0 for no limit
+     int max_transfers;           // Server-wide transfers at once; 0 for no limit
+     int drain_timeout;           // Seconds an old process waits for its connections in an upgrade
+ } server_config_t;
+
+ void config_defaults(server_config_t *config);
+ int config_load(const char *path, server_config_t *config);
+
+ #endif
@@ -0,0 +1,500 @@
+/**
+ * Delta Encoding for the File Transfer System
+ *
+ * The weak checksum is rsync's: two 16-bit sums over a block that can be
+ * rolled forward one byte at a time, so the client can test every offset
+ * of the new file against the old blocks cheaply. Candidates are confirmed
+ * with XXH64, and the whole rebuilt file is checked against the client's
+ * XXH64 at the end, so a collision can't publish a corrupt file.
+ */
+
+ #include <stdlib.h>
+ #include <string.h>
+ #include <unistd.h>
+ #include <errno.h>
+
+ #include "delta.h"
+ #include "xxhash.h"
+
+ #define DELTA_OUT_SIZE 65536         // Instructions buffered before they reach the sink
+ #define DELTA_COPY_SIZE 65536        // Old data read per pread() when copying
+
+ // Client side: the stream being produced
+ typedef struct {
+     uint8_t *out;
+     size_t out_len;
+     codec_sink_t sink;
+     void *ctx;
+     int error;
+     uint64_t copy_first;         // Copy instruction still being extended
+     uint64_t copy_count;
+ } encoder_t;
+
+ // Server side: the stream being applied
+ struct delta {
+     int base_fd;
+     uint64_t base_size;
+     uint64_t block_size;
+     uint64_t blocks;
+     uint8_t op[17];              // Instruction being assembled
+     size_t op_len;
+     uint64_t literal;            // Bytes of DATA still to come
+     int ended;
+     uint64_t expected;
+     xxh64_state_t hash;
+     uint8_t *buf;
+ };
+
+ static uint32_t weak_sum(const uint8_t *p, size_t len, uint32_t *a, uint32_t *b);
+ static void put64(uint8_t *p, uint64_t value);
+ static uint64_t get64(const uint8_t *p);
+ static int op_size(uint8_t op);
+ static void emit(encoder_t *e, uint8_t op, uint64_t v1, uint64_t v2);
+ static void emit_copy(encoder_t *e, uint64_t block);
+ static void emit_data(encoder_t *e, const uint8_t *p, uint64_t len);
+ static void flush_copy(encoder_t *e);
+ static void flush_out(encoder_t *e);
+ static int apply_op(delta_t *d, codec_sink_t sink, void *ctx);
+ static int send_out(delta_t *d, const void *data, size_t len, codec_sink_t sink, void *ctx);
+
+ /**
+  * Block size for a file, chosen so it has at most DELTA_MAX_BLOCKS blocks
+  */
+ uint64_t delta_block_size(uint64_t size) {
+     uint64_t block_size = (size + DELTA_MAX_BLOCKS - 1) / DELTA_MAX_BLOCKS;
+
+     if (block_size < DELTA_MIN_BLOCK) {
+         return DELTA_MIN_BLOCK;
+     }
+     return (block_size + 1023) & ~(uint64_t)1023;
+ }
+
+ /**
+  * Tag naming one version of a file; it changes whenever the file does
+  */
+ uint64_t delta_tag(const struct stat *st) {
+     uint64_t fields[] = {
+         st->st_dev, st->st_ino, st->st_size, st->st_mtim.tv_sec, st->st_mtim.tv_nsec,
+     };
+
+     return xxh64(fields, sizeof(fields), 0);
+ }
+
+ /**
+  * Allocates room for the signatures of a file of the given size
+  */
+ int delta_sigs_init(delta_sigs_t *sigs, uint64_t block_size, uint64_t size, uint64_t tag) {
+     sigs->block_size = block_size;
+     sigs->size = size;
+     sigs->tag = tag;
+     sigs->count = (size + block_size - 1) / block_size;
+     sigs->weak = malloc((sigs->count + 1) * sizeof(*sigs->weak));
+     sigs->strong = malloc((sigs->count + 1) * sizeof(*sigs->strong));
+
+     if (sigs->weak == NULL || sigs->strong == NULL) {
+         delta_sigs_free(sigs);
+         return -1;
+     }
+     return 0;
+ }
+
+ /**
+  * Reads a whole file and computes the signature of each block
+  */
+ int delta_signatures(int fd, const struct stat *st, delta_sigs_t *sigs) {
+     uint64_t block_size = delta_block_size(st->st_size);
+
+     if (delta_sigs_init(sigs, block_size, st->st_size, delta_tag(st)) != 0) {
+         return -1;
+     }
+
+     uint8_t *block = malloc(block_size);
+     if (block == NULL) {
+         delta_sigs_free(sigs);
+         return -1;
+     }
+
+     for (uint64_t i = 0; i < sigs->count; i++) {
+         uint64_t offset = i * block_size;
+         size_t len = (sigs->size - offset < block_size) ? sigs->size - offset : block_size;
+         size_t got = 0;
+
+         while (got < len) {
+             ssize_t n = pread(fd, block + got, len - got, offset + got);
+             if (n < 0 && errno == EINTR) {
+                 continue;
+             }
+             if (n <= 0) {
+                 free(block);
+                 delta_sigs_free(sigs);
+                 return -1;
+             }
+             got += n;
+         }
+
+         uint32_t a, b;
+         sigs->weak[i] = weak_sum(block, len, &a, &b);
+         sigs->strong[i] = xxh64(block, len, 0);
+     }
+
+     free(block);
+     return 0;
+ }
+
+ void delta_sigs_free(delta_sigs_t *sigs) {
+     free(sigs->weak);
+     free(sigs->strong);
+     sigs->weak = NULL;
+     sigs->strong = NULL;
+     sigs->count = 0;
+ }
+
+ /**
+  * Turns a new version of a file into a delta against the old one's signatures
+  *
+  * The instruction stream goes to sink, ending with DELTA_OP_END. matched
+  * is set to the bytes that will be copied rather than sent. Returns -1 if
+  * memory ran out or the sink failed.
+  */
+ int delta_encode(const void *data, uint64_t size, const delta_sigs_t *sigs,
+                  codec_sink_t sink, void *ctx, uint64_t *matched) {
+     const uint8_t *p = data;
+     uint64_t block_size = sigs->block_size;
+     uint64_t full_blocks = sigs->size / block_size;
+     uint64_t tail_len = sigs->size % block_size;
+     encoder_t e = { .sink = sink, .ctx = ctx };
+
+     // Chained hash table from weak checksum to block, for full blocks only
+     size_t buckets = 1;
+     while (buckets < 2 * full_blocks) {
+         buckets *= 2;
+     }
+     uint32_t *head = calloc(buckets, sizeof(*head));
+     uint32_t *next = malloc((full_blocks + 1) * sizeof(*next));
+     e.out = malloc(DELTA_OUT_SIZE);
+     if (head == NULL || next == NULL || e.out == NULL) {
+         free(head);
+         free(next);
+         free(e.out);
+         return -1;
+     }
+
+     for (uint64_t i = full_blocks; i-- > 0;) {
+         size_t bucket = (sigs->weak[i] * 2654435761u) & (buckets - 1);
+         next[i] = head[bucket];
+         head[bucket] = i + 1;
+     }
+
+     *matched = 0;
+     uint64_t literal = 0;        // Start of bytes not yet covered by an instruction
+     uint64_t pos = 0;
+     int rolling = 0;
+     uint32_t a = 0, b = 0;
+
+     while (full_blocks > 0 && pos + block_size <= size && !e.error) {
+         if (!rolling) {
+             weak_sum(p + pos, block_size, &a, &b);
+             rolling = 1;
+         }
+
+         uint32_t weak = (a & 0xffff) | (b << 16);
+         uint32_t i = head[(weak * 2654435761u) & (buckets - 1)];
+         uint64_t strong = 0;
+         int have_strong = 0;
+         for (; i != 0; i = next[i - 1]) {
+             if (sigs->weak[i - 1] != weak) {
+                 continue;
+             }
+             if (!have_strong) {
+                 strong = xxh64(p + pos, block_size, 0);
+                 have_strong = 1;
+             }
+             if (sigs->strong[i - 1] == strong) {
+                 break;
+             }
+         }
+
+         if (i != 0) {
+             emit_data(&e, p + literal, pos - literal);
+             emit_copy(&e, i - 1);
+             *matched += block_size;
+             pos += block_size;
+             literal = pos;
+             rolling = 0;
+             continue;
+         }
+
+         // Slide the window on by one byte
+         if (pos + block_size < size) {
+             uint8_t out = p[pos], in = p[pos + block_size];
+             a = a - out + in;
+             b = b - (uint32_t)block_size * out + a;
+         }
+         pos++;
+     }
+
+     // The old version's short last block can only match at the very end
+     if (tail_len > 0 && size - literal >= tail_len) {
+         uint64_t start = size - tail_len;
+         uint64_t last = sigs->count - 1;
+         if (weak_sum(p + start, tail_len, &a, &b) == sigs->weak[last] &&
+             xxh64(p + start, tail_len, 0) == sigs->strong[last]) {
+             emit_data(&e, p + literal, start - literal);
+             emit_copy(&e, last);
+             *matched += tail_len;
+             literal = size;
+         }
+     }
+
+     emit_data(&e, p + literal, size - literal);
+     emit(&e, DELTA_OP_END, xxh64(p, size, 0), 0);
+     flush_out(&e);
+
+     free(head);
+     free(next);
+     free(e.out);
+     return e.error ? -1 : 0;
+ }
+
+ /**
+  * Creates a decoder rebuilding a file from base_fd, which it takes over
+  */
+ delta_t *delta_new(int base_fd, uint64_t base_size) {
+     delta_t *d = calloc(1, sizeof(*d));
+     if (d == NULL) {
+         return NULL;
+     }
+
+     d->buf = malloc(DELTA_COPY_SIZE);
+     if (d->buf == NULL) {
+         free(d);
+         return NULL;
+     }
+
+     d->base_fd = base_fd;
+     d->base_size = base_size;
+     d->block_size = delta_block_size(base_size);
+     d->blocks = (base_size + d->block_size - 1) / d->block_size;
+     xxh64_init(&d->hash, 0);
+     return d;
+ }
+
+ /**
+  * Applies the next part of a delta stream, passing the rebuilt file to sink
+  *
+  * Returns -1 if the stream is malformed, the old version can't be read or
+  * the sink failed.
+  */
+ int delta_update(delta_t *d, const void *data, size_t len, codec_sink_t sink, void *ctx) {
+     const uint8_t *p = data;
+
+     while (len > 0) {
+         if (d->literal > 0) {
+             size_t step = (len < d->literal) ? len : d->literal;
+             if (send_out(d, p, step, sink, ctx) != 0) {
+                 return -1;
+             }
+             d->literal -= step;
+             p += step;
+             len -= step;
+             continue;
+         }
+
+         // Nothing may follow the end of the stream
+         if (d->ended || (d->op_len == 0 && op_size(*p) < 0)) {
+             return -1;
+         }
+
+         d->op[d->op_len++] = *p++;
+         len--;
+         if ((int)d->op_len == op_size(d->op[0])) {
+             if (apply_op(d, sink, ctx) != 0) {
+                 return -1;
+             }
+             d->op_len = 0;
+         }
+     }
+
+     return 0;
+ }
+
+ /**
+  * Checks that the stream ended and rebuilt exactly the client's file
+  */
+ int delta_finish(delta_t *d) {
+     return (d->ended && xxh64_digest(&d->hash) == d->expected) ? 0 : -1;
+ }
+
+ void delta_free(delta_t *d) {
+     if (d == NULL) {
+         return;
+     }
+
+     close(d->base_fd);
+     free(d->buf);
+     free(d);
+ }
+
+ /**
+  * rsync's rolling checksum of a block; a and b are its two halves
+  */
+ static uint32_t weak_sum(const uint8_t *p, size_t len, uint32_t *a, uint32_t *b) {
+     uint32_t s1 = 0, s2 = 0;
+
+     for (size_t i = 0; i < len; i++) {
+         s1 += p[i];
+         s2 += (uint32_t)(len - i) * p[i];
+     }
+
+     *a = s1;
+     *b = s2;
+     return (s1 & 0xffff) | (s2 << 16);
+ }
+
+ static void put64(uint8_t *p, uint64_t value) {
+     for (int i = 7; i >= 0; i--) {
+         p[i] = value & 0xff;
+         value >>= 8;
+     }
+ }
+
+ static uint64_t get64(const uint8_t *p) {
+     uint64_t value = 0;
+
+     for (int i = 0; i < 8; i++) {
+         value = (value << 8) | p[i];
+     }
+     return value;
+ }
+
+ /**
+  * Length of an instruction with its operands, or -1 if op isn't one
+  */
+ static int op_size(uint8_t op) {
+     switch (op) {
+     case DELTA_OP_COPY:
+         return 17;
+     case DELTA_OP_DATA:
+     case DELTA_OP_END:
+         return 9;
+     default:
+         return -1;
+     }
+ }
+
+ /**
+  * Appends an instruction to the output; copies waiting to be extended go first
+  */
+ static void emit(encoder_t *e, uint8_t op, uint64_t v1, uint64_t v2) {
+     if (op != DELTA_OP_COPY) {
+         flush_copy(e);
+     }
+     if (e->out_len + 17 > DELTA_OUT_SIZE) {
+         flush_out(e);
+     }
+
+     uint8_t *p = e->out + e->out_len;
+     p[0] = op;
+     put64(p + 1, v1);
+     if (op == DELTA_OP_COPY) {
+         put64(p + 9, v2);
+     }
+     e->out_len += op_size(op);
+ }
+
+ /**
+  * Copies one block, merged into the previous copy where they're consecutive
+  */
+ static void emit_copy(encoder_t *e, uint64_t block) {
+     if (e->copy_count > 0 && block == e->copy_first + e->copy_count) {
+         e->copy_count++;
+         return;
+     }
+
+     flush_copy(e);
+     e->copy_first = block;
+     e->copy_count = 1;
+ }
+
+ /**
+  * Sends literal bytes; large runs go to the sink directly, not through the buffer
+  */
+ static void emit_data(encoder_t *e, const uint8_t *p, uint64_t len) {
+     if (len == 0) {
+         return;
+     }
+
+     emit(e, DELTA_OP_DATA, len, 0);
+     if (e->out_len + len <= DELTA_OUT_SIZE) {
+         memcpy(e->out + e->out_len, p, len);
+         e->out_len += len;
+         return;
+     }
+
+     flush_out(e);
+     if (!e->error && e->sink(e->ctx, p, len) != 0) {
+         e->error = 1;
+     }
+ }
+
+ static void flush_copy(encoder_t *e) {
+     if (e->copy_count > 0) {
+         uint64_t count = e->copy_count;
+         e->copy_count = 0;
+         emit(e, DELTA_OP_COPY, e->copy_first, count);
+     }
+ }
+
+ static void flush_out(encoder_t *e) {
+     if (e->out_len > 0 && !e->error && e->sink(e->ctx, e->out, e->out_len) != 0) {
+         e->error = 1;
+     }
+     e->out_len = 0;
+ }
+
+ /**
+  * Carries out the instruction in d->op
+  */
+ static int apply_op(delta_t *d, codec_sink_t sink, void *ctx) {
+     uint64_t v1 = get64(d->op + 1);
+
+     if (d->op[0] == DELTA_OP_DATA) {
+         d->literal = v1;
+         return 0;
+     }
+     if (d->op[0] == DELTA_OP_END) {
+         d->ended = 1;
+         d->expected = v1;
+         return 0;
+     }
+
+     uint64_t count = get64(d->op + 9);
+     if (v1 >= d->blocks || count == 0 || count > d->blocks - v1) {
+         return -1;
+     }
+
+     uint64_t offset = v1 * d->block_size;
+     uint64_t end = (v1 + count) * d->block_size;
+     if (end > d->base_size) {
+         end = d->base_size;
+     }
+
+     while (offset < end) {
+         size_t want = (end - offset < DELTA_COPY_SIZE) ? end - offset : DELTA_COPY_SIZE;
+         ssize_t n = pread(d->base_fd, d->buf, want, offset);
+         if (n < 0 && errno == EINTR) {
+             continue;
+         }
+         if (n <= 0 || send_out(d, d->buf, n, sink, ctx) != 0) {
+             return -1;
+         }
+         offset += n;
+     }
+
+     return 0;
+ }
+
+ static int send_out(delta_t *d, const void *data, size_t len, codec_sink_t sink, void *ctx) {
+     xxh64_update(&d->hash, data, len);
+     return sink(ctx, data, len);
+ }
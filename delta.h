@@ -0,0 +1,58 @@
+/**
+ * Delta Encoding for the File Transfer System
+ *
+ * An rsync-style scheme for re-uploading a file the server already has an
+ * older version of. The server describes its copy as a list of per-block
+ * signatures; the client slides a rolling checksum over the new version,
+ * finds the blocks that are still there and sends a stream of COPY and
+ * DATA instructions; the server rebuilds the new version from those and
+ * its old copy. Shared by the client (encoding) and the server (block
+ * signatures and decoding).
+ */
+
+ #ifndef DELTA_H
+ #define DELTA_H
+
+ #include <stdint.h>
+ #include <stddef.h>
+ #include <sys/stat.h>
+
+ #include "protocol.h"
+ #include "compress.h"
+
+ #define DELTA_MIN_BLOCK 2048
+ #define DELTA_MAX_BLOCKS 16384       // Block size grows with the file to stay within this
+ #define DELTA_SIGS_PER_FRAME ((FT_MAX_PAYLOAD - 3 * 8) / 16)
+
+ // Instructions in a delta stream; each is an opcode byte and u64 operands
+ #define DELTA_OP_COPY 'C'            // First block, block count: copy from the old version
+ #define DELTA_OP_DATA 'D'            // Length, then that many literal bytes
+ #define DELTA_OP_END 'E'             // XXH64 of the rebuilt file
+
+ // Signatures of every block of a file
+ typedef struct {
+     uint64_t block_size;
+     uint64_t size;
+     uint64_t tag;                // Identifies this version of the file
+     uint64_t count;
+     uint32_t *weak;              // Rolling checksum
+     uint64_t *strong;            // XXH64
+ } delta_sigs_t;
+
+ typedef struct delta delta_t;
+
+ uint64_t delta_block_size(uint64_t size);
+ uint64_t delta_tag(const struct stat *st);
+ int delta_sigs_init(delta_sigs_t *sigs, uint64_t block_size, uint64_t size, uint64_t tag);
+ int delta_signatures(int fd, const struct stat *st, delta_sigs_t *sigs);
+ void delta_sigs_free(delta_sigs_t *sigs);
+
+ int delta_encode(const void *data, uint64_t size, const delta_sigs_t *sigs,
+                  codec_sink_t sink, void *ctx, uint64_t *matched);
+
+ delta_t *delta_new(int base_fd, uint64_t base_size);
+ int delta_update(delta_t *d, const void *data, size_t len, codec_sink_t sink, void *ctx);
+ int delta_finish(delta_t *d);
+ void delta_free(delta_t *d);
+
+ #endif
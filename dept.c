@@ -0,0 +1,332 @@
+/**
+ * Department Registry for the File Transfer Server
+ *
+ * The config file has one department per line:
+ *
+ *     <name> <group> <directory> [<limit>=<value> ...]
+ *
+ * The optional limits are priority= (critical, normal or bulk), the
+ * rate= and user_rate= byte rates (with a K, M or G suffix), and the
+ * transfers= and user_transfers= counts of transfers at once.
+ *
+ * Blank lines and lines starting with '#' are ignored. A relative
+ * directory is taken to be under BASE_DIR. When the file doesn't exist the
+ * two original departments are used. The registry is filled in once at
+ * startup and only read after that, so looking a department up needs no
+ * locking. Only the limits can change later: dept_reload_limits() re-reads
+ * them and swaps them in under limits_lock, dept_limits() copies them out
+ * under it, and quota_configure() hands them to the running quotas.
+ */
+
+ #include <stdio.h>
+ #include <stdlib.h>
+ #include <string.h>
+ #include <unistd.h>
+ #include <errno.h>
+ #include <fcntl.h>
+ #include <grp.h>
+ #include <pthread.h>
+ #include <sys/stat.h>
+
+ #include "dept.h"
+ #include "quota.h"
+ #include "log.h"
+
+ static dept_t departments[MAX_DEPARTMENTS];
+ static int num_departments;
+ static dept_limits_t dept_limit_table[MAX_DEPARTMENTS];  // Guarded by limits_lock
+ static pthread_rwlock_t limits_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+ static int dept_add(const char *name, const char *group, const char *dir);
+ static int parse_line(char *line, char *name, char *group, char *dir, dept_limits_t *limits);
+ static int dept_set_limit(dept_limits_t *limits, const char *option);
+
+ /**
+  * Reads the department list from config_path
+  *
+  * Returns 0 on success, -1 if the file exists but can't be used.
+  */
+ int dept_load(const char *config_path) {
+     char line[512];
+     int line_no = 0;
+
+     num_departments = 0;
+
+     FILE *f = fopen(config_path, "r");
+     if (f == NULL) {
+         if (errno != ENOENT) {
+             fprintf(stderr, "Cannot open %s: %s\n", config_path, strerror(errno));
+             return -1;
+         }
+
+         printf("No %s found, using the default departments\n", config_path);
+         dept_add("Manufacturing", "Manufacturing", "Manufacturing");
+         dept_add("Distribution", "Distribution", "Distribution");
+         return 0;
+     }
+
+     while (fgets(line, sizeof(line), f) != NULL) {
+         char name[MAX_DEPT_LENGTH], group[MAX_GROUP_LENGTH], dir[MAX_DEPT_DIR_LENGTH];
+         dept_limits_t limits;
+         line_no++;
+
+         int ret = parse_line(line, name, group, dir, &limits);
+         if (ret == 0) {
+             continue;
+         }
+         if (ret < 0 || dept_add(name, group, dir) != 0) {
+             fprintf(stderr, "%s:%d: invalid department entry\n", config_path, line_no);
+             fclose(f);
+             return -1;
+         }
+         dept_limit_table[num_departments - 1] = limits;
+     }
+
+     fclose(f);
+
+     if (num_departments == 0) {
+         fprintf(stderr, "%s: no departments defined\n", config_path);
+         return -1;
+     }
+
+     printf("Loaded %d departments from %s\n", num_departments, config_path);
+     return 0;
+ }
+
+ /**
+  * Re-reads the departments' limits from config_path
+  *
+  * Departments are matched by name. Adding or removing one takes a
+  * restart, so new lines are only warned about. Nothing changes if the
+  * file has an error. Returns 0 on success, -1 otherwise.
+  */
+ int dept_reload_limits(const char *config_path) {
+     dept_limits_t limits[MAX_DEPARTMENTS];
+     char line[512];
+     int line_no = 0;
+
+     FILE *f = fopen(config_path, "r");
+     if (f == NULL) {
+         // Without a file the defaults have no limits to change
+         return (errno == ENOENT) ? 0 : -1;
+     }
+
+     for (int i = 0; i < num_departments; i++) {
+         dept_limits(i, &limits[i]);
+     }
+
+     while (fgets(line, sizeof(line), f) != NULL) {
+         char name[MAX_DEPT_LENGTH], group[MAX_GROUP_LENGTH], dir[MAX_DEPT_DIR_LENGTH];
+         dept_limits_t parsed;
+         line_no++;
+
+         int ret = parse_line(line, name, group, dir, &parsed);
+         if (ret == 0) {
+             continue;
+         }
+         if (ret < 0) {
+             log_event(LOG_LEVEL_ERROR, "Department limits not reloaded", "file=%s line=%d", config_path, line_no);
+             fclose(f);
+             return -1;
+         }
+
+         int id = dept_find(name);
+         if (id < 0) {
+             log_event(LOG_LEVEL_WARN, "New department needs a restart", "dept=%s", name);
+             continue;
+         }
+         limits[id] = parsed;
+     }
+
+     fclose(f);
+
+     pthread_rwlock_wrlock(&limits_lock);
+     memcpy(dept_limit_table, limits, num_departments * sizeof(dept_limits_t));
+     pthread_rwlock_unlock(&limits_lock);
+     return 0;
+ }
+
+ /**
+  * Creates the department directories and opens a handle on each
+  */
+ int dept_open(void) {
+     // Create base directory
+     mkdir(BASE_DIR, 0755);
+
+     for (int i = 0; i < num_departments; i++) {
+         dept_t *d = &departments[i];
+
+         mkdir(d->dir, 0777);
+
+         // Set group ownership for the directory
+         struct group grp, *result = NULL;
+         char buffer[16384];
+         if (getgrnam_r(d->group, &grp, buffer, sizeof(buffer), &result) == 0 && result != NULL) {
+             d->gid = grp.gr_gid;
+             d->has_gid = 1;
+             printf("Found %s group with GID: %d\n", d->group, (int)d->gid);
+             chown(d->dir, 0, d->gid);
+         } else {
+             printf("WARNING: %s group not found, directory permissions may be incorrect\n", d->group);
+         }
+
+         d->dir_fd = open(d->dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+         if (d->dir_fd < 0) {
+             fprintf(stderr, "Cannot open %s directory %s: %s\n", d->name, d->dir, strerror(errno));
+             return -1;
+         }
+     }
+
+     printf("Directory setup complete\n");
+     return 0;
+ }
+
+ /**
+  * Looks a department up by name
+  *
+  * Returns its ID, or -1 if there is no such department.
+  */
+ int dept_find(const char *name) {
+     for (int i = 0; i < num_departments; i++) {
+         if (strcmp(departments[i].name, name) == 0) {
+             return i;
+         }
+     }
+
+     return -1;
+ }
+
+ /**
+  * Returns the department with the given ID, or NULL
+  */
+ const dept_t *dept_get(int id) {
+     if (id < 0 || id >= num_departments) {
+         return NULL;
+     }
+
+     return &departments[id];
+ }
+
+ /**
+  * Copies out a department's current limits
+  *
+  * Returns 0, or -1 if there is no such department.
+  */
+ int dept_limits(int id, dept_limits_t *limits) {
+     if (id < 0 || id >= num_departments) {
+         return -1;
+     }
+
+     pthread_rwlock_rdlock(&limits_lock);
+     *limits = dept_limit_table[id];
+     pthread_rwlock_unlock(&limits_lock);
+     return 0;
+ }
+
+ /**
+  * Number of departments in the registry
+  */
+ int dept_count(void) {
+     return num_departments;
+ }
+
+ /**
+  * Appends a department to the registry
+  */
+ static int dept_add(const char *name, const char *group, const char *dir) {
+     if (num_departments >= MAX_DEPARTMENTS || dept_find(name) >= 0) {
+         return -1;
+     }
+
+     dept_t *d = &departments[num_departments];
+     memset(d, 0, sizeof(*d));
+     d->id = num_departments;
+     d->dir_fd = -1;
+     memset(&dept_limit_table[num_departments], 0, sizeof(dept_limits_t));
+     dept_limit_table[num_departments].priority = PRIORITY_NORMAL;
+     snprintf(d->name, sizeof(d->name), "%s", name);
+     snprintf(d->group, sizeof(d->group), "%s", group);
+
+     int len;
+     if (dir[0] == '/') {
+         len = snprintf(d->dir, sizeof(d->dir), "%s", dir);
+     } else {
+         len = snprintf(d->dir, sizeof(d->dir), "%s/%s", BASE_DIR, dir);
+     }
+     if (len >= (int)sizeof(d->dir)) {
+         return -1;
+     }
+
+     num_departments++;
+     return 0;
+ }
+
+ /**
+  * Splits a config line into a department and its limits
+  *
+  * Returns 1 for a department, 0 for a blank or comment line, -1 if the
+  * line is invalid.
+  */
+ static int parse_line(char *line, char *name, char *group, char *dir, dept_limits_t *limits) {
+     char *p = line + strspn(line, " \t");
+     int used = 0;
+
+     if (*p == '#' || *p == '\n' || *p == '\0') {
+         return 0;
+     }
+
+     if (sscanf(p, "%31s %31s %255s%n", name, group, dir, &used) != 3) {
+         return -1;
+     }
+
+     memset(limits, 0, sizeof(*limits));
+     limits->priority = PRIORITY_NORMAL;
+
+     char *save = NULL;
+     for (char *option = strtok_r(p + used, " \t\n", &save); option != NULL;
+          option = strtok_r(NULL, " \t\n", &save)) {
+         if (dept_set_limit(limits, option) != 0) {
+             fprintf(stderr, "Invalid limit '%s' for department %s\n", option, name);
+             return -1;
+         }
+     }
+     return 1;
+ }
+
+ /**
+  * Applies one <limit>=<value> option to a department's limits
+  */
+ static int dept_set_limit(dept_limits_t *limits, const char *option) {
+     const char *value = strchr(option, '=');
+     if (value == NULL) {
+         return -1;
+     }
+     size_t key_len = value - option;
+     value++;
+
+     if (key_len == 8 && strncmp(option, "priority", 8) == 0) {
+         limits->priority = quota_parse_priority(value);
+         return (limits->priority < 0) ? -1 : 0;
+     }
+     if (key_len == 4 && strncmp(option, "rate", 4) == 0) {
+         return quota_parse_rate(value, &limits->rate);
+     }
+     if (key_len == 9 && strncmp(option, "user_rate", 9) == 0) {
+         return quota_parse_rate(value, &limits->user_rate);
+     }
+
+     char *end;
+     long count = strtol(value, &end, 10);
+     if (*value == '\0' || *end != '\0' || count < 0 || count > INT32_MAX) {
+         return -1;
+     }
+     if (key_len == 9 && strncmp(option, "transfers", 9) == 0) {
+         limits->transfers = count;
+         return 0;
+     }
+     if (key_len == 14 && strncmp(option, "user_transfers", 14) == 0) {
+         limits->user_transfers = count;
+         return 0;
+     }
+     return -1;
+ }
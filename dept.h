@@ -0,0 +1,57 @@
+/**
+ * Department Registry for the File Transfer Server
+ *
+ * Departments are read from a config file at startup. Each one maps a
+ * name to the group whose members belong to it and the directory its
+ * files go in, and is known everywhere else by a small integer ID. A
+ * department may also carry the transfer limits enforced in quota.c,
+ * which a reload can change under running sessions, so they are only
+ * handed out as copies by dept_limits().
+ */
+
+ #ifndef DEPT_H
+ #define DEPT_H
+
+ #include <stdint.h>
+ #include <sys/types.h>
+
+ #include "server.h"
+
+ #define DEPT_CONFIG_FILE "departments.conf"
+ #define MAX_DEPARTMENTS 64
+ #define MAX_GROUP_LENGTH 32
+ #define MAX_DEPT_DIR_LENGTH 256
+
+ // Priority classes; under a server-wide rate limit, higher classes get the bandwidth first
+ #define PRIORITY_CRITICAL 0
+ #define PRIORITY_NORMAL 1
+ #define PRIORITY_BULK 2
+
+ // Limits on a department's transfers; 0 means no limit
+ typedef struct {
+     int priority;                // PRIORITY_* class
+     uint64_t rate;               // Bytes per second across the department
+     uint64_t user_rate;          // Bytes per second for each of its users
+     int transfers;               // Uploads and downloads at once across the department
+     int user_transfers;          // Uploads and downloads at once for each user
+ } dept_limits_t;
+
+ typedef struct {
+     int id;                      // Index in the registry
+     char name[MAX_DEPT_LENGTH];
+     char group[MAX_GROUP_LENGTH];
+     char dir[MAX_DEPT_DIR_LENGTH];
+     gid_t gid;
+     int has_gid;                 // Group exists on this system
+     int dir_fd;                  // Directory uploads are created in, via openat()
+ } dept_t;
+
+ int dept_load(const char *config_path);
+ int dept_reload_limits(const char *config_path);
+ int dept_open(void);
+ int dept_find(const char *name);
+ const dept_t *dept_get(int id);
+ int dept_limits(int id, dept_limits_t *limits);
+ int dept_count(void);
+
+ #endif
@@ -0,0 +1,126 @@
+/**
+ * SHA-256 Content Digest for the File Transfer System
+ *
+ * A thin wrapper over OpenSSL's EVP digests, kept behind HAVE_OPENSSL
+ * like the TLS transport in tls.c.
+ */
+
+ #include <stdio.h>
+ #include <stdlib.h>
+ #include <string.h>
+
+ #ifdef HAVE_OPENSSL
+ #include <openssl/evp.h>
+ #endif
+
+ #include "digest.h"
+
+ #ifdef HAVE_OPENSSL
+
+ struct digest {
+     EVP_MD_CTX *ctx;
+ };
+
+ /**
+  * Says whether content can be digested at all
+  */
+ int digest_available(void) {
+     return 1;
+ }
+
+ /**
+  * Starts a new digest; returns NULL if it can't be set up
+  */
+ digest_t *digest_new(void) {
+     digest_t *digest = malloc(sizeof(*digest));
+     if (digest == NULL) {
+         return NULL;
+     }
+
+     digest->ctx = EVP_MD_CTX_new();
+     if (digest->ctx == NULL || EVP_DigestInit_ex(digest->ctx, EVP_sha256(), NULL) != 1) {
+         EVP_MD_CTX_free(digest->ctx);
+         free(digest);
+         return NULL;
+     }
+     return digest;
+ }
+
+ /**
+  * Adds len bytes to the digest
+  */
+ void digest_update(digest_t *digest, const void *data, size_t len) {
+     EVP_DigestUpdate(digest->ctx, data, len);
+ }
+
+ /**
+  * Ends the digest and writes it out as hex
+  *
+  * Nothing more can be added afterwards; the digest still has to be freed.
+  */
+ void digest_final(digest_t *digest, char hex[DIGEST_HEX_SIZE]) {
+     unsigned char raw[EVP_MAX_MD_SIZE];
+     unsigned int len = 0;
+
+     hex[0] = '\0';
+     if (EVP_DigestFinal_ex(digest->ctx, raw, &len) != 1 || len * 2 + 1 != DIGEST_HEX_SIZE) {
+         return;
+     }
+     for (unsigned int i = 0; i < len; i++) {
+         snprintf(hex + i * 2, 3, "%02x", raw[i]);
+     }
+ }
+
+ /**
+  * Releases a digest; NULL is ignored
+  */
+ void digest_free(digest_t *digest) {
+     if (digest == NULL) {
+         return;
+     }
+     EVP_MD_CTX_free(digest->ctx);
+     free(digest);
+ }
+
+ #else
+
+ int digest_available(void) {
+     return 0;
+ }
+
+ digest_t *digest_new(void) {
+     return NULL;
+ }
+
+ void digest_update(digest_t *digest, const void *data, size_t len) {
+     (void)digest, (void)data, (void)len;
+ }
+
+ void digest_final(digest_t *digest, char hex[DIGEST_HEX_SIZE]) {
+     (void)digest;
+     hex[0] = '\0';
+ }
+
+ void digest_free(digest_t *digest) {
+     (void)digest;
+ }
+
+ #endif
+
+ /**
+  * Checks that a digest from the network is well formed hex, so it is
+  * safe to use in a file name
+  */
+ int digest_valid(const char *hex) {
+     size_t len = strlen(hex);
+
+     if (len != DIGEST_HEX_SIZE - 1) {
+         return 0;
+     }
+     for (size_t i = 0; i < len; i++) {
+         if (!((hex[i] >= '0' && hex[i] <= '9') || (hex[i] >= 'a' && hex[i] <= 'f'))) {
+             return 0;
+         }
+     }
+     return 1;
+ }
@@ -0,0 +1,30 @@
+/**
+ * SHA-256 Content Digest for the File Transfer System
+ *
+ * Names content in the server's blob store, and proves to the server that
+ * a client holds a file when it asks for a stored copy with HAVE. Unlike
+ * XXH64, the digest can't be forged to match content the client has never
+ * seen. Computed incrementally through OpenSSL, so a file can be digested
+ * while it streams.
+ *
+ * Built without OpenSSL (no HAVE_OPENSSL), digest_available() is false
+ * and digest_new() always fails.
+ */
+
+ #ifndef DIGEST_H
+ #define DIGEST_H
+
+ #include <stddef.h>
+
+ #define DIGEST_HEX_SIZE 65           // SHA-256 as lowercase hex, with its terminator
+
+ typedef struct digest digest_t;
+
+ int digest_available(void);
+ digest_t *digest_new(void);
+ void digest_update(digest_t *digest, const void *data, size_t len);
+ void digest_final(digest_t *digest, char hex[DIGEST_HEX_SIZE]);
+ void digest_free(digest_t *digest);
+ int digest_valid(const char *hex);
+
+ #endif
@@ -0,0 +1,320 @@
+/**
+ * Upload Durability for the File Transfer Server
+ *
+ * In group-commit mode uploads queue up for the committer thread, which
+ * takes the whole queue as one batch: it flushes the batch's file data
+ * (with one syncfs() per filesystem once the batch is big enough to make
+ * that cheaper than an fdatasync() per file), publishes each file, and
+ * then syncs every directory and index log the batch touched, once each.
+ * Uploads that arrive while a batch is being synced form the next one, so
+ * the busier the server, the more files each round of syncs covers.
+ *
+ * With per-file durability the committer still does the syncing, so no
+ * engine thread stalls on the disk, but it syncs each file and then its
+ * directory one job at a time.
+ *
+ * A file's data is always on disk before its name is, so a crash can't
+ * leave an acknowledged name pointing at blocks that were never written.
+ */
+
+ #define _GNU_SOURCE              // syncfs()
+
+ #include <stdio.h>
+ #include <string.h>
+ #include <unistd.h>
+ #include <pthread.h>
+ #include <errno.h>
+
+ #include "durable.h"
+ #include "index.h"
+ #include "metrics.h"
+ #include "log.h"
+
+ static int durable_mode = DURABLE_NONE;
+ static durable_job_t *queue_head;
+ static durable_job_t *queue_tail;
+ static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+ static pthread_cond_t queue_ready = PTHREAD_COND_INITIALIZER;   // Signalled to the committer
+ static pthread_cond_t batch_done = PTHREAD_COND_INITIALIZER;    // Broadcast to durable_wait()
+
+ static const char *level_names[] = { "none", "file", "group" };
+
+ static int sync_data(int fd);
+ static int sync_dir(const dept_t *dept);
+ static void commit_each(durable_job_t *batch);
+ static void commit_batch(durable_job_t *batch);
+ static void *committer_thread(void *arg);
+
+ /**
+  * A durability level by name, or -1 if there's no such level
+  */
+ int durable_parse_level(const char *name) {
+     for (int i = 0; i < (int)(sizeof(level_names) / sizeof(level_names[0])); i++) {
+         if (strcmp(name, level_names[i]) == 0) {
+             return i;
+         }
+     }
+     return -1;
+ }
+
+ /**
+  * Sets the durability level, starting the committer unless nothing is
+  * ever synced
+  */
+ int durable_start(int level) {
+     durable_mode = level;
+     if (level == DURABLE_NONE) {
+         return 0;
+     }
+
+     pthread_t thread_id;
+     if (pthread_create(&thread_id, NULL, committer_thread, NULL) != 0) {
+         perror("Committer thread creation failed");
+         return -1;
+     }
+     pthread_detach(thread_id);
+     return 0;
+ }
+
+ int durable_level(void) {
+     return durable_mode;
+ }
+
+ /**
+  * Flushes one file's data; returns 0 or an errno value
+  */
+ static int sync_data(int fd) {
+     uint64_t started = metrics_now_us();
+     int error = (fdatasync(fd) == 0) ? 0 : errno;
+     metrics_since(METRIC_FSYNC, started);
+     return error;
+ }
+
+ /**
+  * Makes a department's directory entries and index log durable; returns
+  * 0 or an errno value
+  */
+ static int sync_dir(const dept_t *dept) {
+     uint64_t started = metrics_now_us();
+     int error = (fsync(dept->dir_fd) == 0) ? 0 : errno;
+     if (index_sync(dept->id) != 0 && error == 0) {
+         error = errno;
+     }
+     metrics_since(METRIC_FSYNC, started);
+     return error;
+ }
+
+ /**
+  * Queues a job for the next batch; have durable_notify() say when it's
+  * through, or call durable_wait()
+  */
+ void durable_submit(durable_job_t *job) {
+     atomic_store(&job->done, 0);
+     job->error = 0;
+     job->release = NULL;
+     job->wake = NULL;
+     job->next = NULL;
+
+     pthread_mutex_lock(&queue_lock);
+     if (queue_tail != NULL) {
+         queue_tail->next = job;
+     } else {
+         queue_head = job;
+     }
+     queue_tail = job;
+     pthread_cond_signal(&queue_ready);
+     pthread_mutex_unlock(&queue_lock);
+ }
+
+ /**
+  * Whether a submitted job has been published and synced
+  *
+  * Read under the lock, so that once it says so the committer is through
+  * waking whoever asked to be told.
+  */
+ int durable_done(durable_job_t *job) {
+     pthread_mutex_lock(&queue_lock);
+     int done = atomic_load(&job->done);
+     pthread_mutex_unlock(&queue_lock);
+     return done;
+ }
+
+ /**
+  * Blocks until a submitted job has been published and synced
+  */
+ void durable_wait(durable_job_t *job) {
+     pthread_mutex_lock(&queue_lock);
+     while (!atomic_load(&job->done)) {
+         pthread_cond_wait(&batch_done, &queue_lock);
+     }
+     pthread_mutex_unlock(&queue_lock);
+ }
+
+ /**
+  * Has the committer call wake(ctx) once a submitted job is done, instead
+  * of being polled
+  *
+  * Returns 1 if it will, or 0 if the job is done already. wake() is called
+  * on the committer's thread, with the queue locked, so it must not block;
+  * durable_detach() or durable_done() seeing the job through means the
+  * call is over.
+  */
+ int durable_notify(durable_job_t *job, void (*wake)(void *ctx), void *ctx) {
+     pthread_mutex_lock(&queue_lock);
+     int notified = !atomic_load(&job->done);
+     if (notified) {
+         job->wake = wake;
+         job->wake_ctx = ctx;
+     }
+     pthread_mutex_unlock(&queue_lock);
+     return notified;
+ }
+
+ /**
+  * Hands a submitted job over to the committer for whoever was going to
+  * wait on it and no longer can
+  *
+  * Returns 1 if the committer will call release(job) once the job is
+  * done, or 0 if it is done already and the caller must finish it itself.
+  */
+ int durable_detach(durable_job_t *job, void (*release)(durable_job_t *job)) {
+     pthread_mutex_lock(&queue_lock);
+     int detached = !atomic_load(&job->done);
+     if (detached) {
+         job->release = release;
+         job->wake = NULL;
+     }
+     pthread_mutex_unlock(&queue_lock);
+     return detached;
+ }
+
+ /**
+  * Syncs and publishes a batch of jobs one at a time, for per-file
+  * durability
+  */
+ static void commit_each(durable_job_t *batch) {
+     for (durable_job_t *job = batch; job != NULL; job = job->next) {
+         if (job->fd >= 0) {
+             job->error = sync_data(job->fd);
+         }
+         job->publish(job);
+
+         int error = sync_dir(job->dept);
+         if (error != 0 && job->error == 0) {
+             job->error = error;
+         }
+     }
+ }
+
+ /**
+  * Syncs and publishes one batch of jobs
+  */
+ static void commit_batch(durable_job_t *batch) {
+     unsigned char touched[MAX_DEPARTMENTS] = { 0 };
+     unsigned files = 0;
+     uint64_t started = metrics_now_us();
+
+     for (durable_job_t *job = batch; job != NULL; job = job->next) {
+         files += (job->fd >= 0);
+     }
+
+     // Data first, so no name is published ahead of its contents
+     if (files >= DURABLE_SYNCFS_BATCH) {
+         for (durable_job_t *job = batch; job != NULL; job = job->next) {
+             int id = job->dept->id;
+             if (touched[id] == 0) {
+                 touched[id] = (syncfs(job->dept->dir_fd) == 0) ? 1 : 2;
+             }
+             // A failed syncfs() says nothing about which file; find out one by one
+             if (touched[id] == 2 && job->fd >= 0 && fdatasync(job->fd) != 0) {
+                 job->error = errno;
+             }
+         }
+     } else {
+         for (durable_job_t *job = batch; job != NULL; job = job->next) {
+             if (job->fd >= 0 && fdatasync(job->fd) != 0) {
+                 job->error = errno;
+             }
+         }
+     }
+
+     for (durable_job_t *job = batch; job != NULL; job = job->next) {
+         job->publish(job);
+     }
+
+     // Then each directory and index log the batch renamed into, once
+     memset(touched, 0, sizeof(touched));
+     for (durable_job_t *job = batch; job != NULL; job = job->next) {
+         int id = job->dept->id;
+         if (touched[id] == 0) {
+             int error = (fsync(job->dept->dir_fd) == 0) ? 0 : errno;
+             if (index_sync(id) != 0 && error == 0) {
+                 error = errno;
+             }
+             touched[id] = (error == 0) ? 1 : 2;
+             if (error != 0) {
+                 log_event(LOG_LEVEL_ERROR, "Directory sync failed", "dept=%s error=%s",
+                           job->dept->name, strerror(error));
+             }
+         }
+         if (touched[id] == 2 && job->error == 0) {
+             job->error = EIO;
+         }
+     }
+
+     metrics_since(METRIC_FSYNC, started);
+     metrics_count(METRIC_SYNC_BATCHES, 1);
+     log_event(LOG_LEVEL_DEBUG, "Batch committed", "files=%u syncfs=%d", files,
+               files >= DURABLE_SYNCFS_BATCH);
+ }
+
+ /**
+  * Committer thread: takes whatever has queued as one batch and commits it
+  */
+ static void *committer_thread(void *arg) {
+     (void)arg;
+
+     while (1) {
+         pthread_mutex_lock(&queue_lock);
+         while (queue_head == NULL) {
+             pthread_cond_wait(&queue_ready, &queue_lock);
+         }
+         durable_job_t *batch = queue_head;
+         queue_head = queue_tail = NULL;
+         pthread_mutex_unlock(&queue_lock);
+
+         if (durable_mode == DURABLE_FILE) {
+             commit_each(batch);
+         } else {
+             commit_batch(batch);
+         }
+
+         // A job may be freed as soon as it's marked done, so step past it first; detached
+         // ones are gathered up and released once the lock is dropped, and whoever waits
+         // on the rest is woken
+         durable_job_t *released = NULL;
+         pthread_mutex_lock(&queue_lock);
+         for (durable_job_t *job = batch, *next; job != NULL; job = next) {
+             next = job->next;
+             if (job->release != NULL) {
+                 job->next = released;
+                 released = job;
+             }
+             void (*wake)(void *ctx) = job->wake;
+             void *wake_ctx = job->wake_ctx;
+             atomic_store(&job->done, 1);
+             if (wake != NULL) {
+                 wake(wake_ctx);
+             }
+         }
+         pthread_cond_broadcast(&batch_done);
+         pthread_mutex_unlock(&queue_lock);
+
+         for (durable_job_t *job = released, *next; job != NULL; job = next) {
+             next = job->next;
+             job->release(job);
+         }
+     }
+
+     return NULL;
+ }
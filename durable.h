@@ -0,0 +1,50 @@
+/**
+ * Upload Durability for the File Transfer Server
+ *
+ * Decides when an upload counts as stored. With DURABLE_NONE the reply
+ * goes out as soon as the file is renamed into place, and a power cut can
+ * still lose it. DURABLE_FILE syncs each file's data before the rename
+ * and its directory after. DURABLE_GROUP makes everything that queued up
+ * while the last round was being synced durable with one round of syncs,
+ * so concurrent uploads share the cost. Either way a committer thread
+ * does the syncing, so no session waits on the disk.
+ */
+
+ #ifndef DURABLE_H
+ #define DURABLE_H
+
+ #include <stdatomic.h>
+
+ #include "dept.h"
+
+ #define DURABLE_NONE 0
+ #define DURABLE_FILE 1
+ #define DURABLE_GROUP 2
+
+ #define DURABLE_SYNCFS_BATCH 16      // Files in one batch past which a single syncfs() beats fdatasync()ing each
+
+ // A staged file to publish once its data is on disk
+ typedef struct durable_job {
+     int fd;                      // The file's data, or -1 if there's nothing to sync first
+     const dept_t *dept;          // Directory it's published in
+     void (*publish)(struct durable_job *job);  // Run by the committer between the syncs
+     int error;                   // First sync that failed, or 0
+
+     // Owned by the committer
+     atomic_int done;
+     void (*release)(struct durable_job *job);  // Set by durable_detach(); run once the job is done
+     void (*wake)(void *ctx);     // Set by durable_notify(); called as the job is marked done
+     void *wake_ctx;
+     struct durable_job *next;
+ } durable_job_t;
+
+ int durable_parse_level(const char *name);
+ int durable_start(int level);
+ int durable_level(void);
+ void durable_submit(durable_job_t *job);
+ int durable_done(durable_job_t *job);
+ void durable_wait(durable_job_t *job);
+ int durable_notify(durable_job_t *job, void (*wake)(void *ctx), void *ctx);
+ int durable_detach(durable_job_t *job, void (*release)(durable_job_t *job));
+
+ #endif
@@ -0,0 +1,253 @@
+/**
+ * Identity Cache for the File Transfer Server
+ *
+ * A fixed-size hash table of entries keyed by username, guarded by a
+ * read-write lock so concurrent logins only contend on a miss. Lookups on a
+ * miss use the reentrant NSS calls, so any number of threads can resolve
+ * users at once.
+ */
+
+ #include <stdio.h>
+ #include <stdlib.h>
+ #include <string.h>
+ #include <unistd.h>
+ #include <errno.h>
+ #include <pthread.h>
+ #include <pwd.h>
+ #include <grp.h>
+
+ #include "identity.h"
+ #include "metrics.h"
+ #include "session.h"
+ #include "dept.h"
+
+ #define IDENTITY_BUCKETS 1024         // Power of two
+ #define NSS_BUFFER_SIZE 16384         // Starting buffer for the *_r lookups
+
+ typedef struct identity_entry {
+     char username[MAX_USERNAME_LENGTH];
+     int status;                       // IDENTITY_* result being cached
+     auth_info_t info;
+     uint64_t expires_ms;
+     struct identity_entry *next;
+ } identity_entry_t;
+
+ static identity_entry_t *buckets[IDENTITY_BUCKETS];
+ static int entry_count;
+ static pthread_rwlock_t cache_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+ static unsigned identity_hash(const char *username);
+ static int identity_resolve(const char *username, auth_info_t *auth_info);
+ static void identity_store(const char *username, int status, const auth_info_t *auth_info);
+ static void purge_expired(uint64_t now);
+
+ /**
+  * Resolves a user, from the cache when possible
+  *
+  * Returns IDENTITY_OK with auth_info filled in, or why the user can't log in.
+  */
+ int identity_lookup(const char *username, auth_info_t *auth_info) {
+     int status = identity_cached(username, auth_info);
+     if (status != IDENTITY_MISS) {
+         return status;
+     }
+
+     uint64_t started = metrics_now_us();
+     status = identity_resolve(username, auth_info);
+     metrics_since(METRIC_NSS, started);
+     identity_store(username, status, auth_info);
+     return status;
+ }
+
+ /**
+  * Resolves a user from the cache alone, never waiting on NSS
+  *
+  * Returns what identity_lookup() would, or IDENTITY_MISS if the user
+  * isn't cached or has expired.
+  */
+ int identity_cached(const char *username, auth_info_t *auth_info) {
+     unsigned bucket = identity_hash(username);
+     uint64_t now = monotonic_ms();
+     int status = IDENTITY_MISS;
+
+     pthread_rwlock_rdlock(&cache_lock);
+     for (identity_entry_t *e = buckets[bucket]; e != NULL; e = e->next) {
+         if (strcmp(e->username, username) == 0) {
+             if (now < e->expires_ms) {
+                 status = e->status;
+                 *auth_info = e->info;
+             }
+             break;
+         }
+     }
+     pthread_rwlock_unlock(&cache_lock);
+
+     return status;
+ }
+
+ /**
+  * Forgets every cached identity
+  */
+ void identity_flush(void) {
+     pthread_rwlock_wrlock(&cache_lock);
+     for (int i = 0; i < IDENTITY_BUCKETS; i++) {
+         identity_entry_t *e = buckets[i];
+         while (e != NULL) {
+             identity_entry_t *next = e->next;
+             free(e);
+             e = next;
+         }
+         buckets[i] = NULL;
+     }
+     entry_count = 0;
+     pthread_rwlock_unlock(&cache_lock);
+ }
+
+ /**
+  * Hashes a username to its bucket (FNV-1a)
+  */
+ static unsigned identity_hash(const char *username) {
+     uint32_t hash = 2166136261u;
+
+     for (const unsigned char *p = (const unsigned char *)username; *p; p++) {
+         hash ^= *p;
+         hash *= 16777619u;
+     }
+
+     return hash & (IDENTITY_BUCKETS - 1);
+ }
+
+ /**
+  * Asks NSS who the user is and which department group they belong to
+  */
+ static int identity_resolve(const char *username, auth_info_t *auth_info) {
+     struct passwd pwd, *result = NULL;
+     size_t size = NSS_BUFFER_SIZE;
+     char *buffer = NULL;
+     int err;
+
+     memset(auth_info, 0, sizeof(*auth_info));
+
+     // Grow the buffer until the entry fits
+     do {
+         char *grown = realloc(buffer, size);
+         if (grown == NULL) {
+             free(buffer);
+             return IDENTITY_NO_USER;
+         }
+         buffer = grown;
+         err = getpwnam_r(username, &pwd, buffer, size, &result);
+         size *= 2;
+     } while (err == ERANGE);
+
+     if (err != 0 || result == NULL) {
+         free(buffer);
+         return IDENTITY_NO_USER;
+     }
+
+     snprintf(auth_info->username, sizeof(auth_info->username), "%s", username);
+     auth_info->uid = pwd.pw_uid;
+     auth_info->gid = pwd.pw_gid;
+
+     // Every group the user is in, primary group included
+     int ngroups = 32;
+     gid_t *groups = NULL;
+     while (1) {
+         gid_t *grown = realloc(groups, ngroups * sizeof(gid_t));
+         if (grown == NULL) {
+             free(groups);
+             free(buffer);
+             return IDENTITY_NO_GROUP;
+         }
+         groups = grown;
+
+         int wanted = ngroups;
+         if (getgrouplist(username, pwd.pw_gid, groups, &wanted) >= 0) {
+             ngroups = wanted;
+             break;
+         }
+         ngroups = (wanted > ngroups) ? wanted : ngroups * 2;
+     }
+     free(buffer);
+
+     // The first department whose group the user is in, in config file order
+     const dept_t *dept = NULL;
+     for (int d = 0; d < dept_count() && dept == NULL; d++) {
+         const dept_t *candidate = dept_get(d);
+         for (int i = 0; i < ngroups; i++) {
+             if (candidate->has_gid && groups[i] == candidate->gid) {
+                 dept = candidate;
+                 break;
+             }
+         }
+     }
+     free(groups);
+
+     if (dept == NULL) {
+         return IDENTITY_NO_GROUP;
+     }
+
+     auth_info->dept_id = dept->id;
+     snprintf(auth_info->department, sizeof(auth_info->department), "%s", dept->name);
+     return IDENTITY_OK;
+ }
+
+ /**
+  * Caches the result of a lookup, replacing any stale entry
+  */
+ static void identity_store(const char *username, int status, const auth_info_t *auth_info) {
+     unsigned bucket = identity_hash(username);
+     uint64_t now = monotonic_ms();
+     uint64_t ttl = (status == IDENTITY_OK) ? IDENTITY_TTL : IDENTITY_NEGATIVE_TTL;
+
+     pthread_rwlock_wrlock(&cache_lock);
+
+     identity_entry_t *e;
+     for (e = buckets[bucket]; e != NULL; e = e->next) {
+         if (strcmp(e->username, username) == 0) {
+             break;
+         }
+     }
+
+     if (e == NULL) {
+         if (entry_count >= IDENTITY_CACHE_MAX) {
+             purge_expired(now);
+         }
+
+         // Still full of live entries: serve this one uncached
+         if (entry_count >= IDENTITY_CACHE_MAX || (e = calloc(1, sizeof(*e))) == NULL) {
+             pthread_rwlock_unlock(&cache_lock);
+             return;
+         }
+
+         snprintf(e->username, sizeof(e->username), "%s", username);
+         e->next = buckets[bucket];
+         buckets[bucket] = e;
+         entry_count++;
+     }
+
+     e->status = status;
+     e->info = *auth_info;
+     e->expires_ms = now + ttl * 1000;
+
+     pthread_rwlock_unlock(&cache_lock);
+ }
+
+ /**
+  * Drops every expired entry; the caller holds the write lock
+  */
+ static void purge_expired(uint64_t now) {
+     for (int i = 0; i < IDENTITY_BUCKETS; i++) {
+         identity_entry_t **link = &buckets[i];
+         while (*link != NULL) {
+             identity_entry_t *e = *link;
+             if (now >= e->expires_ms) {
+                 *link = e->next;
+                 free(e);
+                 entry_count--;
+             } else {
+                 link = &e->next;
+             }
+         }
+     }
+ }
@@ -0,0 +1,28 @@
+/**
+ * Identity Cache for the File Transfer Server
+ *
+ * Resolves a username to its uid, gid and department through NSS and
+ * remembers the answer, so logins don't wait on a slow directory server
+ * (LDAP/SSSD) every time. Unknown users are cached too, for a shorter time.
+ */
+
+ #ifndef IDENTITY_H
+ #define IDENTITY_H
+
+ #include "server.h"
+
+ #define IDENTITY_TTL 300              // Seconds a resolved identity is trusted
+ #define IDENTITY_NEGATIVE_TTL 30      // Seconds a failed lookup is remembered
+ #define IDENTITY_CACHE_MAX 4096       // Entries kept before expired ones are purged
+
+ // Outcomes of identity_lookup()
+ #define IDENTITY_OK 0
+ #define IDENTITY_NO_USER -1
+ #define IDENTITY_NO_GROUP -2          // User exists but is in no department group
+ #define IDENTITY_MISS 1               // identity_cached() only: not cached, so NSS must be asked
+
+ int identity_lookup(const char *username, auth_info_t *auth_info);
+ int identity_cached(const char *username, auth_info_t *auth_info);
+ void identity_flush(void);
+
+ #endif
@@ -0,0 +1,1086 @@
+/**
+ * Department Index for the File Transfer Server
+ *
+ * Each department's entries are kept in an array sorted by name, for
+ * lookups and paged listings, and on a list in sequence order, so the
+ * changes since N are found by walking back from the newest.
+ *
+ * Every change is appended to the department's log in INDEX_DIR as it is
+ * made. Every INDEX_SNAPSHOT_INTERVAL seconds a changed index is written
+ * out whole as a snapshot and its log is cut back to the changes made
+ * since, so a restart reads the snapshot and replays a short log.
+ *
+ * A department without a snapshot is indexed by scanning its directory
+ * once. Its numbering then starts from the current time in microseconds,
+ * above any number handed out before, so a client carrying on from an
+ * old sequence number is sent everything again rather than missing
+ * files. Files put in a department directory other than by an upload are
+ * only picked up by such a scan.
+ *
+ * Owners used to be kept in a "<name>.owner" file beside each file. A
+ * scan reads them, and deletes them once the snapshot holding the owners
+ * is on disk, so older trees are migrated the first time they're loaded.
+ * A change costs one append to the log instead of creating, writing and
+ * renaming a sidecar.
+ *
+ * During an upgrade (see upgrade.c) the new process takes the files over.
+ * The old one stops logging and snapshotting and sends each change it
+ * still makes to the new one, which applies it with a fresh sequence
+ * number and logs it as its own. Changes are queued under the index lock,
+ * to keep their order, and sent by a thread of their own; one that can't
+ * be sent leaves a "<dept>.rescan" marker, so the next start indexes that
+ * department from its directory again.
+ */
+
+ #include <stdio.h>
+ #include <stdlib.h>
+ #include <string.h>
+ #include <unistd.h>
+ #include <fcntl.h>
+ #include <errno.h>
+ #include <limits.h>
+ #include <time.h>
+ #include <pthread.h>
+ #include <dirent.h>
+ #include <sys/socket.h>
+ #include <sys/time.h>
+
+ #include "index.h"
+ #include "dept.h"
+ #include "log.h"
+
+ #define INDEX_MAGIC 0x46544958u      // "FTIX"
+ #define INDEX_VERSION 2             // 2 added upload times and addresses, and replaced .owner files
+ #define RECORD_MAX (sizeof(record_t) + MAX_FILEPATH_LENGTH + MAX_USERNAME_LENGTH + INET_ADDRSTRLEN)
+ #define FORWARD_TIMEOUT_SEC 5      // Longest a forwarded change may wait on the other process
+
+ // An entry as stored in snapshots and logs, followed by its name, owner and client address
+ typedef struct {
+     uint64_t seq;
+     uint64_t size;
+     int64_t mtime;
+     uint64_t hash;
+     int64_t uploaded;
+     uint16_t name_len;
+     uint16_t owner_len;
+     uint16_t ip_len;
+     uint16_t reserved;
+ } record_t;
+
+ typedef struct {
+     uint32_t magic;
+     uint32_t version;
+     uint64_t last_seq;
+     uint64_t count;
+ } snapshot_header_t;
+
+ typedef struct {
+     pthread_rwlock_t lock;
+     index_entry_t **by_name;
+     unsigned count;
+     unsigned capacity;
+     index_entry_t *oldest;       // In sequence order
+     index_entry_t *newest;
+     uint64_t last_seq;
+     int log_fd;
+     unsigned logged;             // Changes in the log since the last snapshot
+ } dept_index_t;
+
+ // A change waiting to be sent to the process that has the logs
+ typedef struct forward {
+     struct forward *next;
+     const dept_t *dept;
+     size_t len;
+     char message[];              // Department name length and name, then the record
+ } forward_t;
+
+ static dept_index_t indexes[MAX_DEPARTMENTS];
+ static pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;  // Held while snapshots are written
+ static int forwarding;           // Logs handed to another process; guarded by snapshot_lock
+ static pthread_mutex_t forward_lock = PTHREAD_MUTEX_INITIALIZER;
+ static pthread_cond_t forward_cond = PTHREAD_COND_INITIALIZER;
+ static int forward_fd = -1;      // Where changes go while forwarding
+ static forward_t *forward_head;  // Oldest first; guarded by forward_lock, like the rest
+ static forward_t *forward_tail;
+ static int forward_busy;         // The sender has a change in hand
+
+ static void apply_change(dept_index_t *idx, const dept_t *dept, const char *name, const record_t *rec,
+                          const char *owner, const char *client_ip);
+ static void forward_change(const dept_t *dept, const char *record, size_t len);
+ static void *forward_thread(void *arg);
+ static void mark_rescan(const dept_t *dept);
+ static int rescan_marked(const dept_t *dept, int clear);
+ static void *follow_thread(void *arg);
+ static int open_log(dept_index_t *idx, const dept_t *dept);
+ static int load_index(dept_index_t *idx, const dept_t *dept);
+ static int read_snapshot(dept_index_t *idx, const char *path);
+ static unsigned replay_log(dept_index_t *idx, const char *path);
+ static int scan_directory(dept_index_t *idx, const dept_t *dept, unsigned *sidecars);
+ static int read_owner(const dept_t *dept, const char *name, char *owner, size_t size);
+ static void remove_sidecars(const dept_t *dept);
+ static int write_snapshot(dept_index_t *idx, const dept_t *dept, int force);
+ static void rewrite_log(dept_index_t *idx, const dept_t *dept, uint64_t seq);
+ static size_t encode_record(const index_entry_t *e, char *buffer);
+ static int read_record(FILE *f, record_t *rec, char *name, char *owner, char *client_ip);
+ static void set_entry(index_entry_t *e, const record_t *rec, const char *owner, const char *client_ip);
+ static int append_entry(dept_index_t *idx, const record_t *rec, const char *name, const char *owner,
+                         const char *client_ip);
+ static index_entry_t *put_entry(dept_index_t *idx, const char *name);
+ static unsigned find_name(const dept_index_t *idx, const char *name, int *found);
+ static index_entry_t *first_since(const dept_index_t *idx, uint64_t seq);
+ static void touch(dept_index_t *idx, index_entry_t *e, uint64_t seq);
+ static int link_by_seq(dept_index_t *idx);
+ static void clear_index(dept_index_t *idx);
+ static int compare_names(const void *a, const void *b);
+ static int compare_seqs(const void *a, const void *b);
+ static void *snapshot_thread(void *arg);
+
+ /**
+  * Loads every department's index, from its snapshot or by scanning it
+  *
+  * Must be called once at startup, after the departments are opened.
+  */
+ int index_init(void) {
+     if (mkdir(INDEX_DIR, 0700) != 0 && errno != EEXIST) {
+         fprintf(stderr, "Cannot create index directory %s: %s\n", INDEX_DIR, strerror(errno));
+         return -1;
+     }
+
+     for (int i = 0; i < dept_count(); i++) {
+         pthread_rwlock_init(&indexes[i].lock, NULL);
+         indexes[i].log_fd = -1;
+         if (load_index(&indexes[i], dept_get(i)) != 0) {
+             return -1;
+         }
+     }
+
+     return 0;
+ }
+
+ /**
+  * Starts the threads that snapshot changed indexes and forward changes
+  */
+ int index_start(void) {
+     pthread_t thread_id;
+
+     if (pthread_create(&thread_id, NULL, snapshot_thread, NULL) != 0) {
+         perror("Index snapshot thread creation failed");
+         return -1;
+     }
+     pthread_detach(thread_id);
+
+     if (pthread_create(&thread_id, NULL, forward_thread, NULL) != 0) {
+         perror("Index forwarding thread creation failed");
+         return -1;
+     }
+     pthread_detach(thread_id);
+     return 0;
+ }
+
+ /**
+  * Whether a directory entry is a published file rather than a staging
+  * file, partial upload or owner record
+  */
+ int index_listable(const char *name) {
+     size_t len = strlen(name);
+     return name[0] != '.' && !(len >= 6 && strcmp(name + len - 6, ".owner") == 0);
+ }
+
+ /**
+  * Records a file that has just been published
+  */
+ void index_update(int dept_id, const char *name, const struct stat *st, const auth_info_t *auth_info,
+                   uint64_t hash) {
+     record_t rec = { .size = st->st_size, .mtime = st->st_mtim.tv_sec, .hash = hash, .uploaded = time(NULL) };
+     apply_change(&indexes[dept_id], dept_get(dept_id), name, &rec, auth_info->username, auth_info->client_ip);
+ }
+
+ /**
+  * Hands the index files to the process taking over in an upgrade, with
+  * changes from now on sent down fd; with fd -1, takes them back
+  *
+  * The new process may load the files as soon as this returns. Taking
+  * them back writes every index out afresh, since the other process may
+  * have changed the files meanwhile. A forwarded change is only as
+  * durable as the other process makes it.
+  */
+ void index_forward(int fd) {
+     pthread_mutex_lock(&snapshot_lock);
+
+     if (fd >= 0) {
+         // A peer that stops reading fails the send rather than holding the queue up
+         struct timeval timeout = { .tv_sec = FORWARD_TIMEOUT_SEC };
+         setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+         pthread_mutex_lock(&forward_lock);
+         forward_fd = fd;
+         pthread_mutex_unlock(&forward_lock);
+     }
+
+     for (int i = 0; i < dept_count(); i++) {
+         dept_index_t *idx = &indexes[i];
+
+         pthread_rwlock_wrlock(&idx->lock);
+         if (fd >= 0) {
+             close(idx->log_fd);
+             idx->log_fd = -1;
+         } else if (open_log(idx, dept_get(i)) != 0) {
+             log_event(LOG_LEVEL_ERROR, "Index log not reopened", "dept=%s error=%s", dept_get(i)->name,
+                       strerror(errno));
+         }
+         pthread_rwlock_unlock(&idx->lock);
+     }
+
+     if (fd < 0) {
+         // Changes still queued are in this process's indexes, which are
+         // about to be written out whole
+         pthread_mutex_lock(&forward_lock);
+         forward_fd = -1;
+         while (forward_head != NULL) {
+             forward_t *f = forward_head;
+             forward_head = f->next;
+             free(f);
+         }
+         forward_tail = NULL;
+         while (forward_busy) {
+             pthread_cond_wait(&forward_cond, &forward_lock);
+         }
+         pthread_mutex_unlock(&forward_lock);
+
+         for (int i = 0; i < dept_count(); i++) {
+             if (write_snapshot(&indexes[i], dept_get(i), 1) == 0) {
+                 rescan_marked(dept_get(i), 1);
+             }
+         }
+     }
+
+     forwarding = (fd >= 0);
+     pthread_mutex_unlock(&snapshot_lock);
+ }
+
+ /**
+  * Waits until every change queued for the other process has been sent,
+  * or given up on
+  */
+ void index_flush(void) {
+     pthread_mutex_lock(&forward_lock);
+     while (forward_head != NULL || forward_busy) {
+         pthread_cond_wait(&forward_cond, &forward_lock);
+     }
+     pthread_mutex_unlock(&forward_lock);
+ }
+
+ /**
+  * Starts a thread applying the changes another process forwards down fd,
+  * until it closes it
+  */
+ int index_follow(int fd) {
+     pthread_t thread_id;
+
+     FILE *f = fdopen(fd, "r");
+     if (f == NULL || pthread_create(&thread_id, NULL, follow_thread, f) != 0) {
+         perror("Index follower creation failed");
+         if (f != NULL) {
+             fclose(f);
+         }
+         return -1;
+     }
+     pthread_detach(thread_id);
+     return 0;
+ }
+
+ /**
+  * Flushes a department's log, so the changes recorded so far survive a
+  * crash; returns 0, or -1 with errno set
+  */
+ int index_sync(int dept_id) {
+     dept_index_t *idx = &indexes[dept_id];
+
+     // Synced through a copy, so updates aren't held up behind the disk; if
+     // rewrite_log() swaps the log meanwhile, the snapshot has the changes
+     pthread_rwlock_rdlock(&idx->lock);
+     int logging = idx->log_fd >= 0;
+     int fd = logging ? dup(idx->log_fd) : -1;
+     pthread_rwlock_unlock(&idx->lock);
+     if (fd < 0) {
+         return logging ? -1 : 0;
+     }
+
+     int status = fdatasync(fd);
+     int saved_errno = errno;
+     close(fd);
+     errno = saved_errno;
+     return status;
+ }
+
+ /**
+  * Calls sink for up to limit files whose names sort after after, in name
+  * order; after may be NULL or empty to start from the first
+  */
+ void index_list(int dept_id, const char *after, unsigned limit, index_sink_t sink, void *ctx,
+                 index_page_t *page) {
+     dept_index_t *idx = &indexes[dept_id];
+     int found = 0;
+
+     pthread_rwlock_rdlock(&idx->lock);
+     unsigned i = (after != NULL && after[0] != '\0') ? find_name(idx, after, &found) : 0;
+     if (found) {
+         i++;
+     }
+
+     for (page->count = 0; i < idx->count && page->count < limit; i++, page->count++) {
+         sink(ctx, idx->by_name[i]);
+     }
+     page->more = i < idx->count;
+     page->seq = idx->last_seq;
+     pthread_rwlock_unlock(&idx->lock);
+ }
+
+ /**
+  * Calls sink for up to limit files changed after sequence number since,
+  * oldest change first
+  */
+ void index_changes(int dept_id, uint64_t since, unsigned limit, index_sink_t sink, void *ctx,
+                    index_page_t *page) {
+     dept_index_t *idx = &indexes[dept_id];
+
+     pthread_rwlock_rdlock(&idx->lock);
+     // Ahead of the index means the client's number came from somewhere else; start it over
+     if (since > idx->last_seq) {
+         since = 0;
+     }
+
+     page->seq = since;
+     index_entry_t *e = first_since(idx, since);
+     for (page->count = 0; e != NULL && page->count < limit; e = e->seq_next, page->count++) {
+         sink(ctx, e);
+         page->seq = e->seq;
+     }
+     page->more = e != NULL;
+     pthread_rwlock_unlock(&idx->lock);
+ }
+
+ /**
+  * Records a change under a new sequence number and logs it, or forwards
+  * it while another process has the logs
+  */
+ static void apply_change(dept_index_t *idx, const dept_t *dept, const char *name, const record_t *rec,
+                          const char *owner, const char *client_ip) {
+     char record[RECORD_MAX];
+
+     pthread_rwlock_wrlock(&idx->lock);
+     index_entry_t *e = put_entry(idx, name);
+     if (e == NULL) {
+         pthread_rwlock_unlock(&idx->lock);
+         log_event(LOG_LEVEL_WARN, "File not indexed", "file=%s error=%s", name, strerror(ENOMEM));
+         return;
+     }
+
+     set_entry(e, rec, owner, client_ip);
+     touch(idx, e, idx->last_seq + 1);
+
+     size_t len = encode_record(e, record);
+     if (idx->log_fd >= 0) {
+         if (write(idx->log_fd, record, len) != (ssize_t)len) {
+             log_event(LOG_LEVEL_WARN, "Index log write failed", "file=%s error=%s", name, strerror(errno));
+         }
+     } else {
+         // Queued under the index lock, so the other process applies changes in the same order
+         forward_change(dept, record, len);
+     }
+     idx->logged++;
+     pthread_rwlock_unlock(&idx->lock);
+ }
+
+ /**
+  * Queues a change for the process that has the logs, if any
+  */
+ static void forward_change(const dept_t *dept, const char *record, size_t len) {
+     size_t name_len = strlen(dept->name);
+
+     forward_t *f = malloc(sizeof(forward_t) + 1 + name_len + len);
+     if (f == NULL) {
+         log_event(LOG_LEVEL_WARN, "Index change not forwarded", "dept=%s error=%s", dept->name, strerror(ENOMEM));
+         mark_rescan(dept);
+         return;
+     }
+     f->next = NULL;
+     f->dept = dept;
+     f->len = 1 + name_len + len;
+     f->message[0] = name_len;
+     memcpy(f->message + 1, dept->name, name_len);
+     memcpy(f->message + 1 + name_len, record, len);
+
+     pthread_mutex_lock(&forward_lock);
+     if (forward_fd < 0) {
+         pthread_mutex_unlock(&forward_lock);
+         free(f);
+         return;
+     }
+     if (forward_tail != NULL) {
+         forward_tail->next = f;
+     } else {
+         forward_head = f;
+     }
+     forward_tail = f;
+     pthread_cond_broadcast(&forward_cond);
+     pthread_mutex_unlock(&forward_lock);
+ }
+
+ /**
+  * Sends queued changes to the other process, one at a time and with no
+  * index lock held
+  */
+ static void *forward_thread(void *arg) {
+     (void)arg;
+
+     pthread_mutex_lock(&forward_lock);
+     while (1) {
+         while (forward_head == NULL) {
+             pthread_cond_wait(&forward_cond, &forward_lock);
+         }
+
+         forward_t *f = forward_head;
+         forward_head = f->next;
+         if (forward_head == NULL) {
+             forward_tail = NULL;
+         }
+         forward_busy = 1;
+         int fd = forward_fd;
+         pthread_mutex_unlock(&forward_lock);
+
+         if (send(fd, f->message, f->len, MSG_NOSIGNAL) != (ssize_t)f->len) {
+             log_event(LOG_LEVEL_WARN, "Index change not forwarded", "dept=%s error=%s", f->dept->name,
+                       strerror(errno));
+             mark_rescan(f->dept);
+         }
+         free(f);
+
+         pthread_mutex_lock(&forward_lock);
+         forward_busy = 0;
+         pthread_cond_broadcast(&forward_cond);
+     }
+
+     return NULL;
+ }
+
+ /**
+  * Leaves a marker telling the next start to index a department from its
+  * directory, since the process that has its logs missed a change
+  */
+ static void mark_rescan(const dept_t *dept) {
+     char path[PATH_MAX];
+
+     snprintf(path, sizeof(path), "%s/%s.rescan", INDEX_DIR, dept->name);
+     int fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0600);
+     if (fd < 0) {
+         log_event(LOG_LEVEL_ERROR, "Index rescan not marked", "dept=%s error=%s", dept->name, strerror(errno));
+         return;
+     }
+     close(fd);
+     log_event(LOG_LEVEL_WARN, "Index marked for rescan", "dept=%s", dept->name);
+ }
+
+ /**
+  * Whether a department is marked for a rescan; with clear set, removes
+  * the marker instead
+  */
+ static int rescan_marked(const dept_t *dept, int clear) {
+     char path[PATH_MAX];
+
+     snprintf(path, sizeof(path), "%s/%s.rescan", INDEX_DIR, dept->name);
+     if (clear) {
+         return unlink(path) == 0;
+     }
+     return access(path, F_OK) == 0;
+ }
+
+ /**
+  * Applies forwarded changes until the sending process closes its end
+  */
+ static void *follow_thread(void *arg) {
+     FILE *f = arg;
+     char dept_name[MAX_DEPT_LENGTH];
+     char name[MAX_FILEPATH_LENGTH], owner[MAX_USERNAME_LENGTH], client_ip[INET_ADDRSTRLEN];
+     record_t rec;
+     unsigned applied = 0;
+     int name_len;
+
+     while ((name_len = fgetc(f)) != EOF) {
+         if (name_len == 0 || name_len >= MAX_DEPT_LENGTH || fread(dept_name, name_len, 1, f) != 1 ||
+             read_record(f, &rec, name, owner, client_ip) != 0) {
+             log_event(LOG_LEVEL_WARN, "Forwarded index change damaged", "applied=%u", applied);
+             break;
+         }
+         dept_name[name_len] = '\0';
+
+         int dept_id = dept_find(dept_name);
+         if (dept_id < 0) {
+             log_event(LOG_LEVEL_WARN, "Forwarded change for unknown department", "dept=%s file=%s", dept_name, name);
+             continue;
+         }
+         apply_change(&indexes[dept_id], dept_get(dept_id), name, &rec, owner, client_ip);
+         applied++;
+     }
+
+     log_event(LOG_LEVEL_INFO, "Index changes taken over", "applied=%u", applied);
+     fclose(f);
+     return NULL;
+ }
+
+ /**
+  * Opens a department's log for appending
+  */
+ static int open_log(dept_index_t *idx, const dept_t *dept) {
+     char log_path[PATH_MAX];
+
+     snprintf(log_path, sizeof(log_path), "%s/%s.log", INDEX_DIR, dept->name);
+     idx->log_fd = open(log_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+     return (idx->log_fd < 0) ? -1 : 0;
+ }
+
+ /**
+  * Fills a department's index from its snapshot and log, or its directory
+  */
+ static int load_index(dept_index_t *idx, const dept_t *dept) {
+     char snapshot_path[PATH_MAX];
+     char log_path[PATH_MAX];
+     struct timespec started;
+     int scanned = 0;
+     unsigned replayed = 0, sidecars = 0;
+
+     clock_gettime(CLOCK_MONOTONIC, &started);
+     snprintf(snapshot_path, sizeof(snapshot_path), "%s/%s.snap", INDEX_DIR, dept->name);
+     snprintf(log_path, sizeof(log_path), "%s/%s.log", INDEX_DIR, dept->name);
+
+     // A marker means the old process of an upgrade lost a change it made
+     int rescan = rescan_marked(dept, 0);
+     if (!rescan && read_snapshot(idx, snapshot_path) == 0) {
+         replayed = replay_log(idx, log_path);
+     } else {
+         scanned = 1;
+         if (scan_directory(idx, dept, &sidecars) != 0) {
+             fprintf(stderr, "Cannot index %s: %s\n", dept->dir, strerror(errno));
+             return -1;
+         }
+         // Whatever the log holds is already in the directory
+         unlink(log_path);
+         replayed = idx->count;
+     }
+
+     if (open_log(idx, dept) != 0) {
+         fprintf(stderr, "Cannot open index log %s: %s\n", log_path, strerror(errno));
+         return -1;
+     }
+
+     // Start the next run from a snapshot that has it all; after a scan,
+     // even an empty one, so the log has something to apply to
+     idx->logged = replayed;
+     if ((replayed > 0 || scanned) && write_snapshot(idx, dept, 1) == 0) {
+         if (rescan) {
+             rescan_marked(dept, 1);
+         }
+         if (sidecars > 0) {
+             // Owners read from .owner files by the scan are safely in the snapshot now
+             remove_sidecars(dept);
+             log_event(LOG_LEVEL_INFO, "Owner records migrated", "dept=%s files=%u", dept->name, sidecars);
+         }
+     }
+
+     struct timespec now;
+     clock_gettime(CLOCK_MONOTONIC, &now);
+     log_event(LOG_LEVEL_INFO, "Department indexed", "dept=%s files=%u source=%s replayed=%u ms=%ld",
+               dept->name, idx->count, scanned ? "scan" : "snapshot", replayed,
+               (now.tv_sec - started.tv_sec) * 1000 + (now.tv_nsec - started.tv_nsec) / 1000000);
+     return 0;
+ }
+
+ /**
+  * Loads a snapshot; returns -1, leaving the index empty, if there is no
+  * usable one
+  */
+ static int read_snapshot(dept_index_t *idx, const char *path) {
+     char name[MAX_FILEPATH_LENGTH];
+     char owner[MAX_USERNAME_LENGTH];
+     char client_ip[INET_ADDRSTRLEN];
+     snapshot_header_t header;
+     record_t rec;
+
+     FILE *f = fopen(path, "re");
+     if (f == NULL) {
+         return -1;
+     }
+
+     int ok = fread(&header, sizeof(header), 1, f) == 1 && header.magic == INDEX_MAGIC &&
+              header.version == INDEX_VERSION;
+     for (uint64_t i = 0; ok && i < header.count; i++) {
+         ok = read_record(f, &rec, name, owner, client_ip) == 0 &&
+              append_entry(idx, &rec, name, owner, client_ip) == 0;
+     }
+     fclose(f);
+
+     // Written in name order, so the sort has nothing to move
+     if (ok) {
+         qsort(idx->by_name, idx->count, sizeof(idx->by_name[0]), compare_names);
+         ok = link_by_seq(idx) == 0;
+     }
+
+     if (!ok) {
+         log_event(LOG_LEVEL_WARN, "Index snapshot unusable", "path=%s", path);
+         clear_index(idx);
+         return -1;
+     }
+
+     idx->last_seq = header.last_seq;
+     return 0;
+ }
+
+ /**
+  * Applies the changes logged after the snapshot; a record cut short by
+  * a crash ends the replay
+  */
+ static unsigned replay_log(dept_index_t *idx, const char *path) {
+     char name[MAX_FILEPATH_LENGTH];
+     char owner[MAX_USERNAME_LENGTH];
+     char client_ip[INET_ADDRSTRLEN];
+     unsigned replayed = 0;
+     record_t rec;
+
+     FILE *f = fopen(path, "re");
+     if (f == NULL) {
+         return 0;
+     }
+
+     while (read_record(f, &rec, name, owner, client_ip) == 0) {
+         // The log may still hold changes the snapshot already has
+         if (rec.seq <= idx->last_seq) {
+             continue;
+         }
+
+         index_entry_t *e = put_entry(idx, name);
+         if (e == NULL) {
+             break;
+         }
+         set_entry(e, &rec, owner, client_ip);
+         touch(idx, e, rec.seq);
+         replayed++;
+     }
+     fclose(f);
+
+     return replayed;
+ }
+
+ /**
+  * Builds an index from the files in a department's directory
+  *
+  * Owners come from the .owner files older versions kept next to each
+  * file; sidecars is set to how many were found.
+  */
+ static int scan_directory(dept_index_t *idx, const dept_t *dept, unsigned *sidecars) {
+     struct timespec now;
+     clock_gettime(CLOCK_REALTIME, &now);
+     uint64_t seq = (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+
+     int fd = openat(dept->dir_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+     DIR *dir = (fd >= 0) ? fdopendir(fd) : NULL;
+     if (dir == NULL) {
+         if (fd >= 0) {
+             close(fd);
+         }
+         return -1;
+     }
+
+     struct dirent *d;
+     while ((d = readdir(dir)) != NULL) {
+         char owner[MAX_USERNAME_LENGTH];
+         struct stat st;
+
+         if (!index_listable(d->d_name) || strlen(d->d_name) >= MAX_FILEPATH_LENGTH ||
+             fstatat(dirfd(dir), d->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISREG(st.st_mode)) {
+             continue;
+         }
+
+         *sidecars += read_owner(dept, d->d_name, owner, sizeof(owner));
+         record_t rec = { .seq = ++seq, .size = st.st_size, .mtime = st.st_mtim.tv_sec };
+         if (append_entry(idx, &rec, d->d_name, owner, "") != 0) {
+             closedir(dir);
+             clear_index(idx);
+             errno = ENOMEM;
+             return -1;
+         }
+     }
+     closedir(dir);
+
+     qsort(idx->by_name, idx->count, sizeof(idx->by_name[0]), compare_names);
+     if (link_by_seq(idx) != 0) {
+         clear_index(idx);
+         errno = ENOMEM;
+         return -1;
+     }
+     idx->last_seq = seq;
+     return 0;
+ }
+
+ /**
+  * Reads a file's .owner record; returns 0, with the owner left empty, if
+  * there isn't one
+  */
+ static int read_owner(const dept_t *dept, const char *name, char *owner, size_t size) {
+     char owner_name[MAX_FILEPATH_LENGTH + sizeof(".owner")];
+     ssize_t n = -1;
+
+     snprintf(owner_name, sizeof(owner_name), "%s.owner", name);
+     int fd = openat(dept->dir_fd, owner_name, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+     if (fd >= 0) {
+         n = read(fd, owner, size - 1);
+         close(fd);
+     }
+     owner[(n > 0) ? n : 0] = '\0';
+     return fd >= 0;
+ }
+
+ /**
+  * Deletes a department's .owner files, including any left behind by
+  * files that are gone
+  */
+ static void remove_sidecars(const dept_t *dept) {
+     int fd = openat(dept->dir_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+     DIR *dir = (fd >= 0) ? fdopendir(fd) : NULL;
+     if (dir == NULL) {
+         if (fd >= 0) {
+             close(fd);
+         }
+         return;
+     }
+
+     struct dirent *d;
+     while ((d = readdir(dir)) != NULL) {
+         size_t len = strlen(d->d_name);
+         if (d->d_name[0] != '.' && len > 6 && strcmp(d->d_name + len - 6, ".owner") == 0) {
+             unlinkat(dirfd(dir), d->d_name, 0);
+         }
+     }
+     closedir(dir);
+ }
+
+ /**
+  * Writes the whole index out if it has changed (or force is set), then
+  * cuts its log back to the changes made meanwhile
+  */
+ static int write_snapshot(dept_index_t *idx, const dept_t *dept, int force) {
+     char path[PATH_MAX];
+     char tmp_path[PATH_MAX + 8];
+     char record[RECORD_MAX];
+
+     snprintf(path, sizeof(path), "%s/%s.snap", INDEX_DIR, dept->name);
+     snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+     FILE *f = fopen(tmp_path, "we");
+     if (f == NULL) {
+         log_event(LOG_LEVEL_WARN, "Index snapshot failed", "dept=%s error=%s", dept->name, strerror(errno));
+         return -1;
+     }
+
+     // Held only while the entries are copied into the file's buffers
+     pthread_rwlock_rdlock(&idx->lock);
+     if (idx->logged == 0 && !force) {
+         pthread_rwlock_unlock(&idx->lock);
+         fclose(f);
+         unlink(tmp_path);
+         return 0;
+     }
+
+     snapshot_header_t header = { INDEX_MAGIC, INDEX_VERSION, idx->last_seq, idx->count };
+     int ok = fwrite(&header, sizeof(header), 1, f) == 1;
+     for (unsigned i = 0; ok && i < idx->count; i++) {
+         size_t len = encode_record(idx->by_name[i], record);
+         ok = fwrite(record, len, 1, f) == 1;
+     }
+     uint64_t seq = idx->last_seq;
+     pthread_rwlock_unlock(&idx->lock);
+
+     ok = fflush(f) == 0 && fsync(fileno(f)) == 0 && ok;
+     ok = fclose(f) == 0 && ok;
+     if (!ok || rename(tmp_path, path) != 0) {
+         log_event(LOG_LEVEL_WARN, "Index snapshot failed", "dept=%s error=%s", dept->name, strerror(errno));
+         unlink(tmp_path);
+         return -1;
+     }
+
+     // The snapshot's name must be on disk before the log it replaces is cut
+     int dir_fd = open(INDEX_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+     if (dir_fd >= 0) {
+         fsync(dir_fd);
+         close(dir_fd);
+     }
+
+     rewrite_log(idx, dept, seq);
+     return 0;
+ }
+
+ /**
+  * Replaces a department's log with the changes made after seq
+  */
+ static void rewrite_log(dept_index_t *idx, const dept_t *dept, uint64_t seq) {
+     char path[PATH_MAX];
+     char tmp_path[PATH_MAX + 8];
+     char record[RECORD_MAX];
+
+     snprintf(path, sizeof(path), "%s/%s.log", INDEX_DIR, dept->name);
+     snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+     int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0600);
+     if (fd < 0) {
+         log_event(LOG_LEVEL_WARN, "Index log rewrite failed", "dept=%s error=%s", dept->name, strerror(errno));
+         return;
+     }
+
+     pthread_rwlock_wrlock(&idx->lock);
+     int ok = 1;
+     unsigned kept = 0;
+     for (index_entry_t *e = first_since(idx, seq); ok && e != NULL; e = e->seq_next, kept++) {
+         size_t len = encode_record(e, record);
+         ok = write(fd, record, len) == (ssize_t)len;
+     }
+
+     // Synced before it replaces a log that may hold durable changes
+     if (ok && fdatasync(fd) == 0 && rename(tmp_path, path) == 0) {
+         close(idx->log_fd);
+         idx->log_fd = fd;
+         idx->logged = kept;
+     } else {
+         log_event(LOG_LEVEL_WARN, "Index log rewrite failed", "dept=%s error=%s", dept->name, strerror(errno));
+         close(fd);
+         unlink(tmp_path);
+     }
+     pthread_rwlock_unlock(&idx->lock);
+ }
+
+ /**
+  * Lays an entry out as a record; buffer must hold RECORD_MAX bytes
+  */
+ static size_t encode_record(const index_entry_t *e, char *buffer) {
+     record_t rec = { .seq = e->seq, .size = e->size, .mtime = e->mtime, .hash = e->hash,
+                      .uploaded = e->uploaded, .name_len = strlen(e->name), .owner_len = strlen(e->owner),
+                      .ip_len = strlen(e->client_ip) };
+     char *p = buffer;
+
+     memcpy(p, &rec, sizeof(rec));
+     memcpy(p += sizeof(rec), e->name, rec.name_len);
+     memcpy(p += rec.name_len, e->owner, rec.owner_len);
+     memcpy(p += rec.owner_len, e->client_ip, rec.ip_len);
+     return sizeof(rec) + rec.name_len + rec.owner_len + rec.ip_len;
+ }
+
+ /**
+  * Reads the next record; returns -1 at the end or on a damaged record
+  */
+ static int read_record(FILE *f, record_t *rec, char *name, char *owner, char *client_ip) {
+     if (fread(rec, sizeof(*rec), 1, f) != 1 || rec->name_len == 0 || rec->name_len >= MAX_FILEPATH_LENGTH ||
+         rec->owner_len >= MAX_USERNAME_LENGTH || rec->ip_len >= INET_ADDRSTRLEN) {
+         return -1;
+     }
+     if (fread(name, rec->name_len, 1, f) != 1 ||
+         (rec->owner_len > 0 && fread(owner, rec->owner_len, 1, f) != 1) ||
+         (rec->ip_len > 0 && fread(client_ip, rec->ip_len, 1, f) != 1)) {
+         return -1;
+     }
+
+     name[rec->name_len] = '\0';
+     owner[rec->owner_len] = '\0';
+     client_ip[rec->ip_len] = '\0';
+     return 0;
+ }
+
+ static void set_entry(index_entry_t *e, const record_t *rec, const char *owner, const char *client_ip) {
+     e->size = rec->size;
+     e->mtime = rec->mtime;
+     e->hash = rec->hash;
+     e->uploaded = rec->uploaded;
+     snprintf(e->owner, sizeof(e->owner), "%s", owner);
+     snprintf(e->client_ip, sizeof(e->client_ip), "%s", client_ip);
+ }
+
+ /**
+  * Adds an entry to the end of the name array, which the caller sorts
+  * and links by sequence afterwards
+  */
+ static int append_entry(dept_index_t *idx, const record_t *rec, const char *name, const char *owner,
+                         const char *client_ip) {
+     if (idx->count == idx->capacity) {
+         unsigned capacity = (idx->capacity > 0) ? idx->capacity * 2 : 64;
+         index_entry_t **by_name = realloc(idx->by_name, capacity * sizeof(*by_name));
+         if (by_name == NULL) {
+             return -1;
+         }
+         idx->by_name = by_name;
+         idx->capacity = capacity;
+     }
+
+     size_t len = strlen(name);
+     index_entry_t *e = calloc(1, sizeof(*e) + len + 1);
+     if (e == NULL) {
+         return -1;
+     }
+     memcpy(e->name, name, len + 1);
+     set_entry(e, rec, owner, client_ip);
+     e->seq = rec->seq;
+
+     idx->by_name[idx->count++] = e;
+     return 0;
+ }
+
+ /**
+  * Finds a file's entry, adding an empty one in its place if it's new
+  *
+  * New entries aren't on the sequence list until touch() puts them there.
+  */
+ static index_entry_t *put_entry(dept_index_t *idx, const char *name) {
+     int found;
+     unsigned pos = find_name(idx, name, &found);
+     if (found) {
+         return idx->by_name[pos];
+     }
+
+     record_t empty = { 0 };
+     if (append_entry(idx, &empty, name, "", "") != 0) {
+         return NULL;
+     }
+
+     index_entry_t *e = idx->by_name[idx->count - 1];
+     memmove(&idx->by_name[pos + 1], &idx->by_name[pos], (idx->count - 1 - pos) * sizeof(idx->by_name[0]));
+     idx->by_name[pos] = e;
+     return e;
+ }
+
+ /**
+  * Position of name in the name array, or of the first name after it
+  */
+ static unsigned find_name(const dept_index_t *idx, const char *name, int *found) {
+     unsigned low = 0, high = idx->count;
+
+     while (low < high) {
+         unsigned mid = low + (high - low) / 2;
+         int cmp = strcmp(idx->by_name[mid]->name, name);
+         if (cmp == 0) {
+             *found = 1;
+             return mid;
+         }
+         if (cmp < 0) {
+             low = mid + 1;
+         } else {
+             high = mid;
+         }
+     }
+
+     *found = 0;
+     return low;
+ }
+
+ /**
+  * Oldest entry changed after seq, or NULL if there is none
+  */
+ static index_entry_t *first_since(const dept_index_t *idx, uint64_t seq) {
+     index_entry_t *first = NULL;
+
+     for (index_entry_t *e = idx->newest; e != NULL && e->seq > seq; e = e->seq_prev) {
+         first = e;
+     }
+
+     return first;
+ }
+
+ /**
+  * Gives an entry a new sequence number, moving it to the newest end
+  */
+ static void touch(dept_index_t *idx, index_entry_t *e, uint64_t seq) {
+     if (e->seq != 0) {
+         if (e->seq_prev != NULL) {
+             e->seq_prev->seq_next = e->seq_next;
+         } else {
+             idx->oldest = e->seq_next;
+         }
+         if (e->seq_next != NULL) {
+             e->seq_next->seq_prev = e->seq_prev;
+         } else {
+             idx->newest = e->seq_prev;
+         }
+     }
+
+     e->seq = seq;
+     e->seq_next = NULL;
+     e->seq_prev = idx->newest;
+     if (idx->newest != NULL) {
+         idx->newest->seq_next = e;
+     } else {
+         idx->oldest = e;
+     }
+     idx->newest = e;
+     idx->last_seq = seq;
+ }
+
+ /**
+  * Builds the sequence list of a freshly loaded index
+  */
+ static int link_by_seq(dept_index_t *idx) {
+     index_entry_t **order = malloc((idx->count + 1) * sizeof(*order));
+     if (order == NULL) {
+         return -1;
+     }
+     memcpy(order, idx->by_name, idx->count * sizeof(*order));
+     qsort(order, idx->count, sizeof(*order), compare_seqs);
+
+     idx->oldest = idx->newest = NULL;
+     for (unsigned i = 0; i < idx->count; i++) {
+         order[i]->seq_prev = idx->newest;
+         order[i]->seq_next = NULL;
+         if (idx->newest != NULL) {
+             idx->newest->seq_next = order[i];
+         } else {
+             idx->oldest = order[i];
+         }
+         idx->newest = order[i];
+     }
+
+     free(order);
+     return 0;
+ }
+
+ static void clear_index(dept_index_t *idx) {
+     for (unsigned i = 0; i < idx->count; i++) {
+         free(idx->by_name[i]);
+     }
+     free(idx->by_name);
+     idx->by_name = NULL;
+     idx->count = idx->capacity = 0;
+     idx->oldest = idx->newest = NULL;
+     idx->last_seq = 0;
+ }
+
+ static int compare_names(const void *a, const void *b) {
+     return strcmp((*(index_entry_t *const *)a)->name, (*(index_entry_t *const *)b)->name);
+ }
+
+ static int compare_seqs(const void *a, const void *b) {
+     uint64_t x = (*(index_entry_t *const *)a)->seq;
+     uint64_t y = (*(index_entry_t *const *)b)->seq;
+     return (x > y) - (x < y);
+ }
+
+ /**
+  * Snapshots each changed index every INDEX_SNAPSHOT_INTERVAL seconds
+  */
+ static void *snapshot_thread(void *arg) {
+     (void)arg;
+
+     while (1) {
+         sleep(INDEX_SNAPSHOT_INTERVAL);
+         pthread_mutex_lock(&snapshot_lock);
+         for (int i = 0; i < dept_count() && !forwarding; i++) {
+             write_snapshot(&indexes[i], dept_get(i), 0);
+         }
+         pthread_mutex_unlock(&snapshot_lock);
+     }
+
+     return NULL;
+ }
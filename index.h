@@ -0,0 +1,63 @@
+/**
+ * Department Index for the File Transfer Server
+ *
+ * Keeps every department's published files in memory, with their size,
+ * mtime, content hash and who uploaded them when and from where, so
+ * listing a department never touches the directory. This is also the
+ * only record of a file's owner. Each change is stamped with a
+ * per-department sequence number, which lets a client that has seen
+ * everything up to N ask for what changed since.
+ */
+
+ #ifndef INDEX_H
+ #define INDEX_H
+
+ #include <stdint.h>
+ #include <sys/stat.h>
+
+ #include "server.h"
+
+ #define INDEX_DIR BASE_DIR "/.index"  // Snapshots and change logs, one pair per department
+ #define INDEX_PAGE_SIZE 1000          // Entries per LIST or CHANGES answer unless asked for fewer
+ #define INDEX_SNAPSHOT_INTERVAL 30    // Seconds between snapshots of a changed index
+
+ // A published file; sinks may read it only while they are being called
+ typedef struct index_entry {
+     uint64_t seq;                // Sequence number of its last change
+     uint64_t size;
+     int64_t mtime;               // Seconds
+     uint64_t hash;               // xxh64 of the content, or 0 if not known
+     int64_t uploaded;            // When it was published, or 0 if not known
+     char owner[MAX_USERNAME_LENGTH];
+     char client_ip[INET_ADDRSTRLEN];  // Where it was uploaded from, if known
+
+     // Owned by the index
+     struct index_entry *seq_prev;
+     struct index_entry *seq_next;
+     char name[];
+ } index_entry_t;
+
+ // How far a LIST or CHANGES answer got
+ typedef struct {
+     unsigned count;
+     int more;                    // Stopped at the limit with entries left over
+     uint64_t seq;                // LIST: the index's latest change; CHANGES: where to carry on from
+ } index_page_t;
+
+ typedef void (*index_sink_t)(void *ctx, const index_entry_t *entry);
+
+ int index_init(void);
+ int index_start(void);
+ int index_listable(const char *name);
+ void index_update(int dept_id, const char *name, const struct stat *st, const auth_info_t *auth_info,
+                   uint64_t hash);
+ int index_sync(int dept_id);
+ void index_forward(int fd);
+ void index_flush(void);
+ int index_follow(int fd);
+ void index_list(int dept_id, const char *after, unsigned limit, index_sink_t sink, void *ctx,
+                 index_page_t *page);
+ void index_changes(int dept_id, uint64_t since, unsigned limit, index_sink_t sink, void *ctx,
+                    index_page_t *page);
+
+ #endif
@@ -0,0 +1,552 @@
+/**
+ * Logging for the File Transfer Server
+ *
+ * A thread's ring is created the first time it logs. Only that thread
+ * adds to it and only the flusher takes from it, so a record costs a
+ * format into the next free slot and one release store. When the thread
+ * exits its ring is marked retired; the flusher writes out what is left
+ * and frees it.
+ *
+ * The flusher wakes every LOG_FLUSH_INTERVAL_MS, formats everything
+ * queued into one buffer and writes it to stdout. Records are written
+ * ring by ring, so lines from different threads can be slightly out of
+ * time order; each carries its own timestamp.
+ */
+
+ #include <stdio.h>
+ #include <stdlib.h>
+ #include <string.h>
+ #include <stdarg.h>
+ #include <time.h>
+ #include <math.h>
+ #include <pthread.h>
+ #include <stdatomic.h>
+ #include <sys/types.h>
+
+ #include "log.h"
+
+ // One queued log line: the message, then key, type ('s' or 'n') and value of each field
+ typedef struct {
+     uint64_t time_ns;
+     int level;
+     uint32_t len;                // Bytes of data used, not counting the final NUL
+     char data[LOG_RECORD_SIZE - 16];
+ } log_record_t;
+
+ typedef struct ring {
+     log_record_t slots[LOG_RING_SLOTS];
+     atomic_size_t head;          // Next slot the owning thread fills
+     atomic_size_t tail;          // Next slot the flusher writes out
+     atomic_uint_fast64_t dropped;
+     atomic_int retired;          // Owning thread has exited
+     struct ring *next;
+ } ring_t;
+
+ static const char *level_names[] = { "debug", "info", "warn", "error" };
+
+ static atomic_int min_level = LOG_LEVEL_INFO;
+ static int out_format = LOG_FORMAT_LOGFMT;
+ static int started;
+
+ // Every ring not yet freed, and the drops of those that have been
+ static ring_t *rings;
+ static uint64_t retired_dropped;
+ static atomic_uint_fast64_t unqueued_dropped;   // Threads that couldn't get a ring
+ static atomic_int ring_count;
+ static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+ static pthread_key_t ring_key;
+ static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+ static __thread ring_t *my_ring;
+
+ // Output being formatted; one flush at a time, by the flusher or log_flush()
+ static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+ static char *out;
+ static size_t out_len;
+ static size_t out_cap;
+ static uint64_t dropped_reported;
+
+ static void create_ring_key(void);
+ static ring_t *get_ring(void);
+ static void retire_ring(void *arg);
+ static void fill_record(log_record_t *rec, int level, const char *msg, const char *fields, va_list ap);
+ static void make_record(log_record_t *rec, int level, const char *msg, const char *fields, ...);
+ static void put(log_record_t *rec, const char *s, size_t n);
+ static int reserve(size_t n);
+ static void out_put(const char *s, size_t n);
+ static void out_value(const char *s, int quote);
+ static void render(const log_record_t *rec);
+ static void write_out(void);
+ static void drain(void);
+ static void *flush_thread(void *arg);
+
+ /**
+  * A level by name, or -1 if there's no such level
+  */
+ int log_parse_level(const char *name) {
+     for (int i = 0; i < (int)(sizeof(level_names) / sizeof(level_names[0])); i++) {
+         if (strcmp(name, level_names[i]) == 0) {
+             return i;
+         }
+     }
+     return -1;
+ }
+
+ /**
+  * An output format by name, or -1 if there's no such format
+  */
+ int log_parse_format(const char *name) {
+     if (strcmp(name, "logfmt") == 0) {
+         return LOG_FORMAT_LOGFMT;
+     }
+     if (strcmp(name, "json") == 0) {
+         return LOG_FORMAT_JSON;
+     }
+     return -1;
+ }
+
+ /**
+  * Starts the flusher; until then log_event() writes synchronously
+  */
+ int log_start(int level, int format) {
+     pthread_t thread_id;
+
+     min_level = level;
+     out_format = format;
+
+     if (pthread_create(&thread_id, NULL, flush_thread, NULL) != 0) {
+         perror("Log flusher creation failed");
+         return -1;
+     }
+     pthread_detach(thread_id);
+
+     // Whatever is still queued when the process exits
+     atexit(log_flush);
+     started = 1;
+     return 0;
+ }
+
+ /**
+  * Changes the least severe level that is logged
+  */
+ void log_set_level(int level) {
+     atomic_store(&min_level, level);
+ }
+
+ /**
+  * Writes out everything queued so far
+  */
+ void log_flush(void) {
+     drain();
+ }
+
+ /**
+  * Records dropped because a thread's ring was full
+  */
+ uint64_t log_dropped(void) {
+     pthread_mutex_lock(&rings_lock);
+     uint64_t total = retired_dropped + atomic_load(&unqueued_dropped);
+     for (ring_t *r = rings; r != NULL; r = r->next) {
+         total += atomic_load_explicit(&r->dropped, memory_order_relaxed);
+     }
+     pthread_mutex_unlock(&rings_lock);
+     return total;
+ }
+
+ /**
+  * Logs msg with the fields described by a "key=%s key=%d ..." format
+  *
+  * Never blocks once the flusher is running: if the calling thread's ring
+  * is full the record is dropped and counted.
+  */
+ void log_event(int level, const char *msg, const char *fields, ...) {
+     va_list ap;
+
+     if (level < atomic_load_explicit(&min_level, memory_order_relaxed)) {
+         return;
+     }
+
+     if (!started) {
+         log_record_t rec;
+         va_start(ap, fields);
+         fill_record(&rec, level, msg, fields, ap);
+         va_end(ap);
+
+         pthread_mutex_lock(&flush_lock);
+         render(&rec);
+         write_out();
+         pthread_mutex_unlock(&flush_lock);
+         return;
+     }
+
+     ring_t *r = get_ring();
+     if (r == NULL) {
+         atomic_fetch_add(&unqueued_dropped, 1);
+         return;
+     }
+
+     size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+     if (head - atomic_load_explicit(&r->tail, memory_order_acquire) >= LOG_RING_SLOTS) {
+         atomic_store_explicit(&r->dropped, atomic_load_explicit(&r->dropped, memory_order_relaxed) + 1,
+                               memory_order_relaxed);
+         return;
+     }
+
+     va_start(ap, fields);
+     fill_record(&r->slots[head % LOG_RING_SLOTS], level, msg, fields, ap);
+     va_end(ap);
+     atomic_store_explicit(&r->head, head + 1, memory_order_release);
+ }
+
+ static void create_ring_key(void) {
+     pthread_key_create(&ring_key, retire_ring);
+ }
+
+ /**
+  * The calling thread's ring, created on first use
+  */
+ static ring_t *get_ring(void) {
+     if (my_ring != NULL) {
+         return my_ring;
+     }
+
+     // Retired rings pile up while stdout is stuck; don't let them grow without bound
+     if (atomic_load(&ring_count) >= LOG_MAX_RINGS) {
+         return NULL;
+     }
+
+     pthread_once(&ring_key_once, create_ring_key);
+     ring_t *r = calloc(1, sizeof(*r));
+     if (r == NULL) {
+         return NULL;
+     }
+     atomic_fetch_add(&ring_count, 1);
+
+     pthread_mutex_lock(&rings_lock);
+     r->next = rings;
+     rings = r;
+     pthread_mutex_unlock(&rings_lock);
+
+     pthread_setspecific(ring_key, r);
+     my_ring = r;
+     return r;
+ }
+
+ /**
+  * Thread exit: leaves the ring for the flusher to empty and free
+  */
+ static void retire_ring(void *arg) {
+     ring_t *r = arg;
+
+     my_ring = NULL;
+     atomic_store_explicit(&r->retired, 1, memory_order_release);
+ }
+
+ /**
+  * Formats a log line into a record, truncating it if it doesn't fit
+  */
+ static void fill_record(log_record_t *rec, int level, const char *msg, const char *fields, va_list ap) {
+     struct timespec ts;
+     const char *f = fields;
+
+     clock_gettime(CLOCK_REALTIME, &ts);
+     rec->time_ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+     rec->level = level;
+     rec->len = 0;
+     put(rec, msg, strlen(msg) + 1);
+
+     while (*f != '\0') {
+         while (*f == ' ') {
+             f++;
+         }
+         if (*f == '\0') {
+             break;
+         }
+
+         // The key, then a placeholder for the type until the value is known
+         const char *key = f;
+         while (*f != '\0' && *f != '=' && *f != ' ') {
+             f++;
+         }
+         put(rec, key, f - key);
+         put(rec, "", 1);
+         uint32_t type_at = rec->len;
+         put(rec, "s", 1);
+         if (*f == '=') {
+             f++;
+         }
+
+         int numeric = 1;
+         int conversions = 0;
+         while (*f != '\0' && *f != ' ') {
+             if (*f != '%' || f[1] == '%') {
+                 put(rec, f, 1);
+                 f += (*f == '%') ? 2 : 1;
+                 numeric = 0;
+                 continue;
+             }
+
+             int longs = 0;
+             int size_t_arg = 0;
+             for (f++; *f == 'l'; f++) {
+                 longs++;
+             }
+             if (*f == 'z') {
+                 size_t_arg = 1;
+                 f++;
+             }
+
+             char tmp[64];
+             const char *s = tmp;
+             tmp[0] = '\0';
+             switch (*f) {
+             case 's':
+                 s = va_arg(ap, const char *);
+                 s = (s != NULL) ? s : "(null)";
+                 numeric = 0;
+                 break;
+             case 'c':
+                 tmp[0] = (char)va_arg(ap, int);
+                 tmp[1] = '\0';
+                 numeric = 0;
+                 break;
+             case 'd':
+             case 'i': {
+                 long long v = size_t_arg ? va_arg(ap, ssize_t) : (longs >= 2) ? va_arg(ap, long long) :
+                               longs ? va_arg(ap, long) : va_arg(ap, int);
+                 snprintf(tmp, sizeof(tmp), "%lld", v);
+                 break;
+             }
+             case 'u':
+             case 'x': {
+                 unsigned long long v = size_t_arg ? va_arg(ap, size_t) :
+                                        (longs >= 2) ? va_arg(ap, unsigned long long) :
+                                        longs ? va_arg(ap, unsigned long) : va_arg(ap, unsigned);
+                 snprintf(tmp, sizeof(tmp), (*f == 'x') ? "%llx" : "%llu", v);
+                 numeric = numeric && *f == 'u';
+                 break;
+             }
+             case 'g': {
+                 double v = va_arg(ap, double);
+                 snprintf(tmp, sizeof(tmp), "%g", v);
+                 numeric = numeric && isfinite(v);
+                 break;
+             }
+             case 'p':
+                 snprintf(tmp, sizeof(tmp), "%p", va_arg(ap, void *));
+                 numeric = 0;
+                 break;
+             default:
+                 numeric = 0;
+                 break;
+             }
+             if (*f != '\0') {
+                 f++;
+             }
+
+             put(rec, s, strlen(s));
+             conversions++;
+         }
+
+         if (numeric && conversions == 1 && type_at < rec->len) {
+             rec->data[type_at] = 'n';
+         }
+         put(rec, "", 1);
+     }
+
+     rec->data[rec->len] = '\0';
+ }
+
+ static void make_record(log_record_t *rec, int level, const char *msg, const char *fields, ...) {
+     va_list ap;
+     va_start(ap, fields);
+     fill_record(rec, level, msg, fields, ap);
+     va_end(ap);
+ }
+
+ /**
+  * Appends to a record, keeping room for the final NUL
+  */
+ static void put(log_record_t *rec, const char *s, size_t n) {
+     size_t room = sizeof(rec->data) - 1 - rec->len;
+     if (n > room) {
+         n = room;
+     }
+     memcpy(rec->data + rec->len, s, n);
+     rec->len += n;
+ }
+
+ /**
+  * Makes room for n more bytes of output; the caller holds flush_lock
+  */
+ static int reserve(size_t n) {
+     if (out_len + n <= out_cap) {
+         return 0;
+     }
+
+     size_t cap = (out_cap > 0) ? out_cap : 65536;
+     while (cap < out_len + n) {
+         cap *= 2;
+     }
+     char *grown = realloc(out, cap);
+     if (grown == NULL) {
+         return -1;
+     }
+     out = grown;
+     out_cap = cap;
+     return 0;
+ }
+
+ static void out_put(const char *s, size_t n) {
+     if (reserve(n) == 0) {
+         memcpy(out + out_len, s, n);
+         out_len += n;
+     }
+ }
+
+ /**
+  * Writes a value, quoted and escaped if asked to or if logfmt needs it
+  */
+ static void out_value(const char *s, int quote) {
+     if (!quote && out_format == LOG_FORMAT_LOGFMT) {
+         quote = (*s == '\0');
+         for (const char *p = s; *p != '\0' && !quote; p++) {
+             quote = (*p == ' ' || *p == '=' || *p == '"' || (unsigned char)*p < 0x20);
+         }
+     }
+     if (!quote) {
+         out_put(s, strlen(s));
+         return;
+     }
+
+     out_put("\"", 1);
+     for (const char *p = s; *p != '\0'; p++) {
+         char esc[8];
+         unsigned char ch = (unsigned char)*p;
+         if (ch == '"' || ch == '\\') {
+             esc[0] = '\\';
+             esc[1] = ch;
+             out_put(esc, 2);
+         } else if (ch == '\n') {
+             out_put("\\n", 2);
+         } else if (ch == '\t') {
+             out_put("\\t", 2);
+         } else if (ch < 0x20) {
+             snprintf(esc, sizeof(esc), "\\u%04x", ch);
+             out_put(esc, strlen(esc));
+         } else {
+             out_put(p, 1);
+         }
+     }
+     out_put("\"", 1);
+ }
+
+ /**
+  * Formats one record as a line of output; the caller holds flush_lock
+  */
+ static void render(const log_record_t *rec) {
+     int json = (out_format == LOG_FORMAT_JSON);
+     char ts[48];
+     struct tm tm;
+     time_t secs = rec->time_ns / 1000000000;
+
+     gmtime_r(&secs, &tm);
+     size_t n = strftime(ts, sizeof(ts), "%Y-%m-%dT%H:%M:%S", &tm);
+     snprintf(ts + n, sizeof(ts) - n, ".%03dZ", (int)(rec->time_ns / 1000000 % 1000));
+
+     out_put(json ? "{\"ts\":\"" : "ts=", json ? 7 : 3);
+     out_put(ts, strlen(ts));
+     out_put(json ? "\",\"level\":\"" : " level=", json ? 11 : 7);
+     out_put(level_names[rec->level], strlen(level_names[rec->level]));
+     out_put(json ? "\",\"msg\":" : " msg=", json ? 8 : 5);
+     out_value(rec->data, json);
+
+     size_t pos = strlen(rec->data) + 1;
+     while (pos < rec->len) {
+         const char *key = rec->data + pos;
+         pos += strlen(key) + 1;
+         if (pos >= rec->len) {
+             break;
+         }
+         int quote = json && rec->data[pos] != 'n';
+         const char *value = rec->data + pos + 1;
+         pos += strlen(value) + 2;
+
+         out_put(json ? ",\"" : " ", json ? 2 : 1);
+         out_put(key, strlen(key));
+         out_put(json ? "\":" : "=", json ? 2 : 1);
+         out_value(value, quote);
+     }
+
+     out_put(json ? "}\n" : "\n", json ? 2 : 1);
+ }
+
+ /**
+  * Writes the formatted output to stdout; the caller holds flush_lock
+  */
+ static void write_out(void) {
+     if (out_len > 0) {
+         fwrite(out, 1, out_len, stdout);
+         fflush(stdout);
+         out_len = 0;
+     }
+ }
+
+ /**
+  * Formats every queued record, frees retired rings, then writes
+  */
+ static void drain(void) {
+     pthread_mutex_lock(&flush_lock);
+     pthread_mutex_lock(&rings_lock);
+
+     uint64_t dropped = retired_dropped + atomic_load(&unqueued_dropped);
+     ring_t **link = &rings;
+     while (*link != NULL) {
+         ring_t *r = *link;
+
+         // Read retired first: a retired thread's records are all visible
+         int retired = atomic_load_explicit(&r->retired, memory_order_acquire);
+         size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+         size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+         for (; tail != head; tail++) {
+             render(&r->slots[tail % LOG_RING_SLOTS]);
+         }
+         atomic_store_explicit(&r->tail, tail, memory_order_release);
+
+         uint64_t ring_dropped = atomic_load_explicit(&r->dropped, memory_order_relaxed);
+         dropped += ring_dropped;
+         if (retired) {
+             retired_dropped += ring_dropped;
+             *link = r->next;
+             free(r);
+             atomic_fetch_sub(&ring_count, 1);
+         } else {
+             link = &r->next;
+         }
+     }
+
+     pthread_mutex_unlock(&rings_lock);
+
+     if (dropped > dropped_reported) {
+         log_record_t rec;
+         make_record(&rec, LOG_LEVEL_WARN, "Log records dropped", "count=%llu total=%llu",
+                     (unsigned long long)(dropped - dropped_reported), (unsigned long long)dropped);
+         render(&rec);
+         dropped_reported = dropped;
+     }
+
+     // Only the flusher waits for a slow stdout
+     write_out();
+     pthread_mutex_unlock(&flush_lock);
+ }
+
+ static void *flush_thread(void *arg) {
+     struct timespec interval = { 0, LOG_FLUSH_INTERVAL_MS * 1000000L };
+     (void)arg;
+
+     while (1) {
+         nanosleep(&interval, NULL);
+         drain();
+     }
+
+     return NULL;
+ }
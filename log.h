@@ -0,0 +1,43 @@
+/**
+ * Logging for the File Transfer Server
+ *
+ * Structured log lines, written by a background thread so a slow stdout
+ * never holds up a transfer. Each thread queues its records in its own
+ * ring; when a ring is full the record is dropped and counted rather than
+ * making the caller wait.
+ *
+ * Fields are given as a printf-style format of space-separated key=value
+ * pairs, e.g. log_event(LOG_LEVEL_INFO, "Connection closed",
+ * "client=%s:%d", ip, port). Values may use %s, %c, %d, %i, %u, %x, %g
+ * and %p, with the l, ll and z length modifiers; a value may mix them
+ * with literal text, but not with spaces.
+ */
+
+ #ifndef LOG_H
+ #define LOG_H
+
+ #include <stdint.h>
+
+ #define LOG_LEVEL_DEBUG 0
+ #define LOG_LEVEL_INFO 1
+ #define LOG_LEVEL_WARN 2
+ #define LOG_LEVEL_ERROR 3
+
+ #define LOG_FORMAT_LOGFMT 0
+ #define LOG_FORMAT_JSON 1
+
+ #define LOG_RING_SLOTS 64            // Records each thread can have queued
+ #define LOG_RECORD_SIZE 512          // Longer records are truncated
+ #define LOG_MAX_RINGS 1024           // Threads past this many drop their records
+ #define LOG_FLUSH_INTERVAL_MS 20
+
+ int log_parse_level(const char *name);
+ int log_parse_format(const char *name);
+ int log_start(int level, int format);
+ void log_set_level(int level);
+ void log_flush(void);
+ uint64_t log_dropped(void);
+ void log_event(int level, const char *msg, const char *fields, ...)
+     __attribute__((format(printf, 3, 4)));
+
+ #endif
@@ -0,0 +1,482 @@
+/**
+ * Metrics for the File Transfer Server
+ *
+ * Histograms are log-linear in the style of HdrHistogram: each power of
+ * two is split into HIST_SUB_BUCKETS equal buckets, so any value is kept
+ * to within 12.5% at a fixed, small cost in memory. Exported histograms
+ * use power-of-two bucket bounds; the quantiles exported next to them use
+ * the full resolution.
+ *
+ * A thread's shard is created the first time it records something. Only
+ * that thread writes to it (relaxed loads and stores are enough, since
+ * there is a single writer), and the exporter reads it. When the thread
+ * exits its totals are folded into a retired shard, so counts survive the
+ * short-lived threads of the thread-per-connection engine.
+ */
+
+ #include <stdio.h>
+ #include <stdlib.h>
+ #include <string.h>
+ #include <unistd.h>
+ #include <errno.h>
+ #include <time.h>
+ #include <pthread.h>
+ #include <stdatomic.h>
+ #include <sys/socket.h>
+ #include <sys/un.h>
+ #include <netinet/in.h>
+
+ #include "metrics.h"
+ #include "pool.h"
+ #include "cache.h"
+ #include "protocol.h"
+ #include "log.h"
+
+ #define HIST_SUB_BITS 3
+ #define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+ #define HIST_MAX_BITS 40             // Larger values are counted in the last bucket
+ #define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 2) * HIST_SUB_BUCKETS)
+ #define METRICS_REQUEST_SIZE 1024
+
+ typedef struct {
+     atomic_uint_fast64_t buckets[HIST_BUCKETS];
+     atomic_uint_fast64_t count;
+     atomic_uint_fast64_t sum;
+ } histogram_t;
+
+ typedef struct shard {
+     atomic_uint_fast64_t counters[METRIC_COUNTERS];
+     histogram_t histograms[METRIC_HISTOGRAMS];
+     struct shard *prev;
+     struct shard *next;
+ } shard_t;
+
+ // What each counter and histogram is called when exported
+ static const struct {
+     const char *name;
+     const char *help;
+ } counter_info[METRIC_COUNTERS] = {
+     { "ft_connections_total", "Connections accepted" },
+     { "ft_auth_failures_total", "Logins refused" },
+     { "ft_uploads_total", "Files stored" },
+     { "ft_upload_failures_total", "Uploads that failed after they started" },
+     { "ft_received_bytes_total", "File bytes stored by uploads" },
+     { "ft_downloads_total", "Files sent" },
+     { "ft_sent_bytes_total", "File bytes sent by downloads" },
+     { "ft_sync_batches_total", "Group commits of uploads made durable together" },
+     { "ft_token_logins_total", "Logins proven by a session token instead of a password" },
+     { "ft_throttles_total", "Times a transfer paused to stay within its bandwidth quota" },
+ };
+
+ static const char *stage_names[METRIC_HISTOGRAMS] = {
+     "accept", "auth", "nss", "lock_wait", "receive", "fsync", "publish", NULL,
+ };
+
+ static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+ // Every live shard, plus the totals of threads that have exited
+ static shard_t *shards;
+ static shard_t retired;
+ static pthread_mutex_t shards_lock = PTHREAD_MUTEX_INITIALIZER;
+ static pthread_key_t shard_key;
+ static pthread_once_t shard_key_once = PTHREAD_ONCE_INIT;
+ static __thread shard_t *my_shard;
+
+ static int listen_fd = -1;
+
+ static void create_shard_key(void);
+ static shard_t *get_shard(void);
+ static void retire_shard(void *arg);
+ static void add_shard(shard_t *into, const shard_t *from);
+ static void bump(atomic_uint_fast64_t *v, uint64_t n);
+ static int bucket_of(uint64_t value);
+ static uint64_t bucket_upper(int bucket);
+ static void write_histogram(FILE *out, const histogram_t *h, const char *name, const char *stage,
+                             double scale, int first_bit, int last_bit);
+ static void write_quantiles(FILE *out, const histogram_t *h, const char *stage);
+ static char *render(size_t *len);
+ static void *metrics_thread(void *arg);
+
+ /**
+  * Microseconds on the monotonic clock
+  */
+ uint64_t metrics_now_us(void) {
+     struct timespec ts;
+     clock_gettime(CLOCK_MONOTONIC, &ts);
+     return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+ }
+
+ void metrics_count(int counter, uint64_t n) {
+     shard_t *s = get_shard();
+     if (s != NULL) {
+         bump(&s->counters[counter], n);
+     }
+ }
+
+ void metrics_record(int histogram, uint64_t value) {
+     shard_t *s = get_shard();
+     if (s == NULL) {
+         return;
+     }
+
+     histogram_t *h = &s->histograms[histogram];
+     bump(&h->buckets[bucket_of(value)], 1);
+     bump(&h->count, 1);
+     bump(&h->sum, value);
+ }
+
+ /**
+  * Records the time since start_us, as returned by metrics_now_us()
+  */
+ void metrics_since(int histogram, uint64_t start_us) {
+     metrics_record(histogram, metrics_now_us() - start_us);
+ }
+
+ /**
+  * Starts serving metrics on a TCP port, or on a Unix socket if given a path
+  */
+ int metrics_start(const char *listen_on) {
+     pthread_t thread_id;
+
+     if (listen_on[0] == '/') {
+         struct sockaddr_un address = { .sun_family = AF_UNIX };
+         if (strlen(listen_on) >= sizeof(address.sun_path)) {
+             fprintf(stderr, "Metrics socket path too long: %s\n", listen_on);
+             return -1;
+         }
+         strcpy(address.sun_path, listen_on);
+         unlink(listen_on);
+
+         listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+         if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+             perror("Metrics socket failed");
+             return -1;
+         }
+     } else {
+         struct sockaddr_in address = {
+             .sin_family = AF_INET,
+             .sin_addr.s_addr = htonl(INADDR_ANY),
+             .sin_port = htons(atoi(listen_on)),
+         };
+         int opt = 1;
+
+         // SO_REUSEPORT lets a server taking over in an upgrade bind while this one drains
+         listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+         if (listen_fd < 0 || setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0 ||
+             setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0 ||
+             bind(listen_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+             perror("Metrics socket failed");
+             return -1;
+         }
+     }
+
+     if (listen(listen_fd, 16) < 0 || pthread_create(&thread_id, NULL, metrics_thread, NULL) != 0) {
+         perror("Metrics listener failed");
+         return -1;
+     }
+
+     pthread_detach(thread_id);
+     printf("Metrics served on %s\n", listen_on);
+     return 0;
+ }
+
+ static void create_shard_key(void) {
+     pthread_key_create(&shard_key, retire_shard);
+ }
+
+ /**
+  * The calling thread's shard, created on first use
+  */
+ static shard_t *get_shard(void) {
+     if (my_shard != NULL) {
+         return my_shard;
+     }
+
+     pthread_once(&shard_key_once, create_shard_key);
+     shard_t *s = calloc(1, sizeof(*s));
+     if (s == NULL) {
+         return NULL;
+     }
+
+     pthread_mutex_lock(&shards_lock);
+     s->next = shards;
+     if (shards != NULL) {
+         shards->prev = s;
+     }
+     shards = s;
+     pthread_mutex_unlock(&shards_lock);
+
+     pthread_setspecific(shard_key, s);
+     my_shard = s;
+     return s;
+ }
+
+ /**
+  * Thread exit: keeps the shard's totals and frees it
+  */
+ static void retire_shard(void *arg) {
+     shard_t *s = arg;
+
+     pthread_mutex_lock(&shards_lock);
+     add_shard(&retired, s);
+     if (s->prev != NULL) {
+         s->prev->next = s->next;
+     } else {
+         shards = s->next;
+     }
+     if (s->next != NULL) {
+         s->next->prev = s->prev;
+     }
+     pthread_mutex_unlock(&shards_lock);
+
+     my_shard = NULL;
+     free(s);
+ }
+
+ /**
+  * Adds one shard's totals to another; the caller holds shards_lock
+  */
+ static void add_shard(shard_t *into, const shard_t *from) {
+     for (int i = 0; i < METRIC_COUNTERS; i++) {
+         bump(&into->counters[i], atomic_load_explicit(&from->counters[i], memory_order_relaxed));
+     }
+
+     for (int i = 0; i < METRIC_HISTOGRAMS; i++) {
+         histogram_t *h = &into->histograms[i];
+         const histogram_t *f = &from->histograms[i];
+
+         for (int b = 0; b < HIST_BUCKETS; b++) {
+             uint64_t n = atomic_load_explicit(&f->buckets[b], memory_order_relaxed);
+             if (n > 0) {
+                 bump(&h->buckets[b], n);
+             }
+         }
+         bump(&h->count, atomic_load_explicit(&f->count, memory_order_relaxed));
+         bump(&h->sum, atomic_load_explicit(&f->sum, memory_order_relaxed));
+     }
+ }
+
+ /**
+  * Adds to a value only this thread writes; readers may see it at any time
+  */
+ static void bump(atomic_uint_fast64_t *v, uint64_t n) {
+     atomic_store_explicit(v, atomic_load_explicit(v, memory_order_relaxed) + n, memory_order_relaxed);
+ }
+
+ /**
+  * The histogram bucket a value falls in
+  */
+ static int bucket_of(uint64_t value) {
+     if (value < HIST_SUB_BUCKETS) {
+         return (int)value;
+     }
+
+     int bits = 63 - __builtin_clzll(value);
+     if (bits > HIST_MAX_BITS) {
+         return HIST_BUCKETS - 1;
+     }
+
+     int sub = (value >> (bits - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1);
+     return (bits - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS + sub;
+ }
+
+ /**
+  * First value past the end of a bucket
+  */
+ static uint64_t bucket_upper(int bucket) {
+     if (bucket < HIST_SUB_BUCKETS) {
+         return bucket + 1;
+     }
+
+     int bits = bucket / HIST_SUB_BUCKETS + HIST_SUB_BITS - 1;
+     int sub = bucket % HIST_SUB_BUCKETS;
+     return ((uint64_t)(HIST_SUB_BUCKETS + sub + 1)) << (bits - HIST_SUB_BITS);
+ }
+
+ /**
+  * Writes a histogram with a bucket bound at each power of two in range
+  */
+ static void write_histogram(FILE *out, const histogram_t *h, const char *name, const char *stage,
+                             double scale, int first_bit, int last_bit) {
+     char stage_label[48] = "";   // With a trailing comma, to go in front of le
+     char labels[48] = "";
+     uint64_t count = atomic_load_explicit(&h->count, memory_order_relaxed);
+     uint64_t cumulative = 0;
+     int b = 0;
+
+     if (stage != NULL) {
+         snprintf(stage_label, sizeof(stage_label), "stage=\"%s\",", stage);
+         snprintf(labels, sizeof(labels), "{stage=\"%s\"}", stage);
+     }
+
+     for (int bit = first_bit; bit <= last_bit; bit++) {
+         uint64_t bound = 1ULL << bit;
+         while (b < HIST_BUCKETS && bucket_upper(b) <= bound) {
+             cumulative += atomic_load_explicit(&h->buckets[b++], memory_order_relaxed);
+         }
+         fprintf(out, "%s_bucket{%sle=\"%.12g\"} %llu\n", name, stage_label, bound * scale,
+                 (unsigned long long)cumulative);
+     }
+
+     fprintf(out, "%s_bucket{%sle=\"+Inf\"} %llu\n", name, stage_label, (unsigned long long)count);
+     fprintf(out, "%s_sum%s %g\n", name, labels, atomic_load_explicit(&h->sum, memory_order_relaxed) * scale);
+     fprintf(out, "%s_count%s %llu\n", name, labels, (unsigned long long)count);
+ }
+
+ /**
+  * Writes the quantiles of a duration histogram, read at full resolution
+  */
+ static void write_quantiles(FILE *out, const histogram_t *h, const char *stage) {
+     uint64_t count = atomic_load_explicit(&h->count, memory_order_relaxed);
+
+     for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+         uint64_t rank = (uint64_t)(quantiles[q] * count);
+         uint64_t seen = 0;
+         double value = 0;
+
+         for (int b = 0; b < HIST_BUCKETS && count > 0; b++) {
+             seen += atomic_load_explicit(&h->buckets[b], memory_order_relaxed);
+             if (seen > rank) {
+                 value = bucket_upper(b) / 1e6;
+                 break;
+             }
+         }
+
+         fprintf(out, "ft_stage_duration_quantile_seconds{stage=\"%s\",quantile=\"%g\"} %g\n",
+                 stage, quantiles[q], value);
+     }
+ }
+
+ /**
+  * Formats every metric in the Prometheus text format
+  */
+ static char *render(size_t *len) {
+     char *text = NULL;
+     FILE *out = open_memstream(&text, len);
+     if (out == NULL) {
+         return NULL;
+     }
+
+     // Add up the shards into one snapshot
+     shard_t *total = calloc(1, sizeof(*total));
+     if (total == NULL) {
+         fclose(out);
+         free(text);
+         return NULL;
+     }
+     pthread_mutex_lock(&shards_lock);
+     add_shard(total, &retired);
+     for (shard_t *s = shards; s != NULL; s = s->next) {
+         add_shard(total, s);
+     }
+     pthread_mutex_unlock(&shards_lock);
+
+     for (int i = 0; i < METRIC_COUNTERS; i++) {
+         fprintf(out, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", counter_info[i].name,
+                 counter_info[i].help, counter_info[i].name, counter_info[i].name,
+                 (unsigned long long)atomic_load(&total->counters[i]));
+     }
+
+     fprintf(out, "# HELP ft_stage_duration_seconds Time spent in each stage of serving uploads\n"
+                  "# TYPE ft_stage_duration_seconds histogram\n");
+     for (int i = 0; i < METRIC_HISTOGRAMS; i++) {
+         if (stage_names[i] != NULL) {
+             write_histogram(out, &total->histograms[i], "ft_stage_duration_seconds", stage_names[i],
+                             1e-6, 0, 36);
+         }
+     }
+
+     fprintf(out, "# HELP ft_stage_duration_quantile_seconds Stage duration quantiles\n"
+                  "# TYPE ft_stage_duration_quantile_seconds gauge\n");
+     for (int i = 0; i < METRIC_HISTOGRAMS; i++) {
+         if (stage_names[i] != NULL) {
+             write_quantiles(out, &total->histograms[i], stage_names[i]);
+         }
+     }
+
+     fprintf(out, "# HELP ft_receive_throughput_bytes_per_second Throughput of each upload\n"
+                  "# TYPE ft_receive_throughput_bytes_per_second histogram\n");
+     write_histogram(out, &total->histograms[METRIC_THROUGHPUT], "ft_receive_throughput_bytes_per_second",
+                     NULL, 1, 10, HIST_MAX_BITS);
+
+     fprintf(out, "# HELP ft_log_dropped_total Log records dropped because a thread's buffer was full\n"
+                  "# TYPE ft_log_dropped_total counter\nft_log_dropped_total %llu\n",
+             (unsigned long long)log_dropped());
+
+     // Admission statistics, when the worker pool is the engine
+     pool_stats_t pool;
+     pool_get_stats(&pool);
+     if (pool.capacity > 0) {
+         fprintf(out, "# TYPE ft_pool_queue_depth gauge\nft_pool_queue_depth %u\n"
+                      "# TYPE ft_pool_queue_capacity gauge\nft_pool_queue_capacity %u\n"
+                      "# TYPE ft_pool_rejected_total counter\nft_pool_rejected_total %llu\n",
+                 pool.depth, pool.capacity, (unsigned long long)pool.rejected);
+     }
+
+     cache_stats_t cache;
+     cache_get_stats(&cache);
+     fprintf(out, "# HELP ft_cache_hits_total Downloads served from the file cache\n"
+                  "# TYPE ft_cache_hits_total counter\nft_cache_hits_total %llu\n"
+                  "# HELP ft_cache_misses_total Downloads that had to open the file\n"
+                  "# TYPE ft_cache_misses_total counter\nft_cache_misses_total %llu\n"
+                  "# TYPE ft_cache_bytes gauge\nft_cache_bytes %llu\n"
+                  "# TYPE ft_cache_capacity_bytes gauge\nft_cache_capacity_bytes %llu\n"
+                  "# TYPE ft_cache_entries gauge\nft_cache_entries %u\n",
+             (unsigned long long)cache.hits, (unsigned long long)cache.misses,
+             (unsigned long long)cache.bytes, (unsigned long long)cache.capacity, cache.entries);
+
+     free(total);
+     fclose(out);
+     return text;
+ }
+
+ /**
+  * Answers each HTTP request for /metrics, one connection at a time
+  */
+ static void *metrics_thread(void *arg) {
+     char request[METRICS_REQUEST_SIZE];
+     char header[256];
+     (void)arg;
+
+     while (1) {
+         int sock = accept(listen_fd, NULL, NULL);
+         if (sock < 0) {
+             if (errno != EINTR) {
+                 log_event(LOG_LEVEL_ERROR, "Metrics accept failed", "error=%s", strerror(errno));
+             }
+             continue;
+         }
+
+         // A scraper that never sends its request mustn't hold up the next one
+         struct timeval timeout = { .tv_sec = 5 };
+         setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+         setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+         ssize_t n = recv(sock, request, sizeof(request) - 1, 0);
+         request[(n > 0) ? n : 0] = '\0';
+
+         size_t len = 0;
+         char *body = NULL;
+         if (strncmp(request, "GET /metrics", 12) == 0 || strncmp(request, "GET / ", 6) == 0) {
+             body = render(&len);
+         }
+
+         if (body != NULL) {
+             int header_len = snprintf(header, sizeof(header),
+                                       "HTTP/1.0 200 OK\r\n"
+                                       "Content-Type: text/plain; version=0.0.4\r\n"
+                                       "Content-Length: %zu\r\n\r\n", len);
+             if (ft_send_all(sock, header, header_len) == 0) {
+                 ft_send_all(sock, body, len);
+             }
+             free(body);
+         } else {
+             const char *not_found = "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+             ft_send_all(sock, not_found, strlen(not_found));
+         }
+
+         close(sock);
+     }
+
+     return NULL;
+ }
@@ -0,0 +1,48 @@
+/**
+ * Metrics for the File Transfer Server
+ *
+ * Counters and latency histograms for each stage of serving an upload,
+ * exported in the Prometheus text format over HTTP on a TCP port or a
+ * Unix socket. Every thread records into its own shard, so the hot paths
+ * never take a lock or share a cache line; the exporter adds the shards
+ * up when it is scraped.
+ */
+
+ #ifndef METRICS_H
+ #define METRICS_H
+
+ #include <stdint.h>
+
+ // Counters
+ #define METRIC_CONNECTIONS 0
+ #define METRIC_AUTH_FAILURES 1
+ #define METRIC_UPLOADS 2
+ #define METRIC_UPLOAD_FAILURES 3
+ #define METRIC_BYTES_RECEIVED 4
+ #define METRIC_DOWNLOADS 5
+ #define METRIC_BYTES_SENT 6
+ #define METRIC_SYNC_BATCHES 7        // Group commits made
+ #define METRIC_TOKEN_LOGINS 8        // Logins that skipped the password check with a session token
+ #define METRIC_THROTTLES 9           // Times a transfer had to wait for its rate quota
+ #define METRIC_COUNTERS 10
+
+ // Histograms; all but METRIC_THROUGHPUT are durations in microseconds
+ #define METRIC_ACCEPT 0              // From accept() to a thread taking the connection on
+ #define METRIC_AUTH 1                // Whole login check, password hash included
+ #define METRIC_NSS 2                 // NSS lookups behind a cache miss
+ #define METRIC_LOCK_WAIT 3           // Waiting for the file's publish lock
+ #define METRIC_RECEIVE 4             // From opening an upload to its last byte
+ #define METRIC_FSYNC 5               // Syncing a file or directory, or a whole group commit
+ #define METRIC_PUBLISH 6             // Owner record and renames
+ #define METRIC_THROUGHPUT 7          // Bytes per second of each upload
+ #define METRIC_HISTOGRAMS 8
+
+ #define METRICS_DEFAULT_PORT 9464
+
+ uint64_t metrics_now_us(void);
+ void metrics_count(int counter, uint64_t n);
+ void metrics_record(int histogram, uint64_t value);
+ void metrics_since(int histogram, uint64_t start_us);
+ int metrics_start(const char *listen_on);
+
+ #endif
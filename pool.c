@@ -0,0 +1,330 @@
+/**
+ * Worker Pool for the File Transfer Server
+ *
+ * The acceptor pushes sockets into a bounded multi-producer multi-consumer
+ * ring (Dmitry Vyukov's design): every slot carries a sequence number that
+ * tells producers and consumers whether it is free, full, or still being
+ * written, so neither side ever takes a lock. A semaphore counts published
+ * slots so idle workers sleep instead of spinning.
+ */
+
+ #include <stdio.h>
+ #include <stdlib.h>
+ #include <string.h>
+ #include <unistd.h>
+ #include <errno.h>
+ #include <time.h>
+ #include <poll.h>
+ #include <pthread.h>
+ #include <semaphore.h>
+ #include <stdatomic.h>
+ #include <sys/socket.h>
+
+ #include "pool.h"
+ #include "session.h"
+ #include "metrics.h"
+ #include "log.h"
+ #include "upgrade.h"
+
+ typedef struct {
+     atomic_size_t sequence;
+     int sock;
+     struct sockaddr_in address;
+     uint64_t enqueued_us;
+ } pool_slot_t;
+
+ static pool_slot_t *slots;
+ static size_t slot_mask;
+ static atomic_size_t enqueue_pos;
+ static atomic_size_t dequeue_pos;
+ static sem_t ready;
+ static pool_handler_t pool_handler;
+ static atomic_int workers_running;
+ static atomic_int workers_wanted;
+
+ // Statistics, updated without locks
+ static atomic_uint_fast64_t accepted;
+ static atomic_uint_fast64_t rejected;
+ static atomic_uint_fast64_t wait_count;
+ static atomic_uint_fast64_t wait_total_us;
+ static atomic_uint_fast64_t wait_max_us;
+
+ static int pool_push(int sock, const struct sockaddr_in *address);
+ static int pool_pop(int *sock, struct sockaddr_in *address, uint64_t *enqueued_us);
+ static void *pool_worker(void *arg);
+ static int pool_retire(void);
+ static void pool_log_stats(void);
+ static uint64_t monotonic_us(void);
+
+ /**
+  * Accepts connections on listen_fd and serves them on a fixed set of workers
+  *
+  * Only returns if the pool could not be started.
+  */
+ int pool_run(int listen_fd, int workers, int queue_depth, pool_handler_t handler) {
+     // The slot sequence numbers need at least two slots to tell a full slot from a free one
+     size_t capacity = 2;
+     while (capacity < (size_t)queue_depth) {
+         capacity <<= 1;
+     }
+
+     slots = calloc(capacity, sizeof(pool_slot_t));
+     if (slots == NULL) {
+         perror("Failed to allocate connection queue");
+         return -1;
+     }
+
+     slot_mask = capacity - 1;
+     for (size_t i = 0; i < capacity; i++) {
+         atomic_init(&slots[i].sequence, i);
+     }
+     pool_handler = handler;
+     sem_init(&ready, 0, 0);
+
+     if (pool_set_workers(workers) != 0) {
+         return -1;
+     }
+
+     printf("Worker pool: %d workers, queue depth %zu\n", workers, capacity);
+     printf("Waiting for connections...\n");
+
+     time_t next_report = time(NULL) + POOL_STATS_INTERVAL;
+     uint64_t reported = 0;
+
+     while (1) {
+         // Wake up now and then so statistics get logged on a quiet server too
+         struct pollfd pfd = { .fd = listen_fd, .events = POLLIN };
+         int ready_fds = poll(&pfd, 1, 1000);
+
+         if (time(NULL) >= next_report) {
+             uint64_t seen = atomic_load(&accepted) + atomic_load(&rejected);
+             if (seen != reported) {
+                 pool_log_stats();
+                 reported = seen;
+             }
+             next_report = time(NULL) + POOL_STATS_INTERVAL;
+         }
+
+         // Once a new server has taken over, the workers only finish what is queued
+         if (upgrade_draining()) {
+             upgrade_release(listen_fd);
+             upgrade_wait();
+         }
+
+         if (ready_fds <= 0) {
+             continue;
+         }
+
+         struct sockaddr_in address;
+         socklen_t addrlen = sizeof(address);
+         int client_sock = accept(listen_fd, (struct sockaddr *)&address, &addrlen);
+         if (client_sock < 0) {
+             if (errno != EINTR && errno != EAGAIN) {
+                 log_event(LOG_LEVEL_ERROR, "Accept failed", "error=%s", strerror(errno));
+             }
+             continue;
+         }
+
+         if (pool_push(client_sock, &address) != 0) {
+             // Turn the client away now rather than let it queue behind the backlog
+             atomic_fetch_add(&rejected, 1);
+             conn_reject_busy(client_sock, POOL_RETRY_AFTER_MS);
+             close(client_sock);
+             continue;
+         }
+
+         atomic_fetch_add(&accepted, 1);
+         sem_post(&ready);
+     }
+
+     return 0;
+ }
+
+ /**
+  * Grows or shrinks the pool to the given number of workers
+  *
+  * A surplus worker leaves within a second if it's idle, or once its
+  * connection closes. Before pool_run() the number is only remembered.
+  */
+ int pool_set_workers(int workers) {
+     atomic_store(&workers_wanted, workers);
+     if (slots == NULL) {
+         return 0;
+     }
+
+     while (atomic_load(&workers_running) < workers) {
+         pthread_t thread_id;
+         atomic_fetch_add(&workers_running, 1);
+         int err = pthread_create(&thread_id, NULL, pool_worker, NULL);
+         if (err != 0) {
+             atomic_fetch_sub(&workers_running, 1);
+             log_event(LOG_LEVEL_ERROR, "Thread creation failed", "error=%s", strerror(err));
+             return -1;
+         }
+         pthread_detach(thread_id);
+     }
+     return 0;
+ }
+
+ /**
+  * Copies the current statistics into stats
+  */
+ void pool_get_stats(pool_stats_t *stats) {
+     size_t head = atomic_load(&dequeue_pos);
+     size_t tail = atomic_load(&enqueue_pos);
+
+     stats->accepted = atomic_load(&accepted);
+     stats->rejected = atomic_load(&rejected);
+     stats->wait_count = atomic_load(&wait_count);
+     stats->wait_total_us = atomic_load(&wait_total_us);
+     stats->wait_max_us = atomic_load(&wait_max_us);
+     stats->depth = (tail > head) ? tail - head : 0;
+     stats->capacity = (slots != NULL) ? slot_mask + 1 : 0;
+ }
+
+ /**
+  * Adds a socket to the queue
+  *
+  * Returns -1 if the queue is full.
+  */
+ static int pool_push(int sock, const struct sockaddr_in *address) {
+     size_t pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+     pool_slot_t *slot;
+
+     while (1) {
+         slot = &slots[pos & slot_mask];
+         size_t seq = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+         intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+         if (diff == 0) {
+             // Slot is free; claim it
+             if (atomic_compare_exchange_weak_explicit(&enqueue_pos, &pos, pos + 1,
+                                                       memory_order_relaxed, memory_order_relaxed)) {
+                 break;
+             }
+         } else if (diff < 0) {
+             // Slot still holds an item from the previous lap
+             return -1;
+         } else {
+             pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+         }
+     }
+
+     slot->sock = sock;
+     slot->address = *address;
+     slot->enqueued_us = monotonic_us();
+     atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+     return 0;
+ }
+
+ /**
+  * Takes the oldest socket off the queue, waiting up to a second for one
+  *
+  * Returns -1 if none came, so the worker can see whether it's surplus.
+  */
+ static int pool_pop(int *sock, struct sockaddr_in *address, uint64_t *enqueued_us) {
+     struct timespec deadline;
+     clock_gettime(CLOCK_REALTIME, &deadline);
+     deadline.tv_sec++;
+
+     while (sem_timedwait(&ready, &deadline) != 0) {
+         if (errno != EINTR) {
+             return -1;
+         }
+     }
+
+     size_t pos = atomic_load_explicit(&dequeue_pos, memory_order_relaxed);
+     pool_slot_t *slot;
+
+     while (1) {
+         slot = &slots[pos & slot_mask];
+         size_t seq = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+         intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+         if (diff == 0) {
+             if (atomic_compare_exchange_weak_explicit(&dequeue_pos, &pos, pos + 1,
+                                                       memory_order_relaxed, memory_order_relaxed)) {
+                 break;
+             }
+         } else {
+             // Another worker got there first, or the item is still being published
+             pos = atomic_load_explicit(&dequeue_pos, memory_order_relaxed);
+         }
+     }
+
+     *sock = slot->sock;
+     *address = slot->address;
+     *enqueued_us = slot->enqueued_us;
+     atomic_store_explicit(&slot->sequence, pos + slot_mask + 1, memory_order_release);
+     return 0;
+ }
+
+ /**
+  * Worker thread: serves queued connections one at a time
+  */
+ static void *pool_worker(void *arg) {
+     (void)arg;
+
+     while (!pool_retire()) {
+         int sock;
+         struct sockaddr_in address;
+         uint64_t enqueued_us;
+
+         if (pool_pop(&sock, &address, &enqueued_us) != 0) {
+             continue;
+         }
+
+         // Record how long the connection sat in the queue
+         uint64_t waited = monotonic_us() - enqueued_us;
+         metrics_record(METRIC_ACCEPT, waited);
+         atomic_fetch_add(&wait_count, 1);
+         atomic_fetch_add(&wait_total_us, waited);
+         uint64_t max = atomic_load(&wait_max_us);
+         while (waited > max && !atomic_compare_exchange_weak(&wait_max_us, &max, waited)) {
+             // max now holds the latest value; try again
+         }
+
+         pool_handler(sock, &address);
+     }
+
+     return NULL;
+ }
+
+ /**
+  * Leaves the pool if it has more workers than it should; returns 1 if
+  * the caller is to exit
+  */
+ static int pool_retire(void) {
+     int running = atomic_load(&workers_running);
+     while (running > atomic_load(&workers_wanted)) {
+         if (atomic_compare_exchange_weak(&workers_running, &running, running - 1)) {
+             return 1;
+         }
+     }
+     return 0;
+ }
+
+ /**
+  * Logs a one-line summary of the pool statistics
+  */
+ static void pool_log_stats(void) {
+     pool_stats_t stats;
+     pool_get_stats(&stats);
+
+     double avg_ms = (stats.wait_count > 0) ?
+         (double)stats.wait_total_us / stats.wait_count / 1000.0 : 0.0;
+
+     log_event(LOG_LEVEL_INFO, "Pool statistics",
+               "connections=%llu rejected=%llu queued=%u capacity=%u wait_avg_ms=%g wait_max_ms=%g",
+               (unsigned long long)stats.accepted, (unsigned long long)stats.rejected,
+               stats.depth, stats.capacity, avg_ms, stats.wait_max_us / 1000.0);
+ }
+
+ /**
+  * Microseconds on the monotonic clock
+  */
+ static uint64_t monotonic_us(void) {
+     struct timespec ts;
+     clock_gettime(CLOCK_MONOTONIC, &ts);
+     return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+ }
@@ -0,0 +1,38 @@
+/**
+ * Worker Pool for the File Transfer Server
+ *
+ * A fixed set of worker threads fed accepted sockets through a bounded
+ * lock-free MPMC queue. When the queue is full new connections are turned
+ * away at once with a "server busy" reply instead of waiting behind the
+ * backlog, so latency stays bounded under overload.
+ */
+
+ #ifndef POOL_H
+ #define POOL_H
+
+ #include <stdint.h>
+ #include <netinet/in.h>
+
+ #define POOL_DEFAULT_WORKERS 16
+ #define POOL_DEFAULT_QUEUE_DEPTH 256
+ #define POOL_RETRY_AFTER_MS 1000   // Suggested back-off sent with busy replies
+ #define POOL_STATS_INTERVAL 60     // Seconds between queue statistics log lines
+
+ // Snapshot of the pool's admission statistics
+ typedef struct {
+     uint64_t accepted;
+     uint64_t rejected;
+     uint64_t wait_count;          // Connections that have left the queue
+     uint64_t wait_total_us;
+     uint64_t wait_max_us;
+     unsigned depth;               // Connections queued right now
+     unsigned capacity;            // 0 when the pool isn't the engine
+ } pool_stats_t;
+
+ typedef void (*pool_handler_t)(int sock, const struct sockaddr_in *address);
+
+ int pool_run(int listen_fd, int workers, int queue_depth, pool_handler_t handler);
+ int pool_set_workers(int workers);
+ void pool_get_stats(pool_stats_t *stats);
+
+ #endif
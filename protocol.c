@@ -0,0 +1,267 @@
+/**
+ * Wire Protocol for the File Transfer System
+ *
+ * Framing helpers shared by the client and the server. See protocol.h for
+ * the frame layout.
+ */
+
+ #include <string.h>
+ #include <errno.h>
+ #include <sys/types.h>
+ #include <sys/socket.h>
+ #include <sys/uio.h>
+ #include <arpa/inet.h>
+
+ #include "protocol.h"
+ #include "tls.h"
+
+ /**
+  * Serialises a frame header into its 16-byte wire form
+  */
+ void ft_encode_header(const ft_header_t *hdr, uint8_t raw[FT_HEADER_SIZE]) {
+     uint16_t magic = htons(hdr->magic);
+     uint16_t flags = htons(hdr->flags);
+     uint16_t reserved = htons(hdr->reserved);
+     uint32_t request_id = htonl(hdr->request_id);
+     uint32_t length = htonl(hdr->length);
+
+     memcpy(raw, &magic, 2);
+     raw[2] = hdr->version;
+     raw[3] = hdr->type;
+     memcpy(raw + 4, &flags, 2);
+     memcpy(raw + 6, &reserved, 2);
+     memcpy(raw + 8, &request_id, 4);
+     memcpy(raw + 12, &length, 4);
+ }
+
+ /**
+  * Parses a 16-byte wire header, rejecting bad magic or unknown versions
+  */
+ int ft_decode_header(const uint8_t raw[FT_HEADER_SIZE], ft_header_t *hdr) {
+     uint16_t magic, flags, reserved;
+     uint32_t request_id, length;
+
+     memcpy(&magic, raw, 2);
+     memcpy(&flags, raw + 4, 2);
+     memcpy(&reserved, raw + 6, 2);
+     memcpy(&request_id, raw + 8, 4);
+     memcpy(&length, raw + 12, 4);
+
+     hdr->magic = ntohs(magic);
+     hdr->version = raw[2];
+     hdr->type = raw[3];
+     hdr->flags = ntohs(flags);
+     hdr->reserved = ntohs(reserved);
+     hdr->request_id = ntohl(request_id);
+     hdr->length = ntohl(length);
+
+     if (hdr->magic != FT_MAGIC || hdr->version != FT_VERSION) {
+         return -1;
+     }
+
+     return 0;
+ }
+
+ /**
+  * Sends the whole buffer, retrying on short writes
+  */
+ int ft_send_all(int sock, const void *buf, size_t len) {
+     const char *p = buf;
+
+     while (len > 0) {
+         ssize_t n = tls_send(sock, p, len);
+         if (n < 0) {
+             if (errno == EINTR) {
+                 continue;
+             }
+             return -1;
+         }
+         p += n;
+         len -= n;
+     }
+
+     return 0;
+ }
+
+ /**
+  * Receives exactly len bytes, failing on EOF or error
+  */
+ int ft_recv_all(int sock, void *buf, size_t len) {
+     char *p = buf;
+
+     while (len > 0) {
+         ssize_t n = tls_recv(sock, p, len);
+         if (n < 0 && errno == EINTR) {
+             continue;
+         }
+         if (n <= 0) {
+             return -1;
+         }
+         p += n;
+         len -= n;
+     }
+
+     return 0;
+ }
+
+ /**
+  * Reads and throws away len bytes, used to skip the body of a rejected request
+  */
+ int ft_discard(int sock, uint64_t len) {
+     char scratch[4096];
+
+     while (len > 0) {
+         size_t chunk = (len < sizeof(scratch)) ? len : sizeof(scratch);
+         if (ft_recv_all(sock, scratch, chunk) != 0) {
+             return -1;
+         }
+         len -= chunk;
+     }
+
+     return 0;
+ }
+
+ /**
+  * Sends a header and its payload with a single system call
+  */
+ int ft_send_frame(int sock, uint8_t type, uint16_t flags, uint32_t request_id,
+                   const void *payload, uint32_t length) {
+     uint8_t raw[FT_HEADER_SIZE];
+     ft_header_t hdr = {
+         .magic = FT_MAGIC,
+         .version = FT_VERSION,
+         .type = type,
+         .flags = flags,
+         .reserved = 0,
+         .request_id = request_id,
+         .length = length,
+     };
+
+     ft_encode_header(&hdr, raw);
+
+     // A TLS record can't be gathered from two buffers, but one record beats two
+     if (tls_get(sock) != NULL) {
+         uint8_t frame[FT_HEADER_SIZE + FT_MAX_PAYLOAD];
+         if (length > FT_MAX_PAYLOAD) {
+             return (ft_send_all(sock, raw, sizeof(raw)) == 0) ? ft_send_all(sock, payload, length) : -1;
+         }
+         memcpy(frame, raw, sizeof(raw));
+         if (length > 0) {
+             memcpy(frame + sizeof(raw), payload, length);
+         }
+         return ft_send_all(sock, frame, sizeof(raw) + length);
+     }
+
+     struct iovec iov[2] = {
+         { .iov_base = raw, .iov_len = sizeof(raw) },
+         { .iov_base = (void *)payload, .iov_len = length },
+     };
+     struct msghdr msg = { .msg_iov = iov, .msg_iovlen = (length > 0) ? 2 : 1 };
+     size_t total = sizeof(raw) + length;
+
+     ssize_t n;
+     do {
+         n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+     } while (n < 0 && errno == EINTR);
+
+     if (n < 0) {
+         return -1;
+     }
+
+     // Finish off a short write the slow way
+     if ((size_t)n < total) {
+         if ((size_t)n < sizeof(raw)) {
+             if (ft_send_all(sock, raw + n, sizeof(raw) - n) != 0) {
+                 return -1;
+             }
+             n = sizeof(raw);
+         }
+         return ft_send_all(sock, (const char *)payload + (n - sizeof(raw)), total - n);
+     }
+
+     return 0;
+ }
+
+ /**
+  * Receives one frame. The payload must fit in payload_size bytes.
+  */
+ int ft_recv_frame(int sock, ft_header_t *hdr, void *payload, size_t payload_size) {
+     uint8_t raw[FT_HEADER_SIZE];
+
+     if (ft_recv_all(sock, raw, sizeof(raw)) != 0) {
+         return -1;
+     }
+
+     if (ft_decode_header(raw, hdr) != 0 || hdr->length > payload_size) {
+         return -1;
+     }
+
+     if (hdr->length > 0 && ft_recv_all(sock, payload, hdr->length) != 0) {
+         return -1;
+     }
+
+     return 0;
+ }
+
+ /**
+  * Starts a payload cursor over a caller-owned buffer
+  */
+ void ft_buf_init(ft_buf_t *b, void *data, size_t size) {
+     b->data = data;
+     b->size = size;
+     b->pos = 0;
+ }
+
+ int ft_put_u64(ft_buf_t *b, uint64_t value) {
+     if (b->size - b->pos < 8) {
+         return -1;
+     }
+
+     for (int i = 7; i >= 0; i--) {
+         b->data[b->pos++] = (uint8_t)(value >> (i * 8));
+     }
+
+     return 0;
+ }
+
+ int ft_put_str(ft_buf_t *b, const char *str) {
+     size_t len = strlen(str) + 1;
+
+     if (b->size - b->pos < len) {
+         return -1;
+     }
+
+     memcpy(b->data + b->pos, str, len);
+     b->pos += len;
+     return 0;
+ }
+
+ int ft_get_u64(ft_buf_t *b, uint64_t *value) {
+     if (b->size - b->pos < 8) {
+         return -1;
+     }
+
+     uint64_t v = 0;
+     for (int i = 0; i < 8; i++) {
+         v = (v << 8) | b->data[b->pos++];
+     }
+
+     *value = v;
+     return 0;
+ }
+
+ /**
+  * Copies out a NUL-terminated string, failing if it is missing or too long
+  */
+ int ft_get_str(ft_buf_t *b, char *out, size_t out_size) {
+     const uint8_t *start = b->data + b->pos;
+     const uint8_t *end = memchr(start, '\0', b->size - b->pos);
+
+     if (end == NULL || (size_t)(end - start) >= out_size) {
+         return -1;
+     }
+
+     memcpy(out, start, end - start + 1);
+     b->pos += end - start + 1;
+     return 0;
+ }
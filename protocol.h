@@ -0,0 +1,172 @@
+/**
+ * Wire Protocol for the File Transfer System
+ *
+ * Every message starts with a fixed 16-byte header followed by `length`
+ * bytes of payload. All integers are sent in network byte order. The file
+ * body of a PUT request is not part of the payload; it follows the frame
+ * as `file_size` raw bytes so it can be streamed straight to disk.
+ *
+ * A PUT with FT_FLAG_CHUNKED set is for data whose size isn't known up
+ * front (a pipe from tar, say). Its `file_size` is ignored and the body is
+ * sent as a series of chunks, each a u32 length followed by that many
+ * bytes, ending with a zero-length chunk.
+ *
+ * HAVE asks the server to store a file from content it already holds. Its
+ * payload is a PUT payload followed by the SHA-256 of the file, as a
+ * string of 64 lowercase hex digits. The server answers OK once the file
+ * is in place, or NEED if the client must send it with an ordinary PUT; a
+ * server built without OpenSSL always answers NEED.
+ *
+ * A PUT with FT_FLAG_RESUMABLE set adds a client-chosen u64 upload ID and
+ * the u64 offset the body starts at to its payload. Its body is chunked,
+ * and every chunk header also carries the u64 XXH64 of the chunk's data.
+ * The server keeps each chunk only once its checksum matches, and keeps
+ * the partial file if the connection drops. RESUME (upload ID, department,
+ * file path) asks how much of it the server holds; the OFFSET reply
+ * carries that as a u64, and the upload continues from there.
+ *
+ * A large file can be sent as several ranges over parallel connections.
+ * Each is a PUT with FT_FLAG_RANGE: the payload is laid out as for a
+ * resumable PUT, with `file_size` the size of the whole file, and the body
+ * is the range's data in checksummed chunks. Once every range has been
+ * acknowledged, COMMIT (a PUT payload plus the u64 upload ID) publishes
+ * the file.
+ *
+ * A plain PUT may set FT_FLAG_CHECKSUM to have the file checked end to
+ * end: the body, or the zero-length chunk ending a chunked one, is then
+ * followed by the u64 XXH64 of the file as stored (after decompression
+ * or applying a delta). The server checks it before publishing the file,
+ * answers ERROR and keeps nothing if it differs, and otherwise sends OK
+ * with the text followed by the u64 hash it verified. Resumable and range
+ * uploads checksum every chunk instead and may not set it.
+ *
+ * The OK reply to AUTH is the message text followed by a u64 of FT_CAP_*
+ * bits naming the compression codecs the server can decode, then a
+ * session token (empty if the server issues none). An AUTH or AUTH_PUT
+ * with FT_FLAG_TOKEN set carries a token from an earlier login after the
+ * password; if it's still valid the server skips checking the password.
+ * A PUT on an authenticated session may then set FT_FLAG_ZSTD or
+ * FT_FLAG_LZ4: its body, usually chunked, is then one zstd or LZ4 frame,
+ * and `file_size` of an unchunked body counts the compressed bytes.
+ *
+ * SIGS (department, file path) asks for the block signatures of the
+ * server's copy of a file, to send a new version as a delta. They come
+ * back as one or more BLOCKS frames, each carrying the u64 block size,
+ * file size and version tag, then u64 weak and strong checksum pairs for
+ * the next run of blocks, until every block is covered; NEED means there
+ * is no copy to work from. A PUT with FT_FLAG_DELTA adds the version tag
+ * to its payload, and its body (usually chunked) is a delta stream as
+ * described in delta.h. The server answers NEED if the file changed in
+ * the meantime, so the client can send it whole.
+ *
+ * GET (department, file path) fetches a file. The FILE reply carries its
+ * u64 size and u64 mtime in seconds, and the file's bytes follow the frame
+ * raw, as a PUT body does. LIST (department) names the files a client may
+ * fetch: zero or more ENTRIES frames, each holding a run of (file name,
+ * u64 size, u64 mtime) records, then an OK.
+ *
+ * A LIST may add a file name and a u64 limit to page through a large
+ * department; it then names up to `limit` files (0 for the server's page
+ * size) sorting after that name. CHANGES (department, u64 sequence
+ * number, u64 limit) names the files changed after that number, oldest
+ * change first, in CHANGED frames of (file name, owner, u64 size, u64
+ * mtime, u64 XXH64 or 0 if unknown, u64 sequence number) records. Either
+ * answer ends with an OK carrying the text, then the u64 sequence number
+ * to ask CHANGES from next and a u64 that is 1 if the page was cut short.
+ * For LIST that is the department's latest change, so a client can list
+ * everything once and then follow the changes from there.
+ *
+ * The first byte of a framed connection is always 0xF7, which can never
+ * start a legacy (unframed) username, so the server can tell the two
+ * protocols apart by peeking at the first byte.
+ */
+
+ #ifndef PROTOCOL_H
+ #define PROTOCOL_H
+
+ #include <stdint.h>
+ #include <stddef.h>
+
+ #define FT_MAGIC 0xF754
+ #define FT_MAGIC_BYTE 0xF7
+ #define FT_VERSION 1
+ #define FT_HEADER_SIZE 16
+ #define FT_MAX_PAYLOAD 4096
+ #define FT_TOKEN_MAX 128         // Longest session token, terminator included
+
+ // Request types (client -> server)
+ #define FT_MSG_AUTH 0x01
+ #define FT_MSG_PUT 0x02
+ #define FT_MSG_AUTH_PUT 0x03
+ #define FT_MSG_BYE 0x04
+ #define FT_MSG_HAVE 0x05
+ #define FT_MSG_RESUME 0x06
+ #define FT_MSG_COMMIT 0x07
+ #define FT_MSG_SIGS 0x08
+ #define FT_MSG_GET 0x09
+ #define FT_MSG_LIST 0x0A
+ #define FT_MSG_CHANGES 0x0B
+
+ // Request flags
+ #define FT_FLAG_CHUNKED 0x0001  // PUT body is sent as length-prefixed chunks
+ #define FT_FLAG_RESUMABLE 0x0002 // PUT continues a partial upload; body has checksummed chunks
+ #define FT_FLAG_RANGE 0x0004   // PUT carries one range of a file sent over several connections
+ #define FT_FLAG_ZSTD 0x0008    // PUT body is zstd compressed
+ #define FT_FLAG_LZ4 0x0010     // PUT body is LZ4 frame compressed
+ #define FT_FLAG_DELTA 0x0020   // PUT body rebuilds the file from the server's older copy
+ #define FT_FLAG_TOKEN 0x0040   // AUTH or AUTH_PUT carries a session token after the password
+ #define FT_FLAG_CHECKSUM 0x0080 // PUT body is followed by the u64 XXH64 of the file
+ #define FT_CHUNK_HEADER_SIZE 4
+ #define FT_CHUNK_SUM_HEADER_SIZE 12  // Chunk header of a resumable body: u32 length, u64 XXH64
+
+ // Reply types (server -> client)
+ #define FT_MSG_OK 0x80
+ #define FT_MSG_ERROR 0x81
+ #define FT_MSG_BUSY 0x82        // Server overloaded; payload is text then u64 retry-after in ms
+ #define FT_MSG_NEED 0x83        // Content not held; send it with a PUT
+ #define FT_MSG_OFFSET 0x84      // Answer to RESUME; payload is the u64 bytes held
+ #define FT_MSG_BLOCKS 0x85      // Part of the answer to SIGS
+ #define FT_MSG_FILE 0x86        // Answer to GET; the file's bytes follow
+ #define FT_MSG_ENTRIES 0x87     // Part of the answer to LIST
+ #define FT_MSG_CHANGED 0x88     // Part of the answer to CHANGES
+
+ // Capabilities announced in the AUTH reply
+ #define FT_CAP_ZSTD 0x1
+ #define FT_CAP_LZ4 0x2
+
+ // Fixed frame header
+ typedef struct {
+     uint16_t magic;
+     uint8_t version;
+     uint8_t type;
+     uint16_t flags;
+     uint16_t reserved;
+     uint32_t request_id;    // Echoed back in the reply to this request
+     uint32_t length;        // Payload length in bytes
+ } ft_header_t;
+
+ // Cursor used to build or parse a frame payload
+ typedef struct {
+     uint8_t *data;
+     size_t size;
+     size_t pos;
+ } ft_buf_t;
+
+ void ft_encode_header(const ft_header_t *hdr, uint8_t raw[FT_HEADER_SIZE]);
+ int ft_decode_header(const uint8_t raw[FT_HEADER_SIZE], ft_header_t *hdr);
+
+ int ft_send_all(int sock, const void *buf, size_t len);
+ int ft_recv_all(int sock, void *buf, size_t len);
+ int ft_discard(int sock, uint64_t len);
+
+ int ft_send_frame(int sock, uint8_t type, uint16_t flags, uint32_t request_id,
+                   const void *payload, uint32_t length);
+ int ft_recv_frame(int sock, ft_header_t *hdr, void *payload, size_t payload_size);
+
+ void ft_buf_init(ft_buf_t *b, void *data, size_t size);
+ int ft_put_u64(ft_buf_t *b, uint64_t value);
+ int ft_put_str(ft_buf_t *b, const char *str);
+ int ft_get_u64(ft_buf_t *b, uint64_t *value);
+ int ft_get_str(ft_buf_t *b, char *out, size_t out_size);
+
+ #endif
@@ -0,0 +1,501 @@
+/**
+ * Transfer Quotas for the File Transfer Server
+ *
+ * A bucket is a single atomic: the time at which it would be full again
+ * (GCRA's theoretical arrival time). Moving n bytes pushes that time
+ * n / rate further out, and the bucket is empty once it's QUOTA_BURST_MS
+ * ahead of now. Checking is a plain load and charging a compare-and-swap,
+ * so any number of threads share a bucket without locking it. Two
+ * sessions that check at the same moment may both be let through; the
+ * overdraft pushes the bucket further ahead and both wait it off.
+ *
+ * A higher class sees up to the whole of the server-wide bucket, a lower
+ * one stops short of the share it leaves, so when the server is at its
+ * rate the lower class is the one that waits. Server-wide transfer slots
+ * are shared out the same way, and each class counts the sessions queued
+ * for one; a class with a higher one queued takes no slot, so a freed
+ * slot goes to the highest class that wants it.
+ *
+ * Users' quotas are kept in a hash table whose chains each have their own
+ * lock, taken when a session attaches or detaches and when the limits
+ * are changed. Limits are atomics too, so quota_configure() can replace
+ * them under running transfers.
+ */
+
+ #include <stdio.h>
+ #include <stdlib.h>
+ #include <string.h>
+ #include <strings.h>
+ #include <errno.h>
+ #include <time.h>
+ #include <pthread.h>
+ #include <stdatomic.h>
+
+ #include "quota.h"
+ #include "dept.h"
+ #include "metrics.h"
+
+ #define NS_PER_SEC 1000000000ull
+
+ typedef struct {
+     atomic_uint_fast64_t rate;   // Bytes per second; 0 for no limit
+     atomic_uint_fast64_t full_at_ns;  // When the bucket would be full again
+ } bucket_t;
+
+ typedef struct {
+     bucket_t bucket;
+     atomic_int transfers;
+     atomic_uint_fast64_t user_rate;  // Rate of each user's bucket
+     atomic_int max_transfers;    // 0 for no limit
+     atomic_int max_user_transfers;
+     atomic_int reserve;          // Percent of the server-wide bucket and slots left to higher classes
+     atomic_int priority;
+ } dept_quota_t;
+
+ struct quota_user {
+     char username[MAX_USERNAME_LENGTH];
+     const dept_t *dept;
+     dept_quota_t *dept_quota;
+     bucket_t bucket;
+     atomic_int transfers;
+     int refs;                    // Sessions attached; guarded by the chain's lock
+     struct quota_user *next;
+ };
+
+ typedef struct {
+     pthread_mutex_t lock;
+     quota_user_t *head;
+ } user_chain_t;
+
+ static atomic_int quota_enabled;
+ static bucket_t server_bucket;
+ static atomic_int server_transfers;
+ static atomic_int server_max_transfers;  // 0 for no limit
+ static atomic_int server_queued[PRIORITY_BULK + 1];  // Sessions of each class waiting for a server-wide slot
+ static dept_quota_t dept_quotas[MAX_DEPARTMENTS];
+ static user_chain_t user_chains[QUOTA_USER_BUCKETS];
+
+ static const char *priority_names[] = { "critical", "normal", "bulk" };
+ static const int priority_reserves[] = { 0, QUOTA_RESERVE_NORMAL, QUOTA_RESERVE_BULK };
+
+ static uint64_t now_ns(void);
+ static void bucket_init(bucket_t *b, uint64_t rate);
+ static uint64_t bucket_burst_ns(uint64_t rate);
+ static uint64_t bucket_allow(bucket_t *b, uint64_t want, int reserve, uint64_t now, uint64_t *wait_ns);
+ static void bucket_charge(bucket_t *b, uint64_t bytes, uint64_t now);
+ static int take_slot(atomic_int *count, int limit);
+ static int take_server_slot(int priority, int reserve);
+ static unsigned user_hash(const char *username);
+
+ /**
+  * Parses a byte rate such as 500K, 40M or 1G (powers of 1024)
+  *
+  * Returns -1 for anything malformed or too large for 64 bits.
+  */
+ int quota_parse_rate(const char *text, uint64_t *rate) {
+     if (*text < '0' || *text > '9') {
+         return -1;
+     }
+
+     char *end;
+     errno = 0;
+     unsigned long long value = strtoull(text, &end, 10);
+     if (errno == ERANGE) {
+         return -1;
+     }
+
+     int shift = 0;
+     switch (*end) {
+     case 'G': case 'g':
+         shift = 30;
+         end++;
+         break;
+     case 'M': case 'm':
+         shift = 20;
+         end++;
+         break;
+     case 'K': case 'k':
+         shift = 10;
+         end++;
+         break;
+     }
+     if (*end != '\0' || value > (UINT64_MAX >> shift)) {
+         return -1;
+     }
+
+     *rate = (uint64_t)value << shift;
+     return 0;
+ }
+
+ /**
+  * A priority class by name, or -1 if there's no such class
+  */
+ int quota_parse_priority(const char *name) {
+     for (int i = 0; i < (int)(sizeof(priority_names) / sizeof(priority_names[0])); i++) {
+         if (strcasecmp(name, priority_names[i]) == 0) {
+             return i;
+         }
+     }
+     return -1;
+ }
+
+ /**
+  * Sets up the buckets from the department limits, the server-wide rate
+  * and the server-wide transfer cap (0 for none); with no limits anywhere,
+  * quotas are off entirely
+  */
+ int quota_init(uint64_t total_rate, int total_transfers) {
+     for (int i = 0; i < QUOTA_USER_BUCKETS; i++) {
+         pthread_mutex_init(&user_chains[i].lock, NULL);
+     }
+
+     bucket_init(&server_bucket, 0);
+     for (int d = 0; d < dept_count(); d++) {
+         bucket_init(&dept_quotas[d].bucket, 0);
+         atomic_init(&dept_quotas[d].transfers, 0);
+         atomic_init(&dept_quotas[d].user_rate, 0);
+     }
+
+     quota_configure(total_rate, total_transfers);
+     return 0;
+ }
+
+ /**
+  * Applies the server-wide limits and the departments' current ones
+  *
+  * Transfers under way pick the new limits up at once. Sessions that
+  * logged in while quotas were off entirely stay unlimited until they
+  * log in again.
+  */
+ void quota_configure(uint64_t total_rate, int total_transfers) {
+     int enabled = (total_rate != 0 || total_transfers != 0);
+
+     atomic_store(&server_bucket.rate, total_rate);
+     atomic_store(&server_max_transfers, total_transfers);
+     for (int d = 0; d < dept_count(); d++) {
+         dept_limits_t limits;
+         dept_quota_t *q = &dept_quotas[d];
+
+         dept_limits(d, &limits);
+         atomic_store(&q->bucket.rate, limits.rate);
+         atomic_store(&q->user_rate, limits.user_rate);
+         atomic_store(&q->max_transfers, limits.transfers);
+         atomic_store(&q->max_user_transfers, limits.user_transfers);
+         atomic_store(&q->reserve, priority_reserves[limits.priority]);
+         atomic_store(&q->priority, limits.priority);
+         if (limits.rate != 0 || limits.user_rate != 0 || limits.transfers != 0 ||
+             limits.user_transfers != 0) {
+             enabled = 1;
+         }
+     }
+     atomic_store(&quota_enabled, enabled);
+
+     for (int i = 0; i < QUOTA_USER_BUCKETS; i++) {
+         pthread_mutex_lock(&user_chains[i].lock);
+         for (quota_user_t *user = user_chains[i].head; user != NULL; user = user->next) {
+             atomic_store(&user->bucket.rate, atomic_load(&user->dept_quota->user_rate));
+         }
+         pthread_mutex_unlock(&user_chains[i].lock);
+     }
+ }
+
+ /**
+  * The quota a logged-in session draws on, shared with the user's other
+  * sessions; NULL when there's nothing to enforce
+  */
+ quota_user_t *quota_attach(const auth_info_t *auth_info) {
+     const dept_t *dept = dept_get(auth_info->dept_id);
+     if (!atomic_load(&quota_enabled) || dept == NULL) {
+         return NULL;
+     }
+
+     user_chain_t *chain = &user_chains[user_hash(auth_info->username)];
+     pthread_mutex_lock(&chain->lock);
+
+     quota_user_t *user;
+     for (user = chain->head; user != NULL; user = user->next) {
+         if (user->dept == dept && strcmp(user->username, auth_info->username) == 0) {
+             break;
+         }
+     }
+
+     if (user == NULL && (user = calloc(1, sizeof(quota_user_t))) != NULL) {
+         snprintf(user->username, sizeof(user->username), "%s", auth_info->username);
+         user->dept = dept;
+         user->dept_quota = &dept_quotas[dept->id];
+         bucket_init(&user->bucket, atomic_load(&user->dept_quota->user_rate));
+         atomic_init(&user->transfers, 0);
+         user->next = chain->head;
+         chain->head = user;
+     }
+     if (user != NULL) {
+         user->refs++;
+     }
+
+     pthread_mutex_unlock(&chain->lock);
+     return user;
+ }
+
+ /**
+  * Lets go of a session's quota; the last session of a user frees it
+  */
+ void quota_detach(quota_user_t *user) {
+     if (user == NULL) {
+         return;
+     }
+
+     user_chain_t *chain = &user_chains[user_hash(user->username)];
+     pthread_mutex_lock(&chain->lock);
+     if (--user->refs == 0) {
+         for (quota_user_t **p = &chain->head; *p != NULL; p = &(*p)->next) {
+             if (*p == user) {
+                 *p = user->next;
+                 break;
+             }
+         }
+         free(user);
+     }
+     pthread_mutex_unlock(&chain->lock);
+ }
+
+ /**
+  * Takes a transfer slot for the user, their department and the server
+  *
+  * Returns 0 if any is at its cap; try again later. queued belongs to the
+  * caller and starts at 0: while it is set the caller is counted as
+  * waiting for a server-wide slot, so lower classes leave the next one to
+  * it. It is cleared once the slot is taken, or by quota_cancel().
+  */
+ int quota_begin(quota_user_t *user, int *queued) {
+     if (user == NULL) {
+         return 1;
+     }
+
+     dept_quota_t *q = user->dept_quota;
+     int priority = atomic_load(&q->priority);
+     if (!take_slot(&user->transfers, atomic_load(&q->max_user_transfers))) {
+         quota_cancel(queued);
+         return 0;
+     }
+     if (!take_slot(&q->transfers, atomic_load(&q->max_transfers))) {
+         atomic_fetch_sub(&user->transfers, 1);
+         quota_cancel(queued);
+         return 0;
+     }
+     if (!take_server_slot(priority, atomic_load(&q->reserve))) {
+         atomic_fetch_sub(&q->transfers, 1);
+         atomic_fetch_sub(&user->transfers, 1);
+         if (!*queued) {
+             atomic_fetch_add(&server_queued[priority], 1);
+             *queued = priority + 1;
+         }
+         return 0;
+     }
+
+     quota_cancel(queued);
+     return 1;
+ }
+
+ /**
+  * Stops counting a caller of quota_begin() as waiting for a slot
+  */
+ void quota_cancel(int *queued) {
+     if (*queued) {
+         atomic_fetch_sub(&server_queued[*queued - 1], 1);
+         *queued = 0;
+     }
+ }
+
+ /**
+  * Gives back the slots quota_begin() took
+  */
+ void quota_end(quota_user_t *user) {
+     if (user == NULL) {
+         return;
+     }
+
+     atomic_fetch_sub(&server_transfers, 1);
+     atomic_fetch_sub(&user->dept_quota->transfers, 1);
+     atomic_fetch_sub(&user->transfers, 1);
+ }
+
+ /**
+  * How many of want bytes the user may move now
+  *
+  * Returns 0, with the milliseconds to wait in wait_ms, if any bucket
+  * can't spare QUOTA_MIN_GRANT bytes (or all of want, if less).
+  * Charge what was actually moved with quota_charge().
+  */
+ size_t quota_allow(quota_user_t *user, size_t want, uint64_t *wait_ms) {
+     if (user == NULL) {
+         return want;
+     }
+
+     uint64_t now = now_ns();
+     uint64_t wait_ns = 0, waited;
+     uint64_t allowed = want;
+
+     allowed = bucket_allow(&user->bucket, allowed, 0, now, &waited);
+     wait_ns = (waited > wait_ns) ? waited : wait_ns;
+     if (allowed > 0) {
+         allowed = bucket_allow(&user->dept_quota->bucket, allowed, 0, now, &waited);
+         wait_ns = (waited > wait_ns) ? waited : wait_ns;
+     }
+     if (allowed > 0) {
+         allowed = bucket_allow(&server_bucket, allowed, atomic_load(&user->dept_quota->reserve), now, &waited);
+         wait_ns = (waited > wait_ns) ? waited : wait_ns;
+     }
+
+     if (allowed == 0) {
+         *wait_ms = (wait_ns + 999999) / 1000000;
+         if (*wait_ms == 0) {
+             *wait_ms = 1;
+         }
+         metrics_count(METRIC_THROTTLES, 1);
+     }
+     return allowed;
+ }
+
+ /**
+  * Draws bytes that were just moved from the user's buckets
+  */
+ void quota_charge(quota_user_t *user, size_t bytes) {
+     if (user == NULL) {
+         return;
+     }
+
+     uint64_t now = now_ns();
+     bucket_charge(&user->bucket, bytes, now);
+     bucket_charge(&user->dept_quota->bucket, bytes, now);
+     bucket_charge(&server_bucket, bytes, now);
+ }
+
+ /**
+  * Nanoseconds on the monotonic clock
+  */
+ static uint64_t now_ns(void) {
+     struct timespec ts;
+     clock_gettime(CLOCK_MONOTONIC, &ts);
+     return (uint64_t)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+ }
+
+ /**
+  * Starts a bucket full
+  */
+ static void bucket_init(bucket_t *b, uint64_t rate) {
+     atomic_init(&b->rate, rate);
+     atomic_init(&b->full_at_ns, 0);
+ }
+
+ /**
+  * How far ahead of now a bucket of the given rate may be drawn
+  */
+ static uint64_t bucket_burst_ns(uint64_t rate) {
+     uint64_t burst_ns = (uint64_t)QUOTA_BURST_MS * 1000000;
+
+     // Even the class that leaves half the bucket must be able to get a whole grant
+     if (burst_ns < 2 * QUOTA_MIN_GRANT * NS_PER_SEC / rate) {
+         burst_ns = 2 * QUOTA_MIN_GRANT * NS_PER_SEC / rate;
+     }
+     return burst_ns;
+ }
+
+ /**
+  * Bytes of want the bucket can spare now, leaving reserve percent of it
+  * untouched; 0, with the time until it can, if less than a grant
+  */
+ static uint64_t bucket_allow(bucket_t *b, uint64_t want, int reserve, uint64_t now, uint64_t *wait_ns) {
+     *wait_ns = 0;
+     uint64_t rate = atomic_load_explicit(&b->rate, memory_order_relaxed);
+     if (rate == 0) {
+         return want;
+     }
+
+     uint64_t full_at = atomic_load(&b->full_at_ns);
+     if (full_at < now) {
+         full_at = now;
+     }
+     uint64_t limit = now + bucket_burst_ns(rate) * (100 - reserve) / 100;
+     uint64_t avail = (full_at < limit) ? (limit - full_at) * rate / NS_PER_SEC : 0;
+
+     uint64_t needed = (want < QUOTA_MIN_GRANT) ? want : QUOTA_MIN_GRANT;
+     if (avail >= needed) {
+         return (avail < want) ? avail : want;
+     }
+
+     *wait_ns = full_at + needed * NS_PER_SEC / rate - limit;
+     return 0;
+ }
+
+ /**
+  * Draws bytes from the bucket, going into debt if they were more than it
+  * held
+  */
+ static void bucket_charge(bucket_t *b, uint64_t bytes, uint64_t now) {
+     uint64_t rate = atomic_load_explicit(&b->rate, memory_order_relaxed);
+     if (rate == 0 || bytes == 0) {
+         return;
+     }
+
+     uint64_t cost = bytes * NS_PER_SEC / rate;
+     uint_fast64_t old = atomic_load(&b->full_at_ns);
+     uint_fast64_t next;
+     do {
+         next = ((old > now) ? old : now) + cost;
+     } while (!atomic_compare_exchange_weak(&b->full_at_ns, &old, next));
+ }
+
+ /**
+  * Counts a transfer in unless limit (0 for none) are already going
+  */
+ static int take_slot(atomic_int *count, int limit) {
+     if (limit == 0) {
+         atomic_fetch_add(count, 1);
+         return 1;
+     }
+
+     int current = atomic_load(count);
+     while (current < limit) {
+         if (atomic_compare_exchange_weak(count, &current, current + 1)) {
+             return 1;
+         }
+     }
+     return 0;
+ }
+
+ /**
+  * Counts a transfer of the given class in against the server-wide cap
+  *
+  * The class may use the cap less the share it leaves to higher classes
+  * (though always at least one slot), and none while a higher class is
+  * waiting.
+  */
+ static int take_server_slot(int priority, int reserve) {
+     int limit = atomic_load(&server_max_transfers);
+     if (limit == 0) {
+         atomic_fetch_add(&server_transfers, 1);
+         return 1;
+     }
+
+     for (int higher = 0; higher < priority; higher++) {
+         if (atomic_load(&server_queued[higher]) > 0) {
+             return 0;
+         }
+     }
+     limit = limit * (100 - reserve) / 100;
+     return take_slot(&server_transfers, (limit > 0) ? limit : 1);
+ }
+
+ /**
+  * Hashes a username to its chain (FNV-1a)
+  */
+ static unsigned user_hash(const char *username) {
+     uint32_t hash = 2166136261u;
+
+     for (const unsigned char *p = (const unsigned char *)username; *p; p++) {
+         hash ^= *p;
+         hash *= 16777619u;
+     }
+
+     return hash & (QUOTA_USER_BUCKETS - 1);
+ }
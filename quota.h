@@ -0,0 +1,51 @@
+/**
+ * Transfer Quotas for the File Transfer Server
+ *
+ * Caps how fast, and how many transfers at once, each user and each
+ * department may move files, using the limits in departments.conf. Rates
+ * are token buckets, one per user, one per department and one for the
+ * whole server (-B); an upload or download over any of them stops
+ * reading or sending until its bucket refills. The whole server may also
+ * be capped in transfers at once (-X). Priority classes act on the
+ * server-wide limits: lower classes leave part of the bucket and of the
+ * transfer slots to higher ones, and get no slot while a higher class is
+ * waiting for one, so line-critical departments keep moving when a bulk
+ * export competes.
+ *
+ * A session attaches to its user's quota once, at login. From then on
+ * the receive and send loops only touch that quota's atomics; no lock is
+ * shared between sessions.
+ */
+
+ #ifndef QUOTA_H
+ #define QUOTA_H
+
+ #include <stddef.h>
+ #include <stdint.h>
+
+ #include "server.h"
+
+ #define QUOTA_BURST_MS 250           // Bytes a bucket holds, in milliseconds of its rate
+ #define QUOTA_MIN_GRANT 16384        // Smallest read or send worth waking up for
+ #define QUOTA_POLL_MS 10             // How often a transfer waiting for a slot checks again
+ #define QUOTA_USER_BUCKETS 256       // Power of two
+
+ // Share of the server-wide bucket each class leaves to the classes above it, in percent
+ #define QUOTA_RESERVE_NORMAL 25
+ #define QUOTA_RESERVE_BULK 50
+
+ typedef struct quota_user quota_user_t;
+
+ int quota_parse_rate(const char *text, uint64_t *rate);
+ int quota_parse_priority(const char *name);
+ int quota_init(uint64_t total_rate, int total_transfers);
+ void quota_configure(uint64_t total_rate, int total_transfers);
+ quota_user_t *quota_attach(const auth_info_t *auth_info);
+ void quota_detach(quota_user_t *user);
+ int quota_begin(quota_user_t *user, int *queued);
+ void quota_cancel(int *queued);
+ void quota_end(quota_user_t *user);
+ size_t quota_allow(quota_user_t *user, size_t want, uint64_t *wait_ms);
+ void quota_charge(quota_user_t *user, size_t bytes);
+
+ #endif
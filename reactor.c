@@ -0,0 +1,716 @@
+/**
+ * Event Loop Engine for the File Transfer Server
+ *
+ * Each reactor thread owns a listener, an epoll instance or io_uring, and
+ * every connection it accepted. Connections never move between reactors,
+ * so none of the per-connection state needs locking.
+ *
+ * The epoll backend is level-triggered and only touches the interest set
+ * when a connection's wishes change. The io_uring backend arms a one-shot
+ * poll per connection and batches re-arming into a single submission.
+ * Either one also watches the reactor's waker, through which the
+ * committer and the auth workers hand back connections they are done
+ * with.
+ */
+
+ #define _GNU_SOURCE
+
+ #include <stdio.h>
+ #include <stdlib.h>
+ #include <string.h>
+ #include <unistd.h>
+ #include <pthread.h>
+ #include <errno.h>
+ #include <sys/epoll.h>
+ #include <sys/socket.h>
+ #include <sys/resource.h>
+
+ #include "reactor.h"
+ #include "session.h"
+ #include "log.h"
+ #include "upgrade.h"
+
+ #if defined(__has_include)
+ #if __has_include(<linux/io_uring.h>)
+ #define HAVE_IO_URING 1
+ #include <linux/io_uring.h>
+ #include <sys/mman.h>
+ #include <sys/syscall.h>
+ #include <signal.h>
+ #endif
+ #endif
+
+ #define MAX_EVENTS 256
+ #define URING_ENTRIES 4096
+ #define SWEEP_INTERVAL_MS 1000   // How often idle connections are looked for
+
+ // Flags kept in conn_t.events alongside the poll mask
+ #define REACTOR_REGISTERED 0x80000000u   // Known to the epoll interest set
+ #define REACTOR_ARMED 0x40000000u        // A one-shot io_uring poll is outstanding
+ #define REACTOR_ZOMBIE 0x20000000u       // Closed, waiting for the poll to be cancelled
+ #define REACTOR_TIMER 0x10000000u        // On the timer list
+ #define REACTOR_MASK 0x0000ffffu
+
+ // Completion tags that aren't connections
+ #define TAG_LISTENER ((void *)1)
+ #define TAG_IGNORE ((void *)2)
+ #define TAG_WAKER ((void *)3)
+
+ typedef struct {
+     void *ptr;
+     uint32_t events;
+ } io_event_t;
+
+ #ifdef HAVE_IO_URING
+ typedef struct {
+     int fd;
+     unsigned entries;
+     unsigned *sq_head;
+     unsigned *sq_tail;
+     unsigned *sq_mask;
+     unsigned *sq_array;
+     unsigned *cq_head;
+     unsigned *cq_tail;
+     unsigned *cq_mask;
+     struct io_uring_sqe *sqes;
+     struct io_uring_cqe *cqes;
+     unsigned to_submit;
+ } uring_t;
+ #endif
+
+ typedef struct {
+     int id;
+     int engine;
+     int listen_fd;
+     int epoll_fd;
+ #ifdef HAVE_IO_URING
+     uring_t ring;
+ #endif
+     conn_t *conns;               // Every connection owned by this reactor
+     conn_t *timers;              // Connections waiting on a CONN_WANT_TIMER
+     conn_waker_t waker;          // Connections other threads have work back for
+     int nconns;
+     uint64_t next_sweep_ms;
+     pthread_t thread;
+ } reactor_t;
+
+ static void *reactor_main(void *arg);
+ static void reactor_accept(reactor_t *r);
+ static void reactor_wake(reactor_t *r);
+ static void reactor_dispatch(reactor_t *r, conn_t *c, int events);
+ static void reactor_close(reactor_t *r, conn_t *c);
+ static void reactor_run_timers(reactor_t *r);
+ static int reactor_timeout(reactor_t *r);
+ static int backend_init(reactor_t *r);
+ static int backend_arm(reactor_t *r, conn_t *c, uint32_t mask);
+ static int backend_wait(reactor_t *r, io_event_t *events, int max, int timeout_ms);
+ #ifdef HAVE_IO_URING
+ static int uring_init(uring_t *u, unsigned entries);
+ static int uring_enter(uring_t *u, int wait, int timeout_ms);
+ static struct io_uring_sqe *uring_get_sqe(uring_t *u);
+ #endif
+
+ /**
+  * Starts the reactor threads and serves connections until the process exits
+  */
+ int reactor_run(int engine, int nthreads) {
+     reactor_t *reactors = calloc(nthreads, sizeof(reactor_t));
+     if (reactors == NULL) {
+         perror("Failed to allocate reactors");
+         return -1;
+     }
+
+     // Every connection is a descriptor, so take whatever the hard limit allows
+     struct rlimit rl;
+     if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+         rl.rlim_cur = rl.rlim_max;
+         setrlimit(RLIMIT_NOFILE, &rl);
+     }
+
+ #ifndef HAVE_IO_URING
+     if (engine == ENGINE_URING) {
+         printf("WARNING: Built without io_uring support, using epoll\n");
+         engine = ENGINE_EPOLL;
+     }
+ #endif
+
+     for (int i = 0; i < nthreads; i++) {
+         reactor_t *r = &reactors[i];
+         r->id = i;
+         r->engine = engine;
+
+         r->listen_fd = create_listener();
+         if (r->listen_fd < 0) {
+             return -1;
+         }
+
+         if (backend_init(r) != 0) {
+             return -1;
+         }
+         engine = r->engine;  // Backend may have fallen back to epoll
+
+         if (pthread_create(&r->thread, NULL, reactor_main, r) != 0) {
+             perror("Reactor thread creation failed");
+             return -1;
+         }
+     }
+
+     printf("Running %d %s reactor thread%s\n", nthreads,
+            (engine == ENGINE_URING) ? "io_uring" : "epoll", (nthreads == 1) ? "" : "s");
+
+     for (int i = 0; i < nthreads; i++) {
+         pthread_join(reactors[i].thread, NULL);
+     }
+
+     return 0;
+ }
+
+ /**
+  * Event loop of one reactor thread
+  */
+ static void *reactor_main(void *arg) {
+     reactor_t *r = arg;
+     io_event_t events[MAX_EVENTS];
+
+     r->next_sweep_ms = monotonic_ms() + SWEEP_INTERVAL_MS;
+
+     while (1) {
+         int n = backend_wait(r, events, MAX_EVENTS, reactor_timeout(r));
+
+         for (int i = 0; i < n; i++) {
+             if (events[i].ptr == TAG_LISTENER) {
+                 reactor_accept(r);
+                 continue;
+             }
+             if (events[i].ptr == TAG_IGNORE) {
+                 continue;
+             }
+             if (events[i].ptr == TAG_WAKER) {
+                 reactor_wake(r);
+                 continue;
+             }
+
+             conn_t *c = events[i].ptr;
+             uint32_t mask = events[i].events;
+
+             if (r->engine == ENGINE_URING) {
+                 c->events &= ~REACTOR_ARMED;
+                 if (c->events & REACTOR_ZOMBIE) {
+                     conn_destroy(c);
+                     continue;
+                 }
+             }
+
+             int ev = 0;
+             if (mask & EPOLLIN) {
+                 ev |= CONN_EV_READ;
+             }
+             if (mask & EPOLLOUT) {
+                 ev |= CONN_EV_WRITE;
+             }
+
+             // Error or hangup with nothing left to read: the peer is gone
+             if (ev == 0) {
+                 reactor_close(r, c);
+                 continue;
+             }
+
+             reactor_dispatch(r, c, ev);
+         }
+
+         reactor_run_timers(r);
+
+         // A new server has taken over; serve what is here and accept no more
+         if (r->listen_fd >= 0 && upgrade_draining()) {
+             if (r->engine == ENGINE_EPOLL) {
+                 epoll_ctl(r->epoll_fd, EPOLL_CTL_DEL, r->listen_fd, NULL);
+             }
+             upgrade_release(r->listen_fd);
+             r->listen_fd = -1;
+         }
+     }
+
+     return NULL;
+ }
+
+ /**
+  * Accepts every pending connection on this reactor's listener
+  */
+ static void reactor_accept(reactor_t *r) {
+     // An io_uring poll armed before the listener was released
+     if (r->listen_fd < 0) {
+         return;
+     }
+
+     while (1) {
+         struct sockaddr_in address;
+         socklen_t addrlen = sizeof(address);
+         int sock = accept4(r->listen_fd, (struct sockaddr *)&address, &addrlen,
+                            SOCK_NONBLOCK | SOCK_CLOEXEC);
+         if (sock < 0) {
+             if (errno == EINTR || errno == ECONNABORTED) {
+                 continue;
+             }
+             if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                 log_event(LOG_LEVEL_ERROR, "Accept failed", "error=%s", strerror(errno));
+             }
+             break;
+         }
+
+         conn_t *c = conn_create(sock, &address, &r->waker);
+         if (c == NULL) {
+             log_event(LOG_LEVEL_ERROR, "Cannot allocate connection", "error=%s", strerror(errno));
+             close(sock);
+             continue;
+         }
+
+         c->next = r->conns;
+         if (r->conns != NULL) {
+             r->conns->prev = c;
+         }
+         r->conns = c;
+         r->nconns++;
+
+         // The first request is often already waiting
+         reactor_dispatch(r, c, CONN_EV_READ);
+     }
+
+ #ifdef HAVE_IO_URING
+     // One-shot listener poll needs re-arming
+     if (r->engine == ENGINE_URING) {
+         struct io_uring_sqe *sqe;
+         if ((sqe = uring_get_sqe(&r->ring)) != NULL) {
+             sqe->opcode = IORING_OP_POLL_ADD;
+             sqe->fd = r->listen_fd;
+             sqe->poll32_events = EPOLLIN;
+             sqe->user_data = (uint64_t)(uintptr_t)TAG_LISTENER;
+         }
+     }
+ #endif
+ }
+
+ /**
+  * Runs every connection the waker holds
+  */
+ static void reactor_wake(reactor_t *r) {
+     conn_t *c;
+
+     while ((c = conn_woken(&r->waker)) != NULL) {
+         // Closed, its poll not yet cancelled
+         if (c->events & REACTOR_ZOMBIE) {
+             continue;
+         }
+         reactor_dispatch(r, c, CONN_EV_WAKE);
+     }
+
+ #ifdef HAVE_IO_URING
+     // One-shot poll, like the listener's
+     if (r->engine == ENGINE_URING) {
+         struct io_uring_sqe *sqe;
+         if ((sqe = uring_get_sqe(&r->ring)) != NULL) {
+             sqe->opcode = IORING_OP_POLL_ADD;
+             sqe->fd = r->waker.fd;
+             sqe->poll32_events = EPOLLIN;
+             sqe->user_data = (uint64_t)(uintptr_t)TAG_WAKER;
+         }
+     }
+ #endif
+ }
+
+ /**
+  * Runs the connection's state machine and applies what it wants next
+  */
+ static void reactor_dispatch(reactor_t *r, conn_t *c, int events) {
+     int want = conn_handle(c, events);
+
+     if (want == 0) {
+         reactor_close(r, c);
+         return;
+     }
+
+     uint32_t mask = 0;
+     if (want & CONN_WANT_READ) {
+         mask |= EPOLLIN;
+     }
+     if (want & CONN_WANT_WRITE) {
+         mask |= EPOLLOUT;
+     }
+
+     if (backend_arm(r, c, mask) != 0) {
+         reactor_close(r, c);
+         return;
+     }
+
+     // Keep the timer list in step with what the connection is waiting on
+     int on_list = (c->events & REACTOR_TIMER) != 0;
+     if ((want & CONN_WANT_TIMER) && !on_list) {
+         c->timer_prev = NULL;
+         c->timer_next = r->timers;
+         if (r->timers != NULL) {
+             r->timers->timer_prev = c;
+         }
+         r->timers = c;
+         c->events |= REACTOR_TIMER;
+     } else if (!(want & CONN_WANT_TIMER) && on_list) {
+         if (c->timer_prev != NULL) {
+             c->timer_prev->timer_next = c->timer_next;
+         } else {
+             r->timers = c->timer_next;
+         }
+         if (c->timer_next != NULL) {
+             c->timer_next->timer_prev = c->timer_prev;
+         }
+         c->events &= ~REACTOR_TIMER;
+     }
+ }
+
+ /**
+  * Unlinks and closes a connection
+  */
+ static void reactor_close(reactor_t *r, conn_t *c) {
+     if (c->prev != NULL) {
+         c->prev->next = c->next;
+     } else {
+         r->conns = c->next;
+     }
+     if (c->next != NULL) {
+         c->next->prev = c->prev;
+     }
+     r->nconns--;
+
+     if (c->events & REACTOR_TIMER) {
+         if (c->timer_prev != NULL) {
+             c->timer_prev->timer_next = c->timer_next;
+         } else {
+             r->timers = c->timer_next;
+         }
+         if (c->timer_next != NULL) {
+             c->timer_next->timer_prev = c->timer_prev;
+         }
+         c->events &= ~REACTOR_TIMER;
+     }
+
+ #ifdef HAVE_IO_URING
+     // The kernel still points at the connection; free it once the poll is cancelled
+     if (r->engine == ENGINE_URING && (c->events & REACTOR_ARMED)) {
+         struct io_uring_sqe *sqe = uring_get_sqe(&r->ring);
+         if (sqe != NULL) {
+             sqe->opcode = IORING_OP_POLL_REMOVE;
+             sqe->addr = (uint64_t)(uintptr_t)c;
+             sqe->user_data = (uint64_t)(uintptr_t)TAG_IGNORE;
+             c->events |= REACTOR_ZOMBIE;
+             return;
+         }
+     }
+ #endif
+
+     conn_destroy(c);
+ }
+
+ /**
+  * Wakes connections whose timers are due and sweeps for idle ones
+  */
+ static void reactor_run_timers(reactor_t *r) {
+     uint64_t now = monotonic_ms();
+     conn_t *c, *next;
+
+     for (c = r->timers; c != NULL; c = next) {
+         next = c->timer_next;
+         if (now >= c->wake_at_ms) {
+             reactor_dispatch(r, c, CONN_EV_TIMER);
+         }
+     }
+
+     if (now < r->next_sweep_ms) {
+         return;
+     }
+     r->next_sweep_ms = now + SWEEP_INTERVAL_MS;
+
+     for (c = r->conns; c != NULL; c = next) {
+         next = c->next;
+         if (!(c->events & REACTOR_TIMER) && now >= conn_deadline(c)) {
+             reactor_dispatch(r, c, CONN_EV_TIMER);
+         }
+     }
+ }
+
+ /**
+  * Milliseconds until the next timer or sweep is due
+  */
+ static int reactor_timeout(reactor_t *r) {
+     uint64_t now = monotonic_ms();
+     uint64_t due = r->next_sweep_ms;
+
+     for (conn_t *c = r->timers; c != NULL; c = c->timer_next) {
+         if (c->wake_at_ms < due) {
+             due = c->wake_at_ms;
+         }
+     }
+
+     return (due > now) ? (int)(due - now) : 0;
+ }
+
+ #ifdef HAVE_IO_URING
+ /**
+  * Sets up the submission and completion rings
+  */
+ static int uring_init(uring_t *u, unsigned entries) {
+     struct io_uring_params p;
+     memset(&p, 0, sizeof(p));
+
+     u->fd = syscall(__NR_io_uring_setup, entries, &p);
+     if (u->fd < 0) {
+         return -1;
+     }
+
+     // Timed waits need IORING_ENTER_EXT_ARG
+     if (!(p.features & IORING_FEAT_EXT_ARG)) {
+         close(u->fd);
+         errno = ENOSYS;
+         return -1;
+     }
+
+     size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+     size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+     if (p.features & IORING_FEAT_SINGLE_MMAP) {
+         sq_size = cq_size = (sq_size > cq_size) ? sq_size : cq_size;
+     }
+
+     void *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     u->fd, IORING_OFF_SQ_RING);
+     if (sq == MAP_FAILED) {
+         close(u->fd);
+         return -1;
+     }
+
+     void *cq = sq;
+     if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+         cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   u->fd, IORING_OFF_CQ_RING);
+         if (cq == MAP_FAILED) {
+             close(u->fd);
+             return -1;
+         }
+     }
+
+     u->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+     if (u->sqes == MAP_FAILED) {
+         close(u->fd);
+         return -1;
+     }
+
+     u->entries = p.sq_entries;
+     u->sq_head = (unsigned *)((char *)sq + p.sq_off.head);
+     u->sq_tail = (unsigned *)((char *)sq + p.sq_off.tail);
+     u->sq_mask = (unsigned *)((char *)sq + p.sq_off.ring_mask);
+     u->sq_array = (unsigned *)((char *)sq + p.sq_off.array);
+     u->cq_head = (unsigned *)((char *)cq + p.cq_off.head);
+     u->cq_tail = (unsigned *)((char *)cq + p.cq_off.tail);
+     u->cq_mask = (unsigned *)((char *)cq + p.cq_off.ring_mask);
+     u->cqes = (struct io_uring_cqe *)((char *)cq + p.cq_off.cqes);
+     u->to_submit = 0;
+     return 0;
+ }
+
+ /**
+  * Submits queued entries and optionally waits for one completion
+  */
+ static int uring_enter(uring_t *u, int wait, int timeout_ms) {
+     struct __kernel_timespec ts = {
+         .tv_sec = timeout_ms / 1000,
+         .tv_nsec = (long long)(timeout_ms % 1000) * 1000000,
+     };
+     struct io_uring_getevents_arg arg = {
+         .sigmask = 0,
+         .sigmask_sz = _NSIG / 8,
+         .ts = (uint64_t)(uintptr_t)&ts,
+     };
+     unsigned flags = wait ? (IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG) : 0;
+
+     int ret = syscall(__NR_io_uring_enter, u->fd, u->to_submit, wait ? 1 : 0, flags,
+                       wait ? &arg : NULL, sizeof(arg));
+     if (ret >= 0) {
+         u->to_submit -= ((unsigned)ret < u->to_submit) ? (unsigned)ret : u->to_submit;
+     }
+
+     return (ret < 0 && errno != ETIME && errno != EINTR && errno != EBUSY) ? -1 : 0;
+ }
+
+ /**
+  * Claims a zeroed submission entry, flushing the ring if it is full
+  */
+ static struct io_uring_sqe *uring_get_sqe(uring_t *u) {
+     unsigned tail = *u->sq_tail;
+     unsigned head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+
+     if (tail - head >= u->entries) {
+         uring_enter(u, 0, 0);
+         head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+         if (tail - head >= u->entries) {
+             return NULL;
+         }
+     }
+
+     unsigned index = tail & *u->sq_mask;
+     struct io_uring_sqe *sqe = &u->sqes[index];
+     memset(sqe, 0, sizeof(*sqe));
+     u->sq_array[index] = index;
+     __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+     u->to_submit++;
+     return sqe;
+ }
+ #endif
+
+ /**
+  * Creates the epoll instance or io_uring and starts watching the listener
+  * and the waker
+  */
+ static int backend_init(reactor_t *r) {
+     if (conn_waker_init(&r->waker) != 0) {
+         perror("eventfd failed");
+         return -1;
+     }
+
+ #ifdef HAVE_IO_URING
+     if (r->engine == ENGINE_URING) {
+         if (uring_init(&r->ring, URING_ENTRIES) == 0) {
+             struct io_uring_sqe *sqe = uring_get_sqe(&r->ring);
+             sqe->opcode = IORING_OP_POLL_ADD;
+             sqe->fd = r->listen_fd;
+             sqe->poll32_events = EPOLLIN;
+             sqe->user_data = (uint64_t)(uintptr_t)TAG_LISTENER;
+
+             sqe = uring_get_sqe(&r->ring);
+             sqe->opcode = IORING_OP_POLL_ADD;
+             sqe->fd = r->waker.fd;
+             sqe->poll32_events = EPOLLIN;
+             sqe->user_data = (uint64_t)(uintptr_t)TAG_WAKER;
+             return 0;
+         }
+
+         printf("WARNING: io_uring unavailable (%s), using epoll\n", strerror(errno));
+         r->engine = ENGINE_EPOLL;
+     }
+ #endif
+
+     r->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+     if (r->epoll_fd < 0) {
+         perror("epoll_create1 failed");
+         return -1;
+     }
+
+     struct epoll_event ev = { .events = EPOLLIN, .data.ptr = TAG_LISTENER };
+     struct epoll_event wake_ev = { .events = EPOLLIN, .data.ptr = TAG_WAKER };
+     if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, r->listen_fd, &ev) != 0 ||
+         epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, r->waker.fd, &wake_ev) != 0) {
+         perror("epoll_ctl failed");
+         return -1;
+     }
+
+     return 0;
+ }
+
+ /**
+  * Makes the backend watch a connection for the given poll mask
+  */
+ static int backend_arm(reactor_t *r, conn_t *c, uint32_t mask) {
+ #ifdef HAVE_IO_URING
+     if (r->engine == ENGINE_URING) {
+         uint32_t armed = c->events & REACTOR_MASK;
+
+         if ((c->events & REACTOR_ARMED) && armed == mask) {
+             return 0;
+         }
+
+         // Waiting on a timer alone needs no poll
+         if (mask == 0 && !(c->events & REACTOR_ARMED)) {
+             return 0;
+         }
+
+         struct io_uring_sqe *sqe = uring_get_sqe(&r->ring);
+         if (sqe == NULL) {
+             return -1;
+         }
+
+         if (c->events & REACTOR_ARMED) {
+             // Change the outstanding poll in place
+             sqe->opcode = IORING_OP_POLL_REMOVE;
+             sqe->len = IORING_POLL_UPDATE_EVENTS;
+             sqe->addr = (uint64_t)(uintptr_t)c;
+             sqe->poll32_events = mask;
+             sqe->user_data = (uint64_t)(uintptr_t)TAG_IGNORE;
+         } else {
+             sqe->opcode = IORING_OP_POLL_ADD;
+             sqe->fd = c->fd;
+             sqe->poll32_events = mask;
+             sqe->user_data = (uint64_t)(uintptr_t)c;
+             c->events |= REACTOR_ARMED;
+         }
+
+         c->events = (c->events & ~REACTOR_MASK) | mask;
+         return 0;
+     }
+ #endif
+
+     if ((c->events & REACTOR_REGISTERED) && (c->events & REACTOR_MASK) == mask) {
+         return 0;
+     }
+
+     struct epoll_event ev = { .events = mask, .data.ptr = c };
+     int op = (c->events & REACTOR_REGISTERED) ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+     if (epoll_ctl(r->epoll_fd, op, c->fd, &ev) != 0) {
+         return -1;
+     }
+
+     c->events = (c->events & ~REACTOR_MASK) | mask | REACTOR_REGISTERED;
+     return 0;
+ }
+
+ /**
+  * Waits for readiness events, submitting any pending io_uring work first
+  */
+ static int backend_wait(reactor_t *r, io_event_t *events, int max, int timeout_ms) {
+ #ifdef HAVE_IO_URING
+     if (r->engine == ENGINE_URING) {
+         uring_t *u = &r->ring;
+         unsigned head = *u->cq_head;
+
+         // Only block when nothing has completed yet
+         int wait = (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE));
+         if ((wait || u->to_submit > 0) && uring_enter(u, wait, timeout_ms) != 0) {
+             log_event(LOG_LEVEL_ERROR, "io_uring_enter failed", "error=%s", strerror(errno));
+             return 0;
+         }
+
+         int n = 0;
+         unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+         while (head != tail && n < max) {
+             struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+             events[n].ptr = (void *)(uintptr_t)cqe->user_data;
+             // Failed polls surface as a hangup so the connection gets closed
+             events[n].events = (cqe->res < 0) ? EPOLLERR : (uint32_t)cqe->res;
+             n++;
+             head++;
+         }
+         __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+         return n;
+     }
+ #endif
+
+     struct epoll_event ev[MAX_EVENTS];
+     int n = epoll_wait(r->epoll_fd, ev, (max < MAX_EVENTS) ? max : MAX_EVENTS, timeout_ms);
+     if (n < 0) {
+         if (errno != EINTR) {
+             log_event(LOG_LEVEL_ERROR, "epoll_wait failed", "error=%s", strerror(errno));
+         }
+         return 0;
+     }
+
+     for (int i = 0; i < n; i++) {
+         events[i].ptr = ev[i].data.ptr;
+         events[i].events = ev[i].events;
+     }
+
+     return n;
+ }
@@ -0,0 +1,20 @@
+/**
+ * Event Loop Engine for the File Transfer Server
+ *
+ * Runs a fixed number of reactor threads, each with its own SO_REUSEPORT
+ * listener, that multiplex all of their connections over epoll or
+ * io_uring instead of dedicating a thread to each one.
+ */
+
+ #ifndef REACTOR_H
+ #define REACTOR_H
+
+ // Connection engines selectable at startup
+ #define ENGINE_THREAD 0          // One thread per connection
+ #define ENGINE_EPOLL 1
+ #define ENGINE_URING 2
+ #define ENGINE_POOL 3            // Fixed worker pool fed by a bounded queue (see pool.c)
+
+ int reactor_run(int engine, int nthreads);
+
+ #endif
@@ -1,8 +1,9 @@
 /**
  * File Transfer Server for Manufacturing Company
  * 
- * This server handles file transfers from multiple clients simultaneously
- * using multithreading. It ensures proper file ownership attribution and
+ * This server handles file transfers from multiple clients simultaneously,
+ * either with a thread per connection, a bounded worker pool (see pool.c),
+ * or a fixed set of event loop threads (see reactor.c). It ensures proper file ownership attribution and
  * enforces access controls based on user groups.
  */
 
@@ -15,144 +16,318 @@
  #include <netinet/in.h>
  #include <sys/stat.h>
  #include <fcntl.h>
- #include <pwd.h>
- #include <grp.h>
  #include <errno.h>
  #include <arpa/inet.h>
+ #include <poll.h>
+ #include <signal.h>
  
- #define PORT 8080
- #define MAX_CLIENTS 10
- #define BUFFER_SIZE 1024
- #define MAX_USERNAME_LENGTH 32
- #define MAX_PASSWORD_LENGTH 32
- #define MAX_FILEPATH_LENGTH 256
- #define MAX_DEPT_LENGTH 32
- 
- // Base directory for file storage
- #define BASE_DIR "/tmp/fileserver"
- #define MANUFACTURING_DIR "/tmp/fileserver/Manufacturing"
- #define DISTRIBUTION_DIR "/tmp/fileserver/Distribution"
+ #include "server.h"
+ #include "session.h"
+ #include "reactor.h"
+ #include "pool.h"
+ #include "identity.h"
+ #include "dept.h"
+ #include "storage.h"
+ #include "metrics.h"
+ #include "log.h"
+ #include "cache.h"
+ #include "index.h"
+ #include "durable.h"
+ #include "tls.h"
+ #include "auth.h"
+ #include "quota.h"
+ #include "config.h"
+ #include "upgrade.h"
  
  // Structure to hold client connection information
  typedef struct {
      int socket;
      struct sockaddr_in address;
+     uint64_t accepted_us;        // For the accept stage metric
  } client_t;
  
- // Structure to hold authentication information
- typedef struct {
-     char username[MAX_USERNAME_LENGTH];
-     char department[MAX_DEPT_LENGTH];
-     uid_t uid;
-     gid_t gid;
- } auth_info_t;
- 
- // Mutex for thread synchronization
- pthread_mutex_t file_mutex = PTHREAD_MUTEX_INITIALIZER;
- 
  // Function prototypes
  void *handle_client(void *client_socket);
- int authenticate_user(int sock, auth_info_t *auth_info);
- int receive_file(int sock, const auth_info_t *auth_info);
- int check_access(const char *department, const auth_info_t *auth_info);
- void setup_directories();
- int is_user_in_group(const char *username, const char *groupname);
+ void serve_connection(int sock, const struct sockaddr_in *address);
+ int start_signal_thread(void);
+ void *signal_thread(void *arg);
+ int load_config(server_config_t *config);
+ void apply_config(const server_config_t *config);
+ void reload_config(void);
+ int answer_login(const char *username, const char *password, int status, const auth_info_t *auth_info,
+                  char *response, size_t response_size, uint64_t started);
  
- /**
-  * Checks if a user belongs to a specific group
-  */
- int is_user_in_group(const char *username, const char *groupname) {
-     struct group *grp = getgrnam(groupname);
-     if (!grp) {
-         return 0;
+ // Settings given on the command line, which win over the config file; kept for SIGHUP
+ #define CLI_LOG_LEVEL 0x01
+ #define CLI_AUTH_WORKERS 0x02
+ #define CLI_POOL_WORKERS 0x04
+ #define CLI_MAX_RATE 0x08
+ #define CLI_MAX_TRANSFERS 0x10
+ static server_config_t cli_config;
+ static unsigned cli_set;          // CLI_* bits of the settings cli_config holds
+ static const char *config_file;
+ static const char *dept_config = DEPT_CONFIG_FILE;
+ static int listen_port = PORT;
+ 
+ int main(int argc, char *argv[]) {
+     int server_fd, client_sock;
+     struct sockaddr_in address;
+     int addrlen = sizeof(address);
+     pthread_t thread_id;
+     int engine = ENGINE_THREAD;
+     int reactors = sysconf(_SC_NPROCESSORS_ONLN);
+     int queue_depth = POOL_DEFAULT_QUEUE_DEPTH;
+     int dedup = 0;
+     const char *metrics_on = NULL;
+     int log_format = LOG_FORMAT_LOGFMT;
+     int durability = DURABLE_NONE;
+     const char *tls_cert = NULL;
+     const char *tls_key = NULL;
+     int tls_only = 0;
+     const char *upgrade_socket = NULL;
+     server_config_t config;
+     int opt;
+     
+     config_defaults(&cli_config);
+     
+     while ((opt = getopt(argc, argv, "e:r:w:q:d:Dm:l:L:C:S:t:k:Ta:B:X:c:U:")) != -1) {
+         switch (opt) {
+         case 'e':
+             if (strcmp(optarg, "thread") == 0) {
+                 engine = ENGINE_THREAD;
+             } else if (strcmp(optarg, "epoll") == 0) {
+                 engine = ENGINE_EPOLL;
+             } else if (strcmp(optarg, "uring") == 0) {
+                 engine = ENGINE_URING;
+             } else if (strcmp(optarg, "pool") == 0) {
+                 engine = ENGINE_POOL;
+             } else {
+                 fprintf(stderr, "Unknown engine '%s'\n", optarg);
+                 return EXIT_FAILURE;
+             }
+             break;
+         case 'r':
+             reactors = atoi(optarg);
+             if (reactors < 1) {
+                 fprintf(stderr, "Need at least one reactor thread\n");
+                 return EXIT_FAILURE;
+             }
+             break;
+         case 'w':
+             cli_config.pool_workers = atoi(optarg);
+             if (cli_config.pool_workers < 1) {
+                 fprintf(stderr, "Need at least one worker thread\n");
+                 return EXIT_FAILURE;
+             }
+             cli_set |= CLI_POOL_WORKERS;
+             break;
+         case 'q':
+             queue_depth = atoi(optarg);
+             if (queue_depth < 1) {
+                 fprintf(stderr, "Queue depth must be at least 1\n");
+                 return EXIT_FAILURE;
+             }
+             break;
+         case 'd':
+             dept_config = optarg;
+             break;
+         case 'D':
+             dedup = 1;
+             break;
+         case 'm':
+             metrics_on = optarg;
+             break;
+         case 'C':
+             if (atoi(optarg) < 0) {
+                 fprintf(stderr, "Cache size can't be negative\n");
+                 return EXIT_FAILURE;
+             }
+             cache_init((uint64_t)atoi(optarg) * 1024 * 1024);
+             break;
+         case 'S':
+             if ((durability = durable_parse_level(optarg)) < 0) {
+                 fprintf(stderr, "Unknown durability level '%s'\n", optarg);
+                 return EXIT_FAILURE;
+             }
+             break;
+         case 't':
+             tls_cert = optarg;
+             break;
+         case 'k':
+             tls_key = optarg;
+             break;
+         case 'T':
+             tls_only = 1;
+             break;
+         case 'a':
+             cli_config.auth_workers = atoi(optarg);
+             if (cli_config.auth_workers < 1) {
+                 fprintf(stderr, "Need at least one auth worker\n");
+                 return EXIT_FAILURE;
+             }
+             cli_set |= CLI_AUTH_WORKERS;
+             break;
+         case 'B':
+             if (quota_parse_rate(optarg, &cli_config.max_rate) != 0) {
+                 fprintf(stderr, "Invalid rate '%s'; use bytes per second, e.g. 500M\n", optarg);
+                 return EXIT_FAILURE;
+             }
+             cli_set |= CLI_MAX_RATE;
+             break;
+         case 'X':
+             cli_config.max_transfers = atoi(optarg);
+             if (cli_config.max_transfers < 0) {
+                 fprintf(stderr, "Transfer cap can't be negative\n");
+                 return EXIT_FAILURE;
+             }
+             cli_set |= CLI_MAX_TRANSFERS;
+             break;
+         case 'l':
+             if ((cli_config.log_level = log_parse_level(optarg)) < 0) {
+                 fprintf(stderr, "Unknown log level '%s'\n", optarg);
+                 return EXIT_FAILURE;
+             }
+             cli_set |= CLI_LOG_LEVEL;
+             break;
+         case 'c':
+             config_file = optarg;
+             break;
+         case 'U':
+             upgrade_socket = optarg;
+             break;
+         case 'L':
+             if ((log_format = log_parse_format(optarg)) < 0) {
+                 fprintf(stderr, "Unknown log format '%s'\n", optarg);
+                 return EXIT_FAILURE;
+             }
+             break;
+         default:
+             fprintf(stderr, "Usage: %s [-e thread|pool|epoll|uring] [-r reactor_threads] "
+                     "[-w pool_workers] [-q pool_queue_depth] [-d departments.conf] [-D] "
+                     "[-m metrics_port|metrics_socket] [-l debug|info|warn|error] [-L logfmt|json] "
+                     "[-C cache_mb] [-S none|file|group] [-t cert.pem [-k key.pem] [-T]] [-a auth_workers] [-B max_rate] "
+                     "[-X max_transfers] [-c server.conf] [-U upgrade_socket]\n",
+                     argv[0]);
+             return EXIT_FAILURE;
+         }
      }
      
-     // Check if user is in gr_mem
-     char **members = grp->gr_mem;
-     while (*members) {
-         if (strcmp(*members, username) == 0) {
-             return 1;
-         }
-         members++;
+     if (reactors < 1) {
+         reactors = 1;
      }
      
-     // If not found in gr_mem, check primary group
-     struct passwd *pwd = getpwnam(username);
-     if (!pwd) {
-         return 0;
+     // The config file fills in what the command line left out
+     if (load_config(&config) != 0) {
+         return EXIT_FAILURE;
      }
+     listen_port = config.port;
      
-     if (pwd->pw_gid == grp->gr_gid) {
-         return 1;
+     if (tls_cert == NULL && (tls_key != NULL || tls_only)) {
+         fprintf(stderr, "-k and -T need a certificate given with -t\n");
+         return EXIT_FAILURE;
+     }
+     if (tls_cert != NULL && tls_server_init(tls_cert, tls_key, tls_only) != 0) {
+         return EXIT_FAILURE;
      }
      
-     return 0;
- }
- 
- int main() {
-     int server_fd, client_sock;
-     struct sockaddr_in address;
-     int addrlen = sizeof(address);
-     pthread_t thread_id;
+     // sendfile() and OpenSSL's writes can't suppress SIGPIPE; a closed connection is reported as EPIPE instead
+     signal(SIGPIPE, SIG_IGN);
      
-     // Create socket
-     if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
-         perror("Socket creation failed");
+     // Before any other thread starts, so they all inherit the blocked SIGHUP and SIGUSR1
+     if (start_signal_thread() != 0) {
          exit(EXIT_FAILURE);
      }
      
-     // Set socket options to reuse address and port
-     int opt = 1;
-     if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt, sizeof(opt))) {
-         perror("Setsockopt failed");
+     if (log_start(config.log_level, log_format) != 0) {
          exit(EXIT_FAILURE);
      }
      
-     // Configure server address
-     address.sin_family = AF_INET;
-     address.sin_addr.s_addr = INADDR_ANY;
-     address.sin_port = htons(PORT);
+     // Load the departments and create their directories if they don't exist
+     if (dept_load(dept_config) != 0 || dept_open() != 0 || storage_init(dedup) != 0 ||
+         quota_init(config.max_rate, config.max_transfers) != 0) {
+         exit(EXIT_FAILURE);
+     }
+     session_configure(config.idle_timeout, config.max_in_flight, config.socket_buffer);
+     upgrade_set_drain_timeout(config.drain_timeout);
      
-     // Bind socket to address and port
-     if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
-         perror("Bind failed");
+     // Take the listeners and index over from the server being upgraded, if one is running
+     if (upgrade_socket != NULL && upgrade_takeover(upgrade_socket) != 0) {
          exit(EXIT_FAILURE);
      }
      
-     // Listen for incoming connections
-     if (listen(server_fd, MAX_CLIENTS) < 0) {
-         perror("Listen failed");
+     if (index_init() != 0 || index_start() != 0 || cache_start() != 0 || durable_start(durability) != 0) {
+         exit(EXIT_FAILURE);
+     }
+     
+     if (auth_start(config.auth_workers) != 0) {
+         exit(EXIT_FAILURE);
+     }
+     
+     if (metrics_on != NULL && metrics_start(metrics_on) != 0) {
          exit(EXIT_FAILURE);
      }
      
-     // Create required directories if they don't exist
-     setup_directories();
+     int listeners = (engine == ENGINE_EPOLL || engine == ENGINE_URING) ? reactors : 1;
+     if (upgrade_socket != NULL && upgrade_start(upgrade_socket, listeners) != 0) {
+         exit(EXIT_FAILURE);
+     }
+     
+     if (engine == ENGINE_EPOLL || engine == ENGINE_URING) {
+         printf("Server started on port %d\n", listen_port);
+         return (reactor_run(engine, reactors) == 0) ? 0 : EXIT_FAILURE;
+     }
+     
+     if ((server_fd = create_listener()) < 0) {
+         exit(EXIT_FAILURE);
+     }
+     
+     printf("Server started on port %d\n", listen_port);
+     
+     if (engine == ENGINE_POOL) {
+         pool_run(server_fd, config.pool_workers, queue_depth, serve_connection);
+         close(server_fd);
+         return EXIT_FAILURE;
+     }
      
-     printf("Server started on port %d\n", PORT);
      printf("Waiting for connections...\n");
      
      // Accept and handle incoming connections
      while (1) {
-         // Accept new connection
+         // Wake up now and then to see whether an upgrade has taken over
+         struct pollfd pfd = { .fd = server_fd, .events = POLLIN };
+         int ready = poll(&pfd, 1, 1000);
+         if (upgrade_draining()) {
+             upgrade_release(server_fd);
+             upgrade_wait();
+         }
+         if (ready <= 0) {
+             continue;
+         }
+         
+         // Accept new connection; another process sharing the listener may have taken it
          if ((client_sock = accept(server_fd, (struct sockaddr *)&address, (socklen_t*)&addrlen)) < 0) {
-             perror("Accept failed");
+             if (errno != EINTR && errno != EAGAIN) {
+                 log_event(LOG_LEVEL_ERROR, "Accept failed", "error=%s", strerror(errno));
+             }
              continue;
          }
          
          // Create client structure
          client_t *client = malloc(sizeof(client_t));
          if (client == NULL) {
-             perror("Failed to allocate memory for client");
+             log_event(LOG_LEVEL_ERROR, "Cannot allocate client", "error=%s", strerror(errno));
              close(client_sock);
              continue;
          }
          
          client->socket = client_sock;
          client->address = address;
+         client->accepted_us = metrics_now_us();
          
          // Create new thread to handle client
-         if (pthread_create(&thread_id, NULL, handle_client, (void*)client) < 0) {
-             perror("Thread creation failed");
+         int err = pthread_create(&thread_id, NULL, handle_client, (void*)client);
+         if (err != 0) {
+             log_event(LOG_LEVEL_ERROR, "Thread creation failed", "error=%s", strerror(err));
              free(client);
              close(client_sock);
              continue;
@@ -168,260 +343,328 @@
  }
  
  /**
-  * Creates required directories with proper permissions
+  * Creates a non-blocking socket listening on the configured port
+  *
+  * SO_REUSEPORT lets every reactor thread bind a listener of its own and
+  * have the kernel spread incoming connections across them. Listeners
+  * handed over by the server being upgraded are used first.
   */
- void setup_directories() {
-     // Create base directory
-     mkdir(BASE_DIR, 0755);
+ int create_listener(void) {
+     int server_fd;
+     struct sockaddr_in address;
+     
+     // Already bound and non-blocking, and still accepting while the old server drains
+     if ((server_fd = upgrade_listener()) >= 0) {
+         upgrade_register(server_fd);
+         return server_fd;
+     }
+     
+     // Create socket
+     if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+         perror("Socket creation failed");
+         return -1;
+     }
      
-     // Create department directories
-     mkdir(MANUFACTURING_DIR, 0777);  
-     mkdir(DISTRIBUTION_DIR, 0777);   
+     // Set socket options to reuse address and port
+     int opt = 1;
+     if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) ||
+         setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt))) {
+         perror("Setsockopt failed");
+         close(server_fd);
+         return -1;
+     }
      
-     // Set group ownership for the directories
-     struct group *manufacturing_group = getgrnam("Manufacturing");
-     struct group *distribution_group = getgrnam("Distribution");
+     // Configure server address
+     address.sin_family = AF_INET;
+     address.sin_addr.s_addr = INADDR_ANY;
+     address.sin_port = htons(listen_port);
      
-     if (manufacturing_group) {
-         printf("Found Manufacturing group with GID: %d\n", manufacturing_group->gr_gid);
-         chown(MANUFACTURING_DIR, 0, manufacturing_group->gr_gid);
-     } else {
-         printf("WARNING: Manufacturing group not found, directory permissions may be incorrect\n");
+     // Bind socket to address and port
+     if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+         perror("Bind failed");
+         close(server_fd);
+         return -1;
      }
      
-     if (distribution_group) {
-         printf("Found Distribution group with GID: %d\n", distribution_group->gr_gid);
-         chown(DISTRIBUTION_DIR, 0, distribution_group->gr_gid);
-     } else {
-         printf("WARNING: Distribution group not found, directory permissions may be incorrect\n");
+     // Listen for incoming connections
+     if (listen(server_fd, LISTEN_BACKLOG) < 0) {
+         perror("Listen failed");
+         close(server_fd);
+         return -1;
      }
      
-     printf("Directory setup complete\n");
+     fcntl(server_fd, F_SETFL, fcntl(server_fd, F_GETFL) | O_NONBLOCK);
+     upgrade_register(server_fd);
+     return server_fd;
  }
  
  /**
-  * Thread function to handle client connection
+  * Starts the thread that handles SIGHUP and SIGUSR1
+  *
+  * Must run before any other thread is created, so that every thread
+  * inherits the blocked signals and only signal_thread() ever sees them.
   */
- void *handle_client(void *client_ptr) {
-     client_t *client = (client_t *)client_ptr;
-     int sock = client->socket;
-     auth_info_t auth_info;
-     char client_ip[INET_ADDRSTRLEN];
-     
-     // Store client IP for logging
-     inet_ntop(AF_INET, &(client->address.sin_addr), client_ip, INET_ADDRSTRLEN);
-     int client_port = ntohs(client->address.sin_port);
+ int start_signal_thread(void) {
+     sigset_t signals;
+     pthread_t thread_id;
      
-     printf("New connection from %s:%d\n", client_ip, client_port);
+     sigemptyset(&signals);
+     sigaddset(&signals, SIGHUP);
+     sigaddset(&signals, SIGUSR1);
+     pthread_sigmask(SIG_BLOCK, &signals, NULL);
      
-     // Authenticate user
-     if (authenticate_user(sock, &auth_info) != 0) {
-         printf("Authentication failed for client %s:%d\n", client_ip, client_port);
-         close(sock);
-         free(client);
-         return NULL;
+     if (pthread_create(&thread_id, NULL, signal_thread, NULL) != 0) {
+         perror("Thread creation failed");
+         return -1;
      }
      
-     printf("User '%s' authenticated successfully from %s:%d\n", 
-            auth_info.username, client_ip, client_port);
+     pthread_detach(thread_id);
+     return 0;
+ }
+ 
+ /**
+  * Reloads the configuration on SIGHUP; on SIGUSR1, flushes the identity
+  * cache and retires the session tokens issued so far along with it
+  */
+ void *signal_thread(void *arg) {
+     sigset_t signals;
+     int sig;
+     (void)arg;
+     
+     sigemptyset(&signals);
+     sigaddset(&signals, SIGHUP);
+     sigaddset(&signals, SIGUSR1);
      
-     // Receive and process file
-     if (receive_file(sock, &auth_info) != 0) {
-         printf("File transfer failed for user '%s' from %s:%d\n", 
-                auth_info.username, client_ip, client_port);
+     while (1) {
+         if (sigwait(&signals, &sig) != 0) {
+             continue;
+         }
+         
+         if (sig == SIGUSR1) {
+             identity_flush();
+             auth_rotate_key();
+             log_event(LOG_LEVEL_INFO, "Identity cache flushed", "signal=SIGUSR1");
+         } else {
+             reload_config();
+         }
      }
      
-     // Clean up
-     close(sock);
-     free(client);
-     printf("Connection closed with %s:%d\n", client_ip, client_port);
      return NULL;
  }
  
  /**
-  * Authenticates a user based on username and password
+  * Builds the settings to run with: the defaults, then the config file,
+  * then whatever the command line gave
+  *
+  * Returns -1, with config unusable, if the file has an error.
   */
- int authenticate_user(int sock, auth_info_t *auth_info) {
-     char username[MAX_USERNAME_LENGTH];
-     char password[MAX_PASSWORD_LENGTH];
-     char response[BUFFER_SIZE];
-     int bytes_received;
-     
-     // Receive username
-     memset(username, 0, sizeof(username));
-     bytes_received = recv(sock, username, sizeof(username) - 1, 0);
-     if (bytes_received <= 0) {
+ int load_config(server_config_t *config) {
+     config_defaults(config);
+     if (config_file != NULL && config_load(config_file, config) != 0) {
          return -1;
      }
      
-     // Receive password
-     memset(password, 0, sizeof(password));
-     bytes_received = recv(sock, password, sizeof(password) - 1, 0);
-     if (bytes_received <= 0) {
-         return -1;
+     if (cli_set & CLI_LOG_LEVEL) {
+         config->log_level = cli_config.log_level;
      }
-     
-     // Get user information
-     struct passwd *pwd;
-     if ((pwd = getpwnam(username)) == NULL) {
-         strcpy(response, "Authentication failed: User not found");
-         send(sock, response, strlen(response), 0);
-         return -1;
+     if (cli_set & CLI_AUTH_WORKERS) {
+         config->auth_workers = cli_config.auth_workers;
      }
-     
-     // Check which department the user belongs to
-     int is_manufacturing = is_user_in_group(username, "Manufacturing");
-     int is_distribution = is_user_in_group(username, "Distribution");
-     
-     // Determine department
-     if (is_manufacturing && !is_distribution) {
-         strcpy(auth_info->department, "Manufacturing");
-     } else if (!is_manufacturing && is_distribution) {
-         strcpy(auth_info->department, "Distribution");
-     } else if (is_manufacturing && is_distribution) {
-         // User is in both groups, default to Manufacturing
-         strcpy(auth_info->department, "Manufacturing");
-     } else {
-         // User is not in any required group
-         strcpy(response, "Authentication failed: User not in required groups");
-         send(sock, response, strlen(response), 0);
-         return -1;
+     if (cli_set & CLI_POOL_WORKERS) {
+         config->pool_workers = cli_config.pool_workers;
+     }
+     if (cli_set & CLI_MAX_RATE) {
+         config->max_rate = cli_config.max_rate;
+     }
+     if (cli_set & CLI_MAX_TRANSFERS) {
+         config->max_transfers = cli_config.max_transfers;
      }
-     
-     // Store user info
-     strcpy(auth_info->username, username);
-     auth_info->uid = pwd->pw_uid;
-     auth_info->gid = pwd->pw_gid;
-     
-     // Send success response with department
-     sprintf(response, "Authentication successful. Department: %s", auth_info->department);
-     send(sock, response, strlen(response), 0);
-     
      return 0;
  }
  
  /**
-  * Checks if a user has access to a specific department
+  * Puts the settings that can change in a running server into effect
   */
- int check_access(const char *department, const auth_info_t *auth_info) {
-     // User must be in the same department
-     return strcmp(department, auth_info->department) == 0;
+ void apply_config(const server_config_t *config) {
+     log_set_level(config->log_level);
+     session_configure(config->idle_timeout, config->max_in_flight, config->socket_buffer);
+     auth_set_workers(config->auth_workers);
+     pool_set_workers(config->pool_workers);
+     quota_configure(config->max_rate, config->max_transfers);
+     upgrade_set_drain_timeout(config->drain_timeout);
  }
  
  /**
-  * Receives and processes a file from the client
+  * Reads the config file and the department limits again and applies
+  * them; a file with an error leaves its settings as they were
   */
- int receive_file(int sock, const auth_info_t *auth_info) {
-     char filepath[MAX_FILEPATH_LENGTH];
-     char department[MAX_DEPT_LENGTH];
-     char buffer[BUFFER_SIZE];
-     char response[BUFFER_SIZE];
-     int bytes_received;
-     
-     // Receive department
-     memset(department, 0, sizeof(department));
-     bytes_received = recv(sock, department, sizeof(department) - 1, 0);
-     if (bytes_received <= 0) {
-         return -1;
+ void reload_config(void) {
+     server_config_t config;
+     if (load_config(&config) != 0) {
+         log_event(LOG_LEVEL_WARN, "Config not reloaded", "file=%s", config_file);
+         return;
      }
      
-     // Check if user has access to the department
-     if (!check_access(department, auth_info)) {
-         sprintf(response, "Error: You don't have access to the %s department", department);
-         send(sock, response, strlen(response), 0);
-         return -1;
-     }
-     
-     // Receive filename
-     memset(filepath, 0, sizeof(filepath));
-     bytes_received = recv(sock, filepath, sizeof(filepath) - 1, 0);
-     if (bytes_received <= 0) {
-         return -1;
+     if (config.port != listen_port) {
+         log_event(LOG_LEVEL_WARN, "Port change needs an upgrade", "port=%d listening=%d", config.port,
+                   listen_port);
      }
      
-     // Extract filename from path
-     char *filename = strrchr(filepath, '/');
-     if (filename == NULL) {
-         filename = filepath;
-     } else {
-         filename++;  // Skip the '/'
-     }
+     dept_reload_limits(dept_config);
+     apply_config(&config);
+     log_event(LOG_LEVEL_INFO, "Config reloaded", "file=%s", (config_file != NULL) ? config_file : "none");
+ }
+ 
+ /**
+  * Thread function to handle client connection
+  */
+ void *handle_client(void *client_ptr) {
+     client_t *client = (client_t *)client_ptr;
      
-     // Create the complete destination path
-     char dest_path[MAX_FILEPATH_LENGTH];
-     if (strcmp(department, "Manufacturing") == 0) {
-         snprintf(dest_path, sizeof(dest_path), "%s/%s", MANUFACTURING_DIR, filename);
-     } else if (strcmp(department, "Distribution") == 0) {
-         snprintf(dest_path, sizeof(dest_path), "%s/%s", DISTRIBUTION_DIR, filename);
-     } else {
-         strcpy(response, "Error: Invalid department");
-         send(sock, response, strlen(response), 0);
-         return -1;
-     }
+     metrics_since(METRIC_ACCEPT, client->accepted_us);
+     serve_connection(client->socket, &client->address);
+     free(client);
+     return NULL;
+ }
+ 
+ /**
+  * Serves one connection on the calling thread until it closes
+  *
+  * Drives the connection's state machine, blocking in poll() whenever it
+  * is waiting for the socket, a timer or its own waker.
+  */
+ void serve_connection(int sock, const struct sockaddr_in *address) {
+     fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
      
-     // Receive file size
-     uint32_t file_size;
-     bytes_received = recv(sock, &file_size, sizeof(file_size), 0);
-     if (bytes_received <= 0) {
-         return -1;
+     conn_waker_t waker;
+     if (conn_waker_init(&waker) != 0) {
+         log_event(LOG_LEVEL_ERROR, "Cannot create waker", "error=%s", strerror(errno));
+         close(sock);
+         return;
      }
-     file_size = ntohl(file_size);
      
-     // Create file
-     pthread_mutex_lock(&file_mutex);
-     int file_fd = open(dest_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
-     if (file_fd < 0) {
-         pthread_mutex_unlock(&file_mutex);
-         sprintf(response, "Error: Cannot create file: %s", strerror(errno));
-         send(sock, response, strlen(response), 0);
-         return -1;
+     conn_t *c = conn_create(sock, address, &waker);
+     if (c == NULL) {
+         log_event(LOG_LEVEL_ERROR, "Cannot allocate connection", "error=%s", strerror(errno));
+         conn_waker_close(&waker);
+         close(sock);
+         return;
      }
      
-     // Receive and write file data
-     uint32_t remaining = file_size;
-     while (remaining > 0) {
-         size_t to_read = (remaining < BUFFER_SIZE) ? remaining : BUFFER_SIZE;
-         bytes_received = recv(sock, buffer, to_read, 0);
+     int want = conn_handle(c, CONN_EV_READ);
+     while (want != 0) {
+         struct pollfd pfd[2] = { { .fd = sock, .events = 0 }, { .fd = waker.fd, .events = POLLIN } };
+         if (want & CONN_WANT_READ) {
+             pfd[0].events |= POLLIN;
+         }
+         if (want & CONN_WANT_WRITE) {
+             pfd[0].events |= POLLOUT;
+         }
+         
+         uint64_t now = monotonic_ms();
+         uint64_t deadline = conn_deadline(c);
+         int ready = poll(pfd, 2, (deadline > now) ? (int)(deadline - now) : 0);
+         if (ready < 0) {
+             if (errno == EINTR) {
+                 continue;
+             }
+             break;
+         }
          
-         if (bytes_received <= 0) {
-             close(file_fd);
-             pthread_mutex_unlock(&file_mutex);
-             return -1;
+         int events = 0;
+         if (ready == 0) {
+             events = CONN_EV_TIMER;
+         } else {
+             if (pfd[0].revents & POLLIN) {
+                 events |= CONN_EV_READ;
+             }
+             if (pfd[0].revents & POLLOUT) {
+                 events |= CONN_EV_WRITE;
+             }
+             
+             // Error or hangup with nothing left to read: the peer is gone
+             if (events == 0 && pfd[0].revents != 0) {
+                 break;
+             }
+             
+             // Only this connection is ever queued on it
+             if (pfd[1].revents & POLLIN) {
+                 while (conn_woken(&waker) != NULL) {
+                     events |= CONN_EV_WAKE;
+                 }
+             }
          }
          
-         write(file_fd, buffer, bytes_received);
-         remaining -= bytes_received;
+         want = conn_handle(c, events);
      }
      
-     // Close file
-     close(file_fd);
-     
-     // Attempt to set file ownership, but don't fail if it doesn't work
-     if (chown(dest_path, auth_info->uid, -1) < 0) {
-         printf("Warning: Could not set file ownership: %s\n", strerror(errno));
+     conn_destroy(c);
+     conn_waker_close(&waker);
+ }
+ 
+ /**
+  * Looks the user up, resolves their department and checks their password
+  *
+  * Fills response with the message to send back to the client. Identities
+  * come from the cache in identity.c; send SIGUSR1 to make the server
+  * forget them after changing users or groups. Checking the password
+  * blocks for as long as the hash takes, so sessions have the auth workers
+  * call this; a NULL password means a session token has already proven it.
+  */
+ int verify_user(const char *username, const char *password, auth_info_t *auth_info,
+                 char *response, size_t response_size) {
+     // Resolve the user and their department, usually from the cache
+     uint64_t started = metrics_now_us();
+     int status = identity_lookup(username, auth_info);
+     return answer_login(username, password, status, auth_info, response, response_size, started);
+ }
+ 
+ /**
+  * Logs in a user whose session token has proven them, if their identity
+  * is cached
+  *
+  * Returns IDENTITY_MISS, with response untouched, if it isn't; resolving
+  * it may wait on a directory server, so that is left to verify_user() on
+  * an auth worker. Otherwise returns what verify_user() would.
+  */
+ int verify_cached_user(const char *username, auth_info_t *auth_info, char *response, size_t response_size) {
+     uint64_t started = metrics_now_us();
+     int status = identity_cached(username, auth_info);
+     if (status == IDENTITY_MISS) {
+         return IDENTITY_MISS;
      }
-     
-     // Create a file in the same directory with the owner's name for attribution
-     char attribution_path[MAX_FILEPATH_LENGTH];
-     snprintf(attribution_path, sizeof(attribution_path), "%s/%s.owner", 
-              (strcmp(department, "Manufacturing") == 0) ? MANUFACTURING_DIR : DISTRIBUTION_DIR, 
-              filename);
-              
-     int attr_fd = open(attribution_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
-     if (attr_fd >= 0) {
-         // Write the username to the attribution file
-         write(attr_fd, auth_info->username, strlen(auth_info->username));
-         close(attr_fd);
+     return answer_login(username, NULL, status, auth_info, response, response_size, started);
+ }
+ 
+ /**
+  * Finishes verify_user() once the user's identity is known: checks the
+  * password, if there is one, and fills in the response
+  */
+ int answer_login(const char *username, const char *password, int status, const auth_info_t *auth_info,
+                  char *response, size_t response_size, uint64_t started) {
+     if (status == IDENTITY_NO_USER) {
+         snprintf(response, response_size, "Authentication failed: User not found");
+     } else if (status == IDENTITY_NO_GROUP) {
+         snprintf(response, response_size, "Authentication failed: User not in required groups");
+     } else if (password != NULL && auth_check_password(username, password) != 0) {
+         snprintf(response, response_size, "Authentication failed: Wrong password");
+         status = -1;
+     }
+     metrics_since(METRIC_AUTH, started);
+     if (status != IDENTITY_OK) {
+         metrics_count(METRIC_AUTH_FAILURES, 1);
+         return -1;
      }
      
-     pthread_mutex_unlock(&file_mutex);
-     
-     // Send success response
-     sprintf(response, "File '%s' successfully transferred to %s department", filename, department);
-     send(sock, response, strlen(response), 0);
-     
-     printf("File '%s' transferred by user '%s' to %s department\n", 
-            filename, auth_info->username, department);
-     
+     snprintf(response, response_size, "Authentication successful. Department: %s", auth_info->department);
      return 0;
- }
\ No newline at end of file
+ }
+ 
+ /**
+  * Checks if a user has access to a specific department
+  */
+ int check_access(int dept_id, const auth_info_t *auth_info) {
+     // User must be in the same department
+     return dept_id >= 0 && dept_id == auth_info->dept_id;
+ }
+ 
@@ -0,0 +1,43 @@
+/**
+ * File Transfer Server for Manufacturing Company
+ *
+ * Definitions shared between the server's modules.
+ */
+
+ #ifndef SERVER_H
+ #define SERVER_H
+
+ #include <stddef.h>
+ #include <sys/types.h>
+ #include <netinet/in.h>
+
+ #define PORT 8080
+ #define LISTEN_BACKLOG 4096
+ #define BUFFER_SIZE 1024
+ #define MAX_USERNAME_LENGTH 32
+ #define MAX_PASSWORD_LENGTH 32
+ #define MAX_FILEPATH_LENGTH 256
+ #define MAX_DEPT_LENGTH 32
+ #define SESSION_IDLE_TIMEOUT 60  // Default seconds a session may sit idle before it is dropped
+ #define SESSION_MAX_IN_FLIGHT 32 // Default pipelined requests a session may have unanswered
+
+ // Base directory for file storage; department directories are set up in dept.c
+ #define BASE_DIR "/tmp/fileserver"
+
+ // Structure to hold authentication information
+ typedef struct {
+     char username[MAX_USERNAME_LENGTH];
+     char department[MAX_DEPT_LENGTH];
+     int dept_id;
+     uid_t uid;
+     gid_t gid;
+     char client_ip[INET_ADDRSTRLEN];  // Where the session connected from
+ } auth_info_t;
+
+ int create_listener(void);
+ int verify_user(const char *username, const char *password, auth_info_t *auth_info,
+                 char *response, size_t response_size);
+ int verify_cached_user(const char *username, auth_info_t *auth_info, char *response, size_t response_size);
+ int check_access(int dept_id, const auth_info_t *auth_info);
+
+ #endif
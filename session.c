@@ -0,0 +1,1875 @@
+/**
+ * Client Sessions for the File Transfer Server
+ *
+ * Non-blocking protocol state machine shared by every connection engine.
+ * See session.h for how engines drive it.
+ */
+
+ #define _GNU_SOURCE              // splice()
+
+ #include <stdio.h>
+ #include <stdlib.h>
+ #include <string.h>
+ #include <unistd.h>
+ #include <errno.h>
+ #include <time.h>
+ #include <fcntl.h>
+ #include <stdatomic.h>
+ #include <sys/socket.h>
+ #include <sys/sendfile.h>
+ #include <sys/eventfd.h>
+ #include <netinet/tcp.h>
+
+ #include "session.h"
+ #include "metrics.h"
+ #include "log.h"
+ #include "identity.h"
+
+ #define CONN_RUN_BUDGET 64       // Steps per call before yielding to other connections
+ #define SPLICE_PIPE_SIZE (1024 * 1024)  // Requested capacity of the body splice pipe
+ #define DOWNLOAD_BURST (4 * 1024 * 1024)  // Bytes sent per call before other connections get a turn
+ #define OUT_BACKLOG_MAX (256 * 1024)  // Unsent reply bytes past which no more requests are read
+
+ // Connection states
+ #define STATE_DETECT 0           // Waiting for the first byte to pick a protocol
+ #define STATE_LEGACY_USERNAME 1
+ #define STATE_LEGACY_PASSWORD 2
+ #define STATE_LEGACY_DEPARTMENT 3
+ #define STATE_LEGACY_FILEPATH 4
+ #define STATE_LEGACY_SIZE 5
+ #define STATE_FRAME 6            // Waiting for the next framed request
+ #define STATE_BODY 7             // Streaming an upload body to disk
+ #define STATE_DISCARD 8          // Skipping the body of a rejected upload
+ #define STATE_CLOSING 9          // Flushing the last replies before closing
+ #define STATE_DOWNLOAD 10        // Sending a file after its reply
+ #define STATE_SYNC 11            // A legacy session holding its one reply until the file is durable
+ #define STATE_HANDSHAKE 12       // Running the TLS handshake
+ #define STATE_AUTH 13            // Waiting for an auth worker to check the password
+ #define STATE_QUEUED 14          // Waiting for a transfer slot under the user's quota
+
+ // Results of a single state machine step
+ #define RUN_AGAIN 0              // Made progress; keep going
+ #define RUN_DRAINED 1            // No more input for now
+ #define RUN_YIELD 2              // Stopped early so other connections get a turn
+ #define RUN_BLOCKED 3            // Waiting on something other than input
+ #define RUN_CLOSE -1             // Tear the connection down
+
+ // An upload whose reply waits for the committer while the session serves later requests
+ typedef struct pending_upload {
+     upload_t upload;
+     auth_info_t auth_info;       // Kept here, as the committer indexes the file under it
+     uint32_t request_id;
+     char response[BUFFER_SIZE];
+     struct pending_upload *next;
+ } pending_upload_t;
+
+ // Settings session_configure() may change while sessions run
+ static atomic_uint_fast64_t idle_timeout_ms = SESSION_IDLE_TIMEOUT * 1000;
+ static atomic_int max_in_flight = SESSION_MAX_IN_FLIGHT;
+ static atomic_int socket_buffer;
+ static atomic_int active_conns;
+
+ static void conn_wake(void *ctx);
+ static void conn_unwake(conn_t *c);
+ static int conn_run(conn_t *c);
+ static int run_detect(conn_t *c);
+ static int run_handshake(conn_t *c);
+ static int run_legacy(conn_t *c);
+ static int run_frame(conn_t *c);
+ static int run_body(conn_t *c);
+ static int handle_request(conn_t *c, uint8_t *payload);
+ static int handle_auth(conn_t *c, ft_buf_t *in);
+ static int start_auth(conn_t *c, const char *password, const char *token);
+ static int run_auth(conn_t *c);
+ static int finish_auth(conn_t *c, int status);
+ static int handle_put(conn_t *c, ft_buf_t *in);
+ static int start_transfer(conn_t *c);
+ static void end_transfer(conn_t *c);
+ static size_t conn_allowance(conn_t *c, size_t want);
+ static int handle_have(conn_t *c, ft_buf_t *in);
+ static int handle_resume(conn_t *c, ft_buf_t *in);
+ static int handle_commit(conn_t *c, ft_buf_t *in);
+ static int handle_sigs(conn_t *c, ft_buf_t *in);
+ static int handle_get(conn_t *c, ft_buf_t *in);
+ static int open_download(conn_t *c);
+ static int handle_list(conn_t *c, ft_buf_t *in);
+ static int handle_changes(conn_t *c, ft_buf_t *in);
+ static void end_page(conn_t *c, ft_buf_t *out, int status, const index_page_t *page);
+ static void page_entry(void *ctx, const index_entry_t *e);
+ static int begin_upload(conn_t *c);
+ static int finish_body(conn_t *c);
+ static int defer_upload(conn_t *c);
+ static pending_upload_t *hold_upload(conn_t *c);
+ static int hold_reply(conn_t *c, pending_upload_t *p, int status);
+ static void collect_synced(conn_t *c);
+ static int run_sync(conn_t *c);
+ static int reply_upload(conn_t *c, int status);
+ static void answer_upload(conn_t *c, uint32_t request_id, int status, const upload_t *up, const char *response);
+ static int next_request(conn_t *c);
+ static int splice_body(conn_t *c);
+ static int run_chunk_header(conn_t *c);
+ static int run_trailer(conn_t *c);
+ static int recv_field(conn_t *c, char *field, size_t size);
+ static ssize_t conn_recv(conn_t *c, void *buf, size_t len);
+ static ssize_t conn_send(conn_t *c, const void *buf, size_t len);
+ static void conn_reply(conn_t *c, uint8_t type, const char *message);
+ static void conn_reply_data(conn_t *c, uint8_t type, const void *data, size_t length);
+ static void conn_answer(conn_t *c, uint32_t request_id, uint8_t type, const void *data, size_t length);
+ static int conn_reserve(conn_t *c, size_t len);
+ static int conn_flush(conn_t *c);
+ static int send_download(conn_t *c);
+
+ /**
+  * Milliseconds on the monotonic clock
+  */
+ uint64_t monotonic_ms(void) {
+     struct timespec ts;
+     clock_gettime(CLOCK_MONOTONIC, &ts);
+     return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+ }
+
+ /**
+  * Sets how long sessions may idle, how many requests they may have
+  * unanswered, and the socket buffer size for new connections (0 to leave
+  * it to the kernel)
+  */
+ void session_configure(int idle_timeout, int in_flight, int buffer_size) {
+     atomic_store(&idle_timeout_ms, (uint64_t)idle_timeout * 1000);
+     atomic_store(&max_in_flight, in_flight);
+     atomic_store(&socket_buffer, buffer_size);
+ }
+
+ /**
+  * Connections created and not yet destroyed
+  */
+ int conn_active(void) {
+     return atomic_load(&active_conns);
+ }
+
+ /**
+  * Sets up an engine's waker; returns -1 if it has no eventfd
+  */
+ int conn_waker_init(conn_waker_t *w) {
+     w->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+     if (w->fd < 0) {
+         return -1;
+     }
+     pthread_mutex_init(&w->lock, NULL);
+     w->woken = NULL;
+     return 0;
+ }
+
+ /**
+  * Closes a waker once no connection uses it
+  */
+ void conn_waker_close(conn_waker_t *w) {
+     close(w->fd);
+     pthread_mutex_destroy(&w->lock);
+ }
+
+ /**
+  * Takes the next woken connection off a waker, or returns NULL once there
+  * are none, leaving the eventfd unreadable until the next wake
+  */
+ conn_t *conn_woken(conn_waker_t *w) {
+     pthread_mutex_lock(&w->lock);
+     conn_t *c = w->woken;
+     if (c != NULL) {
+         w->woken = c->wake_next;
+         c->wake_queued = 0;
+     } else {
+         uint64_t count;
+         while (read(w->fd, &count, sizeof(count)) < 0 && errno == EINTR) {
+             // Retry
+         }
+     }
+     pthread_mutex_unlock(&w->lock);
+     return c;
+ }
+
+ /**
+  * Queues a connection on its engine's waker; called by whichever thread
+  * has finished what the connection was waiting on, while it is sure the
+  * connection still exists
+  */
+ static void conn_wake(void *ctx) {
+     conn_t *c = ctx;
+     conn_waker_t *w = c->waker;
+
+     pthread_mutex_lock(&w->lock);
+     if (!c->wake_queued) {
+         c->wake_queued = 1;
+         c->wake_next = w->woken;
+         w->woken = c;
+         uint64_t one = 1;
+         if (write(w->fd, &one, sizeof(one)) < 0) {
+             // Can only overflow, and then it's readable anyway
+         }
+     }
+     pthread_mutex_unlock(&w->lock);
+ }
+
+ /**
+  * Takes a connection that's going away off its waker
+  */
+ static void conn_unwake(conn_t *c) {
+     conn_waker_t *w = c->waker;
+
+     pthread_mutex_lock(&w->lock);
+     if (c->wake_queued) {
+         conn_t **link = &w->woken;
+         while (*link != c) {
+             link = &(*link)->wake_next;
+         }
+         *link = c->wake_next;
+         c->wake_queued = 0;
+     }
+     pthread_mutex_unlock(&w->lock);
+ }
+
+ /**
+  * Wraps an accepted, non-blocking socket in a new connection, woken
+  * through the engine's waker
+  */
+ conn_t *conn_create(int fd, const struct sockaddr_in *address, conn_waker_t *waker) {
+     conn_t *c = calloc(1, sizeof(conn_t));
+     if (c == NULL) {
+         return NULL;
+     }
+
+     c->fd = fd;
+     c->waker = waker;
+     c->pipe_fds[0] = c->pipe_fds[1] = -1;
+     c->state = STATE_DETECT;
+     c->last_active_ms = monotonic_ms();
+     upload_init(&c->upload);
+     metrics_count(METRIC_CONNECTIONS, 1);
+     atomic_fetch_add(&active_conns, 1);
+
+     int buffer_size = atomic_load(&socket_buffer);
+     if (buffer_size > 0) {
+         setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+         setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &buffer_size, sizeof(buffer_size));
+     }
+
+     // Store client IP for logging
+     inet_ntop(AF_INET, &address->sin_addr, c->client_ip, INET_ADDRSTRLEN);
+     c->client_port = ntohs(address->sin_port);
+
+     log_event(LOG_LEVEL_INFO, "New connection", "client=%s:%d", c->client_ip, c->client_port);
+     return c;
+ }
+
+ /**
+  * Closes the socket and frees the connection
+  */
+ void conn_destroy(conn_t *c) {
+     // Uploads the committer still has go through whether or not anyone hears; it frees them
+     while (c->syncing != NULL) {
+         pending_upload_t *p = c->syncing;
+         c->syncing = p->next;
+         if (!upload_detach(&p->upload, free, p)) {
+             upload_complete(&p->upload, 0);
+             free(p);
+         }
+     }
+
+     // A worker may still be checking the password; it lets go of the job itself
+     if (c->auth_job != NULL) {
+         auth_release(c->auth_job);
+     }
+
+     // Nothing can wake it any more, but it may have been woken already
+     conn_unwake(c);
+
+     end_transfer(c);
+     quota_cancel(&c->slot_queued);
+     quota_detach(c->quota);
+
+     if (c->upload.fd >= 0) {
+         log_event(LOG_LEVEL_WARN, "File transfer failed", "user=%s client=%s:%d file=%s",
+                   c->auth_info.username, c->client_ip, c->client_port, c->upload.filename);
+         upload_abort(&c->upload);
+     }
+
+     if (c->download != NULL) {
+         cache_release(c->download);
+     }
+
+     if (c->pipe_fds[0] >= 0) {
+         close(c->pipe_fds[0]);
+         close(c->pipe_fds[1]);
+     }
+
+     tls_free(c->tls);
+
+     close(c->fd);
+     log_event(LOG_LEVEL_INFO, "Connection closed", "client=%s:%d files=%d",
+               c->client_ip, c->client_port, c->files_received);
+     free(c->out);
+     free(c);
+     atomic_fetch_sub(&active_conns, 1);
+ }
+
+ /**
+  * Tells a client the server is too busy to serve it
+  *
+  * Called on a freshly accepted socket before any connection is created.
+  * Framed clients get a BUSY frame carrying the suggested retry delay;
+  * a client that has already sent a legacy username gets plain text.
+  */
+ void conn_reject_busy(int fd, uint64_t retry_after_ms) {
+     char message[BUFFER_SIZE];
+     unsigned char first_byte;
+
+     snprintf(message, sizeof(message), "Server busy, retry after %llu ms",
+              (unsigned long long)retry_after_ms);
+
+     ssize_t n = recv(fd, &first_byte, 1, MSG_PEEK | MSG_DONTWAIT);
+     if (n == 1 && first_byte != FT_MAGIC_BYTE) {
+         ft_send_all(fd, message, strlen(message));
+     } else {
+         uint8_t payload[BUFFER_SIZE + sizeof(uint64_t)];
+         ft_buf_t out;
+
+         ft_buf_init(&out, payload, sizeof(payload));
+         ft_put_str(&out, message);
+         ft_put_u64(&out, retry_after_ms);
+         ft_send_frame(fd, FT_MSG_BUSY, 0, 0, payload, out.pos);
+     }
+
+     // Closing with unread input resets the connection, which can destroy the reply
+     shutdown(fd, SHUT_WR);
+     char discard[BUFFER_SIZE];
+     while (recv(fd, discard, sizeof(discard), MSG_DONTWAIT) > 0) {
+         // Keep draining
+     }
+ }
+
+ /**
+  * Time by which the engine must call conn_handle() with CONN_EV_TIMER
+  */
+ uint64_t conn_deadline(const conn_t *c) {
+     if (c->timer_wanted) {
+         return c->wake_at_ms;
+     }
+     return c->last_active_ms + atomic_load(&idle_timeout_ms);
+ }
+
+ /**
+  * Advances the connection after the events it was waiting for
+  *
+  * Returns the CONN_WANT_* events to wait for next, or 0 once the
+  * connection should be destroyed.
+  */
+ int conn_handle(conn_t *c, int events) {
+     uint64_t now = monotonic_ms();
+
+     if (events & (CONN_EV_READ | CONN_EV_WRITE)) {
+         c->last_active_ms = now;
+     } else if (now >= c->last_active_ms + atomic_load(&idle_timeout_ms)) {
+         log_event(LOG_LEVEL_INFO, "Session timed out", "client=%s:%d files=%d",
+                   c->client_ip, c->client_port, c->files_received);
+         return 0;
+     }
+
+     c->timer_wanted = 0;
+     c->throttled_until = 0;
+     collect_synced(c);
+     if (c->out_failed || conn_flush(c) != 0) {
+         return 0;
+     }
+
+     int status = RUN_BLOCKED;
+     while (c->state != STATE_CLOSING) {
+         status = conn_run(c);
+         if (status == RUN_CLOSE) {
+             return 0;
+         }
+         int downloading = (c->state == STATE_DOWNLOAD);
+
+         // Replies go out once the client has nothing more queued, or when they pile up
+         if (status != RUN_YIELD || c->out_len - c->out_off >= OUT_BACKLOG_MAX) {
+             if (conn_flush(c) != 0) {
+                 return 0;
+             }
+         }
+
+         // Requests may have arrived behind a download that has just finished
+         if (!downloading || c->state == STATE_DOWNLOAD) {
+             break;
+         }
+     }
+
+     // TLS may need to write before it can read, even with nothing queued
+     int flushing = c->out_len > c->out_off || (c->tls != NULL && tls_wants_write(c->tls));
+     int pending = flushing || c->download != NULL;
+
+     // Nothing is read while waiting for a transfer slot, and nothing is moved while over
+     // quota; check back later
+     uint64_t wake_at = 0;
+     if (c->state == STATE_QUEUED) {
+         wake_at = now + QUOTA_POLL_MS;
+     } else if (c->throttled_until != 0) {
+         wake_at = c->throttled_until;
+     }
+     // The committer wakes the session once replies held for it can go, and an auth
+     // worker once the login is through; nothing is read until then
+     int woken = (c->syncing != NULL || c->state == STATE_AUTH) ? CONN_WANT_WAKE : 0;
+     if (wake_at != 0) {
+         c->wake_at_ms = wake_at;
+         c->timer_wanted = 1;
+         return (flushing ? CONN_WANT_WRITE : 0) | CONN_WANT_TIMER | woken;
+     }
+
+     if (c->state == STATE_CLOSING) {
+         return pending ? CONN_WANT_WRITE : 0;
+     }
+
+     // No requests are read while a file is going out or a login is being checked
+     int want = (pending ? CONN_WANT_WRITE : 0) | woken;
+     if (c->download == NULL && c->state != STATE_SYNC && c->state != STATE_AUTH &&
+         c->in_flight < atomic_load(&max_in_flight) && c->out_len - c->out_off < OUT_BACKLOG_MAX) {
+         want |= CONN_WANT_READ;
+
+         // Input buffered before the run stopped early, like records already decrypted,
+         // won't make the socket readable; come straight back for it
+         if (status == RUN_YIELD || (c->tls != NULL && tls_pending(c->tls))) {
+             c->wake_at_ms = now;
+             c->timer_wanted = 1;
+             want |= CONN_WANT_TIMER;
+         }
+     }
+
+     return want;
+ }
+
+ /**
+  * Runs the state machine until it runs out of input or work
+  */
+ static int conn_run(conn_t *c) {
+     for (int budget = CONN_RUN_BUDGET; budget > 0; budget--) {
+         int status;
+
+         switch (c->state) {
+         case STATE_DETECT:
+             status = run_detect(c);
+             break;
+         case STATE_HANDSHAKE:
+             status = run_handshake(c);
+             break;
+         case STATE_AUTH:
+             status = run_auth(c);
+             break;
+         case STATE_QUEUED:
+             status = start_transfer(c);
+             break;
+         case STATE_LEGACY_USERNAME:
+         case STATE_LEGACY_PASSWORD:
+         case STATE_LEGACY_DEPARTMENT:
+         case STATE_LEGACY_FILEPATH:
+         case STATE_LEGACY_SIZE:
+             status = run_legacy(c);
+             break;
+         case STATE_FRAME:
+             // Stop taking requests while as many as the client may have in flight are still
+             // unanswered, or while it isn't reading its replies
+             if (c->in_flight >= atomic_load(&max_in_flight) || c->out_len - c->out_off >= OUT_BACKLOG_MAX) {
+                 return RUN_BLOCKED;
+             }
+             status = run_frame(c);
+             break;
+         case STATE_BODY:
+         case STATE_DISCARD:
+             status = run_body(c);
+             break;
+         case STATE_SYNC:
+             status = run_sync(c);
+             break;
+         default:
+             return RUN_BLOCKED;
+         }
+
+         // The client would wait forever on a reply that was never queued
+         if (c->out_failed) {
+             return RUN_CLOSE;
+         }
+         if (status != RUN_AGAIN) {
+             return status;
+         }
+     }
+
+     return RUN_YIELD;
+ }
+
+ /**
+  * Picks the protocol from the first byte
+  *
+  * A TLS client opens with a handshake record, and the protocol inside is
+  * picked the same way once the handshake is done. Framed clients always
+  * open with the magic byte; anything else is legacy.
+  */
+ static int run_detect(conn_t *c) {
+     unsigned char first_byte;
+     ssize_t n = (c->tls != NULL) ? tls_peek(c->tls, &first_byte, 1) : recv(c->fd, &first_byte, 1, MSG_PEEK);
+
+     if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+         return RUN_DRAINED;
+     }
+     if (n <= 0) {
+         return RUN_CLOSE;
+     }
+
+     if (c->tls == NULL && first_byte == TLS_RECORD_BYTE && tls_server_enabled()) {
+         c->tls = tls_accept(c->fd);
+         if (c->tls == NULL) {
+             log_event(LOG_LEVEL_ERROR, "Cannot start TLS", "client=%s:%d", c->client_ip, c->client_port);
+             return RUN_CLOSE;
+         }
+         c->state = STATE_HANDSHAKE;
+         return RUN_AGAIN;
+     }
+
+     if (c->tls == NULL && tls_server_required()) {
+         log_event(LOG_LEVEL_WARN, "Plaintext connection refused", "client=%s:%d", c->client_ip, c->client_port);
+         c->framed = (first_byte == FT_MAGIC_BYTE);
+         conn_reply(c, FT_MSG_ERROR, "Error: This server only accepts TLS connections");
+         c->state = STATE_CLOSING;
+         return RUN_BLOCKED;
+     }
+
+     if (first_byte == FT_MAGIC_BYTE) {
+         // Replies go out as whole frames, so don't let Nagle hold them back
+         int nodelay = 1;
+         setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+         c->framed = 1;
+         c->state = STATE_FRAME;
+     } else {
+         c->state = STATE_LEGACY_USERNAME;
+     }
+
+     return RUN_AGAIN;
+ }
+
+ /**
+  * Runs the TLS handshake as far as the socket allows
+  */
+ static int run_handshake(conn_t *c) {
+     int status = tls_handshake(c->tls);
+
+     if (status == TLS_AGAIN) {
+         return tls_wants_write(c->tls) ? RUN_BLOCKED : RUN_DRAINED;
+     }
+     if (status != TLS_DONE) {
+         log_event(LOG_LEVEL_WARN, "TLS handshake failed", "client=%s:%d", c->client_ip, c->client_port);
+         return RUN_CLOSE;
+     }
+
+     char tls[96];
+     log_event(LOG_LEVEL_DEBUG, "TLS established", "client=%s:%d tls=%s", c->client_ip, c->client_port,
+               tls_describe(c->tls, tls, sizeof(tls)));
+     c->state = STATE_DETECT;
+     return RUN_AGAIN;
+ }
+
+ /**
+  * Reads one field of the legacy protocol
+  *
+  * Legacy clients send each field as a separate segment, so every recv()
+  * is taken to be exactly one field.
+  */
+ static int run_legacy(conn_t *c) {
+     char password[MAX_PASSWORD_LENGTH];
+     int status;
+
+     switch (c->state) {
+     case STATE_LEGACY_USERNAME:
+         if ((status = recv_field(c, c->username, sizeof(c->username))) <= 0) {
+             return (status == 0) ? RUN_DRAINED : RUN_CLOSE;
+         }
+         c->state = STATE_LEGACY_PASSWORD;
+         return RUN_AGAIN;
+
+     case STATE_LEGACY_PASSWORD:
+         if ((status = recv_field(c, password, sizeof(password))) <= 0) {
+             return (status == 0) ? RUN_DRAINED : RUN_CLOSE;
+         }
+         return start_auth(c, password, NULL);
+
+     case STATE_LEGACY_DEPARTMENT:
+         if ((status = recv_field(c, c->department, sizeof(c->department))) <= 0) {
+             return (status == 0) ? RUN_DRAINED : RUN_CLOSE;
+         }
+
+         // Check access before waiting on the rest of the request
+         if (!check_access(dept_find(c->department), &c->auth_info)) {
+             snprintf(c->response, sizeof(c->response),
+                      "Error: You don't have access to the %s department", c->department);
+             conn_reply(c, FT_MSG_ERROR, c->response);
+             c->state = STATE_CLOSING;
+             return RUN_BLOCKED;
+         }
+
+         c->state = STATE_LEGACY_FILEPATH;
+         return RUN_AGAIN;
+
+     case STATE_LEGACY_FILEPATH:
+         if ((status = recv_field(c, c->filepath, sizeof(c->filepath))) <= 0) {
+             return (status == 0) ? RUN_DRAINED : RUN_CLOSE;
+         }
+         c->in_off = c->in_len = 0;
+         c->state = STATE_LEGACY_SIZE;
+         return RUN_AGAIN;
+
+     default: {
+         // The 32-bit file size may be split across segments
+         ssize_t n = conn_recv(c, c->in + c->in_len, sizeof(uint32_t) - c->in_len);
+         if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+             return RUN_DRAINED;
+         }
+         if (n <= 0) {
+             return RUN_CLOSE;
+         }
+
+         c->in_len += n;
+         if (c->in_len < sizeof(uint32_t)) {
+             return RUN_AGAIN;
+         }
+
+         uint32_t file_size;
+         memcpy(&file_size, c->in, sizeof(file_size));
+         c->file_size = ntohl(file_size);
+         c->in_off = c->in_len = 0;
+         return start_transfer(c);
+     }
+     }
+ }
+
+ /**
+  * Parses the next framed request once it has fully arrived
+  */
+ static int run_frame(conn_t *c) {
+     size_t avail = c->in_len - c->in_off;
+
+     if (avail >= FT_HEADER_SIZE) {
+         ft_header_t hdr;
+         if (ft_decode_header(c->in + c->in_off, &hdr) != 0 || hdr.length > FT_MAX_PAYLOAD) {
+             log_event(LOG_LEVEL_WARN, "Malformed frame", "client=%s:%d", c->client_ip, c->client_port);
+             return RUN_CLOSE;
+         }
+
+         if (avail >= FT_HEADER_SIZE + hdr.length) {
+             uint8_t *payload = c->in + c->in_off + FT_HEADER_SIZE;
+             c->hdr = hdr;
+             c->in_off += FT_HEADER_SIZE + hdr.length;
+             return handle_request(c, payload);
+         }
+     }
+
+     // Make room for the rest of the frame
+     if (c->in_off > 0) {
+         memmove(c->in, c->in + c->in_off, avail);
+         c->in_off = 0;
+         c->in_len = avail;
+     }
+
+     ssize_t n = conn_recv(c, c->in + c->in_len, sizeof(c->in) - c->in_len);
+     if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+         return RUN_DRAINED;
+     }
+     if (n < 0) {
+         return RUN_CLOSE;
+     }
+     if (n == 0) {
+         // Client is done sending; answer what it already asked for
+         c->state = STATE_CLOSING;
+         return RUN_BLOCKED;
+     }
+
+     c->in_len += n;
+     return RUN_AGAIN;
+ }
+
+ /**
+  * Handles one framed request
+  *
+  * The client either sends AUTH followed by any number of PUTs, or an
+  * AUTH_PUT that carries both so a single upload costs one round trip.
+  * The session stays open until the client sends BYE or goes quiet for
+  * the idle timeout (SESSION_IDLE_TIMEOUT seconds unless configured).
+  *
+  * Clients may pipeline requests without waiting for replies. Each reply
+  * carries the request_id of the request it answers, so clients must not
+  * rely on reply order.
+  */
+ static int handle_request(conn_t *c, uint8_t *payload) {
+     ft_buf_t in;
+
+     ft_buf_init(&in, payload, c->hdr.length);
+
+     if (c->hdr.type == FT_MSG_BYE) {
+         conn_reply(c, FT_MSG_OK, "Goodbye");
+         c->state = STATE_CLOSING;
+         return RUN_BLOCKED;
+     }
+
+     if (c->hdr.type == FT_MSG_AUTH || c->hdr.type == FT_MSG_AUTH_PUT) {
+         return handle_auth(c, &in);
+     }
+     if (c->hdr.type != FT_MSG_PUT && c->hdr.type != FT_MSG_HAVE && c->hdr.type != FT_MSG_RESUME &&
+                c->hdr.type != FT_MSG_COMMIT && c->hdr.type != FT_MSG_SIGS && c->hdr.type != FT_MSG_GET &&
+                c->hdr.type != FT_MSG_LIST && c->hdr.type != FT_MSG_CHANGES) {
+         conn_reply(c, FT_MSG_ERROR, "Error: Unexpected message");
+         c->state = STATE_CLOSING;
+         return RUN_BLOCKED;
+     }
+
+     if (!c->authenticated) {
+         conn_reply(c, FT_MSG_ERROR, "Error: Not authenticated");
+         c->state = STATE_CLOSING;
+         return RUN_BLOCKED;
+     }
+
+     if (c->hdr.type == FT_MSG_HAVE) {
+         return handle_have(c, &in);
+     }
+     if (c->hdr.type == FT_MSG_RESUME) {
+         return handle_resume(c, &in);
+     }
+     if (c->hdr.type == FT_MSG_COMMIT) {
+         return handle_commit(c, &in);
+     }
+     if (c->hdr.type == FT_MSG_SIGS) {
+         return handle_sigs(c, &in);
+     }
+     if (c->hdr.type == FT_MSG_GET) {
+         return handle_get(c, &in);
+     }
+     if (c->hdr.type == FT_MSG_LIST) {
+         return handle_list(c, &in);
+     }
+     if (c->hdr.type == FT_MSG_CHANGES) {
+         return handle_changes(c, &in);
+     }
+     return handle_put(c, &in);
+ }
+
+ /**
+  * Reads the credentials of an AUTH or AUTH_PUT and starts checking them
+  */
+ static int handle_auth(conn_t *c, ft_buf_t *in) {
+     char password[MAX_PASSWORD_LENGTH];
+     char token[FT_TOKEN_MAX];
+
+     if (c->authenticated) {
+         conn_reply(c, FT_MSG_ERROR, "Error: Already authenticated");
+         c->state = STATE_CLOSING;
+         return RUN_BLOCKED;
+     }
+
+     int has_token = (c->hdr.flags & FT_FLAG_TOKEN) != 0;
+     if (ft_get_str(in, c->username, sizeof(c->username)) != 0 ||
+         ft_get_str(in, password, sizeof(password)) != 0 ||
+         (has_token && ft_get_str(in, token, sizeof(token)) != 0)) {
+         conn_reply(c, FT_MSG_ERROR, "Error: Malformed request");
+         c->state = STATE_CLOSING;
+         return RUN_BLOCKED;
+     }
+
+     // An AUTH_PUT's upload is read from the payload once the login is through
+     c->auth_rest = in->pos;
+     return start_auth(c, password, has_token ? token : NULL);
+ }
+
+ /**
+  * Logs the session in at once if it has a valid session token and its
+  * identity is cached, or else hands the login to the auth workers and
+  * waits in STATE_AUTH
+  */
+ static int start_auth(conn_t *c, const char *password, const char *token) {
+     if (token != NULL && auth_token_valid(c->username, token)) {
+         metrics_count(METRIC_TOKEN_LOGINS, 1);
+         int status = verify_cached_user(c->username, &c->auth_info, c->response, sizeof(c->response));
+         if (status != IDENTITY_MISS) {
+             return finish_auth(c, status);
+         }
+         // Resolving the user may wait on NSS, which no engine thread should
+         password = NULL;
+     }
+
+     c->auth_job = auth_submit(c->username, password);
+     if (c->auth_job == NULL) {
+         log_event(LOG_LEVEL_WARN, "Auth queue full", "user=%s client=%s:%d",
+                   c->username, c->client_ip, c->client_port);
+         snprintf(c->response, sizeof(c->response), "Server busy, retry after %d ms", AUTH_RETRY_MS);
+         if (c->framed) {
+             uint8_t reply[BUFFER_SIZE + sizeof(uint64_t)];
+             ft_buf_t out;
+             ft_buf_init(&out, reply, sizeof(reply));
+             ft_put_str(&out, c->response);
+             ft_put_u64(&out, AUTH_RETRY_MS);
+             conn_reply_data(c, FT_MSG_BUSY, reply, out.pos);
+         } else {
+             conn_reply(c, FT_MSG_ERROR, c->response);
+         }
+         c->state = STATE_CLOSING;
+         return RUN_BLOCKED;
+     }
+
+     c->state = STATE_AUTH;
+     // Through already, and there'll be no wake for it
+     return auth_notify(c->auth_job, conn_wake, c) ? RUN_BLOCKED : RUN_AGAIN;
+ }
+
+ /**
+  * Picks up the verdict on a password once a worker has reached it
+  */
+ static int run_auth(conn_t *c) {
+     auth_job_t *job = c->auth_job;
+     if (!auth_done(job)) {
+         return RUN_BLOCKED;
+     }
+
+     int status = job->status;
+     c->auth_info = job->auth_info;
+     memcpy(c->response, job->response, sizeof(c->response));
+     auth_release(job);
+     c->auth_job = NULL;
+     return finish_auth(c, status);
+ }
+
+ /**
+  * Answers a login and carries on with the session
+  *
+  * A framed AUTH is answered with the codecs the server can decode and a
+  * token for the client's next login; an AUTH_PUT goes on to its upload.
+  */
+ static int finish_auth(conn_t *c, int status) {
+     if (status != 0) {
+         log_event(LOG_LEVEL_WARN, "Authentication failed", "user=%s client=%s:%d",
+                   c->username, c->client_ip, c->client_port);
+         conn_reply(c, FT_MSG_ERROR, c->response);
+         c->state = STATE_CLOSING;
+         return RUN_BLOCKED;
+     }
+
+     c->authenticated = 1;
+     c->quota = quota_attach(&c->auth_info);
+     memcpy(c->auth_info.client_ip, c->client_ip, sizeof(c->client_ip));
+     log_event(LOG_LEVEL_INFO, "User authenticated", "user=%s dept=%s client=%s:%d",
+               c->auth_info.username, c->auth_info.department, c->client_ip, c->client_port);
+
+     if (!c->framed) {
+         conn_reply(c, FT_MSG_OK, c->response);
+         c->state = STATE_LEGACY_DEPARTMENT;
+         return RUN_AGAIN;
+     }
+
+     c->state = STATE_FRAME;
+     if (c->hdr.type == FT_MSG_AUTH) {
+         char token[FT_TOKEN_MAX] = "";
+         if (auth_token_issue(c->auth_info.username, token, sizeof(token)) != 0) {
+             token[0] = '\0';
+         }
+
+         uint8_t reply[BUFFER_SIZE + sizeof(uint64_t) + FT_TOKEN_MAX];
+         ft_buf_t out;
+         ft_buf_init(&out, reply, sizeof(reply));
+         ft_put_str(&out, c->response);
+         ft_put_u64(&out, codec_caps());
+         ft_put_str(&out, token);
+         conn_reply_data(c, FT_MSG_OK, reply, out.pos);
+         return RUN_AGAIN;
+     }
+
+     // The frame is still in the input buffer, which nothing reads while the login is checked
+     ft_buf_t in;
+     ft_buf_init(&in, c->in + c->in_off - c->hdr.length, c->hdr.length);
+     in.pos = c->auth_rest;
+     return handle_put(c, &in);
+ }
+
+ /**
+  * Parses the file description of a PUT (or AUTH_PUT) and starts the upload
+  */
+ static int handle_put(conn_t *c, ft_buf_t *in) {
+     // Remaining payload describes the file
+     int resumable = (c->hdr.flags & (FT_FLAG_RESUMABLE | FT_FLAG_RANGE)) != 0;
+     if ((resumable && (c->hdr.flags & FT_FLAG_CHECKSUM)) ||
+         ft_get_u64(in, &c->file_size) != 0 ||
+         ft_get_str(in, c->department, sizeof(c->department)) != 0 ||
+         ft_get_str(in, c->filepath, sizeof(c->filepath)) != 0 ||
+         (resumable && (ft_get_u64(in, &c->upload_id) != 0 || ft_get_u64(in, &c->resume_offset) != 0)) ||
+         ((c->hdr.flags & FT_FLAG_DELTA) && ft_get_u64(in, &c->delta_tag) != 0)) {
+         conn_reply(c, FT_MSG_ERROR, "Error: Malformed request");
+         c->state = STATE_CLOSING;
+         return RUN_BLOCKED;
+     }
+
+     return start_transfer(c);
+ }
+
+ /**
+  * Starts the upload or download just asked for once the user and their
+  * department are under their transfer caps, waiting in STATE_QUEUED
+  * until they are
+  *
+  * Only the request's fields in the connection are used, so it can be
+  * tried again from STATE_QUEUED.
+  */
+ static int start_transfer(conn_t *c) {
+     if (!quota_begin(c->quota, &c->slot_queued)) {
+         // Woken by a timer, and waiting its turn isn't idling
+         c->last_active_ms = monotonic_ms();
+         c->state = STATE_QUEUED;
+         return RUN_BLOCKED;
+     }
+     c->transferring = 1;
+
+     if (c->framed && c->hdr.type == FT_MSG_GET) {
+         c->state = STATE_FRAME;
+         return open_download(c);
+     }
+     return begin_upload(c);
+ }
+
+ /**
+  * Gives back the session's transfer slot, if it holds one
+  */
+ static void end_transfer(conn_t *c) {
+     if (c->transferring) {
+         quota_end(c->quota);
+         c->transferring = 0;
+     }
+ }
+
+ /**
+  * How many of want bytes the session's quota lets it move now; 0 if it
+  * must wait, with throttled_until set to when it may go on
+  */
+ static size_t conn_allowance(conn_t *c, size_t want) {
+     if (c->quota == NULL) {
+         return want;
+     }
+
+     // Woken by a timer rather than the socket, so count the progress as activity here
+     uint64_t wait_ms;
+     size_t allowed = quota_allow(c->quota, want, &wait_ms);
+     c->last_active_ms = monotonic_ms();
+     if (allowed == 0) {
+         c->throttled_until = c->last_active_ms + wait_ms;
+     }
+     return allowed;
+ }
+
+ /**
+  * Answers whether the server already holds a file's content
+  *
+  * If it does, the file is stored from that content with no body sent.
+  */
+ static int handle_have(conn_t *c, ft_buf_t *in) {
+     char digest[DIGEST_HEX_SIZE];
+
+     if (ft_get_u64(in, &c->file_size) != 0 ||
+         ft_get_str(in, c->department, sizeof(c->department)) != 0 ||
+         ft_get_str(in, c->filepath, sizeof(c->filepath)) != 0 ||
+         ft_get_str(in, digest, sizeof(digest)) != 0) {
+         conn_reply(c, FT_MSG_ERROR, "Error: Malformed request");
+         c->state = STATE_CLOSING;
+         return RUN_BLOCKED;
+     }
+
+     // Publishing waits on the committer like any upload, and so does the OK
+     pending_upload_t *p = hold_upload(c);
+     if (p == NULL) {
+         conn_reply(c, FT_MSG_ERROR, "Error: Out of memory");
+         return RUN_AGAIN;
+     }
+
+     int status = upload_have(&p->upload, &p->auth_info, c->department, c->filepath, c->file_size, digest,
+                              p->response, sizeof(p->response));
+     if (status == STORE_MISSING) {
+         conn_reply(c, FT_MSG_NEED, p->response);
+         free(p);
+         return RUN_AGAIN;
+     }
+     return hold_reply(c, p, status);
+ }
+
+ /**
+  * Answers how much of a resumable upload the server already holds
+  */
+ static int handle_resume(conn_t *c, ft_buf_t *in) {
+     uint64_t upload_id, offset;
+
+     if (ft_get_u64(in, &upload_id) != 0 ||
+         ft_get_str(in, c->department, sizeof(c->department)) != 0 ||
+         ft_get_str(in, c->filepath, sizeof(c->filepath)) != 0) {
+         conn_reply(c, FT_MSG_ERROR, "Error: Malformed request");
+         c->state = STATE_CLOSING;
+         return RUN_BLOCKED;
+     }
+
+     if (upload_query(&c->auth_info, c->department, c->filepath, upload_id, &offset,
+                      c->response, sizeof(c->response)) != STORE_OK) {
+         conn_reply(c, FT_MSG_ERROR, c->response);
+         return RUN_AGAIN;
+     }
+
+     uint8_t payload[sizeof(uint64_t)];
+     ft_buf_t out;
+     ft_buf_init(&out, payload, sizeof(payload));
+     ft_put_u64(&out, offset);
+     conn_reply_data(c, FT_MSG_OFFSET, payload, out.pos);
+     return RUN_AGAIN;
+ }
+
+ /**
+  * Publishes a file whose ranges have all been received
+  */
+ static int handle_commit(conn_t *c, ft_buf_t *in) {
+     uint64_t upload_id;
+
+     if (ft_get_u64(in, &c->file_size) != 0 ||
+         ft_get_str(in, c->department, sizeof(c->department)) != 0 ||
+         ft_get_str(in, c->filepath, sizeof(c->filepath)) != 0 ||
+         ft_get_u64(in, &upload_id) != 0) {
+         conn_reply(c, FT_MSG_ERROR, "Error: Malformed request");
+         c->state = STATE_CLOSING;
+         return RUN_BLOCKED;
+     }
+
+     pending_upload_t *p = hold_upload(c);
+     if (p == NULL) {
+         conn_reply(c, FT_MSG_ERROR, "Error: Out of memory");
+         return RUN_AGAIN;
+     }
+
+     int status = upload_assemble(&p->upload, &p->auth_info, c->department, c->filepath, upload_id,
+                                  c->file_size, p->response, sizeof(p->response));
+     return hold_reply(c, p, status);
+ }
+
+ /**
+  * Sends the block signatures of a file, for a delta upload of its next version
+  */
+ static int handle_sigs(conn_t *c, ft_buf_t *in) {
+     delta_sigs_t sigs;
+
+     if (ft_get_str(in, c->department, sizeof(c->department)) != 0 ||
+         ft_get_str(in, c->filepath, sizeof(c->filepath)) != 0) {
+         conn_reply(c, FT_MSG_ERROR, "Error: Malformed request");
+         c->state = STATE_CLOSING;
+         return RUN_BLOCKED;
+     }
+
+     int status = upload_signatures(&c->auth_info, c->department, c->filepath, &sigs,
+                                    c->response, sizeof(c->response));
+     if (status != STORE_OK) {
+         conn_reply(c, (status == STORE_MISSING) ? FT_MSG_NEED : FT_MSG_ERROR, c->response);
+         return RUN_AGAIN;
+     }
+
+     // As many frames as it takes; even an empty file gets one
+     uint64_t next = 0;
+     do {
+         uint8_t payload[FT_MAX_PAYLOAD];
+         ft_buf_t out;
+
+         ft_buf_init(&out, payload, sizeof(payload));
+         ft_put_u64(&out, sigs.block_size);
+         ft_put_u64(&out, sigs.size);
+         ft_put_u64(&out, sigs.tag);
+         for (int i = 0; i < DELTA_SIGS_PER_FRAME && next < sigs.count; i++, next++) {
+             ft_put_u64(&out, sigs.weak[next]);
+             ft_put_u64(&out, sigs.strong[next]);
+         }
+         conn_reply_data(c, FT_MSG_BLOCKS, payload, out.pos);
+     } while (next < sigs.count);
+
+     delta_sigs_free(&sigs);
+     return RUN_AGAIN;
+ }
+
+ /**
+  * Starts sending a file
+  *
+  * The FILE reply is queued like any other; conn_flush() sends the file's
+  * bytes straight after it, and no more requests are read until it has.
+  */
+ static int handle_get(conn_t *c, ft_buf_t *in) {
+     if (ft_get_str(in, c->department, sizeof(c->department)) != 0 ||
+         ft_get_str(in, c->filepath, sizeof(c->filepath)) != 0) {
+         conn_reply(c, FT_MSG_ERROR, "Error: Malformed request");
+         c->state = STATE_CLOSING;
+         return RUN_BLOCKED;
+     }
+     return start_transfer(c);
+ }
+
+ /**
+  * Opens the file a GET asked for and queues its reply; the file's bytes
+  * follow from send_download()
+  */
+ static int open_download(conn_t *c) {
+     if (download_open(&c->auth_info, c->department, c->filepath, &c->download,
+                       c->response, sizeof(c->response)) != STORE_OK) {
+         end_transfer(c);
+         conn_reply(c, FT_MSG_ERROR, c->response);
+         return RUN_AGAIN;
+     }
+
+     uint8_t payload[2 * sizeof(uint64_t)];
+     ft_buf_t out;
+     ft_buf_init(&out, payload, sizeof(payload));
+     ft_put_u64(&out, c->download->size);
+     ft_put_u64(&out, c->download->mtime.tv_sec);
+     conn_reply_data(c, FT_MSG_FILE, payload, out.pos);
+
+     log_event(LOG_LEVEL_INFO, "File download", "file=%s user=%s dept=%s size=%llu cached=%d",
+               c->download->name, c->auth_info.username, c->department,
+               (unsigned long long)c->download->size, c->download->data != NULL);
+     metrics_count(METRIC_DOWNLOADS, 1);
+
+     c->download_off = 0;
+     c->state = STATE_DOWNLOAD;
+     return RUN_BLOCKED;
+ }
+
+ /**
+  * Lists a page of the files a client may download from a department
+  */
+ static int handle_list(conn_t *c, ft_buf_t *in) {
+     char after[MAX_FILEPATH_LENGTH] = "";
+     uint64_t limit = 0;
+
+     // A bare department asks for the first page
+     if (ft_get_str(in, c->department, sizeof(c->department)) != 0 ||
+         (in->pos < in->size && (ft_get_str(in, after, sizeof(after)) != 0 || ft_get_u64(in, &limit) != 0))) {
+         conn_reply(c, FT_MSG_ERROR, "Error: Malformed request");
+         c->state = STATE_CLOSING;
+         return RUN_BLOCKED;
+     }
+
+     uint8_t payload[FT_MAX_PAYLOAD];
+     ft_buf_t out;
+     index_page_t page;
+     ft_buf_init(&out, payload, sizeof(payload));
+     c->page_out = &out;
+     c->page_type = FT_MSG_ENTRIES;
+     int status = download_list(&c->auth_info, c->department, after,
+                                (limit == 0 || limit > INDEX_PAGE_SIZE) ? INDEX_PAGE_SIZE : limit,
+                                page_entry, c, &page, c->response, sizeof(c->response));
+     end_page(c, &out, status, &page);
+     return RUN_AGAIN;
+ }
+
+ /**
+  * Sends a page of the files in a department that changed after a
+  * sequence number
+  */
+ static int handle_changes(conn_t *c, ft_buf_t *in) {
+     uint64_t since, limit;
+
+     if (ft_get_str(in, c->department, sizeof(c->department)) != 0 ||
+         ft_get_u64(in, &since) != 0 || ft_get_u64(in, &limit) != 0) {
+         conn_reply(c, FT_MSG_ERROR, "Error: Malformed request");
+         c->state = STATE_CLOSING;
+         return RUN_BLOCKED;
+     }
+
+     uint8_t payload[FT_MAX_PAYLOAD];
+     ft_buf_t out;
+     index_page_t page;
+     ft_buf_init(&out, payload, sizeof(payload));
+     c->page_out = &out;
+     c->page_type = FT_MSG_CHANGED;
+     int status = download_changes(&c->auth_info, c->department, since,
+                                   (limit == 0 || limit > INDEX_PAGE_SIZE) ? INDEX_PAGE_SIZE : limit,
+                                   page_entry, c, &page, c->response, sizeof(c->response));
+     end_page(c, &out, status, &page);
+     return RUN_AGAIN;
+ }
+
+ /**
+  * Sends the last frame of a LIST or CHANGES answer, then the OK saying
+  * where the page ended
+  */
+ static void end_page(conn_t *c, ft_buf_t *out, int status, const index_page_t *page) {
+     c->page_out = NULL;
+     if (status != STORE_OK) {
+         conn_reply(c, FT_MSG_ERROR, c->response);
+         return;
+     }
+
+     if (out->pos > 0) {
+         conn_reply_data(c, c->page_type, out->data, out->pos);
+     }
+
+     uint8_t payload[BUFFER_SIZE + 2 * sizeof(uint64_t)];
+     ft_buf_t reply;
+     ft_buf_init(&reply, payload, sizeof(payload));
+     ft_put_str(&reply, c->response);
+     ft_put_u64(&reply, page->seq);
+     ft_put_u64(&reply, page->more);
+     conn_reply_data(c, FT_MSG_OK, payload, reply.pos);
+ }
+
+ /**
+  * Adds one file to a LIST or CHANGES answer, sending the frame so far if
+  * it's full
+  */
+ static void page_entry(void *ctx, const index_entry_t *e) {
+     conn_t *c = ctx;
+     ft_buf_t *out = c->page_out;
+     size_t mark = out->pos;
+
+     for (int tries = 0; tries < 2; tries++) {
+         int full = ft_put_str(out, e->name) != 0;
+         if (c->page_type == FT_MSG_CHANGED) {
+             full = full || ft_put_str(out, e->owner) != 0;
+         }
+         full = full || ft_put_u64(out, e->size) != 0 || ft_put_u64(out, e->mtime) != 0;
+         if (c->page_type == FT_MSG_CHANGED) {
+             full = full || ft_put_u64(out, e->hash) != 0 || ft_put_u64(out, e->seq) != 0;
+         }
+         if (!full) {
+             return;
+         }
+
+         out->pos = mark;
+         if (mark == 0) {
+             return;
+         }
+         conn_reply_data(c, c->page_type, out->data, mark);
+         out->pos = mark = 0;
+     }
+ }
+
+ /**
+  * Opens the destination for the parsed upload request
+  */
+ static int begin_upload(conn_t *c) {
+     int status;
+
+     c->resumable = c->framed && (c->hdr.flags & (FT_FLAG_RESUMABLE | FT_FLAG_RANGE));
+     if (c->resumable && (c->hdr.flags & FT_FLAG_RANGE)) {
+         status = upload_open_range(&c->upload, &c->auth_info, c->department, c->filepath,
+                                    c->upload_id, c->file_size, c->resume_offset,
+                                    c->response, sizeof(c->response));
+     } else if (c->resumable) {
+         status = upload_open_resumable(&c->upload, &c->auth_info, c->department, c->filepath,
+                                        c->upload_id, c->resume_offset, c->response, sizeof(c->response));
+     } else {
+         status = upload_open(&c->upload, &c->auth_info, c->department, c->filepath,
+                              c->response, sizeof(c->response));
+     }
+
+     int codec = c->framed ? codec_from_flags(c->hdr.flags) : CODEC_NONE;
+     if (status == STORE_OK && codec != CODEC_NONE) {
+         if (c->resumable) {
+             snprintf(c->response, sizeof(c->response), "Error: Compressed uploads can't be resumed");
+             status = STORE_REJECTED;
+         } else {
+             status = upload_set_codec(&c->upload, codec, c->response, sizeof(c->response));
+         }
+         if (status != STORE_OK) {
+             upload_abort(&c->upload);
+         }
+     }
+
+     if (status == STORE_OK && c->framed && (c->hdr.flags & FT_FLAG_DELTA)) {
+         if (c->resumable) {
+             snprintf(c->response, sizeof(c->response), "Error: Delta uploads can't be resumed");
+             status = STORE_REJECTED;
+         } else {
+             status = upload_set_delta(&c->upload, c->delta_tag, c->response, sizeof(c->response));
+         }
+         if (status != STORE_OK) {
+             upload_abort(&c->upload);
+         }
+     }
+
+     c->checksummed = c->framed && (c->hdr.flags & FT_FLAG_CHECKSUM);
+     if (status == STORE_OK && c->checksummed) {
+         upload_want_hash(&c->upload);
+     }
+
+     c->reject_status = status;
+     if (status != STORE_OK) {
+         // Legacy clients get the error straight away; nothing more is read
+         if (!c->framed) {
+             conn_reply(c, FT_MSG_ERROR, c->response);
+             c->state = STATE_CLOSING;
+             return RUN_BLOCKED;
+         }
+
+         // Skip the body of a rejected upload to keep the stream in step
+         c->state = STATE_DISCARD;
+     } else {
+         c->state = STATE_BODY;
+     }
+
+     // A chunked body starts with a chunk header rather than data
+     c->chunked = c->resumable || (c->framed && (c->hdr.flags & FT_FLAG_CHUNKED));
+     c->chunk_open = 0;
+     c->body_remaining = c->chunked ? 0 : c->file_size;
+     return RUN_AGAIN;
+ }
+
+ /**
+  * Moves upload body bytes from the socket to disk
+  */
+ static int run_body(conn_t *c) {
+     char buffer[UPLOAD_COPY_SIZE];
+     const char *data;
+     size_t len;
+
+     if (c->body_remaining == 0) {
+         if (c->chunked) {
+             return run_chunk_header(c);
+         }
+         return c->checksummed ? run_trailer(c) : finish_body(c);
+     }
+
+     // Bytes that arrived along with the request frame come first
+     size_t avail = c->in_len - c->in_off;
+     if (avail > 0) {
+         len = (avail < c->body_remaining) ? avail : c->body_remaining;
+         data = (const char *)c->in + c->in_off;
+         c->in_off += len;
+     } else if (c->state == STATE_BODY && c->upload.error == 0 && c->upload.can_splice &&
+                c->pipe_fds[0] != -2 && (c->tls == NULL || tls_can_splice(c->tls))) {
+         return splice_body(c);
+     } else {
+         size_t to_read = (c->body_remaining < sizeof(buffer)) ? c->body_remaining : sizeof(buffer);
+         if (c->state == STATE_BODY && (to_read = conn_allowance(c, to_read)) == 0) {
+             return RUN_BLOCKED;
+         }
+         ssize_t n = conn_recv(c, buffer, to_read);
+         if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+             return RUN_DRAINED;
+         }
+         if (n <= 0) {
+             return RUN_CLOSE;
+         }
+         len = n;
+         data = buffer;
+     }
+
+     if (c->state == STATE_BODY) {
+         if (c->resumable) {
+             xxh64_update(&c->chunk_hash, data, len);
+         }
+         upload_write(&c->upload, data, len);
+         quota_charge(c->quota, len);
+     }
+     c->body_remaining -= len;
+
+     return RUN_AGAIN;
+ }
+
+ /**
+  * Moves upload body bytes from the socket to disk without copying them
+  *
+  * Data is spliced from the socket into a pipe and from there into the
+  * file, so it never passes through user space. The pipe is created on
+  * first use and is always empty between calls.
+  */
+ static int splice_body(conn_t *c) {
+     if (c->pipe_fds[0] < 0) {
+         if (pipe2(c->pipe_fds, O_CLOEXEC) != 0) {
+             // Out of descriptors; copy through a buffer for the rest of the session
+             c->pipe_fds[0] = -2;
+             return RUN_AGAIN;
+         }
+         fcntl(c->pipe_fds[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+     }
+
+     size_t to_move = (c->body_remaining < SPLICE_PIPE_SIZE) ? c->body_remaining : SPLICE_PIPE_SIZE;
+     if ((to_move = conn_allowance(c, to_move)) == 0) {
+         return RUN_BLOCKED;
+     }
+     ssize_t n = splice(c->fd, NULL, c->pipe_fds[1], NULL, to_move,
+                        SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+     if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+         return RUN_DRAINED;
+     }
+     if (n < 0 && c->tls != NULL) {
+         // A record the kernel can't hand over as data, e.g. a key update; OpenSSL reads the rest
+         c->upload.can_splice = 0;
+         return RUN_AGAIN;
+     }
+     if (n <= 0) {
+         return RUN_CLOSE;
+     }
+
+     upload_splice(&c->upload, c->pipe_fds[0], n);
+     quota_charge(c->quota, n);
+     c->body_remaining -= n;
+     return RUN_AGAIN;
+ }
+
+ /**
+  * Reads the length of the next chunk of a chunked upload body
+  *
+  * A zero-length chunk ends the body. The chunks of a resumable upload are
+  * checked against their checksum here once they are complete; a bad one
+  * is cut off and the connection dropped, so the client resumes from the
+  * last good chunk.
+  */
+ static int run_chunk_header(conn_t *c) {
+     size_t header_size = c->resumable ? FT_CHUNK_SUM_HEADER_SIZE : FT_CHUNK_HEADER_SIZE;
+     size_t avail = c->in_len - c->in_off;
+
+     if (c->chunk_open) {
+         c->chunk_open = 0;
+         if (c->state == STATE_BODY && xxh64_digest(&c->chunk_hash) != c->chunk_sum) {
+             upload_rollback(&c->upload);
+             log_event(LOG_LEVEL_WARN, "Chunk checksum mismatch", "client=%s:%d file=%s offset=%llu",
+                       c->client_ip, c->client_port, c->upload.filename,
+                       (unsigned long long)c->upload.committed);
+             snprintf(c->response, sizeof(c->response), "Error: Chunk checksum mismatch at offset %llu",
+                      (unsigned long long)c->upload.committed);
+             upload_abort(&c->upload);
+             conn_reply(c, FT_MSG_ERROR, c->response);
+             c->state = STATE_CLOSING;
+             return RUN_BLOCKED;
+         }
+         if (c->state == STATE_BODY) {
+             upload_commit(&c->upload);
+         }
+     }
+
+     if (avail >= header_size) {
+         uint32_t length;
+         memcpy(&length, c->in + c->in_off, sizeof(length));
+         if (c->resumable) {
+             ft_buf_t in;
+             ft_buf_init(&in, c->in + c->in_off + sizeof(length), sizeof(uint64_t));
+             ft_get_u64(&in, &c->chunk_sum);
+         }
+         c->in_off += header_size;
+
+         c->body_remaining = ntohl(length);
+         if (c->body_remaining == 0) {
+             c->chunked = 0;
+             return c->checksummed ? run_trailer(c) : finish_body(c);
+         }
+
+         c->chunk_open = c->resumable;
+         xxh64_init(&c->chunk_hash, 0);
+         return RUN_AGAIN;
+     }
+
+     // Make room for the rest of the chunk header
+     memmove(c->in, c->in + c->in_off, avail);
+     c->in_off = 0;
+     c->in_len = avail;
+
+     ssize_t n = conn_recv(c, c->in + c->in_len, sizeof(c->in) - c->in_len);
+     if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+         return RUN_DRAINED;
+     }
+     if (n <= 0) {
+         return RUN_CLOSE;
+     }
+
+     c->in_len += n;
+     return RUN_AGAIN;
+ }
+
+ /**
+  * Reads the checksum that follows the body of a checksummed upload
+  */
+ static int run_trailer(conn_t *c) {
+     size_t avail = c->in_len - c->in_off;
+
+     if (avail >= sizeof(uint64_t)) {
+         ft_buf_t in;
+         ft_buf_init(&in, c->in + c->in_off, sizeof(uint64_t));
+         ft_get_u64(&in, &c->upload.expected_hash);
+         c->in_off += sizeof(uint64_t);
+         c->checksummed = 0;
+         return finish_body(c);
+     }
+
+     // Make room for the rest of the checksum
+     memmove(c->in, c->in + c->in_off, avail);
+     c->in_off = 0;
+     c->in_len = avail;
+
+     ssize_t n = conn_recv(c, c->in + c->in_len, sizeof(c->in) - c->in_len);
+     if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+         return RUN_DRAINED;
+     }
+     if (n <= 0) {
+         return RUN_CLOSE;
+     }
+
+     c->in_len += n;
+     return RUN_AGAIN;
+ }
+
+ /**
+  * Completes the current upload and queues its reply
+  */
+ static int finish_body(conn_t *c) {
+     int status = STORE_REJECTED;
+
+     end_transfer(c);
+     if (c->state == STATE_BODY && durable_level() != DURABLE_NONE) {
+         return defer_upload(c);
+     }
+     if (c->state == STATE_BODY) {
+         status = upload_finish(&c->upload, &c->auth_info, c->response, sizeof(c->response));
+     }
+     return reply_upload(c, status);
+ }
+
+ /**
+  * Hands the current upload to the committer and moves on to the next
+  * request
+  *
+  * The upload moves out of the session into the syncing list, where its
+  * reply waits until collect_synced() finds the file durable.
+  */
+ static int defer_upload(conn_t *c) {
+     pending_upload_t *p = hold_upload(c);
+     if (p == NULL) {
+         upload_abort(&c->upload);
+         snprintf(c->response, sizeof(c->response), "Error: Out of memory");
+         return reply_upload(c, STORE_REJECTED);
+     }
+
+     int status = upload_finish(&p->upload, &p->auth_info, p->response, sizeof(p->response));
+     if (status != STORE_PENDING) {
+         answer_upload(c, p->request_id, status, &p->upload, p->response);
+         free(p);
+         return next_request(c);
+     }
+     return hold_reply(c, p, status);
+ }
+
+ /**
+  * Moves the session's upload, and who it's for, into a pending upload for
+  * the current request, leaving the session free for the next one
+  */
+ static pending_upload_t *hold_upload(conn_t *c) {
+     pending_upload_t *p = malloc(sizeof(*p));
+     if (p == NULL) {
+         return NULL;
+     }
+
+     p->upload = c->upload;
+     p->auth_info = c->auth_info;
+     p->request_id = c->hdr.request_id;
+     p->next = NULL;
+     upload_init(&c->upload);
+     return p;
+ }
+
+ /**
+  * Answers a held upload at once, or puts it on the syncing list while the
+  * committer has it
+  */
+ static int hold_reply(conn_t *c, pending_upload_t *p, int status) {
+     if (status != STORE_PENDING) {
+         answer_upload(c, p->request_id, status, &p->upload, p->response);
+         free(p);
+         return RUN_AGAIN;
+     }
+
+     pending_upload_t **tail = &c->syncing;
+     while (*tail != NULL) {
+         tail = &(*tail)->next;
+     }
+     *tail = p;
+     c->in_flight++;
+
+     // Through already, and there'll be no wake for it; come back for it at once
+     if (!upload_notify(&p->upload, conn_wake, c)) {
+         conn_wake(c);
+     }
+
+     // A legacy client sends nothing more; it just waits for this reply
+     if (!c->framed) {
+         c->state = STATE_SYNC;
+         return RUN_BLOCKED;
+     }
+     c->state = STATE_FRAME;
+     return RUN_AGAIN;
+ }
+
+ /**
+  * Replies to every held upload the committer has made durable
+  *
+  * Requests served meanwhile have been answered already, so replies don't
+  * come in the order they were asked for; the request ID tells the client
+  * which is which.
+  */
+ static void collect_synced(conn_t *c) {
+     for (pending_upload_t **link = &c->syncing; *link != NULL; ) {
+         pending_upload_t *p = *link;
+         int status = upload_complete(&p->upload, 0);
+         if (status == STORE_PENDING) {
+             link = &p->next;
+             continue;
+         }
+
+         answer_upload(c, p->request_id, status, &p->upload, p->response);
+         *link = p->next;
+         c->in_flight--;
+         free(p);
+         if (c->state == STATE_SYNC) {
+             c->state = STATE_CLOSING;
+         }
+     }
+ }
+
+ /**
+  * Waits for collect_synced() to answer a legacy session's upload
+  */
+ static int run_sync(conn_t *c) {
+     (void)c;
+     return RUN_BLOCKED;
+ }
+
+ /**
+  * Queues the reply to a finished upload and moves on to the next request
+  */
+ static int reply_upload(conn_t *c, int status) {
+     // A delta against a file that has since changed is sent again in full
+     if (c->state == STATE_DISCARD && c->reject_status == STORE_MISSING) {
+         conn_reply(c, FT_MSG_NEED, c->response);
+     } else {
+         answer_upload(c, c->hdr.request_id, status, &c->upload, c->response);
+     }
+     return next_request(c);
+ }
+
+ /**
+  * Queues the OK or ERROR that answers an upload
+  */
+ static void answer_upload(conn_t *c, uint32_t request_id, int status, const upload_t *up, const char *response) {
+     if (status != STORE_OK) {
+         conn_answer(c, request_id, FT_MSG_ERROR, response, strlen(response));
+         return;
+     }
+     c->files_received++;
+
+     // A checksummed upload's OK gives back the hash it was verified against
+     if (up->checksummed) {
+         uint8_t reply[BUFFER_SIZE + sizeof(uint64_t)];
+         ft_buf_t out;
+         ft_buf_init(&out, reply, sizeof(reply));
+         ft_put_str(&out, response);
+         ft_put_u64(&out, up->expected_hash);
+         conn_answer(c, request_id, FT_MSG_OK, reply, out.pos);
+     } else {
+         conn_answer(c, request_id, FT_MSG_OK, response, strlen(response));
+     }
+ }
+
+ /**
+  * Goes back to waiting for a request, or closes a legacy session after
+  * its one upload
+  */
+ static int next_request(conn_t *c) {
+     if (!c->framed) {
+         c->state = STATE_CLOSING;
+         return RUN_BLOCKED;
+     }
+
+     c->state = STATE_FRAME;
+     return RUN_AGAIN;
+ }
+
+ /**
+  * Receives one legacy field
+  *
+  * Returns 1 once a field arrived, 0 if nothing is available yet, or -1
+  * if the connection is gone.
+  */
+ static int recv_field(conn_t *c, char *field, size_t size) {
+     memset(field, 0, size);
+     ssize_t n = conn_recv(c, field, size - 1);
+
+     if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+         return 0;
+     }
+
+     return (n > 0) ? 1 : -1;
+ }
+
+ /**
+  * Reads from the client, through TLS if the connection uses it
+  */
+ static ssize_t conn_recv(conn_t *c, void *buf, size_t len) {
+     return (c->tls != NULL) ? tls_read(c->tls, buf, len) : recv(c->fd, buf, len, 0);
+ }
+
+ /**
+  * Writes to the client, through TLS if the connection uses it
+  */
+ static ssize_t conn_send(conn_t *c, const void *buf, size_t len) {
+     return (c->tls != NULL) ? tls_write(c->tls, buf, len) : send(c->fd, buf, len, MSG_NOSIGNAL);
+ }
+
+ /**
+  * Queues a text reply, framed or raw depending on the client's protocol
+  */
+ static void conn_reply(conn_t *c, uint8_t type, const char *message) {
+     conn_reply_data(c, type, message, strlen(message));
+ }
+
+ /**
+  * Queues a reply with a binary payload
+  */
+ static void conn_reply_data(conn_t *c, uint8_t type, const void *data, size_t length) {
+     conn_answer(c, c->hdr.request_id, type, data, length);
+ }
+
+ /**
+  * Queues a reply to a request other than the one being served
+  *
+  * Room for the header and payload is made first, so a reply is queued
+  * whole or not at all; if not, the session is marked to be dropped.
+  */
+ static void conn_answer(conn_t *c, uint32_t request_id, uint8_t type, const void *data, size_t length) {
+     size_t header_len = c->framed ? FT_HEADER_SIZE : 0;
+
+     if (c->out_failed) {
+         return;
+     }
+     if (conn_reserve(c, header_len + length) != 0) {
+         log_event(LOG_LEVEL_ERROR, "Reply not queued", "client=%s:%d bytes=%zu error=%s", c->client_ip,
+                   c->client_port, header_len + length, strerror(ENOMEM));
+         c->out_failed = 1;
+         return;
+     }
+
+     if (c->framed) {
+         ft_header_t hdr = {
+             .magic = FT_MAGIC,
+             .version = FT_VERSION,
+             .type = type,
+             .request_id = request_id,
+             .length = length,
+         };
+
+         ft_encode_header(&hdr, c->out + c->out_len);
+         c->out_len += FT_HEADER_SIZE;
+     }
+
+     memcpy(c->out + c->out_len, data, length);
+     c->out_len += length;
+ }
+
+ /**
+  * Makes room for len more bytes in the output buffer
+  */
+ static int conn_reserve(conn_t *c, size_t len) {
+     if (c->out_len + len > c->out_cap) {
+         size_t cap = (c->out_cap > 0) ? c->out_cap : BUFFER_SIZE;
+         while (cap < c->out_len + len) {
+             cap *= 2;
+         }
+
+         uint8_t *out = realloc(c->out, cap);
+         if (out == NULL) {
+             return -1;
+         }
+         c->out = out;
+         c->out_cap = cap;
+     }
+
+     return 0;
+ }
+
+ /**
+  * Writes as much queued output as the socket will take
+  *
+  * Returns 0 unless the connection failed.
+  */
+ static int conn_flush(conn_t *c) {
+     while (c->out_off < c->out_len) {
+         ssize_t n = conn_send(c, c->out + c->out_off, c->out_len - c->out_off);
+         if (n < 0) {
+             if (errno == EINTR) {
+                 continue;
+             }
+             return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+         }
+         c->out_off += n;
+     }
+
+     c->out_off = c->out_len = 0;
+     return (c->download != NULL) ? send_download(c) : 0;
+ }
+
+ /**
+  * Sends as much of the file being downloaded as the socket will take
+  *
+  * sendfile() copies from the page cache, which a cached file keeps
+  * resident; where the socket can't take it, a mapped file is sent with
+  * send() and anything else is read through a buffer. At most
+  * DOWNLOAD_BURST bytes go per call so one download can't hold up the
+  * other connections on an event loop. Returns 0 unless the connection
+  * failed.
+  */
+ static int send_download(conn_t *c) {
+     cached_file_t *f = c->download;
+     uint64_t burst_end = c->download_off + DOWNLOAD_BURST;
+
+     while (c->download_off < f->size && c->download_off < burst_end) {
+         size_t len = ((burst_end < f->size) ? burst_end : f->size) - c->download_off;
+         if ((len = conn_allowance(c, len)) == 0) {
+             return 0;
+         }
+         ssize_t n;
+
+         if (!c->download_copy) {
+             off_t off = c->download_off;
+             n = (c->tls != NULL) ? tls_sendfile(c->tls, f->fd, off, len) : sendfile(c->fd, f->fd, &off, len);
+             if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                 c->download_copy = 1;
+                 continue;
+             }
+         } else if (f->data != NULL) {
+             n = conn_send(c, (const char *)f->data + c->download_off, len);
+         } else {
+             char buffer[UPLOAD_COPY_SIZE];
+             n = pread(f->fd, buffer, (len < sizeof(buffer)) ? len : sizeof(buffer), c->download_off);
+             if (n > 0) {
+                 n = conn_send(c, buffer, n);
+             }
+         }
+
+         if (n < 0) {
+             if (errno == EINTR) {
+                 continue;
+             }
+             return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+         }
+         if (n == 0) {
+             // The file shrank under us; the stream can't be kept in step
+             return -1;
+         }
+         c->download_off += n;
+         quota_charge(c->quota, n);
+         metrics_count(METRIC_BYTES_SENT, n);
+     }
+
+     if (c->download_off < f->size) {
+         return 0;
+     }
+
+     cache_release(f);
+     c->download = NULL;
+     c->download_copy = 0;
+     end_transfer(c);
+     c->state = STATE_FRAME;
+     return 0;
+ }
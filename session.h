@@ -0,0 +1,140 @@
+/**
+ * Client Sessions for the File Transfer Server
+ *
+ * Each connection is driven by a non-blocking state machine that handles
+ * both the framed protocol and the legacy sleep-separated one. Engines
+ * (a thread per connection, or an epoll event loop) wait for the socket
+ * to become ready and then call conn_handle(), which does as much work as
+ * it can without blocking and returns what it wants to wait for next.
+ *
+ * A session waiting on another thread, the committer or an auth worker,
+ * isn't polled: that thread queues it on its engine's waker and makes the
+ * waker's eventfd readable, and the engine then takes each woken
+ * connection off with conn_woken() and calls conn_handle() with
+ * CONN_EV_WAKE.
+ */
+
+ #ifndef SESSION_H
+ #define SESSION_H
+
+ #include <stdint.h>
+ #include <pthread.h>
+ #include <netinet/in.h>
+ #include <arpa/inet.h>
+
+ #include "protocol.h"
+ #include "server.h"
+ #include "storage.h"
+ #include "tls.h"
+ #include "auth.h"
+ #include "quota.h"
+
+ // Events passed to conn_handle()
+ #define CONN_EV_READ 0x1
+ #define CONN_EV_WRITE 0x2
+ #define CONN_EV_TIMER 0x4
+ #define CONN_EV_WAKE 0x8         // Taken off the engine's waker
+
+ // Interest returned by conn_handle(); 0 means close the connection
+ #define CONN_WANT_READ 0x1
+ #define CONN_WANT_WRITE 0x2
+ #define CONN_WANT_TIMER 0x4
+ #define CONN_WANT_WAKE 0x8       // Waiting on a thread that will wake it through the waker
+
+ struct pending_upload;
+ struct conn;
+
+ // Where threads outside an engine queue the connections they have finished work for
+ typedef struct {
+     int fd;                      // eventfd the engine watches; readable while any are queued
+     pthread_mutex_t lock;
+     struct conn *woken;          // Linked through wake_next
+ } conn_waker_t;
+
+ typedef struct conn {
+     int fd;
+     char client_ip[INET_ADDRSTRLEN];
+     int client_port;
+     int state;
+     int framed;
+     tls_t *tls;                  // TLS session, or NULL for plain TCP
+     uint64_t last_active_ms;
+     uint64_t wake_at_ms;         // When a CONN_WANT_TIMER wait ends
+     int timer_wanted;            // The last conn_handle() asked for CONN_WANT_TIMER
+     conn_waker_t *waker;         // The engine's, for the committer and auth workers
+     struct conn *wake_next;      // Guarded by the waker's lock, like wake_queued
+     int wake_queued;
+
+     // Session
+     char username[MAX_USERNAME_LENGTH];
+     int authenticated;
+     auth_info_t auth_info;
+     int files_received;
+     auth_job_t *auth_job;        // Login the auth workers are checking, or NULL
+     size_t auth_rest;            // Where an AUTH_PUT's file description starts in its payload
+     quota_user_t *quota;         // Limits the session's transfers count against, or NULL
+     int transferring;            // Holds one of the user's transfer slots
+     int slot_queued;             // Counted as waiting for a server-wide slot (see quota_begin())
+     uint64_t throttled_until;    // Over its rate: when to read or send again, or 0
+
+     // Buffered input not yet consumed
+     size_t in_off;
+     size_t in_len;
+     uint8_t in[FT_HEADER_SIZE + FT_MAX_PAYLOAD];
+
+     // Replies not yet written
+     uint8_t *out;
+     size_t out_off;
+     size_t out_len;
+     size_t out_cap;
+     int out_failed;              // A reply couldn't be queued, so the session is dropped
+     int in_flight;               // Requests taken but not answered yet
+
+     // Request being served
+     ft_header_t hdr;
+     char department[MAX_DEPT_LENGTH];
+     char filepath[MAX_FILEPATH_LENGTH];
+     uint64_t file_size;
+     uint64_t body_remaining;     // Of the whole body, or of the current chunk if chunked
+     int chunked;
+     int resumable;               // Chunks carry checksums and are verified one by one
+     int checksummed;             // The file's XXH64 is still to come after the body
+     uint64_t upload_id;
+     uint64_t resume_offset;
+     uint64_t delta_tag;          // Version of the file a delta upload applies to
+     int reject_status;           // Why the body being discarded was refused (STORE_*)
+     int chunk_open;              // A checksummed chunk is being received
+     uint64_t chunk_sum;          // Checksum the current chunk should have
+     xxh64_state_t chunk_hash;
+     int pipe_fds[2];             // Splices upload bodies to disk; -2 if unavailable
+     upload_t upload;
+     struct pending_upload *syncing;  // Uploads whose replies wait on the committer, oldest first
+     cached_file_t *download;     // File whose bytes follow the queued replies, or NULL
+     uint64_t download_off;
+     int download_copy;           // Sent without sendfile(), which the socket refused
+     ft_buf_t *page_out;          // LIST or CHANGES answer being built
+     uint8_t page_type;           // Frame type it's sent in
+     char response[BUFFER_SIZE];
+
+     // Owned by the engine driving this connection
+     struct conn *prev;
+     struct conn *next;
+     struct conn *timer_prev;
+     struct conn *timer_next;
+     uint32_t events;
+ } conn_t;
+
+ uint64_t monotonic_ms(void);
+
+ void session_configure(int idle_timeout, int in_flight, int buffer_size);
+ int conn_active(void);
+ int conn_waker_init(conn_waker_t *w);
+ void conn_waker_close(conn_waker_t *w);
+ conn_t *conn_woken(conn_waker_t *w);
+ conn_t *conn_create(int fd, const struct sockaddr_in *address, conn_waker_t *waker);
+ int conn_handle(conn_t *c, int events);
+ uint64_t conn_deadline(const conn_t *c);
+ void conn_destroy(conn_t *c);
+ void conn_reject_busy(int fd, uint64_t retry_after_ms);
+
+ #endif
@@ -0,0 +1,1346 @@
+/**
+ * Upload Storage for the File Transfer Server
+ *
+ * Writes uploads into the department directories and records who owns
+ * each file. Uploads are staged out of sight and published with rename(),
+ * so a reader never sees a half-written file.
+ *
+ * With deduplication enabled, every upload is hashed as it streams in and
+ * its content is kept once in BLOB_DIR under "<sha256>-<size>" (or
+ * "<xxh64>-<size>" when built without OpenSSL). Department files are hard
+ * links to those blobs, so the blob's link count is its reference count; a
+ * blob with a single link is no longer used by any department and can be
+ * deleted. Blobs are shared between owners, so the file's uid isn't
+ * changed in this mode and the owner kept in the index (see index.c) is
+ * the only attribution. An upload only shares a blob whose bytes it
+ * matches, so a planted hash collision can't replace anyone's content,
+ * and HAVE needs the SHA-256: content is only handed to a client that
+ * proves it already holds it.
+ *
+ * A resumable upload is received into ".upload-<uid>-<id>" instead, named
+ * after the user and their upload ID, and survives a dropped connection.
+ * The file is cut back to the last verified chunk whenever a transfer
+ * ends early, so its length is the offset to resume from.
+ *
+ * A large file can also arrive as several ranges over parallel
+ * connections. They share one partial file, allocated at full size by the
+ * first range and written in place with pwrite(). A table in memory
+ * records which parts have arrived, and upload_assemble() publishes the
+ * file once they cover all of it.
+ *
+ * Every publish goes through publish(), which syncs the file's data before
+ * the rename and its directory after, as far as the durability level asks
+ * (see durable.c). Whenever anything is synced, upload_finish(),
+ * upload_have() and upload_assemble() leave the syncs and the rename to
+ * the committer and return STORE_PENDING; the session collects the
+ * outcome with upload_complete() before it replies.
+ */
+
+ #define _GNU_SOURCE              // O_TMPFILE
+
+ #include <stdio.h>
+ #include <stdlib.h>
+ #include <stddef.h>
+ #include <string.h>
+ #include <unistd.h>
+ #include <pthread.h>
+ #include <fcntl.h>
+ #include <errno.h>
+ #include <stdatomic.h>
+ #include <sys/stat.h>
+ #include <sys/file.h>
+
+ #include "storage.h"
+ #include "metrics.h"
+ #include "log.h"
+
+ #define FILE_LOCK_STRIPES 256    // Power of two
+
+ // Serialise the publish step for the same destination, so a file and its
+ // index entry always come from the same upload. Each path hashes to one
+ // stripe. The lock is only held for the rename and the index update,
+ // never while waiting on the network.
+ static pthread_mutex_t file_locks[FILE_LOCK_STRIPES];
+ static pthread_once_t file_locks_once = PTHREAD_ONCE_INIT;
+
+ // Makes staging file names unique within this process
+ static atomic_uint staging_counter;
+
+ // A file being received as ranges over several connections
+ typedef struct range_upload {
+     int dept_id;
+     char name[sizeof(((upload_t *)0)->staging)];  // Its partial file
+     uint64_t size;
+     int writers;                 // Ranges being received right now
+     uint64_t (*received)[2];     // [start, end) parts, sorted and merged
+     int count;
+     int capacity;
+     struct range_upload *next;
+ } range_upload_t;
+
+ static range_upload_t *range_uploads;
+ static pthread_mutex_t range_lock = PTHREAD_MUTEX_INITIALIZER;
+
+ // Content-addressed blob store; set up once by storage_init()
+ static int dedup_enabled;
+ static int blob_dir_fd = -1;
+
+ static void init_file_locks(void);
+ static unsigned lock_stripe(int dept_id, const char *filename);
+ static void staging_name(char *name, size_t size);
+ static void partial_name(const auth_info_t *auth_info, uint64_t upload_id, char *name, size_t size);
+ static int open_staging(const dept_t *dept, char *name, size_t size);
+ static int resolve_target(const auth_info_t *auth_info, const char *department, const char *filepath,
+                           const dept_t **dept, const char **filename, char *response, size_t response_size);
+ static int write_out(void *ctx, const void *data, size_t len);
+ static int write_delta(void *ctx, const void *data, size_t len);
+ static void free_decoder(upload_t *up);
+ static range_upload_t *find_range_upload(int dept_id, const char *name);
+ static void end_range(upload_t *up);
+ static void blob_name(const char *key, uint64_t size, char *name, size_t size_of_name);
+ static int same_content(int fd_a, int fd_b);
+ static int store_blob(upload_t *up);
+ static void prepare_publish(publish_t *p, const dept_t *dept, const char *filename, const char *staging,
+                             int fd, const auth_info_t *auth_info, char *response, size_t response_size);
+ static int open_for_sync(const dept_t *dept, const char *name);
+ static int finish_publish(upload_t *up);
+ static int publish(publish_t *p);
+ static void publish_synced(durable_job_t *job);
+ static void release_upload(durable_job_t *job);
+ static int rename_into_place(publish_t *p);
+ static int settle(publish_t *p);
+ static void count_upload(const upload_t *up, int status);
+
+ /**
+  * Initialises the lock table on first use
+  */
+ static void init_file_locks(void) {
+     for (int i = 0; i < FILE_LOCK_STRIPES; i++) {
+         pthread_mutex_init(&file_locks[i], NULL);
+     }
+ }
+
+ /**
+  * Picks the lock stripe for a destination file (FNV-1a hash)
+  */
+ static unsigned lock_stripe(int dept_id, const char *filename) {
+     uint32_t hash = (2166136261u ^ (uint32_t)dept_id) * 16777619u;
+
+     for (const unsigned char *p = (const unsigned char *)filename; *p; p++) {
+         hash ^= *p;
+         hash *= 16777619u;
+     }
+
+     return hash & (FILE_LOCK_STRIPES - 1);
+ }
+
+ /**
+  * Picks a fresh name for a hidden staging file
+  */
+ static void staging_name(char *name, size_t size) {
+     snprintf(name, size, ".partial-%d-%u", (int)getpid(), atomic_fetch_add(&staging_counter, 1));
+ }
+
+ /**
+  * Names the partial file of a user's resumable upload
+  */
+ static void partial_name(const auth_info_t *auth_info, uint64_t upload_id, char *name, size_t size) {
+     snprintf(name, size, ".upload-%u-%016llx", (unsigned)auth_info->uid, (unsigned long long)upload_id);
+ }
+
+ /**
+  * Creates a uniquely named hidden staging file in the department directory
+  */
+ static int open_staging(const dept_t *dept, char *name, size_t size) {
+     staging_name(name, size);
+     return openat(dept->dir_fd, name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+ }
+
+ /**
+  * Chooses the storage backend
+  *
+  * Must be called once at startup, after the departments are loaded.
+  */
+ int storage_init(int dedup) {
+     if (!dedup) {
+         return 0;
+     }
+
+     mkdir(BLOB_DIR, 0700);
+     blob_dir_fd = open(BLOB_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+     if (blob_dir_fd < 0) {
+         fprintf(stderr, "Cannot open blob store %s: %s\n", BLOB_DIR, strerror(errno));
+         return -1;
+     }
+
+     dedup_enabled = 1;
+     printf("Deduplicating uploads into %s\n", BLOB_DIR);
+     return 0;
+ }
+
+ /**
+  * Marks an upload as not open
+  */
+ void upload_init(upload_t *up) {
+     up->fd = -1;
+     up->error = 0;
+     up->resumable = 0;
+     up->range = NULL;
+     up->decoder = NULL;
+     up->delta = NULL;
+     up->digest = NULL;
+     up->content_digest[0] = '\0';
+     up->bodiless = 0;
+ }
+
+ /**
+  * Checks access and creates a staging file for the upload
+  *
+  * The body is received into an anonymous O_TMPFILE (or a hidden .partial
+  * file where the filesystem lacks O_TMPFILE) in the department directory,
+  * so the live file is untouched until upload_finish() publishes it.
+  *
+  * Returns STORE_OK, or STORE_REJECTED with response filled in.
+  */
+ int upload_open(upload_t *up, const auth_info_t *auth_info, const char *department,
+                 const char *filepath, char *response, size_t response_size) {
+     const char *filename;
+
+     if (resolve_target(auth_info, department, filepath, &up->dept, &filename,
+                        response, response_size) != 0) {
+         return STORE_REJECTED;
+     }
+     up->started_us = metrics_now_us();
+
+     // Receive into a file nobody else can see yet
+     up->staging[0] = '\0';
+     up->fd = openat(up->dept->dir_fd, ".", O_TMPFILE | O_WRONLY | O_CLOEXEC, 0666);
+     if (up->fd < 0 && (errno == EOPNOTSUPP || errno == EISDIR || errno == EINVAL)) {
+         up->fd = open_staging(up->dept, up->staging, sizeof(up->staging));
+     }
+     if (up->fd < 0) {
+         snprintf(response, response_size, "Error: Cannot create file: %s", strerror(errno));
+         return STORE_REJECTED;
+     }
+
+     up->error = 0;
+     up->bytes = 0;
+     up->resumable = 0;
+     up->base = 0;
+     up->range = NULL;
+     up->decoder = NULL;
+     up->delta = NULL;
+     up->bodiless = 0;
+     up->checksummed = 0;
+     // Content must pass through user space to be hashed
+     up->can_splice = !dedup_enabled;
+     xxh64_init(&up->hash, 0);
+     up->digest = dedup_enabled ? digest_new() : NULL;
+     up->content_digest[0] = '\0';
+     snprintf(up->filename, sizeof(up->filename), "%s", filename);
+     return STORE_OK;
+ }
+
+ /**
+  * Reports how much of a resumable upload the server holds
+  */
+ int upload_query(const auth_info_t *auth_info, const char *department, const char *filepath,
+                  uint64_t upload_id, uint64_t *offset, char *response, size_t response_size) {
+     const dept_t *dept;
+     const char *filename;
+     char name[sizeof(((upload_t *)0)->staging)];
+     struct stat st;
+
+     if (resolve_target(auth_info, department, filepath, &dept, &filename,
+                        response, response_size) != 0) {
+         return STORE_REJECTED;
+     }
+
+     partial_name(auth_info, upload_id, name, sizeof(name));
+     if (fstatat(dept->dir_fd, name, &st, 0) == 0) {
+         *offset = st.st_size;
+     } else if (errno == ENOENT) {
+         *offset = 0;
+     } else {
+         snprintf(response, response_size, "Error: Cannot check upload: %s", strerror(errno));
+         return STORE_REJECTED;
+     }
+
+     return STORE_OK;
+ }
+
+ /**
+  * Opens the partial file of a resumable upload, positioned at offset
+  *
+  * Offset 0 starts the upload over; any other offset must be exactly what
+  * upload_query() reports.
+  */
+ int upload_open_resumable(upload_t *up, const auth_info_t *auth_info, const char *department,
+                           const char *filepath, uint64_t upload_id, uint64_t offset,
+                           char *response, size_t response_size) {
+     const char *filename;
+     struct stat st;
+
+     if (resolve_target(auth_info, department, filepath, &up->dept, &filename,
+                        response, response_size) != 0) {
+         return STORE_REJECTED;
+     }
+     up->started_us = metrics_now_us();
+
+     partial_name(auth_info, upload_id, up->staging, sizeof(up->staging));
+     int fd = openat(up->dept->dir_fd, up->staging, O_WRONLY | O_CREAT | O_CLOEXEC, 0666);
+     if (fd < 0) {
+         snprintf(response, response_size, "Error: Cannot create file: %s", strerror(errno));
+         return STORE_REJECTED;
+     }
+
+     // One connection at a time may add to a partial file
+     if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+         close(fd);
+         snprintf(response, response_size, "Error: Upload already in progress");
+         return STORE_REJECTED;
+     }
+
+     if (fstat(fd, &st) != 0 || (offset == 0 && ftruncate(fd, 0) != 0)) {
+         snprintf(response, response_size, "Error: Cannot write file: %s", strerror(errno));
+         close(fd);
+         return STORE_REJECTED;
+     }
+     if (offset != 0 && offset != (uint64_t)st.st_size) {
+         snprintf(response, response_size, "Error: Upload can only resume at offset %llu",
+                  (unsigned long long)st.st_size);
+         close(fd);
+         return STORE_REJECTED;
+     }
+     lseek(fd, offset, SEEK_SET);
+
+     up->fd = fd;
+     up->error = 0;
+     up->bytes = 0;
+     up->resumable = 1;
+     up->base = offset;
+     up->committed = offset;
+     up->range = NULL;
+     up->decoder = NULL;
+     up->digest = NULL;
+     up->content_digest[0] = '\0';
+     up->bodiless = 0;
+     up->checksummed = 0;
+     up->can_splice = 0;          // Chunks are checksummed on the way through
+     xxh64_init(&up->hash, 0);
+     snprintf(up->filename, sizeof(up->filename), "%s", filename);
+     return STORE_OK;
+ }
+
+ /**
+  * Opens one range of a file that is being sent over several connections
+  *
+  * The first range to arrive allocates the partial file at the full size
+  * so the others can be written into it as they come. The body is written
+  * from offset onwards and must not run past size.
+  */
+ int upload_open_range(upload_t *up, const auth_info_t *auth_info, const char *department,
+                       const char *filepath, uint64_t upload_id, uint64_t size, uint64_t offset,
+                       char *response, size_t response_size) {
+     const char *filename;
+
+     if (resolve_target(auth_info, department, filepath, &up->dept, &filename,
+                        response, response_size) != 0) {
+         return STORE_REJECTED;
+     }
+     up->started_us = metrics_now_us();
+     if (offset > size) {
+         snprintf(response, response_size, "Error: Range starts past the end of the file");
+         return STORE_REJECTED;
+     }
+
+     partial_name(auth_info, upload_id, up->staging, sizeof(up->staging));
+
+     pthread_mutex_lock(&range_lock);
+     range_upload_t *r = find_range_upload(up->dept->id, up->staging);
+     if (r != NULL && r->size != size) {
+         pthread_mutex_unlock(&range_lock);
+         snprintf(response, response_size, "Error: Upload is already under way with another size");
+         return STORE_REJECTED;
+     }
+
+     int fd = openat(up->dept->dir_fd, up->staging, O_WRONLY | O_CREAT | O_CLOEXEC, 0666);
+     if (fd >= 0 && r == NULL) {
+         // Reserve the space up front; extents are laid out once rather than range by range
+         if (fallocate(fd, 0, 0, size) != 0 && (errno != EOPNOTSUPP || ftruncate(fd, size) != 0)) {
+             close(fd);
+             fd = -1;
+         } else if ((r = calloc(1, sizeof(*r))) == NULL) {
+             close(fd);
+             fd = -1;
+             errno = ENOMEM;
+         } else {
+             r->dept_id = up->dept->id;
+             snprintf(r->name, sizeof(r->name), "%s", up->staging);
+             r->size = size;
+             r->next = range_uploads;
+             range_uploads = r;
+         }
+     }
+     if (fd < 0) {
+         pthread_mutex_unlock(&range_lock);
+         snprintf(response, response_size, "Error: Cannot create file: %s", strerror(errno));
+         return STORE_REJECTED;
+     }
+     r->writers++;
+     pthread_mutex_unlock(&range_lock);
+
+     up->fd = fd;
+     up->error = 0;
+     up->bytes = 0;
+     up->resumable = 1;
+     up->base = offset;
+     up->committed = offset;
+     up->range = r;
+     up->decoder = NULL;
+     up->digest = NULL;
+     up->content_digest[0] = '\0';
+     up->bodiless = 0;
+     up->checksummed = 0;
+     up->can_splice = 0;          // Chunks are checksummed on the way through
+     snprintf(up->filename, sizeof(up->filename), "%s", filename);
+     return STORE_OK;
+ }
+
+ /**
+  * Publishes a file sent as ranges, once they cover all of it
+  *
+  * up holds the publish until it's through; like upload_finish(), this
+  * returns STORE_PENDING while the committer has it.
+  */
+ int upload_assemble(upload_t *up, const auth_info_t *auth_info, const char *department,
+                     const char *filepath, uint64_t upload_id, uint64_t size,
+                     char *response, size_t response_size) {
+     const dept_t *dept;
+     const char *filename;
+     char *name = up->staging;
+
+     if (resolve_target(auth_info, department, filepath, &dept, &filename,
+                        response, response_size) != 0) {
+         return STORE_REJECTED;
+     }
+
+     partial_name(auth_info, upload_id, name, sizeof(up->staging));
+
+     pthread_mutex_lock(&range_lock);
+     range_upload_t **link = &range_uploads;
+     while (*link != NULL && ((*link)->dept_id != dept->id || strcmp((*link)->name, name) != 0)) {
+         link = &(*link)->next;
+     }
+
+     range_upload_t *r = *link;
+     int complete = r != NULL && r->size == size && r->writers == 0 &&
+                    (size == 0 || (r->count == 1 && r->received[0][0] == 0 && r->received[0][1] == size));
+     if (complete) {
+         *link = r->next;
+     }
+     pthread_mutex_unlock(&range_lock);
+
+     if (!complete) {
+         snprintf(response, response_size, "Error: Upload is incomplete");
+         return STORE_REJECTED;
+     }
+     free(r->received);
+     free(r);
+
+     // Attempt to set file ownership, but don't fail if it doesn't work
+     if (fchownat(dept->dir_fd, name, auth_info->uid, -1, 0) < 0) {
+         log_event(LOG_LEVEL_WARN, "Could not set file ownership", "error=%s", strerror(errno));
+     }
+
+     // The ranges were written by connections that have gone; sync through a descriptor of our own
+     up->dept = dept;
+     up->bodiless = 1;
+     snprintf(up->filename, sizeof(up->filename), "%s", filename);
+     up->fd = open_for_sync(dept, name);
+     prepare_publish(&up->publish, dept, up->filename, name, up->fd, auth_info, response, response_size);
+     return finish_publish(up);
+ }
+
+ /**
+  * Has the body of an open upload decompressed as it is written
+  *
+  * Only for plain uploads, where the file is written front to back.
+  */
+ int upload_set_codec(upload_t *up, int codec, char *response, size_t response_size) {
+     // codec_new() fails for codecs this build doesn't have
+     up->decoder = codec_new(codec, 0);
+     if (up->decoder == NULL) {
+         snprintf(response, response_size, "Error: %s compression is not supported", codec_name(codec));
+         return STORE_REJECTED;
+     }
+
+     up->can_splice = 0;
+     return STORE_OK;
+ }
+
+ /**
+  * Computes the block signatures of the current version of a file
+  *
+  * Returns STORE_MISSING if there is no such file to send a delta against.
+  * The whole file is read, so this costs about as much as hashing it.
+  */
+ int upload_signatures(const auth_info_t *auth_info, const char *department, const char *filepath,
+                       delta_sigs_t *sigs, char *response, size_t response_size) {
+     const dept_t *dept;
+     const char *filename;
+     struct stat st;
+
+     if (resolve_target(auth_info, department, filepath, &dept, &filename,
+                        response, response_size) != 0) {
+         return STORE_REJECTED;
+     }
+
+     int fd = openat(dept->dir_fd, filename, O_RDONLY | O_CLOEXEC);
+     if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+         if (fd >= 0) {
+             close(fd);
+         }
+         snprintf(response, response_size, "No earlier version; send file");
+         return STORE_MISSING;
+     }
+
+     int status = delta_signatures(fd, &st, sigs);
+     close(fd);
+     if (status != 0) {
+         snprintf(response, response_size, "Error: Cannot read file: %s", strerror(errno));
+         return STORE_REJECTED;
+     }
+
+     return STORE_OK;
+ }
+
+ /**
+  * Makes an open upload a delta against the version of the file named by tag
+  *
+  * Returns STORE_MISSING if the file has changed (or gone) since its
+  * signatures were sent, so the delta can't be applied.
+  */
+ int upload_set_delta(upload_t *up, uint64_t tag, char *response, size_t response_size) {
+     struct stat st;
+
+     int fd = openat(up->dept->dir_fd, up->filename, O_RDONLY | O_CLOEXEC);
+     if (fd < 0 || fstat(fd, &st) != 0 || delta_tag(&st) != tag) {
+         if (fd >= 0) {
+             close(fd);
+         }
+         snprintf(response, response_size, "File changed since its signatures were sent; send file");
+         return STORE_MISSING;
+     }
+
+     up->delta = delta_new(fd, st.st_size);
+     if (up->delta == NULL) {
+         close(fd);
+         snprintf(response, response_size, "Error: Out of memory");
+         return STORE_REJECTED;
+     }
+
+     up->can_splice = 0;
+     return STORE_OK;
+ }
+
+ /**
+  * Has a plain upload hashed as it is written, to check against the hash
+  * the client sends in expected_hash after the body
+  *
+  * The hash covers the file as stored, after any decompression or delta.
+  */
+ void upload_want_hash(upload_t *up) {
+     up->checksummed = 1;
+     up->can_splice = 0;
+ }
+
+ /**
+  * Marks everything received so far as verified
+  */
+ void upload_commit(upload_t *up) {
+     if (up->error == 0) {
+         up->committed = up->base + up->bytes;
+     }
+ }
+
+ /**
+  * Discards data received since the last commit
+  */
+ void upload_rollback(upload_t *up) {
+     // Other ranges live beyond this one, so a shared file is never cut short
+     if (up->range != NULL) {
+         up->bytes = up->committed - up->base;
+     } else if (ftruncate(up->fd, up->committed) == 0) {
+         lseek(up->fd, up->committed, SEEK_SET);
+         up->bytes = up->committed - up->base;
+     }
+ }
+
+ /**
+  * Stores a file from content the server already holds
+  *
+  * The content is named by its SHA-256 digest, which the client can only
+  * know by holding it. Returns STORE_OK once the file is published,
+  * STORE_PENDING while the committer has it (up holds it until then),
+  * STORE_MISSING if no blob matches or the server can't check digests (the
+  * client must upload it), or STORE_REJECTED.
+  */
+ int upload_have(upload_t *up, const auth_info_t *auth_info, const char *department,
+                 const char *filepath, uint64_t size, const char *digest,
+                 char *response, size_t response_size) {
+     const dept_t *dept;
+     const char *filename;
+     char blob[BLOB_NAME_SIZE];
+     char *staging = up->staging;
+
+     if (resolve_target(auth_info, department, filepath, &dept, &filename,
+                        response, response_size) != 0) {
+         return STORE_REJECTED;
+     }
+
+     // An XXH64 is easily forged, so without SHA-256 every file is sent in full
+     if (!dedup_enabled || !digest_available() || !digest_valid(digest)) {
+         snprintf(response, response_size, "Send file");
+         return STORE_MISSING;
+     }
+
+     // A link to the blob becomes the staging file, exactly as if it had been uploaded
+     blob_name(digest, size, blob, sizeof(blob));
+     staging_name(staging, sizeof(up->staging));
+     if (linkat(blob_dir_fd, blob, dept->dir_fd, staging, 0) != 0) {
+         snprintf(response, response_size, "Send file");
+         return STORE_MISSING;
+     }
+
+     // The blob may predate durable uploads, so its data is synced too
+     up->dept = dept;
+     up->bodiless = 1;
+     snprintf(up->filename, sizeof(up->filename), "%s", filename);
+     up->fd = open_for_sync(dept, staging);
+     prepare_publish(&up->publish, dept, up->filename, staging, up->fd, auth_info, response, response_size);
+     up->publish.deduplicated = 1;
+     return finish_publish(up);
+ }
+
+ /**
+  * Appends body data to an open upload
+  */
+ int upload_write(upload_t *up, const void *data, size_t len) {
+     if (up->decoder != NULL) {
+         if (up->error == 0 && codec_update(up->decoder, data, len, write_delta, up) != 0 && up->error == 0) {
+             up->error = EBADMSG;
+         }
+         return (up->error == 0) ? 0 : -1;
+     }
+
+     return write_delta(up, data, len);
+ }
+
+ /**
+  * Moves len bytes of body data from a pipe into an open upload
+  *
+  * The data goes from the pipe to the file without passing through user
+  * space. If the filesystem can't take spliced writes, the rest is copied
+  * through a buffer instead and can_splice is cleared so the caller stops
+  * using this path. The pipe is always left empty.
+  */
+ int upload_splice(upload_t *up, int pipe_fd, size_t len) {
+     char buffer[UPLOAD_COPY_SIZE];
+
+     while (len > 0 && up->error == 0 && up->can_splice) {
+         ssize_t n = splice(pipe_fd, NULL, up->fd, NULL, len, SPLICE_F_MOVE);
+         if (n < 0) {
+             if (errno == EINTR) {
+                 continue;
+             }
+             if (errno == EINVAL || errno == ENOSYS) {
+                 up->can_splice = 0;
+             } else {
+                 up->error = errno;
+             }
+             break;
+         }
+         up->bytes += n;
+         len -= n;
+     }
+
+     // Whatever splice didn't move is copied, or dropped after a failure
+     while (len > 0) {
+         ssize_t n = read(pipe_fd, buffer, (len < sizeof(buffer)) ? len : sizeof(buffer));
+         if (n < 0 && errno == EINTR) {
+             continue;
+         }
+         if (n <= 0) {
+             up->error = (n < 0) ? errno : EIO;
+             return -1;
+         }
+         upload_write(up, buffer, n);
+         len -= n;
+     }
+
+     return (up->error == 0) ? 0 : -1;
+ }
+
+ /**
+  * Publishes the upload and records it in the index
+  *
+  * The staging file is given a name and renamed over the destination, so
+  * readers see either the old file or the complete new one, never a
+  * partial write.
+  */
+ int upload_finish(upload_t *up, const auth_info_t *auth_info, char *response, size_t response_size) {
+     const dept_t *dept = up->dept;
+
+     metrics_since(METRIC_RECEIVE, up->started_us);
+
+     // A compressed body must end with a complete frame, and a delta must rebuild the client's file
+     if (up->decoder != NULL && up->error == 0 && codec_finish(up->decoder, write_delta, up) != 0) {
+         up->error = EBADMSG;
+     }
+     if (up->delta != NULL && up->error == 0 && delta_finish(up->delta) != 0) {
+         up->error = EBADMSG;
+     }
+     // Only a digest taken of this upload's body may name its blob
+     if (up->digest != NULL) {
+         digest_final(up->digest, up->content_digest);
+     } else {
+         up->content_digest[0] = '\0';
+     }
+     free_decoder(up);
+
+     // Nothing the client didn't send gets published
+     if (up->checksummed && up->error == 0 && xxh64_digest(&up->hash) != up->expected_hash) {
+         log_event(LOG_LEVEL_WARN, "Upload checksum mismatch", "user=%s file=%s bytes=%llu",
+                   auth_info->username, up->filename, (unsigned long long)up->bytes);
+         upload_abort(up);
+         snprintf(response, response_size, "Error: Checksum mismatch; file not stored");
+         metrics_count(METRIC_UPLOAD_FAILURES, 1);
+         return STORE_REJECTED;
+     }
+
+     // A range is only recorded; upload_assemble() publishes the whole file
+     if (up->range != NULL) {
+         int error = up->error;
+         end_range(up);
+         if (error != 0) {
+             snprintf(response, response_size, "Error: Cannot write file: %s", strerror(error));
+             metrics_count(METRIC_UPLOAD_FAILURES, 1);
+             return STORE_REJECTED;
+         }
+         snprintf(response, response_size, "Range received");
+         return STORE_OK;
+     }
+
+     // Attempt to set file ownership, but don't fail if it doesn't work
+     if (up->error == 0 && !dedup_enabled && fchown(up->fd, auth_info->uid, -1) < 0) {
+         log_event(LOG_LEVEL_WARN, "Could not set file ownership", "error=%s", strerror(errno));
+     }
+
+     // An anonymous temp file needs a name before it can be renamed into place
+     if (up->error == 0 && up->staging[0] == '\0') {
+         char proc_path[32];
+         snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", up->fd);
+         for (int tries = 0; tries < 8; tries++) {
+             staging_name(up->staging, sizeof(up->staging));
+             if (linkat(AT_FDCWD, proc_path, dept->dir_fd, up->staging, AT_SYMLINK_FOLLOW) == 0) {
+                 break;
+             }
+             if (errno != EEXIST) {
+                 up->error = errno;
+             }
+             up->staging[0] = '\0';
+             if (up->error != 0) {
+                 break;
+             }
+         }
+         if (up->error == 0 && up->staging[0] == '\0') {
+             up->error = EEXIST;
+         }
+     }
+
+     if (up->error != 0 && up->resumable) {
+         // Keep what was verified so the client can resume
+         upload_rollback(up);
+     }
+
+     if (up->error != 0) {
+         close(up->fd);
+         up->fd = -1;
+         if (up->staging[0] != '\0' && !up->resumable) {
+             unlinkat(dept->dir_fd, up->staging, 0);
+         }
+         snprintf(response, response_size, "Error: Cannot write file: %s", strerror(up->error));
+         metrics_count(METRIC_UPLOAD_FAILURES, 1);
+         return STORE_REJECTED;
+     }
+
+     // A resumed upload's hash only covers its last part
+     publish_t *p = &up->publish;
+     prepare_publish(p, dept, up->filename, up->staging, up->fd, auth_info, response, response_size);
+     p->hash = ((dedup_enabled || up->checksummed) && up->base == 0) ? xxh64_digest(&up->hash) : 0;
+     p->deduplicated = dedup_enabled && up->base == 0 && store_blob(up);
+     return finish_publish(up);
+ }
+
+ /**
+  * Publishes an upload prepared in up->publish, or hands it to the
+  * committer, which then holds its file open until the data is on disk
+  */
+ static int finish_publish(upload_t *up) {
+     int status = publish(&up->publish);
+     if (status == STORE_PENDING) {
+         return status;
+     }
+
+     if (up->fd >= 0) {
+         close(up->fd);
+         up->fd = -1;
+     }
+     count_upload(up, status);
+     return status;
+ }
+
+ /**
+  * Collects the outcome of an upload that upload_finish() handed to the
+  * committer
+  *
+  * Returns STORE_PENDING while the upload isn't durable yet, unless wait
+  * is set, in which case it blocks until it is.
+  */
+ int upload_complete(upload_t *up, int wait) {
+     if (!durable_done(&up->publish.job)) {
+         if (!wait) {
+             return STORE_PENDING;
+         }
+         durable_wait(&up->publish.job);
+     }
+
+     int status = settle(&up->publish);
+     if (up->fd >= 0) {
+         close(up->fd);
+         up->fd = -1;
+     }
+     count_upload(up, status);
+     return status;
+ }
+
+ /**
+  * Has the committer call wake(ctx) once an upload it was handed is
+  * through; returns 0 if it is already (see durable_notify())
+  */
+ int upload_notify(upload_t *up, void (*wake)(void *ctx), void *ctx) {
+     return durable_notify(&up->publish.job, wake, ctx);
+ }
+
+ /**
+  * Leaves an upload that upload_finish() handed to the committer for the
+  * committer to finish, when nobody is left to hear how it went
+  *
+  * The file is published all the same. Returns 1 if release(ctx) will be
+  * called once it is, from the committer's thread, or 0 if it is through
+  * already and upload_complete() collects it as usual.
+  */
+ int upload_detach(upload_t *up, void (*release)(void *ctx), void *ctx) {
+     up->publish.release = release;
+     up->publish.release_ctx = ctx;
+     return durable_detach(&up->publish.job, release_upload);
+ }
+
+ /**
+  * Finishes a detached upload once the committer is through with it
+  */
+ static void release_upload(durable_job_t *job) {
+     upload_t *up = (upload_t *)((char *)job - offsetof(upload_t, publish));
+
+     upload_complete(up, 0);
+     up->publish.release(up->publish.release_ctx);
+ }
+
+ /**
+  * Drops an upload whose connection went away mid-transfer
+  */
+ void upload_abort(upload_t *up) {
+     if (up->fd < 0) {
+         return;
+     }
+     free_decoder(up);
+
+     if (up->range != NULL) {
+         end_range(up);
+         return;
+     }
+     if (up->resumable) {
+         upload_rollback(up);
+         close(up->fd);
+         up->fd = -1;
+         return;
+     }
+
+     // An anonymous temp file vanishes on close; a named one must be removed
+     close(up->fd);
+     up->fd = -1;
+     if (up->staging[0] != '\0') {
+         unlinkat(up->dept->dir_fd, up->staging, 0);
+     }
+ }
+
+ /**
+  * Opens a department file for a client to download
+  *
+  * The same department rules apply as for uploads. Staging files, and
+  * .owner files left by older versions, can't be fetched.
+  */
+ int download_open(const auth_info_t *auth_info, const char *department, const char *filepath,
+                   cached_file_t **file, char *response, size_t response_size) {
+     const dept_t *dept;
+     const char *filename;
+
+     if (resolve_target(auth_info, department, filepath, &dept, &filename,
+                        response, response_size) != 0) {
+         return STORE_REJECTED;
+     }
+
+     if (!index_listable(filename)) {
+         snprintf(response, response_size, "Error: Cannot open file '%s': %s", filename, strerror(ENOENT));
+         return STORE_REJECTED;
+     }
+
+     *file = cache_open(dept->dir_fd, dept->id, filename);
+     if (*file == NULL) {
+         snprintf(response, response_size, "Error: Cannot open file '%s': %s", filename, strerror(errno));
+         return STORE_REJECTED;
+     }
+
+     return STORE_OK;
+ }
+
+ /**
+  * Pages through the files a client may download from a department
+  */
+ int download_list(const auth_info_t *auth_info, const char *department, const char *after, unsigned limit,
+                   index_sink_t sink, void *ctx, index_page_t *page, char *response, size_t response_size) {
+     int dept_id = dept_find(department);
+     if (!check_access(dept_id, auth_info)) {
+         snprintf(response, response_size, "Error: You don't have access to the %s department", department);
+         return STORE_REJECTED;
+     }
+
+     index_list(dept_id, after, limit, sink, ctx, page);
+     snprintf(response, response_size, "%u files in %s", page->count, dept_get(dept_id)->name);
+     return STORE_OK;
+ }
+
+ /**
+  * Pages through the files of a department that changed after since
+  */
+ int download_changes(const auth_info_t *auth_info, const char *department, uint64_t since, unsigned limit,
+                      index_sink_t sink, void *ctx, index_page_t *page, char *response, size_t response_size) {
+     int dept_id = dept_find(department);
+     if (!check_access(dept_id, auth_info)) {
+         snprintf(response, response_size, "Error: You don't have access to the %s department", department);
+         return STORE_REJECTED;
+     }
+
+     index_changes(dept_id, since, limit, sink, ctx, page);
+     snprintf(response, response_size, "%u changes in %s", page->count, dept_get(dept_id)->name);
+     return STORE_OK;
+ }
+
+ /**
+  * Checks that the user may write filepath to department
+  *
+  * Fills in the department and the bare file name, or fills response and
+  * returns -1.
+  */
+ static int resolve_target(const auth_info_t *auth_info, const char *department, const char *filepath,
+                           const dept_t **dept, const char **filename, char *response, size_t response_size) {
+     // Check if user has access to the department
+     int dept_id = dept_find(department);
+     if (!check_access(dept_id, auth_info)) {
+         snprintf(response, response_size, "Error: You don't have access to the %s department", department);
+         return -1;
+     }
+     *dept = dept_get(dept_id);
+
+     // Extract filename from path
+     const char *name = strrchr(filepath, '/');
+     if (name == NULL) {
+         name = filepath;
+     } else {
+         name++;  // Skip the '/'
+     }
+
+     // Names that would escape the directory, or take over the hidden files
+     // the server keeps there (staging and resumable partials, owner sidecars)
+     if (name[0] == '\0' || !index_listable(name)) {
+         snprintf(response, response_size, "Error: Invalid file name");
+         return -1;
+     }
+
+     *filename = name;
+     return 0;
+ }
+
+ /**
+  * Writes file data at the upload's current position
+  *
+  * Also the sink for decompressed data and rebuilt deltas, so the dedup
+  * hash and byte count always cover the file as stored.
+  */
+ static int write_out(void *ctx, const void *data, size_t len) {
+     upload_t *up = ctx;
+     const char *p = data;
+     uint64_t pos = up->base + up->bytes;
+
+     if (up->error == 0 && up->range != NULL && pos + len > up->range->size) {
+         up->error = EFBIG;
+     }
+
+     if (up->error == 0) {
+         up->bytes += len;
+         if (dedup_enabled || up->checksummed) {
+             xxh64_update(&up->hash, data, len);
+         }
+         if (up->digest != NULL) {
+             digest_update(up->digest, data, len);
+         }
+     }
+
+     // Keep draining the body after a failure so the stream stays in step
+     while (len > 0 && up->error == 0) {
+         ssize_t n = (up->range != NULL) ? pwrite(up->fd, p, len, pos) : write(up->fd, p, len);
+         if (n < 0) {
+             if (errno == EINTR) {
+                 continue;
+             }
+             up->error = errno;
+             return -1;
+         }
+         p += n;
+         pos += n;
+         len -= n;
+     }
+
+     return (up->error == 0) ? 0 : -1;
+ }
+
+ /**
+  * Passes plain body data through the delta decoder, if there is one
+  */
+ static int write_delta(void *ctx, const void *data, size_t len) {
+     upload_t *up = ctx;
+
+     if (up->delta == NULL) {
+         return write_out(up, data, len);
+     }
+
+     if (up->error == 0 && delta_update(up->delta, data, len, write_out, up) != 0 && up->error == 0) {
+         up->error = EBADMSG;
+     }
+     return (up->error == 0) ? 0 : -1;
+ }
+
+ /**
+  * Releases the decoders of a compressed or delta upload, and its digest
+  */
+ static void free_decoder(upload_t *up) {
+     codec_free(up->decoder);
+     up->decoder = NULL;
+     delta_free(up->delta);
+     up->delta = NULL;
+     digest_free(up->digest);
+     up->digest = NULL;
+ }
+
+ /**
+  * Looks up a file being received as ranges; the caller holds range_lock
+  */
+ static range_upload_t *find_range_upload(int dept_id, const char *name) {
+     for (range_upload_t *r = range_uploads; r != NULL; r = r->next) {
+         if (r->dept_id == dept_id && strcmp(r->name, name) == 0) {
+             return r;
+         }
+     }
+
+     return NULL;
+ }
+
+ /**
+  * Closes a range and records the verified part of it as received
+  */
+ static void end_range(upload_t *up) {
+     range_upload_t *r = up->range;
+     uint64_t start = up->base, end = up->committed;
+
+     close(up->fd);
+     up->fd = -1;
+     up->range = NULL;
+
+     pthread_mutex_lock(&range_lock);
+     r->writers--;
+
+     if (end > start) {
+         if (r->count == r->capacity) {
+             int capacity = r->capacity ? r->capacity * 2 : 8;
+             void *grown = realloc(r->received, capacity * sizeof(*r->received));
+             if (grown == NULL) {
+                 pthread_mutex_unlock(&range_lock);
+                 return;
+             }
+             r->received = grown;
+             r->capacity = capacity;
+         }
+
+         // Insert in order, then fold in every part it overlaps or touches
+         int i = 0;
+         while (i < r->count && r->received[i][0] < start) {
+             i++;
+         }
+         memmove(&r->received[i + 1], &r->received[i], (r->count - i) * sizeof(*r->received));
+         r->received[i][0] = start;
+         r->received[i][1] = end;
+         r->count++;
+
+         int out = 0;
+         for (int j = 1; j < r->count; j++) {
+             if (r->received[j][0] <= r->received[out][1]) {
+                 if (r->received[j][1] > r->received[out][1]) {
+                     r->received[out][1] = r->received[j][1];
+                 }
+             } else {
+                 out++;
+                 r->received[out][0] = r->received[j][0];
+                 r->received[out][1] = r->received[j][1];
+             }
+         }
+         r->count = out + 1;
+     }
+
+     pthread_mutex_unlock(&range_lock);
+ }
+
+ /**
+  * Names the blob holding content with the given digest (hex) and size
+  *
+  * The size is part of the name so that a hash collision would also need
+  * the lengths to match.
+  */
+ static void blob_name(const char *key, uint64_t size, char *name, size_t size_of_name) {
+     snprintf(name, size_of_name, "%s-%llu", key, (unsigned long long)size);
+ }
+
+ /**
+  * Compares two files byte for byte; returns 1 if they hold the same data
+  */
+ static int same_content(int fd_a, int fd_b) {
+     char a[16384], b[16384];
+     struct stat st_a, st_b;
+
+     if (fstat(fd_a, &st_a) != 0 || fstat(fd_b, &st_b) != 0 || st_a.st_size != st_b.st_size) {
+         return 0;
+     }
+     for (off_t pos = 0; pos < st_a.st_size; ) {
+         ssize_t n = pread(fd_a, a, sizeof(a), pos);
+         if (n <= 0 || pread(fd_b, b, n, pos) != n || memcmp(a, b, n) != 0) {
+             return 0;
+         }
+         pos += n;
+     }
+     return 1;
+ }
+
+ /**
+  * Files a finished upload's content in the blob store
+  *
+  * New content becomes a blob. If the blob already exists and holds the
+  * same bytes, the staging file is swapped for a link to it and the
+  * duplicate copy is freed; a blob that only shares the name is left alone
+  * and the upload kept as a plain copy. Returns 1 if the upload turned out
+  * to be a duplicate.
+  */
+ static int store_blob(upload_t *up) {
+     const dept_t *dept = up->dept;
+     char key[DIGEST_HEX_SIZE];
+     char blob[BLOB_NAME_SIZE];
+     char staging[sizeof(up->staging)];
+
+     if (up->content_digest[0] != '\0') {
+         memcpy(key, up->content_digest, sizeof(key));
+     } else if (!digest_available()) {
+         snprintf(key, sizeof(key), "%016llx", (unsigned long long)xxh64_digest(&up->hash));
+     } else {
+         // Not digested (a resumed upload, say); its name would mix with SHA-256 ones
+         return 0;
+     }
+     blob_name(key, up->bytes, blob, sizeof(blob));
+
+     if (linkat(dept->dir_fd, up->staging, blob_dir_fd, blob, 0) == 0) {
+         return 0;
+     }
+     if (errno != EEXIST) {
+         // e.g. the department is on another filesystem; keep the plain copy
+         return 0;
+     }
+
+     // Our own bytes are compared, not just the name, before they are thrown away
+     int blob_fd = openat(blob_dir_fd, blob, O_RDONLY | O_CLOEXEC);
+     int staged_fd = openat(dept->dir_fd, up->staging, O_RDONLY | O_CLOEXEC);
+     int same = blob_fd >= 0 && staged_fd >= 0 && same_content(blob_fd, staged_fd);
+     if (blob_fd >= 0) {
+         close(blob_fd);
+     }
+     if (staged_fd >= 0) {
+         close(staged_fd);
+     }
+     if (!same) {
+         log_event(LOG_LEVEL_WARN, "Blob name collision", "blob=%s", blob);
+         return 0;
+     }
+
+     staging_name(staging, sizeof(staging));
+     if (linkat(blob_dir_fd, blob, dept->dir_fd, staging, 0) != 0) {
+         return 0;
+     }
+
+     unlinkat(dept->dir_fd, up->staging, 0);
+     memcpy(up->staging, staging, sizeof(staging));
+     return 1;
+ }
+
+ /**
+  * Describes a staged file to publish; fd is its data, or -1
+  */
+ static void prepare_publish(publish_t *p, const dept_t *dept, const char *filename, const char *staging,
+                             int fd, const auth_info_t *auth_info, char *response, size_t response_size) {
+     p->job.fd = fd;
+     p->job.dept = dept;
+     p->job.publish = publish_synced;
+     p->job.error = 0;
+     p->filename = filename;
+     p->staging = staging;
+     p->deduplicated = 0;
+     p->hash = 0;
+     p->auth_info = auth_info;
+     p->response = response;
+     p->response_size = response_size;
+     p->status = STORE_REJECTED;
+ }
+
+ /**
+  * Opens a staged file so its data can be synced, if anything is synced
+  */
+ static int open_for_sync(const dept_t *dept, const char *name) {
+     if (durable_level() == DURABLE_NONE) {
+         return -1;
+     }
+     return openat(dept->dir_fd, name, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+ }
+
+ /**
+  * Publishes a staged file as durably as the server is set up to
+  *
+  * Anything to sync is left to the committer, and STORE_PENDING returned.
+  */
+ static int publish(publish_t *p) {
+     if (durable_level() != DURABLE_NONE) {
+         durable_submit(&p->job);
+         return STORE_PENDING;
+     }
+
+     publish_synced(&p->job);
+     return settle(p);
+ }
+
+ /**
+  * Renames a staged file into place once its data is on disk, or drops it
+  * if syncing the data failed
+  */
+ static void publish_synced(durable_job_t *job) {
+     publish_t *p = (publish_t *)job;
+
+     if (job->error != 0) {
+         unlinkat(job->dept->dir_fd, p->staging, 0);
+         snprintf(p->response, p->response_size, "Error: Cannot write file: %s", strerror(job->error));
+         p->status = STORE_REJECTED;
+         return;
+     }
+
+     uint64_t started = metrics_now_us();
+     p->status = rename_into_place(p);
+     metrics_since(METRIC_PUBLISH, started);
+ }
+
+ /**
+  * Renames a staged file into place and records its owner in the index
+  *
+  * Both happen under the destination's lock. The staging file is removed
+  * if the rename fails.
+  */
+ static int rename_into_place(publish_t *p) {
+     const dept_t *dept = p->job.dept;
+     pthread_once(&file_locks_once, init_file_locks);
+     pthread_mutex_t *lock = &file_locks[lock_stripe(dept->id, p->filename)];
+
+     uint64_t lock_started = metrics_now_us();
+     pthread_mutex_lock(lock);
+     metrics_since(METRIC_LOCK_WAIT, lock_started);
+     int published = renameat(dept->dir_fd, p->staging, dept->dir_fd, p->filename) == 0;
+     int saved_errno = errno;
+     // rename() is a no-op when the destination is already a link to the
+     // same blob, leaving the staging name behind
+     if (published && p->deduplicated) {
+         unlinkat(dept->dir_fd, p->staging, 0);
+     }
+     // Indexed under the lock too, so the index sees publishes in the order they happened
+     struct stat st;
+     if (published && fstatat(dept->dir_fd, p->filename, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+         index_update(dept->id, p->filename, &st, p->auth_info, p->hash);
+     }
+     pthread_mutex_unlock(lock);
+
+     if (!published) {
+         unlinkat(dept->dir_fd, p->staging, 0);
+         snprintf(p->response, p->response_size, "Error: Cannot publish file: %s", strerror(saved_errno));
+         return STORE_REJECTED;
+     }
+
+     snprintf(p->response, p->response_size, "File '%s' successfully transferred to %s department",
+              p->filename, dept->name);
+
+     log_event(LOG_LEVEL_INFO, "File transferred", "file=%s user=%s dept=%s deduplicated=%d",
+               p->filename, p->auth_info->username, dept->name, p->deduplicated);
+
+     return STORE_OK;
+ }
+
+ /**
+  * The final outcome of a publish: a file whose name couldn't be made
+  * durable stays in place, but the client is told to send it again
+  */
+ static int settle(publish_t *p) {
+     if (p->status == STORE_OK && p->job.error != 0) {
+         snprintf(p->response, p->response_size, "Error: Cannot sync file: %s", strerror(p->job.error));
+         p->status = STORE_REJECTED;
+     }
+     return p->status;
+ }
+
+ /**
+  * Records a finished upload's outcome and throughput
+  */
+ static void count_upload(const upload_t *up, int status) {
+     // Only a body received counts as an upload
+     if (up->bodiless) {
+         return;
+     }
+     if (status != STORE_OK) {
+         metrics_count(METRIC_UPLOAD_FAILURES, 1);
+         return;
+     }
+
+     uint64_t elapsed_us = metrics_now_us() - up->started_us;
+     metrics_count(METRIC_UPLOADS, 1);
+     metrics_count(METRIC_BYTES_RECEIVED, up->bytes);
+     metrics_record(METRIC_THROUGHPUT, up->bytes * 1000000 / (elapsed_us > 0 ? elapsed_us : 1));
+ }
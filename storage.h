@@ -0,0 +1,116 @@
+/**
+ * Upload Storage for the File Transfer Server
+ *
+ * Places uploaded files in their department directory. An upload is
+ * opened once its request has been parsed, fed body bytes as they arrive
+ * and then finished or aborted, so callers never block waiting on the
+ * network while inside this module.
+ */
+
+ #ifndef STORAGE_H
+ #define STORAGE_H
+
+ #include <stdint.h>
+
+ #include "server.h"
+ #include "dept.h"
+ #include "xxhash.h"
+ #include "digest.h"
+ #include "compress.h"
+ #include "delta.h"
+ #include "cache.h"
+ #include "index.h"
+ #include "durable.h"
+
+ // Outcomes of upload_open(), upload_have(), upload_assemble() and upload_finish()
+ #define STORE_OK 0
+ #define STORE_REJECTED -1        // Refused; the response explains why
+ #define STORE_MISSING -2         // Content or older version not held; send the file in full
+ #define STORE_PENDING -3         // Not durable yet; ask upload_complete() for the outcome
+
+ #define UPLOAD_COPY_SIZE 65536    // Chunk size when body data is copied rather than spliced
+ #define BLOB_DIR BASE_DIR "/.blobs"  // Content store used when deduplicating
+ #define BLOB_NAME_SIZE (DIGEST_HEX_SIZE + 24)
+
+ struct range_upload;
+
+ // A staged file on its way into place
+ typedef struct {
+     durable_job_t job;           // First, so the committer's callback can find the rest
+     const char *filename;
+     const char *staging;
+     int deduplicated;
+     uint64_t hash;
+     const auth_info_t *auth_info;
+     char *response;
+     size_t response_size;
+     int status;                  // Once published
+     void (*release)(void *ctx);  // Called by the committer for a detached upload, once it is through
+     void *release_ctx;
+ } publish_t;
+
+ // An upload being written to disk
+ typedef struct {
+     int fd;                      // -1 when no upload is open
+     int error;                   // First write error, reported by upload_finish()
+     int can_splice;              // Destination accepts splice() writes
+     char filename[MAX_FILEPATH_LENGTH];
+     const dept_t *dept;          // Department the file goes to
+     char staging[48];            // Name while unpublished; empty for an anonymous O_TMPFILE
+     uint64_t bytes;              // Body bytes received so far
+     uint64_t started_us;         // When the upload was opened, for the metrics
+     int resumable;               // Kept as a named partial file if the transfer drops
+     uint64_t base;               // Offset a resumed upload's body starts at
+     uint64_t committed;          // File length up to the last verified chunk
+     struct range_upload *range;  // File this upload is one range of, or NULL
+     codec_t *decoder;            // Decompresses the body on its way to disk, or NULL
+     delta_t *delta;              // Rebuilds the file from its older version, or NULL
+     int checksummed;             // Checked against the client's hash before it is published
+     uint64_t expected_hash;      // The client's XXH64 of the file, once it has arrived
+     xxh64_state_t hash;          // Hash of the file as stored, when deduplicating or checksummed
+     digest_t *digest;            // SHA-256 naming the file in the blob store, or NULL
+     char content_digest[DIGEST_HEX_SIZE];  // Its final value, once the body is complete
+     int bodiless;                // Stored by HAVE or COMMIT, so not counted as an upload
+     publish_t publish;           // Waiting on the committer after STORE_PENDING
+ } upload_t;
+
+ int storage_init(int dedup);
+ void upload_init(upload_t *up);
+ int upload_open(upload_t *up, const auth_info_t *auth_info, const char *department,
+                 const char *filepath, char *response, size_t response_size);
+ int upload_have(upload_t *up, const auth_info_t *auth_info, const char *department,
+                 const char *filepath, uint64_t size, const char *digest,
+                 char *response, size_t response_size);
+ int upload_query(const auth_info_t *auth_info, const char *department, const char *filepath,
+                  uint64_t upload_id, uint64_t *offset, char *response, size_t response_size);
+ int upload_open_resumable(upload_t *up, const auth_info_t *auth_info, const char *department,
+                           const char *filepath, uint64_t upload_id, uint64_t offset,
+                           char *response, size_t response_size);
+ int upload_open_range(upload_t *up, const auth_info_t *auth_info, const char *department,
+                       const char *filepath, uint64_t upload_id, uint64_t size, uint64_t offset,
+                       char *response, size_t response_size);
+ int upload_assemble(upload_t *up, const auth_info_t *auth_info, const char *department,
+                     const char *filepath, uint64_t upload_id, uint64_t size,
+                     char *response, size_t response_size);
+ int upload_set_codec(upload_t *up, int codec, char *response, size_t response_size);
+ int upload_signatures(const auth_info_t *auth_info, const char *department, const char *filepath,
+                       delta_sigs_t *sigs, char *response, size_t response_size);
+ int upload_set_delta(upload_t *up, uint64_t tag, char *response, size_t response_size);
+ void upload_want_hash(upload_t *up);
+ void upload_commit(upload_t *up);
+ void upload_rollback(upload_t *up);
+ int upload_write(upload_t *up, const void *data, size_t len);
+ int upload_splice(upload_t *up, int pipe_fd, size_t len);
+ int upload_finish(upload_t *up, const auth_info_t *auth_info, char *response, size_t response_size);
+ int upload_complete(upload_t *up, int wait);
+ int upload_notify(upload_t *up, void (*wake)(void *ctx), void *ctx);
+ int upload_detach(upload_t *up, void (*release)(void *ctx), void *ctx);
+ void upload_abort(upload_t *up);
+ int download_open(const auth_info_t *auth_info, const char *department, const char *filepath,
+                   cached_file_t **file, char *response, size_t response_size);
+ int download_list(const auth_info_t *auth_info, const char *department, const char *after, unsigned limit,
+                   index_sink_t sink, void *ctx, index_page_t *page, char *response, size_t response_size);
+ int download_changes(const auth_info_t *auth_info, const char *department, uint64_t since, unsigned limit,
+                      index_sink_t sink, void *ctx, index_page_t *page, char *response, size_t response_size);
+
+ #endif
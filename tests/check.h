@@ -0,0 +1,27 @@
+/**
+ * Checks for the File Transfer System's tests
+ *
+ * Each test program is a main() calling its test functions in turn. A
+ * failed CHECK is reported with its file and line and the run carries on,
+ * so one run shows every failure; CHECK_DONE() is the exit status.
+ */
+
+ #ifndef CHECK_H
+ #define CHECK_H
+
+ #include <stdio.h>
+
+ static int check_failures;
+
+ #define CHECK(cond)                                                                     \
+     do {                                                                                \
+         if (!(cond)) {                                                                  \
+             fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);    \
+             check_failures++;                                                           \
+         }                                                                               \
+     } while (0)
+
+ #define CHECK_DONE()                                                                    \
+     (printf("%s: %s\n", __FILE__, check_failures ? "FAILED" : "ok"), check_failures != 0)
+
+ #endif
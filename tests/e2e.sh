@@ -0,0 +1,31 @@
+#!/bin/sh
+# Runs test_e2e against servers of its own, deduplicating, on FT_TEST_PORT:
+# one for each durability level
+#
+# Needs the test users and departments (make setup create_users); without
+# them the test is skipped. The server's log is left in tests/e2e.log.
+
+cd "$(dirname "$0")/.." || exit 1
+port=${FT_TEST_PORT:-18080}
+
+if ! getent passwd "${FT_TEST_USER:-manufacturing_user1}" > /dev/null; then
+    echo "tests/e2e.sh: skipped, no test users (see make setup create_users)"
+    exit 0
+fi
+
+conf=$(mktemp) || exit 1
+echo "port = $port" > "$conf"
+server=
+trap 'kill $server 2> /dev/null; rm -f "$conf"' EXIT
+: > tests/e2e.log
+
+# Each durability level publishes by a different path
+for level in none file group; do
+    echo "tests/e2e.sh: durability $level"
+    ./server -D -S "$level" -c "$conf" >> tests/e2e.log 2>&1 &
+    server=$!
+    tests/test_e2e "$port" || exit 1
+    kill $server
+    wait $server 2> /dev/null
+    server=
+done
@@ -0,0 +1,116 @@
+/**
+ * Tests for reading server.conf files in config.c
+ */
+
+ #include <stdlib.h>
+ #include <string.h>
+ #include <unistd.h>
+
+ #include "config.h"
+ #include "log.h"
+ #include "check.h"
+
+ static void test_settings(void);
+ static void test_errors(void);
+ static void test_shipped_file(void);
+ static int load(const char *text, server_config_t *config);
+
+ int main(void) {
+     test_settings();
+     test_errors();
+     test_shipped_file();
+     return CHECK_DONE();
+ }
+
+ /**
+  * Settings are read past comments, blank lines and stray whitespace;
+  * keys not given keep what they had
+  */
+ static void test_settings(void) {
+     server_config_t config;
+     config_defaults(&config);
+     int auth_workers = config.auth_workers;
+
+     CHECK(load("# A comment\n"
+                "\n"
+                "port = 9090\n"
+                "  log_level=debug   # trailing comment\n"
+                "\tmax_rate = 40M\r\n"
+                "socket_buffer = 256K\n"
+                "max_transfers = 0\n"
+                "drain_timeout = 5\n", &config) == 0);
+     CHECK(config.port == 9090);
+     CHECK(config.log_level == LOG_LEVEL_DEBUG);
+     CHECK(config.max_rate == 40ull * 1024 * 1024);
+     CHECK(config.socket_buffer == 256 * 1024);
+     CHECK(config.max_transfers == 0);
+     CHECK(config.drain_timeout == 5);
+     CHECK(config.auth_workers == auth_workers);
+
+     // A second file only changes what it names
+     CHECK(load("idle_timeout = 7\n", &config) == 0);
+     CHECK(config.idle_timeout == 7 && config.port == 9090);
+ }
+
+ /**
+  * Any bad line refuses the whole file and leaves the settings alone
+  */
+ static void test_errors(void) {
+     const char *bad[] = {
+         "port = 0\n",
+         "port = 65536\n",
+         "port = 80x\n",
+         "port =\n",
+         "log_level = loud\n",
+         "max_rate = fast\n",
+         "socket_buffer = 4G\n",
+         "auth_workers = 0\n",
+         "no_such_key = 1\n",
+         "port 8080\n",
+     };
+
+     for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+         server_config_t config;
+         config_defaults(&config);
+         char text[128];
+         snprintf(text, sizeof(text), "idle_timeout = 9\n%s", bad[i]);
+         CHECK(load(text, &config) != 0);
+         CHECK(config.idle_timeout != 9);
+     }
+
+     server_config_t config;
+     CHECK(config_load("/nonexistent/server.conf", &config) != 0);
+ }
+
+ /**
+  * The server.conf shipped with the server only documents the defaults
+  */
+ static void test_shipped_file(void) {
+     server_config_t defaults, config;
+     config_defaults(&defaults);
+     config = defaults;
+
+     CHECK(config_load("server.conf", &config) == 0);
+     CHECK(config.port == defaults.port && config.log_level == defaults.log_level);
+     CHECK(config.idle_timeout == defaults.idle_timeout && config.max_in_flight == defaults.max_in_flight);
+     CHECK(config.socket_buffer == defaults.socket_buffer && config.auth_workers == defaults.auth_workers);
+     CHECK(config.pool_workers == defaults.pool_workers && config.max_rate == defaults.max_rate);
+     CHECK(config.max_transfers == defaults.max_transfers && config.drain_timeout == defaults.drain_timeout);
+ }
+
+ /**
+  * Writes text to a temporary file and loads it on top of config
+  */
+ static int load(const char *text, server_config_t *config) {
+     char path[] = "/tmp/test_config.XXXXXX";
+     int fd = mkstemp(path);
+     if (fd < 0) {
+         return -1;
+     }
+     ssize_t written = write(fd, text, strlen(text));
+     close(fd);
+
+     int status = (written == (ssize_t)strlen(text)) ? config_load(path, config) : -1;
+     unlink(path);
+     return status;
+ }
@@ -0,0 +1,194 @@
+/**
+ * Tests for the delta stream in delta.c: encoding against an old version
+ * and applying it, and the bounds it checks instructions against
+ */
+
+ #include <stdlib.h>
+ #include <string.h>
+ #include <stdint.h>
+ #include <unistd.h>
+ #include <sys/stat.h>
+
+ #include "delta.h"
+ #include "xxhash.h"
+ #include "check.h"
+
+ #define OLD_SIZE (5 * DELTA_MIN_BLOCK + 100)  // Five full blocks and a short one
+
+ // Collects what a sink is given
+ typedef struct {
+     uint8_t *data;
+     size_t len;
+ } collected_t;
+
+ static uint8_t old_data[OLD_SIZE];
+
+ static void test_round_trip(void);
+ static void test_copy_bounds(void);
+ static void test_malformed(void);
+ static int collect(void *ctx, const void *data, size_t len);
+ static int old_file(void);
+ static delta_t *old_decoder(void);
+ static size_t put_op(uint8_t *p, uint8_t op, uint64_t v1, uint64_t v2);
+
+ int main(void) {
+     for (size_t i = 0; i < sizeof(old_data); i++) {
+         old_data[i] = (uint8_t)(rand() & 0xff);
+     }
+
+     test_round_trip();
+     test_copy_bounds();
+     test_malformed();
+     return CHECK_DONE();
+ }
+
+ /**
+  * A new version with bytes changed, inserted and cut is rebuilt exactly,
+  * copying the blocks it kept
+  */
+ static void test_round_trip(void) {
+     size_t new_size = OLD_SIZE + 50 - 300;
+     uint8_t *new_data = malloc(new_size);
+
+     // Block 0 kept, 50 new bytes, blocks 1 to 3 kept, the rest cut short and changed
+     memcpy(new_data, old_data, DELTA_MIN_BLOCK);
+     memset(new_data + DELTA_MIN_BLOCK, 'x', 50);
+     memcpy(new_data + DELTA_MIN_BLOCK + 50, old_data + DELTA_MIN_BLOCK, 3 * DELTA_MIN_BLOCK);
+     size_t done = 4 * DELTA_MIN_BLOCK + 50;
+     memset(new_data + done, 'y', new_size - done);
+
+     int fd = old_file();
+     struct stat st;
+     fstat(fd, &st);
+     delta_sigs_t sigs;
+     CHECK(delta_signatures(fd, &st, &sigs) == 0);
+
+     collected_t stream = { 0 };
+     uint64_t matched;
+     CHECK(delta_encode(new_data, new_size, &sigs, collect, &stream, &matched) == 0);
+     CHECK(matched == 4 * DELTA_MIN_BLOCK);
+     CHECK(stream.len < new_size - matched + 100);
+
+     // Fed a byte at a time, so every instruction is split across calls
+     collected_t rebuilt = { 0 };
+     delta_t *d = delta_new(fd, OLD_SIZE);
+     for (size_t i = 0; i < stream.len; i++) {
+         CHECK(delta_update(d, stream.data + i, 1, collect, &rebuilt) == 0);
+     }
+     CHECK(delta_finish(d) == 0);
+     CHECK(rebuilt.len == new_size && memcmp(rebuilt.data, new_data, new_size) == 0);
+     delta_free(d);
+
+     delta_sigs_free(&sigs);
+     free(stream.data);
+     free(rebuilt.data);
+     free(new_data);
+ }
+
+ /**
+  * COPY may only name blocks the old version has
+  */
+ static void test_copy_bounds(void) {
+     uint64_t blocks = (OLD_SIZE + DELTA_MIN_BLOCK - 1) / DELTA_MIN_BLOCK;
+     uint64_t bad[][2] = {
+         { blocks, 1 },           // First block past the end
+         { 0, 0 },                // Nothing to copy
+         { 1, blocks },           // Runs past the end
+         { 2, UINT64_MAX },       // first + count wraps around
+         { UINT64_MAX, 2 },
+     };
+     uint8_t op[17];
+     collected_t out = { 0 };
+
+     for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+         delta_t *d = old_decoder();
+         size_t len = put_op(op, DELTA_OP_COPY, bad[i][0], bad[i][1]);
+         CHECK(delta_update(d, op, len, collect, &out) != 0);
+         delta_free(d);
+     }
+     CHECK(out.len == 0);
+
+     // The short last block is copied only as far as the old file goes
+     delta_t *d = old_decoder();
+     size_t len = put_op(op, DELTA_OP_COPY, blocks - 1, 1);
+     CHECK(delta_update(d, op, len, collect, &out) == 0);
+     CHECK(out.len == OLD_SIZE % DELTA_MIN_BLOCK);
+     CHECK(memcmp(out.data, old_data + OLD_SIZE - out.len, out.len) == 0);
+     delta_free(d);
+     free(out.data);
+ }
+
+ /**
+  * Unknown instructions, anything after the end and a wrong final hash
+  * are all refused
+  */
+ static void test_malformed(void) {
+     uint8_t stream[64];
+     collected_t out = { 0 };
+     size_t len;
+
+     delta_t *d = old_decoder();
+     CHECK(delta_update(d, "Z", 1, collect, &out) != 0);
+     delta_free(d);
+
+     // A DATA of 3 bytes, then the end
+     d = old_decoder();
+     len = put_op(stream, DELTA_OP_DATA, 3, 0);
+     memcpy(stream + len, "abc", 3);
+     len += 3;
+     len += put_op(stream + len, DELTA_OP_END, xxh64("abc", 3, 0), 0);
+     CHECK(delta_update(d, stream, len, collect, &out) == 0);
+     CHECK(delta_finish(d) == 0);
+     CHECK(delta_update(d, "D", 1, collect, &out) != 0);
+     delta_free(d);
+
+     d = old_decoder();
+     len = put_op(stream, DELTA_OP_END, xxh64("abd", 3, 0), 0);
+     CHECK(delta_update(d, stream, len, collect, &out) == 0);
+     CHECK(delta_finish(d) != 0);
+     delta_free(d);
+
+     // Cut off before the end
+     d = old_decoder();
+     len = put_op(stream, DELTA_OP_DATA, 3, 0);
+     CHECK(delta_update(d, stream, len + 1, collect, &out) == 0);
+     CHECK(delta_finish(d) != 0);
+     delta_free(d);
+     free(out.data);
+ }
+
+ static int collect(void *ctx, const void *data, size_t len) {
+     collected_t *c = ctx;
+     uint8_t *grown = realloc(c->data, c->len + len);
+     if (grown == NULL) {
+         return -1;
+     }
+     c->data = grown;
+     memcpy(c->data + c->len, data, len);
+     c->len += len;
+     return 0;
+ }
+
+ /**
+  * A descriptor holding the old version, in an unlinked temporary file
+  */
+ static int old_file(void) {
+     char path[] = "/tmp/test_delta.XXXXXX";
+     int fd = mkstemp(path);
+     unlink(path);
+     CHECK(fd >= 0 && write(fd, old_data, sizeof(old_data)) == (ssize_t)sizeof(old_data));
+     return fd;
+ }
+
+ static delta_t *old_decoder(void) {
+     return delta_new(old_file(), OLD_SIZE);
+ }
+
+ static size_t put_op(uint8_t *p, uint8_t op, uint64_t v1, uint64_t v2) {
+     p[0] = op;
+     for (int i = 0; i < 8; i++) {
+         p[1 + i] = (uint8_t)(v1 >> (56 - 8 * i));
+         p[9 + i] = (uint8_t)(v2 >> (56 - 8 * i));
+     }
+     return (op == DELTA_OP_COPY) ? 17 : 9;
+ }
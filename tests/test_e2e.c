@@ -0,0 +1,404 @@
+/**
+ * End-to-end tests against a running server, deduplicating (-D):
+ * HAVE answered with NEED and then served from content already held, a
+ * resumable upload dropped halfway and carried on after RESUME, a
+ * resumable upload after a plain one kept out of the plain one's blob,
+ * and a file sent as two ranges and published with COMMIT
+ *
+ * Usage: test_e2e <port>. Logs in as FT_TEST_USER (manufacturing_user1)
+ * with FT_TEST_PASSWORD (password1) into FT_TEST_DEPT (Manufacturing).
+ * The content is new each run, so nothing the server holds already
+ * matches it.
+ */
+
+ #include <stdio.h>
+ #include <stdlib.h>
+ #include <string.h>
+ #include <stdint.h>
+ #include <time.h>
+ #include <unistd.h>
+ #include <arpa/inet.h>
+ #include <sys/socket.h>
+ #include <sys/stat.h>
+
+ #include "protocol.h"
+ #include "xxhash.h"
+ #include "digest.h"
+ #include "server.h"
+ #include "check.h"
+
+ #define FILE_SIZE (300 * 1024)
+ #define BLOB_DIR BASE_DIR "/.blobs"  // As storage.h has it
+ #define CONNECT_TRIES 50         // 100 ms apart, while the server starts
+ #define RESUME_TRIES 50          // 100 ms apart, while the server closes the dropped upload
+
+ static int port;
+ static const char *username;
+ static const char *password;
+ static const char *department;
+ static uint8_t content[FILE_SIZE];
+
+ static void test_have(void);
+ static void test_resume(void);
+ static void test_resumable_after_plain(void);
+ static void test_commit(void);
+ static int open_session(void);
+ static int request(int sock, uint8_t type, uint16_t flags, const ft_buf_t *payload, const void *body,
+                    size_t body_len, ft_header_t *reply, uint8_t *reply_payload);
+ static int send_chunk(int sock, const void *data, uint32_t len);
+ static int fetch_matches(int sock, const char *name, const uint8_t *expected, uint64_t expected_size);
+ static int blob_exists(const char *hex, uint64_t size);
+ static void content_digest(const uint8_t *data, size_t len, char hex[DIGEST_HEX_SIZE]);
+ static void put_file(ft_buf_t *b, uint8_t *data, size_t size, uint64_t file_size, const char *name);
+ static const char *env_or(const char *name, const char *fallback);
+
+ int main(int argc, char *argv[]) {
+     if (argc != 2 || (port = atoi(argv[1])) <= 0) {
+         fprintf(stderr, "Usage: %s <port>\n", argv[0]);
+         return 2;
+     }
+     username = env_or("FT_TEST_USER", "manufacturing_user1");
+     password = env_or("FT_TEST_PASSWORD", "password1");
+     department = env_or("FT_TEST_DEPT", "Manufacturing");
+
+     srand(time(NULL) ^ getpid());
+     for (size_t i = 0; i < sizeof(content); i++) {
+         content[i] = (uint8_t)(rand() & 0xff);
+     }
+
+     test_have();
+     test_resume();
+     test_resumable_after_plain();
+     test_commit();
+     return CHECK_DONE();
+ }
+
+ /**
+  * Content the server doesn't hold is asked for with NEED; once uploaded,
+  * a HAVE for it under another name is stored without sending it again
+  */
+ static void test_have(void) {
+     uint8_t data[FT_MAX_PAYLOAD], reply_data[FT_MAX_PAYLOAD];
+     char first[64], second[64], hex[DIGEST_HEX_SIZE];
+     ft_header_t reply;
+     ft_buf_t b;
+
+     snprintf(first, sizeof(first), "e2e-have-%d-a.bin", getpid());
+     snprintf(second, sizeof(second), "e2e-have-%d-b.bin", getpid());
+     content_digest(content, sizeof(content), hex);
+
+     int sock = open_session();
+     CHECK(sock >= 0);
+     if (sock < 0) {
+         return;
+     }
+
+     put_file(&b, data, sizeof(data), sizeof(content), first);
+     ft_put_str(&b, hex);
+     CHECK(request(sock, FT_MSG_HAVE, 0, &b, NULL, 0, &reply, reply_data) == 0 && reply.type == FT_MSG_NEED);
+
+     put_file(&b, data, sizeof(data), sizeof(content), first);
+     CHECK(request(sock, FT_MSG_PUT, 0, &b, content, sizeof(content), &reply, reply_data) == 0 &&
+           reply.type == FT_MSG_OK);
+
+     // Without SHA-256 the server can't trust a HAVE, and every file is sent whole
+     put_file(&b, data, sizeof(data), sizeof(content), second);
+     ft_put_str(&b, hex);
+     CHECK(request(sock, FT_MSG_HAVE, 0, &b, NULL, 0, &reply, reply_data) == 0);
+     CHECK(reply.type == (digest_available() ? FT_MSG_OK : FT_MSG_NEED));
+
+     CHECK(fetch_matches(sock, first, content, sizeof(content)));
+     if (digest_available()) {
+         CHECK(fetch_matches(sock, second, content, sizeof(content)));
+     }
+     close(sock);
+ }
+
+ /**
+  * A resumable upload that loses its connection after a chunk carries on,
+  * on a new connection, from the offset RESUME reports
+  */
+ static void test_resume(void) {
+     uint8_t data[FT_MAX_PAYLOAD], reply_data[FT_MAX_PAYLOAD];
+     uint64_t upload_id = ((uint64_t)rand() << 32) ^ (uint64_t)rand();
+     uint64_t half = sizeof(content) / 2;
+     uint64_t offset = 0;
+     char name[64];
+     ft_header_t reply;
+     ft_buf_t b;
+
+     snprintf(name, sizeof(name), "e2e-resume-%d.bin", getpid());
+
+     // First connection: the first half in one chunk, then gone
+     int sock = open_session();
+     CHECK(sock >= 0);
+     if (sock < 0) {
+         return;
+     }
+     put_file(&b, data, sizeof(data), sizeof(content), name);
+     ft_put_u64(&b, upload_id);
+     ft_put_u64(&b, 0);
+     CHECK(ft_send_frame(sock, FT_MSG_PUT, FT_FLAG_RESUMABLE, 1, data, b.pos) == 0);
+     CHECK(send_chunk(sock, content, half) == 0);
+     close(sock);
+
+     sock = open_session();
+     CHECK(sock >= 0);
+     if (sock < 0) {
+         return;
+     }
+     for (int i = 0; i < RESUME_TRIES && offset != half; i++) {
+         ft_buf_init(&b, data, sizeof(data));
+         ft_put_u64(&b, upload_id);
+         ft_put_str(&b, department);
+         ft_put_str(&b, name);
+         if (request(sock, FT_MSG_RESUME, 0, &b, NULL, 0, &reply, reply_data) != 0) {
+             break;
+         }
+
+         ft_buf_t in;
+         ft_buf_init(&in, reply_data, reply.length);
+         if (reply.type != FT_MSG_OFFSET || ft_get_u64(&in, &offset) != 0) {
+             break;
+         }
+         if (offset != half) {
+             usleep(100 * 1000);
+         }
+     }
+     CHECK(offset == half);
+
+     // The rest, from where the server says it got to
+     put_file(&b, data, sizeof(data), sizeof(content), name);
+     ft_put_u64(&b, upload_id);
+     ft_put_u64(&b, offset);
+     CHECK(ft_send_frame(sock, FT_MSG_PUT, FT_FLAG_RESUMABLE, 2, data, b.pos) == 0);
+     CHECK(send_chunk(sock, content + offset, sizeof(content) - offset) == 0);
+     CHECK(send_chunk(sock, NULL, 0) == 0);
+     CHECK(ft_recv_frame(sock, &reply, reply_data, sizeof(reply_data)) == 0 && reply.type == FT_MSG_OK);
+
+     CHECK(fetch_matches(sock, name, content, sizeof(content)));
+     close(sock);
+ }
+
+ /**
+  * A resumable upload isn't digested, so on a session whose last upload
+  * was a plain one it must not be filed under that upload's digest
+  */
+ static void test_resumable_after_plain(void) {
+     uint8_t data[FT_MAX_PAYLOAD], reply_data[FT_MAX_PAYLOAD];
+     uint64_t upload_id = ((uint64_t)rand() << 32) ^ (uint64_t)rand();
+     uint64_t size = sizeof(content) / 3;
+     uint64_t other_size = sizeof(content) / 2;   // A size of its own, so a blob misnamed for it shows
+     const uint8_t *other = content + sizeof(content) - other_size;
+     char plain[64], resumed[64], hex[DIGEST_HEX_SIZE];
+     ft_header_t reply;
+     ft_buf_t b;
+
+     snprintf(plain, sizeof(plain), "e2e-mixed-%d-a.bin", getpid());
+     snprintf(resumed, sizeof(resumed), "e2e-mixed-%d-b.bin", getpid());
+     content_digest(content, size, hex);
+
+     int sock = open_session();
+     CHECK(sock >= 0);
+     if (sock < 0) {
+         return;
+     }
+
+     put_file(&b, data, sizeof(data), size, plain);
+     CHECK(request(sock, FT_MSG_PUT, 0, &b, content, size, &reply, reply_data) == 0 &&
+           reply.type == FT_MSG_OK);
+
+     put_file(&b, data, sizeof(data), other_size, resumed);
+     ft_put_u64(&b, upload_id);
+     ft_put_u64(&b, 0);
+     CHECK(ft_send_frame(sock, FT_MSG_PUT, FT_FLAG_RESUMABLE, 3, data, b.pos) == 0);
+     CHECK(send_chunk(sock, other, other_size) == 0);
+     CHECK(send_chunk(sock, NULL, 0) == 0);
+     CHECK(ft_recv_frame(sock, &reply, reply_data, sizeof(reply_data)) == 0 && reply.type == FT_MSG_OK);
+
+     // Blobs are only named by SHA-256 when the server has it
+     if (digest_available()) {
+         CHECK(blob_exists(hex, size));
+         CHECK(!blob_exists(hex, other_size));
+     }
+     CHECK(fetch_matches(sock, plain, content, size));
+     CHECK(fetch_matches(sock, resumed, other, other_size));
+     close(sock);
+ }
+
+ /**
+  * The two halves of a file sent as ranges over two connections, at once,
+  * make up the file COMMIT publishes
+  */
+ static void test_commit(void) {
+     uint8_t data[FT_MAX_PAYLOAD], reply_data[FT_MAX_PAYLOAD];
+     uint64_t upload_id = ((uint64_t)rand() << 32) ^ (uint64_t)rand();
+     uint64_t half = sizeof(content) / 2;
+     char name[64];
+     ft_header_t reply;
+     ft_buf_t b;
+
+     snprintf(name, sizeof(name), "e2e-commit-%d.bin", getpid());
+
+     int socks[2] = { open_session(), open_session() };
+     CHECK(socks[0] >= 0 && socks[1] >= 0);
+     if (socks[0] < 0 || socks[1] < 0) {
+         return;
+     }
+
+     for (int i = 0; i < 2; i++) {
+         put_file(&b, data, sizeof(data), sizeof(content), name);
+         ft_put_u64(&b, upload_id);
+         ft_put_u64(&b, i * half);
+         CHECK(ft_send_frame(socks[i], FT_MSG_PUT, FT_FLAG_RANGE, 4, data, b.pos) == 0);
+         CHECK(send_chunk(socks[i], content + i * half, (i == 0) ? half : sizeof(content) - half) == 0);
+         CHECK(send_chunk(socks[i], NULL, 0) == 0);
+     }
+     for (int i = 0; i < 2; i++) {
+         CHECK(ft_recv_frame(socks[i], &reply, reply_data, sizeof(reply_data)) == 0 && reply.type == FT_MSG_OK);
+     }
+
+     put_file(&b, data, sizeof(data), sizeof(content), name);
+     ft_put_u64(&b, upload_id);
+     CHECK(request(socks[0], FT_MSG_COMMIT, 0, &b, NULL, 0, &reply, reply_data) == 0 && reply.type == FT_MSG_OK);
+
+     CHECK(fetch_matches(socks[1], name, content, sizeof(content)));
+     close(socks[0]);
+     close(socks[1]);
+ }
+
+ /**
+  * Connects and logs in; returns the socket, or -1
+  */
+ static int open_session(void) {
+     uint8_t data[FT_MAX_PAYLOAD];
+     struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port) };
+     inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+
+     int sock = -1;
+     for (int i = 0; i < CONNECT_TRIES && sock < 0; i++) {
+         sock = socket(AF_INET, SOCK_STREAM, 0);
+         if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+             close(sock);
+             sock = -1;
+             usleep(100 * 1000);
+         }
+     }
+     if (sock < 0) {
+         fprintf(stderr, "No server on port %d\n", port);
+         return -1;
+     }
+
+     ft_buf_t b;
+     ft_header_t reply;
+     ft_buf_init(&b, data, sizeof(data));
+     ft_put_str(&b, username);
+     ft_put_str(&b, password);
+     if (request(sock, FT_MSG_AUTH, 0, &b, NULL, 0, &reply, data) != 0 || reply.type != FT_MSG_OK) {
+         fprintf(stderr, "Cannot log in as %s\n", username);
+         close(sock);
+         return -1;
+     }
+     return sock;
+ }
+
+ /**
+  * Sends a request, and its body if it has one, and waits for the reply;
+  * reply_payload must hold FT_MAX_PAYLOAD bytes
+  */
+ static int request(int sock, uint8_t type, uint16_t flags, const ft_buf_t *payload, const void *body,
+                    size_t body_len, ft_header_t *reply, uint8_t *reply_payload) {
+     static uint32_t request_id = 100;
+
+     if (ft_send_frame(sock, type, flags, ++request_id, payload->data, payload->pos) != 0 ||
+         (body_len > 0 && ft_send_all(sock, body, body_len) != 0) ||
+         ft_recv_frame(sock, reply, reply_payload, FT_MAX_PAYLOAD) != 0) {
+         return -1;
+     }
+     return (reply->request_id == request_id) ? 0 : -1;
+ }
+
+ /**
+  * Sends one chunk of a resumable body, with the checksum of its data
+  */
+ static int send_chunk(int sock, const void *data, uint32_t len) {
+     uint8_t header[FT_CHUNK_SUM_HEADER_SIZE];
+     uint32_t length = htonl(len);
+     ft_buf_t b;
+
+     memcpy(header, &length, sizeof(length));
+     ft_buf_init(&b, header + sizeof(length), sizeof(uint64_t));
+     ft_put_u64(&b, (len > 0) ? xxh64(data, len, 0) : 0);
+     if (ft_send_all(sock, header, sizeof(header)) != 0) {
+         return -1;
+     }
+     return (len > 0) ? ft_send_all(sock, data, len) : 0;
+ }
+
+ /**
+  * Whether GET gives back exactly the expected bytes for a file
+  */
+ static int fetch_matches(int sock, const char *name, const uint8_t *expected, uint64_t expected_size) {
+     uint8_t data[FT_MAX_PAYLOAD];
+     ft_header_t reply;
+     ft_buf_t b;
+     uint64_t size, mtime;
+
+     ft_buf_init(&b, data, sizeof(data));
+     ft_put_str(&b, department);
+     ft_put_str(&b, name);
+     if (request(sock, FT_MSG_GET, 0, &b, NULL, 0, &reply, data) != 0 || reply.type != FT_MSG_FILE) {
+         return 0;
+     }
+
+     ft_buf_init(&b, data, reply.length);
+     if (ft_get_u64(&b, &size) != 0 || ft_get_u64(&b, &mtime) != 0 || size != expected_size) {
+         return 0;
+     }
+
+     uint8_t *got = malloc(size);
+     int same = got != NULL && ft_recv_all(sock, got, size) == 0 && memcmp(got, expected, size) == 0;
+     free(got);
+     return same;
+ }
+
+ /**
+  * Whether the blob store holds a blob for this digest and size
+  */
+ static int blob_exists(const char *hex, uint64_t size) {
+     char path[sizeof(BLOB_DIR) + DIGEST_HEX_SIZE + 24];
+     struct stat st;
+
+     snprintf(path, sizeof(path), "%s/%s-%llu", BLOB_DIR, hex, (unsigned long long)size);
+     return stat(path, &st) == 0;
+ }
+
+ /**
+  * The hex SHA-256 of data, or zeros without OpenSSL
+  */
+ static void content_digest(const uint8_t *data, size_t len, char hex[DIGEST_HEX_SIZE]) {
+     digest_t *d = digest_new();
+     if (d != NULL) {
+         digest_update(d, data, len);
+         digest_final(d, hex);
+         digest_free(d);
+     } else {
+         memset(hex, '0', DIGEST_HEX_SIZE - 1);
+         hex[DIGEST_HEX_SIZE - 1] = '\0';
+     }
+ }
+
+ /**
+  * Starts a PUT payload: the file's size, department and name
+  */
+ static void put_file(ft_buf_t *b, uint8_t *data, size_t size, uint64_t file_size, const char *name) {
+     ft_buf_init(b, data, size);
+     ft_put_u64(b, file_size);
+     ft_put_str(b, department);
+     ft_put_str(b, name);
+ }
+
+ static const char *env_or(const char *name, const char *fallback) {
+     const char *value = getenv(name);
+     return (value != NULL && *value != '\0') ? value : fallback;
+ }
@@ -0,0 +1,114 @@
+/**
+ * Tests for the framing codec in protocol.c
+ */
+
+ #include <string.h>
+ #include <stdint.h>
+
+ #include "protocol.h"
+ #include "check.h"
+
+ static void test_header_round_trip(void);
+ static void test_header_rejects(void);
+ static void test_buf_u64(void);
+ static void test_buf_str(void);
+
+ int main(void) {
+     test_header_round_trip();
+     test_header_rejects();
+     test_buf_u64();
+     test_buf_str();
+     return CHECK_DONE();
+ }
+
+ /**
+  * A header comes back as it went in, laid out in network byte order
+  */
+ static void test_header_round_trip(void) {
+     uint8_t raw[FT_HEADER_SIZE];
+     ft_header_t in = { .magic = FT_MAGIC, .version = FT_VERSION, .type = FT_MSG_PUT,
+                        .flags = FT_FLAG_CHUNKED | FT_FLAG_CHECKSUM, .reserved = 0,
+                        .request_id = 0x01020304, .length = 0xA0B0C0D0 };
+     ft_header_t out;
+
+     ft_encode_header(&in, raw);
+     CHECK(raw[0] == FT_MAGIC_BYTE && raw[1] == 0x54);
+     CHECK(raw[2] == FT_VERSION && raw[3] == FT_MSG_PUT);
+     CHECK(raw[4] == 0x00 && raw[5] == 0x81);
+     CHECK(raw[8] == 0x01 && raw[11] == 0x04);
+     CHECK(raw[12] == 0xA0 && raw[15] == 0xD0);
+
+     CHECK(ft_decode_header(raw, &out) == 0);
+     CHECK(out.type == in.type && out.flags == in.flags);
+     CHECK(out.request_id == in.request_id && out.length == in.length);
+ }
+
+ /**
+  * Bad magic or an unknown version is refused
+  */
+ static void test_header_rejects(void) {
+     uint8_t raw[FT_HEADER_SIZE];
+     ft_header_t hdr = { .magic = FT_MAGIC, .version = FT_VERSION, .type = FT_MSG_AUTH };
+     ft_header_t out;
+
+     ft_encode_header(&hdr, raw);
+     raw[1] ^= 0xFF;
+     CHECK(ft_decode_header(raw, &out) != 0);
+
+     ft_encode_header(&hdr, raw);
+     raw[2] = FT_VERSION + 1;
+     CHECK(ft_decode_header(raw, &out) != 0);
+ }
+
+ /**
+  * u64s are big-endian and never written or read past the buffer
+  */
+ static void test_buf_u64(void) {
+     uint8_t data[12];
+     ft_buf_t b;
+     uint64_t value;
+
+     ft_buf_init(&b, data, sizeof(data));
+     CHECK(ft_put_u64(&b, 0x1122334455667788ull) == 0);
+     CHECK(b.pos == 8 && data[0] == 0x11 && data[7] == 0x88);
+     CHECK(ft_put_u64(&b, 1) != 0);
+     CHECK(b.pos == 8);
+
+     ft_buf_init(&b, data, 8);
+     CHECK(ft_get_u64(&b, &value) == 0 && value == 0x1122334455667788ull);
+     CHECK(ft_get_u64(&b, &value) != 0);
+
+     ft_buf_init(&b, data, 7);
+     CHECK(ft_get_u64(&b, &value) != 0);
+ }
+
+ /**
+  * Strings go out with their terminator and must come back with one that
+  * fits the caller's buffer
+  */
+ static void test_buf_str(void) {
+     uint8_t data[16];
+     char out[8];
+     ft_buf_t b;
+
+     ft_buf_init(&b, data, sizeof(data));
+     CHECK(ft_put_str(&b, "dept") == 0 && b.pos == 5);
+     CHECK(ft_put_str(&b, "") == 0 && b.pos == 6);
+     CHECK(ft_put_str(&b, "much too long") != 0);
+
+     ft_buf_init(&b, data, 6);
+     CHECK(ft_get_str(&b, out, sizeof(out)) == 0 && strcmp(out, "dept") == 0);
+     CHECK(ft_get_str(&b, out, sizeof(out)) == 0 && out[0] == '\0');
+     CHECK(ft_get_str(&b, out, sizeof(out)) != 0);
+
+     // No terminator before the end of the payload
+     memcpy(data, "abc", 3);
+     ft_buf_init(&b, data, 3);
+     CHECK(ft_get_str(&b, out, sizeof(out)) != 0);
+
+     // Longer than the caller can hold
+     ft_buf_init(&b, data, sizeof(data));
+     ft_put_str(&b, "12345678");
+     ft_buf_init(&b, data, sizeof(data));
+     CHECK(ft_get_str(&b, out, sizeof(out)) != 0);
+ }
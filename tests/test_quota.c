@@ -0,0 +1,105 @@
+/**
+ * Tests for the GCRA buckets in quota.c
+ *
+ * Built with quota.c included, to reach its static functions. Times are
+ * given explicitly, so nothing here waits.
+ */
+
+ #include "quota.c"
+ #include "check.h"
+
+ #define RATE (1024 * 1024)       // Bytes per second
+ #define BURST (RATE / 4)         // What QUOTA_BURST_MS of it holds
+ #define NOW (10 * NS_PER_SEC)
+ #define MS (NS_PER_SEC / 1000)
+
+ static void test_unlimited(void);
+ static void test_burst(void);
+ static void test_reserve(void);
+ static void test_parse_rate(void);
+
+ int main(void) {
+     test_unlimited();
+     test_burst();
+     test_reserve();
+     test_parse_rate();
+     return CHECK_DONE();
+ }
+
+ static void test_unlimited(void) {
+     bucket_t b;
+     uint64_t wait_ns = 1;
+
+     bucket_init(&b, 0);
+     CHECK(bucket_allow(&b, UINT64_MAX, 0, NOW, &wait_ns) == UINT64_MAX && wait_ns == 0);
+     bucket_charge(&b, 1 << 30, NOW);
+     CHECK(bucket_allow(&b, 100, 50, NOW, &wait_ns) == 100 && wait_ns == 0);
+ }
+
+ /**
+  * A full bucket grants up to its burst; an empty one says how long until
+  * a grant's worth has come back in
+  */
+ static void test_burst(void) {
+     bucket_t b;
+     uint64_t wait_ns;
+
+     bucket_init(&b, RATE);
+     CHECK(bucket_allow(&b, 10 * RATE, 0, NOW, &wait_ns) == BURST && wait_ns == 0);
+     CHECK(bucket_allow(&b, 100, 0, NOW, &wait_ns) == 100);
+
+     bucket_charge(&b, BURST, NOW);
+     CHECK(bucket_allow(&b, RATE, 0, NOW, &wait_ns) == 0);
+     CHECK(wait_ns == (uint64_t)QUOTA_MIN_GRANT * NS_PER_SEC / RATE);
+
+     // Less than a grant left is still nothing, unless that's all that's wanted
+     CHECK(bucket_allow(&b, RATE, 0, NOW + 10 * MS, &wait_ns) == 0 && wait_ns > 0);
+     CHECK(bucket_allow(&b, 1000, 0, NOW + 10 * MS, &wait_ns) == 1000);
+
+     // Refilled at the rate, and no fuller than the burst however long it sat
+     CHECK(bucket_allow(&b, RATE, 0, NOW + 125 * MS, &wait_ns) == BURST / 2);
+     CHECK(bucket_allow(&b, 10 * RATE, 0, NOW + 60 * NS_PER_SEC, &wait_ns) == BURST);
+
+     // An overdraft is waited off before anything more is granted
+     bucket_charge(&b, 3 * BURST, NOW + 60 * NS_PER_SEC);
+     CHECK(bucket_allow(&b, RATE, 0, NOW + 60 * NS_PER_SEC + 500 * MS, &wait_ns) == 0);
+     CHECK(wait_ns > 0 && wait_ns <= 250 * MS + (uint64_t)QUOTA_MIN_GRANT * NS_PER_SEC / RATE);
+ }
+
+ /**
+  * A class with a reserve sees only the part of the bucket it leaves
+  * alone, so it waits while a higher class is still granted
+  */
+ static void test_reserve(void) {
+     bucket_t b;
+     uint64_t wait_ns;
+
+     bucket_init(&b, RATE);
+     CHECK(bucket_allow(&b, RATE, QUOTA_RESERVE_BULK, NOW, &wait_ns) == BURST / 2);
+     CHECK(bucket_allow(&b, RATE, QUOTA_RESERVE_NORMAL, NOW, &wait_ns) == BURST * 3 / 4);
+
+     bucket_charge(&b, BURST / 2, NOW);
+     CHECK(bucket_allow(&b, RATE, QUOTA_RESERVE_BULK, NOW, &wait_ns) == 0 && wait_ns > 0);
+     CHECK(bucket_allow(&b, RATE, QUOTA_RESERVE_NORMAL, NOW, &wait_ns) == BURST / 4);
+     CHECK(bucket_allow(&b, RATE, 0, NOW, &wait_ns) == BURST / 2);
+ }
+
+ static void test_parse_rate(void) {
+     uint64_t rate;
+
+     CHECK(quota_parse_rate("500", &rate) == 0 && rate == 500);
+     CHECK(quota_parse_rate("500K", &rate) == 0 && rate == 500 * 1024);
+     CHECK(quota_parse_rate("40m", &rate) == 0 && rate == 40ull * 1024 * 1024);
+     CHECK(quota_parse_rate("1G", &rate) == 0 && rate == 1ull << 30);
+     CHECK(quota_parse_rate("0", &rate) == 0 && rate == 0);
+     CHECK(quota_parse_rate("", &rate) != 0);
+     CHECK(quota_parse_rate("-5", &rate) != 0);
+     CHECK(quota_parse_rate("5T", &rate) != 0);
+     CHECK(quota_parse_rate("5KB", &rate) != 0);
+
+     // Out of 64 bits, before or after the suffix
+     CHECK(quota_parse_rate("17179869183G", &rate) == 0 && rate == 17179869183ull << 30);
+     CHECK(quota_parse_rate("17179869184G", &rate) != 0);
+     CHECK(quota_parse_rate("20000000000G", &rate) != 0);
+     CHECK(quota_parse_rate("99999999999999999999", &rate) != 0);
+ }
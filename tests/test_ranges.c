@@ -0,0 +1,96 @@
+/**
+ * Tests for how end_range() in storage.c merges the parts of a file
+ * received over parallel connections
+ *
+ * Built with storage.c included, to reach its static functions.
+ */
+
+ #include "storage.c"
+ #include "check.h"
+
+ static void test_merge(void);
+ static void test_empty_ranges(void);
+ static void receive(range_upload_t *r, uint64_t start, uint64_t end);
+ static int holds(const range_upload_t *r, int count, const uint64_t (*parts)[2]);
+
+ int main(void) {
+     test_merge();
+     test_empty_ranges();
+     return CHECK_DONE();
+ }
+
+ /**
+  * Parts arriving in any order are kept sorted, and folded together where
+  * they overlap or touch
+  */
+ static void test_merge(void) {
+     range_upload_t r = { .writers = 8 };
+
+     receive(&r, 100, 200);
+     receive(&r, 300, 400);
+     CHECK(holds(&r, 2, (const uint64_t[][2]){ { 100, 200 }, { 300, 400 } }));
+
+     // Before the first, then between two without touching either
+     receive(&r, 0, 50);
+     receive(&r, 220, 280);
+     CHECK(holds(&r, 4, (const uint64_t[][2]){ { 0, 50 }, { 100, 200 }, { 220, 280 }, { 300, 400 } }));
+
+     // Touching on both sides joins three into one
+     receive(&r, 200, 220);
+     CHECK(holds(&r, 3, (const uint64_t[][2]){ { 0, 50 }, { 100, 280 }, { 300, 400 } }));
+
+     // Inside one already held
+     receive(&r, 120, 130);
+     CHECK(holds(&r, 3, (const uint64_t[][2]){ { 0, 50 }, { 100, 280 }, { 300, 400 } }));
+
+     // Overlapping two and running past the last
+     receive(&r, 40, 500);
+     CHECK(holds(&r, 1, (const uint64_t[][2]){ { 0, 500 } }));
+     CHECK(r.writers == 1);
+
+     // More parts than the first allocation holds
+     for (uint64_t i = 0; i < 20; i++) {
+         r.writers++;
+         receive(&r, 1000 + 20 * i, 1010 + 20 * i);
+     }
+     CHECK(r.count == 21 && r.received[20][0] == 1380 && r.received[20][1] == 1390);
+     free(r.received);
+ }
+
+ /**
+  * A range that verified nothing adds nothing
+  */
+ static void test_empty_ranges(void) {
+     range_upload_t r = { .writers = 1 };
+
+     receive(&r, 100, 100);
+     CHECK(r.count == 0 && r.writers == 0);
+     free(r.received);
+ }
+
+ /**
+  * Ends a range of r that started at start and was verified up to end
+  */
+ static void receive(range_upload_t *r, uint64_t start, uint64_t end) {
+     upload_t up;
+     upload_init(&up);
+     up.fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+     up.range = r;
+     up.base = start;
+     up.committed = end;
+
+     end_range(&up);
+     CHECK(up.fd == -1 && up.range == NULL);
+ }
+
+ static int holds(const range_upload_t *r, int count, const uint64_t (*parts)[2]) {
+     if (r->count != count) {
+         return 0;
+     }
+     for (int i = 0; i < count; i++) {
+         if (r->received[i][0] != parts[i][0] || r->received[i][1] != parts[i][1]) {
+             return 0;
+         }
+     }
+     return 1;
+ }
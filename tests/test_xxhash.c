@@ -0,0 +1,50 @@
+/**
+ * Tests for XXH64 in xxhash.c, against the reference implementation's
+ * values
+ */
+
+ #include <string.h>
+ #include <stdint.h>
+
+ #include "xxhash.h"
+ #include "check.h"
+
+ static void test_reference_values(void);
+ static void test_streaming(void);
+
+ int main(void) {
+     test_reference_values();
+     test_streaming();
+     return CHECK_DONE();
+ }
+
+ static void test_reference_values(void) {
+     const char *phrase = "Nobody inspects the spammish repetition";
+
+     CHECK(xxh64("", 0, 0) == 0xEF46DB3751D8E999ull);
+     CHECK(xxh64("a", 1, 0) == 0xD24EC4F1A98C6E5Bull);
+     CHECK(xxh64("abc", 3, 0) == 0x44BC2CF5AD770999ull);
+     CHECK(xxh64(phrase, strlen(phrase), 0) == 0xFBCEA83C8A378BF1ull);
+ }
+
+ /**
+  * Feeding the input in pieces of every size gives the one-shot hash,
+  * across the 32-byte stripes
+  */
+ static void test_streaming(void) {
+     uint8_t data[1000];
+     for (size_t i = 0; i < sizeof(data); i++) {
+         data[i] = (uint8_t)(i * 31 + 7);
+     }
+     uint64_t whole = xxh64(data, sizeof(data), 12345);
+
+     for (size_t piece = 1; piece <= 67; piece++) {
+         xxh64_state_t state;
+         xxh64_init(&state, 12345);
+         for (size_t off = 0; off < sizeof(data); off += piece) {
+             size_t len = (sizeof(data) - off < piece) ? sizeof(data) - off : piece;
+             xxh64_update(&state, data + off, len);
+         }
+         CHECK(xxh64_digest(&state) == whole);
+     }
+ }
@@ -0,0 +1,579 @@
+/**
+ * TLS Transport for the File Transfer System
+ *
+ * Every read and write clears the thread's OpenSSL error queue first, so
+ * SSL_get_error() only ever reports on the call just made. WANT_READ and
+ * WANT_WRITE come back as EAGAIN, like a non-blocking socket; a clean
+ * close_notify, or a peer that just hangs up, reads as end of file.
+ *
+ * kTLS is asked for on both sides and used wherever OpenSSL and the kernel
+ * agree on it: sends then go through SSL_sendfile(), and upload bodies are
+ * spliced out of the socket already decrypted. Without it, files are
+ * copied through a buffer and encrypted in user space.
+ */
+
+ #include <stdio.h>
+ #include <stdlib.h>
+ #include <stdint.h>
+ #include <string.h>
+ #include <unistd.h>
+ #include <errno.h>
+ #include <pthread.h>
+ #include <arpa/inet.h>
+ #include <sys/socket.h>
+ #include <sys/sendfile.h>
+
+ #ifdef HAVE_OPENSSL
+ #include <openssl/ssl.h>
+ #include <openssl/err.h>
+ #include <openssl/pem.h>
+ #include <openssl/x509v3.h>
+ #endif
+
+ #include "tls.h"
+
+ #ifdef HAVE_OPENSSL
+
+ struct tls {
+     SSL *ssl;
+     int want_write;              // The last call is waiting for the socket to take data
+     int ktls_send;               // The kernel encrypts what's sent
+     int ktls_recv;               // The kernel decrypts what's received
+ };
+
+ static SSL_CTX *server_ctx;
+ static int server_tls_only;
+ static SSL_CTX *client_ctx;
+ static tls_t *client_conns[TLS_MAX_FDS];
+
+ // The ticket the client's next connection resumes with
+ static SSL_SESSION *client_session;
+ static const char *client_session_file;
+ static pthread_mutex_t client_session_lock = PTHREAD_MUTEX_INITIALIZER;
+
+ static SSL_CTX *new_ctx(const SSL_METHOD *method);
+ static tls_t *wrap(SSL *ssl);
+ static void note_offload(tls_t *tls);
+ static ssize_t io_result(tls_t *tls, ssize_t n);
+ static int keep_session(SSL *ssl, SSL_SESSION *session);
+ static void print_error(const char *what, const char *name);
+
+ /**
+  * Loads the server's certificate and key; key_file may be NULL when the
+  * certificate file holds both. With tls_only set, plaintext clients are
+  * turned away.
+  */
+ int tls_server_init(const char *cert_file, const char *key_file, int tls_only) {
+     if (key_file == NULL) {
+         key_file = cert_file;
+     }
+
+     server_ctx = new_ctx(TLS_server_method());
+     if (server_ctx == NULL) {
+         print_error("Cannot set up TLS", NULL);
+         return -1;
+     }
+     if (SSL_CTX_use_certificate_chain_file(server_ctx, cert_file) != 1) {
+         print_error("Cannot load TLS certificate", cert_file);
+         return -1;
+     }
+     if (SSL_CTX_use_PrivateKey_file(server_ctx, key_file, SSL_FILETYPE_PEM) != 1 ||
+         SSL_CTX_check_private_key(server_ctx) != 1) {
+         print_error("Cannot load TLS key", key_file);
+         return -1;
+     }
+
+     // Partial writes let a session send what the socket takes and retry the rest later
+     SSL_CTX_set_mode(server_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                                  SSL_MODE_RELEASE_BUFFERS);
+
+     // Stateless tickets for TLS 1.3, plus the session cache for TLS 1.2 clients
+     SSL_CTX_set_session_id_context(server_ctx, (const unsigned char *)"ft", 2);
+     SSL_CTX_set_session_cache_mode(server_ctx, SSL_SESS_CACHE_SERVER);
+
+     server_tls_only = tls_only;
+     printf("TLS enabled with certificate %s%s\n", cert_file, tls_only ? ", plaintext refused" : "");
+     return 0;
+ }
+
+ int tls_server_enabled(void) {
+     return server_ctx != NULL;
+ }
+
+ int tls_server_required(void) {
+     return server_tls_only;
+ }
+
+ /**
+  * Starts a server-side session on an accepted socket; the handshake is
+  * driven by tls_handshake()
+  */
+ tls_t *tls_accept(int fd) {
+     SSL *ssl = SSL_new(server_ctx);
+     if (ssl == NULL || SSL_set_fd(ssl, fd) != 1) {
+         SSL_free(ssl);
+         return NULL;
+     }
+     SSL_set_accept_state(ssl);
+
+     tls_t *tls = wrap(ssl);
+     if (tls == NULL) {
+         SSL_free(ssl);
+     }
+     return tls;
+ }
+
+ /**
+  * Takes the handshake as far as the socket allows
+  */
+ int tls_handshake(tls_t *tls) {
+     ERR_clear_error();
+     tls->want_write = 0;
+
+     int n = SSL_do_handshake(tls->ssl);
+     if (n == 1) {
+         note_offload(tls);
+         return TLS_DONE;
+     }
+
+     switch (SSL_get_error(tls->ssl, n)) {
+     case SSL_ERROR_WANT_WRITE:
+         tls->want_write = 1;
+         return TLS_AGAIN;
+     case SSL_ERROR_WANT_READ:
+         return TLS_AGAIN;
+     default:
+         return TLS_FAILED;
+     }
+ }
+
+ /**
+  * Like recv() on a non-blocking socket
+  */
+ ssize_t tls_read(tls_t *tls, void *buf, size_t len) {
+     ERR_clear_error();
+     tls->want_write = 0;
+     return io_result(tls, SSL_read(tls->ssl, buf, (len > INT32_MAX) ? INT32_MAX : (int)len));
+ }
+
+ /**
+  * Like recv() with MSG_PEEK
+  */
+ ssize_t tls_peek(tls_t *tls, void *buf, size_t len) {
+     ERR_clear_error();
+     tls->want_write = 0;
+     return io_result(tls, SSL_peek(tls->ssl, buf, (len > INT32_MAX) ? INT32_MAX : (int)len));
+ }
+
+ /**
+  * Like send() on a non-blocking socket
+  *
+  * After EAGAIN the same bytes must be offered again, though more may
+  * follow them.
+  */
+ ssize_t tls_write(tls_t *tls, const void *buf, size_t len) {
+     ERR_clear_error();
+     tls->want_write = 0;
+     return io_result(tls, SSL_write(tls->ssl, buf, (len > INT32_MAX) ? INT32_MAX : (int)len));
+ }
+
+ /**
+  * Like sendfile(), where the kernel does the encryption; fails with
+  * EINVAL otherwise, so the caller copies the file instead
+  */
+ ssize_t tls_sendfile(tls_t *tls, int file_fd, off_t offset, size_t len) {
+     if (!tls->ktls_send) {
+         errno = EINVAL;
+         return -1;
+     }
+
+     ERR_clear_error();
+     tls->want_write = 0;
+     ossl_ssize_t n = SSL_sendfile(tls->ssl, file_fd, offset, len, 0);
+     return (n >= 0) ? n : io_result(tls, -1);
+ }
+
+ /**
+  * Whether bytes spliced from the socket now would be plaintext and next
+  * in line, i.e. the kernel decrypts and OpenSSL holds nothing back
+  */
+ int tls_can_splice(tls_t *tls) {
+     return tls->ktls_recv && !SSL_has_pending(tls->ssl);
+ }
+
+ /**
+  * Whether decrypted bytes are waiting that the socket won't signal
+  */
+ int tls_pending(tls_t *tls) {
+     return SSL_pending(tls->ssl) > 0;
+ }
+
+ int tls_wants_write(const tls_t *tls) {
+     return tls->want_write;
+ }
+
+ /**
+  * Names the protocol and cipher in use, for logs, as one word
+  */
+ const char *tls_describe(tls_t *tls, char *buf, size_t size) {
+     snprintf(buf, size, "%s/%s%s%s%s", SSL_get_version(tls->ssl), SSL_get_cipher_name(tls->ssl),
+              SSL_session_reused(tls->ssl) ? "/resumed" : "", tls->ktls_send ? "/ktls-tx" : "",
+              tls->ktls_recv ? "/ktls-rx" : "");
+     return buf;
+ }
+
+ /**
+  * Sends close_notify if the socket takes it, then frees the session; the
+  * caller closes the socket
+  */
+ void tls_free(tls_t *tls) {
+     if (tls == NULL) {
+         return;
+     }
+     ERR_clear_error();
+     if (SSL_is_init_finished(tls->ssl)) {
+         SSL_shutdown(tls->ssl);
+     }
+     SSL_free(tls->ssl);
+     free(tls);
+ }
+
+ /**
+  * Sets up client connections, verifying the server against ca_file (or
+  * the system's trust store) and resuming from session_file if given
+  */
+ int tls_client_init(const char *ca_file, const char *session_file) {
+     client_ctx = new_ctx(TLS_client_method());
+     if (client_ctx == NULL) {
+         print_error("Cannot set up TLS", NULL);
+         return -1;
+     }
+
+     SSL_CTX_set_verify(client_ctx, SSL_VERIFY_PEER, NULL);
+     if (ca_file != NULL ? SSL_CTX_load_verify_locations(client_ctx, ca_file, NULL) != 1
+                         : SSL_CTX_set_default_verify_paths(client_ctx) != 1) {
+         print_error("Cannot load CA certificates", ca_file);
+         return -1;
+     }
+
+     // Tickets are kept here rather than in OpenSSL's cache, so every connection sees the newest
+     SSL_CTX_set_session_cache_mode(client_ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+     SSL_CTX_sess_set_new_cb(client_ctx, keep_session);
+
+     client_session_file = session_file;
+     FILE *f = (session_file != NULL) ? fopen(session_file, "re") : NULL;
+     if (f != NULL) {
+         client_session = PEM_read_SSL_SESSION(f, NULL, NULL, NULL);
+         fclose(f);
+     }
+     return 0;
+ }
+
+ int tls_client_enabled(void) {
+     return client_ctx != NULL;
+ }
+
+ /**
+  * Runs the client handshake on a connected blocking socket, resuming the
+  * last session if there is one; host is what the certificate must name
+  */
+ int tls_connect(int sock, const char *host) {
+     if (sock < 0 || sock >= TLS_MAX_FDS) {
+         fprintf(stderr, "TLS handshake failed: Descriptor %d out of range\n", sock);
+         return -1;
+     }
+
+     SSL *ssl = SSL_new(client_ctx);
+     if (ssl == NULL || SSL_set_fd(ssl, sock) != 1) {
+         SSL_free(ssl);
+         print_error("TLS handshake failed", NULL);
+         return -1;
+     }
+
+     struct in_addr addr;
+     if (inet_pton(AF_INET, host, &addr) == 1) {
+         X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), host);
+     } else {
+         SSL_set_tlsext_host_name(ssl, host);
+         SSL_set1_host(ssl, host);
+     }
+
+     pthread_mutex_lock(&client_session_lock);
+     if (client_session != NULL && SSL_SESSION_is_resumable(client_session)) {
+         SSL_set_session(ssl, client_session);
+     }
+     pthread_mutex_unlock(&client_session_lock);
+
+     ERR_clear_error();
+     if (SSL_connect(ssl) != 1) {
+         long verify = SSL_get_verify_result(ssl);
+         if (verify != X509_V_OK) {
+             fprintf(stderr, "TLS handshake failed: %s\n", X509_verify_cert_error_string(verify));
+         } else {
+             print_error("TLS handshake failed", NULL);
+         }
+         SSL_free(ssl);
+         return -1;
+     }
+
+     tls_t *tls = wrap(ssl);
+     if (tls == NULL) {
+         SSL_free(ssl);
+         return -1;
+     }
+     note_offload(tls);
+     client_conns[sock] = tls;
+     return 0;
+ }
+
+ /**
+  * The TLS session on a client socket, or NULL if it's plain TCP
+  */
+ tls_t *tls_get(int sock) {
+     return (sock >= 0 && sock < TLS_MAX_FDS) ? client_conns[sock] : NULL;
+ }
+
+ ssize_t tls_send(int sock, const void *buf, size_t len) {
+     tls_t *tls = tls_get(sock);
+     return (tls != NULL) ? tls_write(tls, buf, len) : send(sock, buf, len, MSG_NOSIGNAL);
+ }
+
+ ssize_t tls_recv(int sock, void *buf, size_t len) {
+     tls_t *tls = tls_get(sock);
+     return (tls != NULL) ? tls_read(tls, buf, len) : recv(sock, buf, len, 0);
+ }
+
+ /**
+  * Like sendfile(), advancing *offset; fails with EINVAL on a TLS socket
+  * the kernel doesn't encrypt for
+  */
+ ssize_t tls_send_file(int sock, int file_fd, off_t *offset, size_t len) {
+     tls_t *tls = tls_get(sock);
+     if (tls == NULL) {
+         return sendfile(sock, file_fd, offset, len);
+     }
+
+     ssize_t n = tls_sendfile(tls, file_fd, *offset, len);
+     if (n > 0) {
+         *offset += n;
+     }
+     return n;
+ }
+
+ /**
+  * Ends the TLS session, if any, and closes the socket
+  */
+ void tls_close(int sock) {
+     tls_t *tls = tls_get(sock);
+     if (tls != NULL) {
+         client_conns[sock] = NULL;
+         tls_free(tls);
+     }
+     close(sock);
+ }
+
+ static SSL_CTX *new_ctx(const SSL_METHOD *method) {
+     SSL_CTX *ctx = SSL_CTX_new(method);
+     if (ctx == NULL) {
+         return NULL;
+     }
+
+     SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+     SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF | SSL_OP_NO_RENEGOTIATION | SSL_OP_ENABLE_KTLS);
+     return ctx;
+ }
+
+ static tls_t *wrap(SSL *ssl) {
+     tls_t *tls = calloc(1, sizeof(*tls));
+     if (tls != NULL) {
+         tls->ssl = ssl;
+     }
+     return tls;
+ }
+
+ /**
+  * Records which directions the kernel took over during the handshake
+  */
+ static void note_offload(tls_t *tls) {
+     tls->ktls_send = BIO_get_ktls_send(SSL_get_wbio(tls->ssl));
+     tls->ktls_recv = BIO_get_ktls_recv(SSL_get_rbio(tls->ssl));
+ }
+
+ /**
+  * Turns an SSL_read() or SSL_write() result into a recv() or send() one
+  */
+ static ssize_t io_result(tls_t *tls, ssize_t n) {
+     if (n > 0) {
+         return n;
+     }
+
+     switch (SSL_get_error(tls->ssl, (int)n)) {
+     case SSL_ERROR_ZERO_RETURN:
+         return 0;
+     case SSL_ERROR_WANT_WRITE:
+         tls->want_write = 1;
+         errno = EAGAIN;
+         return -1;
+     case SSL_ERROR_WANT_READ:
+         errno = EAGAIN;
+         return -1;
+     case SSL_ERROR_SYSCALL:
+         if (errno == 0) {
+             errno = ECONNRESET;
+         }
+         return -1;
+     default:
+         errno = EPROTO;
+         return -1;
+     }
+ }
+
+ /**
+  * Keeps each new ticket for the client's next connection, and in the
+  * session file for its next run
+  */
+ static int keep_session(SSL *ssl, SSL_SESSION *session) {
+     (void)ssl;
+
+     pthread_mutex_lock(&client_session_lock);
+     if (client_session != NULL) {
+         SSL_SESSION_free(client_session);
+     }
+     client_session = session;
+
+     if (client_session_file != NULL) {
+         char tmp_path[4096];
+         snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", client_session_file);
+         FILE *f = fopen(tmp_path, "we");
+         if (f != NULL) {
+             int ok = PEM_write_SSL_SESSION(f, session) == 1;
+             ok = fclose(f) == 0 && ok;
+             if (!ok || rename(tmp_path, client_session_file) != 0) {
+                 unlink(tmp_path);
+             }
+         }
+     }
+     pthread_mutex_unlock(&client_session_lock);
+
+     // We hold the reference now
+     return 1;
+ }
+
+ static void print_error(const char *what, const char *name) {
+     unsigned long error = ERR_get_error();
+     const char *reason = (error != 0) ? ERR_reason_error_string(error) : NULL;
+
+     fprintf(stderr, "%s%s%s: %s\n", what, (name != NULL) ? " " : "", (name != NULL) ? name : "",
+             (reason != NULL) ? reason : strerror(errno));
+ }
+
+ #else
+
+ int tls_server_init(const char *cert_file, const char *key_file, int tls_only) {
+     (void)key_file, (void)tls_only;
+     fprintf(stderr, "Cannot use TLS certificate %s: Built without OpenSSL\n", cert_file);
+     return -1;
+ }
+
+ int tls_server_enabled(void) {
+     return 0;
+ }
+
+ int tls_server_required(void) {
+     return 0;
+ }
+
+ tls_t *tls_accept(int fd) {
+     (void)fd;
+     return NULL;
+ }
+
+ int tls_handshake(tls_t *tls) {
+     (void)tls;
+     return TLS_FAILED;
+ }
+
+ ssize_t tls_read(tls_t *tls, void *buf, size_t len) {
+     (void)tls, (void)buf, (void)len;
+     errno = ENOSYS;
+     return -1;
+ }
+
+ ssize_t tls_peek(tls_t *tls, void *buf, size_t len) {
+     return tls_read(tls, buf, len);
+ }
+
+ ssize_t tls_write(tls_t *tls, const void *buf, size_t len) {
+     (void)tls, (void)buf, (void)len;
+     errno = ENOSYS;
+     return -1;
+ }
+
+ ssize_t tls_sendfile(tls_t *tls, int file_fd, off_t offset, size_t len) {
+     (void)tls, (void)file_fd, (void)offset, (void)len;
+     errno = EINVAL;
+     return -1;
+ }
+
+ int tls_can_splice(tls_t *tls) {
+     (void)tls;
+     return 0;
+ }
+
+ int tls_pending(tls_t *tls) {
+     (void)tls;
+     return 0;
+ }
+
+ int tls_wants_write(const tls_t *tls) {
+     (void)tls;
+     return 0;
+ }
+
+ const char *tls_describe(tls_t *tls, char *buf, size_t size) {
+     (void)tls;
+     snprintf(buf, size, "none");
+     return buf;
+ }
+
+ void tls_free(tls_t *tls) {
+     (void)tls;
+ }
+
+ int tls_client_init(const char *ca_file, const char *session_file) {
+     (void)ca_file, (void)session_file;
+     fprintf(stderr, "Cannot use TLS: Built without OpenSSL\n");
+     return -1;
+ }
+
+ int tls_client_enabled(void) {
+     return 0;
+ }
+
+ int tls_connect(int sock, const char *host) {
+     (void)sock, (void)host;
+     return -1;
+ }
+
+ tls_t *tls_get(int sock) {
+     (void)sock;
+     return NULL;
+ }
+
+ ssize_t tls_send(int sock, const void *buf, size_t len) {
+     return send(sock, buf, len, MSG_NOSIGNAL);
+ }
+
+ ssize_t tls_recv(int sock, void *buf, size_t len) {
+     return recv(sock, buf, len, 0);
+ }
+
+ ssize_t tls_send_file(int sock, int file_fd, off_t *offset, size_t len) {
+     return sendfile(sock, file_fd, offset, len);
+ }
+
+ void tls_close(int sock) {
+     close(sock);
+ }
+
+ #endif
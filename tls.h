@@ -0,0 +1,61 @@
+/**
+ * TLS Transport for the File Transfer System
+ *
+ * Wraps connections in TLS with OpenSSL. The server detects a TLS client
+ * by its first byte and runs the handshake inside the session's state
+ * machine; afterwards the session reads and writes through tls_read() and
+ * tls_write(), which behave like recv() and send() on a non-blocking
+ * socket. The client's sockets are blocking and are looked up by
+ * descriptor, so the framing helpers in protocol.c work unchanged.
+ *
+ * Session tickets let a reconnecting client skip the full handshake; the
+ * client keeps the latest one in memory for its other connections, and
+ * optionally in a file for its next run. Where the kernel supports it,
+ * the record layer is handed to the kernel (kTLS), so sendfile() and
+ * splice() keep working on encrypted connections.
+ *
+ * Built without OpenSSL (no HAVE_OPENSSL), every connection is plain TCP.
+ */
+
+ #ifndef TLS_H
+ #define TLS_H
+
+ #include <sys/types.h>
+
+ #define TLS_RECORD_BYTE 0x16         // A ClientHello starts with a handshake record
+ #define TLS_MAX_FDS 1024             // Client descriptors that can carry TLS
+
+ // Outcomes of tls_handshake()
+ #define TLS_DONE 0
+ #define TLS_AGAIN 1                  // Wait for the socket; tls_wants_write() says which way
+ #define TLS_FAILED -1
+
+ typedef struct tls tls_t;
+
+ // Server side
+ int tls_server_init(const char *cert_file, const char *key_file, int tls_only);
+ int tls_server_enabled(void);
+ int tls_server_required(void);
+ tls_t *tls_accept(int fd);
+ int tls_handshake(tls_t *tls);
+ ssize_t tls_read(tls_t *tls, void *buf, size_t len);
+ ssize_t tls_peek(tls_t *tls, void *buf, size_t len);
+ ssize_t tls_write(tls_t *tls, const void *buf, size_t len);
+ ssize_t tls_sendfile(tls_t *tls, int file_fd, off_t offset, size_t len);
+ int tls_can_splice(tls_t *tls);
+ int tls_pending(tls_t *tls);
+ int tls_wants_write(const tls_t *tls);
+ const char *tls_describe(tls_t *tls, char *buf, size_t size);
+ void tls_free(tls_t *tls);
+
+ // Client side, by socket descriptor; plain sockets pass straight through
+ int tls_client_init(const char *ca_file, const char *session_file);
+ int tls_client_enabled(void);
+ int tls_connect(int sock, const char *host);
+ tls_t *tls_get(int sock);
+ ssize_t tls_send(int sock, const void *buf, size_t len);
+ ssize_t tls_recv(int sock, void *buf, size_t len);
+ ssize_t tls_send_file(int sock, int file_fd, off_t *offset, size_t len);
+ void tls_close(int sock);
+
+ #endif
@@ -0,0 +1,357 @@
+/**
+ * Graceful Upgrades for the File Transfer Server
+ *
+ * The conversation on the upgrade socket:
+ *
+ *     new -> old  'U'                  take over, please
+ *     old -> new  'L' + descriptors    the index channel, then every listener
+ *     new -> old  'R'                  ready; stop accepting and drain
+ *
+ * The old process hands its index over before it sends the descriptors,
+ * so the new one finds the files settled when it loads them. If the new
+ * process goes away before 'R', the old one takes the index back and
+ * carries on as if nothing had happened. After 'R' the new process binds
+ * the upgrade socket itself, ready for the next upgrade.
+ */
+
+ #define _GNU_SOURCE              // accept4()
+
+ #include <stdio.h>
+ #include <stdlib.h>
+ #include <string.h>
+ #include <unistd.h>
+ #include <errno.h>
+ #include <pthread.h>
+ #include <stdatomic.h>
+ #include <sys/socket.h>
+ #include <sys/stat.h>
+ #include <sys/un.h>
+
+ #include "upgrade.h"
+ #include "index.h"
+ #include "session.h"
+ #include "pool.h"
+ #include "log.h"
+
+ #define MSG_TAKEOVER 'U'
+ #define MSG_LISTENERS 'L'
+ #define MSG_READY 'R'
+
+ static pthread_mutex_t listeners_lock = PTHREAD_MUTEX_INITIALIZER;
+ static int listeners[UPGRADE_MAX_FDS - 1];  // Open listeners of this process
+ static int num_listeners;
+
+ // Handed over by the process being replaced
+ static int inherited[UPGRADE_MAX_FDS - 1];
+ static int num_inherited;
+ static int next_inherited;
+ static int index_channel = -1;
+ static int control_fd = -1;
+
+ static int control_listen_fd = -1;
+ static atomic_int draining;
+ static atomic_int drain_timeout = UPGRADE_DRAIN_TIMEOUT;
+
+ static int unix_address(const char *path, struct sockaddr_un *address);
+ static void *upgrade_thread(void *arg);
+ static int hand_over(int fd);
+ static void drain(void);
+
+ /**
+  * Takes the listeners and index over from a server on the upgrade socket
+  *
+  * Returns 0 with nothing taken when no server is listening there, so a
+  * first start works the same way. Must be called before index_init().
+  */
+ int upgrade_takeover(const char *path) {
+     struct sockaddr_un address;
+     if (unix_address(path, &address) != 0) {
+         return -1;
+     }
+
+     int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+     if (fd < 0) {
+         perror("Upgrade socket failed");
+         return -1;
+     }
+     if (connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+         close(fd);
+         if (errno == ENOENT || errno == ECONNREFUSED) {
+             return 0;
+         }
+         fprintf(stderr, "Cannot reach the server on %s: %s\n", path, strerror(errno));
+         return -1;
+     }
+
+     char msg = MSG_TAKEOVER;
+     union {
+         struct cmsghdr header;
+         char space[CMSG_SPACE(UPGRADE_MAX_FDS * sizeof(int))];
+     } control;
+     struct iovec iov = { .iov_base = &msg, .iov_len = 1 };
+     struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.space,
+                          .msg_controllen = sizeof(control.space) };
+
+     if (send(fd, &msg, 1, MSG_NOSIGNAL) != 1 || recvmsg(fd, &mh, MSG_CMSG_CLOEXEC) != 1 || msg != MSG_LISTENERS) {
+         fprintf(stderr, "Server on %s did not hand over its listeners\n", path);
+         close(fd);
+         return -1;
+     }
+
+     struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+     if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+         fprintf(stderr, "Server on %s sent no descriptors\n", path);
+         close(fd);
+         return -1;
+     }
+
+     int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+     int fds[UPGRADE_MAX_FDS];
+     memcpy(fds, CMSG_DATA(cmsg), count * sizeof(int));
+
+     index_channel = (count > 0) ? fds[0] : -1;
+     for (int i = 1; i < count; i++) {
+         inherited[num_inherited++] = fds[i];
+     }
+     control_fd = fd;
+
+     printf("Took over %d listener%s from the server on %s\n", num_inherited, (num_inherited == 1) ? "" : "s",
+            path);
+     return 0;
+ }
+
+ /**
+  * Finishes a takeover and listens for the next upgrade on path
+  *
+  * wanted is how many of the inherited listeners the engine will use;
+  * the rest are closed. Call just before the engine starts accepting.
+  */
+ int upgrade_start(const char *path, int wanted) {
+     if (control_fd >= 0) {
+         if (index_channel >= 0 && index_follow(index_channel) != 0) {
+             return -1;
+         }
+         index_channel = -1;
+
+         if (num_inherited > wanted) {
+             log_event(LOG_LEVEL_WARN, "Surplus listeners closed", "inherited=%d used=%d", num_inherited, wanted);
+             while (num_inherited > wanted) {
+                 close(inherited[--num_inherited]);
+             }
+         }
+
+         // The old server starts draining on this
+         char msg = MSG_READY;
+         if (send(control_fd, &msg, 1, MSG_NOSIGNAL) != 1) {
+             log_event(LOG_LEVEL_WARN, "Old server gone before the handover finished", "error=%s", strerror(errno));
+         }
+         close(control_fd);
+         control_fd = -1;
+     }
+
+     struct sockaddr_un address;
+     if (unix_address(path, &address) != 0) {
+         return -1;
+     }
+
+     unlink(path);
+     control_listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+     if (control_listen_fd < 0 || bind(control_listen_fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+         perror("Upgrade socket failed");
+         return -1;
+     }
+
+     // Whoever connects gets the listeners
+     chmod(path, 0600);
+
+     pthread_t thread_id;
+     if (listen(control_listen_fd, 1) != 0 || pthread_create(&thread_id, NULL, upgrade_thread, NULL) != 0) {
+         perror("Upgrade listener failed");
+         return -1;
+     }
+     pthread_detach(thread_id);
+     return 0;
+ }
+
+ /**
+  * Takes the next inherited listener; -1 if there are none left
+  */
+ int upgrade_listener(void) {
+     return (next_inherited < num_inherited) ? inherited[next_inherited++] : -1;
+ }
+
+ /**
+  * Notes a listener to hand over in an upgrade
+  */
+ void upgrade_register(int fd) {
+     pthread_mutex_lock(&listeners_lock);
+     if (num_listeners < UPGRADE_MAX_FDS - 1) {
+         listeners[num_listeners++] = fd;
+     }
+     pthread_mutex_unlock(&listeners_lock);
+ }
+
+ /**
+  * Closes a listener once an engine stops accepting on it
+  */
+ void upgrade_release(int fd) {
+     pthread_mutex_lock(&listeners_lock);
+     for (int i = 0; i < num_listeners; i++) {
+         if (listeners[i] == fd) {
+             listeners[i] = listeners[--num_listeners];
+             break;
+         }
+     }
+     close(fd);
+     pthread_mutex_unlock(&listeners_lock);
+ }
+
+ /**
+  * Whether engines should stop accepting and release their listeners
+  */
+ int upgrade_draining(void) {
+     return atomic_load_explicit(&draining, memory_order_relaxed);
+ }
+
+ /**
+  * Parks an engine's accepting thread until the drain ends the process
+  */
+ void upgrade_wait(void) {
+     while (1) {
+         pause();
+     }
+ }
+
+ /**
+  * Sets how long a draining process waits for its connections to finish
+  */
+ void upgrade_set_drain_timeout(int seconds) {
+     atomic_store(&drain_timeout, seconds);
+ }
+
+ static int unix_address(const char *path, struct sockaddr_un *address) {
+     memset(address, 0, sizeof(*address));
+     address->sun_family = AF_UNIX;
+     if (strlen(path) >= sizeof(address->sun_path)) {
+         fprintf(stderr, "Upgrade socket path too long: %s\n", path);
+         return -1;
+     }
+     strcpy(address->sun_path, path);
+     return 0;
+ }
+
+ /**
+  * Waits for a successor; once one has taken over, drains and exits
+  */
+ static void *upgrade_thread(void *arg) {
+     (void)arg;
+
+     while (1) {
+         int fd = accept4(control_listen_fd, NULL, NULL, SOCK_CLOEXEC);
+         if (fd < 0) {
+             if (errno != EINTR && errno != ECONNABORTED) {
+                 log_event(LOG_LEVEL_ERROR, "Upgrade accept failed", "error=%s", strerror(errno));
+                 sleep(1);
+             }
+             continue;
+         }
+
+         if (hand_over(fd) == 0) {
+             drain();
+         }
+         close(fd);
+     }
+
+     return NULL;
+ }
+
+ /**
+  * Gives a successor the index and listeners; returns 0 once it is ready,
+  * or -1 with everything taken back
+  */
+ static int hand_over(int fd) {
+     char msg;
+     if (recv(fd, &msg, 1, 0) != 1 || msg != MSG_TAKEOVER) {
+         return -1;
+     }
+
+     int channel[2];
+     if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, channel) != 0) {
+         log_event(LOG_LEVEL_ERROR, "Upgrade refused", "error=%s", strerror(errno));
+         return -1;
+     }
+     index_forward(channel[0]);
+
+     union {
+         struct cmsghdr header;
+         char space[CMSG_SPACE(UPGRADE_MAX_FDS * sizeof(int))];
+     } control;
+     memset(&control, 0, sizeof(control));
+
+     pthread_mutex_lock(&listeners_lock);
+     int count = num_listeners + 1;
+     struct cmsghdr *cmsg = &control.header;
+     cmsg->cmsg_level = SOL_SOCKET;
+     cmsg->cmsg_type = SCM_RIGHTS;
+     cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+     int *fds = (int *)CMSG_DATA(cmsg);
+     fds[0] = channel[1];
+     memcpy(fds + 1, listeners, num_listeners * sizeof(int));
+     pthread_mutex_unlock(&listeners_lock);
+
+     msg = MSG_LISTENERS;
+     struct iovec iov = { .iov_base = &msg, .iov_len = 1 };
+     struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.space,
+                          .msg_controllen = CMSG_SPACE(count * sizeof(int)) };
+     int sent = sendmsg(fd, &mh, MSG_NOSIGNAL) == 1;
+     close(channel[1]);
+
+     if (sent) {
+         log_event(LOG_LEVEL_INFO, "Listeners handed over", "listeners=%d", count - 1);
+     }
+     if (!sent || recv(fd, &msg, 1, 0) != 1 || msg != MSG_READY) {
+         log_event(LOG_LEVEL_WARN, "Upgrade abandoned", "serving=on");
+         index_forward(-1);
+         close(channel[0]);
+         return -1;
+     }
+
+     atomic_store(&draining, 1);
+     return 0;
+ }
+
+ /**
+  * Waits for the engines to let go of their listeners and for every
+  * connection to finish, then exits
+  *
+  * A connection accepted just before its listener closed may not have
+  * been set up yet, so the process must look idle twice in a row.
+  */
+ static void drain(void) {
+     int timeout = atomic_load(&drain_timeout);
+     uint64_t deadline = monotonic_ms() + (uint64_t)timeout * 1000;
+     int idle = 0;
+
+     log_event(LOG_LEVEL_INFO, "Draining for upgrade", "connections=%d timeout=%d", conn_active(), timeout);
+
+     while (idle < 2) {
+         usleep(UPGRADE_POLL_MS * 1000);
+
+         pool_stats_t stats;
+         pool_get_stats(&stats);
+         pthread_mutex_lock(&listeners_lock);
+         int open = num_listeners;
+         pthread_mutex_unlock(&listeners_lock);
+         idle = (open == 0 && conn_active() == 0 && stats.depth == 0) ? idle + 1 : 0;
+
+         if (monotonic_ms() >= deadline) {
+             log_event(LOG_LEVEL_WARN, "Drain timed out", "connections=%d", conn_active());
+             break;
+         }
+     }
+
+     // Changes made while draining must reach the new process before this one goes
+     index_flush();
+     log_event(LOG_LEVEL_INFO, "Drained, exiting", "upgrade=done");
+     exit(0);
+ }
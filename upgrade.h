@@ -0,0 +1,33 @@
+/**
+ * Graceful Upgrades for the File Transfer Server
+ *
+ * Started with -U <socket>, the server listens on a Unix socket for its
+ * successor. A new process given the same socket connects at startup and
+ * is handed the listening sockets with SCM_RIGHTS, so no connection is
+ * refused while the binaries change over. Once the new process says it
+ * is ready, the old one stops accepting and serves the connections it
+ * has until they finish, or until the drain timeout, then exits. The
+ * index files change hands at the same time (see index.c).
+ *
+ * A new process started with a different engine or reactor count uses
+ * as many of the sockets as it needs; connections still queued on the
+ * others are dropped.
+ */
+
+ #ifndef UPGRADE_H
+ #define UPGRADE_H
+
+ #define UPGRADE_MAX_FDS 256          // Sockets handed over at once, the index channel included
+ #define UPGRADE_DRAIN_TIMEOUT 300    // Default seconds an old process waits for its connections
+ #define UPGRADE_POLL_MS 100          // How often a draining process checks whether it is done
+
+ int upgrade_takeover(const char *path);
+ int upgrade_start(const char *path, int wanted);
+ int upgrade_listener(void);
+ void upgrade_register(int fd);
+ void upgrade_release(int fd);
+ int upgrade_draining(void);
+ void upgrade_wait(void);
+ void upgrade_set_drain_timeout(int seconds);
+
+ #endif
@@ -0,0 +1,30 @@
+/**
+ * XXH64 Content Hash for the File Transfer System
+ *
+ * A fast non-cryptographic 64-bit hash, used to recognise file contents
+ * the server already holds and to check uploads end to end. Shared by the
+ * client and the server, and computed incrementally so a file can be
+ * hashed while it streams.
+ */
+
+ #ifndef XXHASH_H
+ #define XXHASH_H
+
+ #include <stdint.h>
+ #include <stddef.h>
+
+ // Running hash state
+ typedef struct {
+     uint64_t total_len;
+     uint64_t v[4];
+     uint8_t mem[32];             // Input not yet making up a full stripe
+     uint32_t memsize;
+     uint64_t seed;
+ } xxh64_state_t;
+
+ void xxh64_init(xxh64_state_t *state, uint64_t seed);
+ void xxh64_update(xxh64_state_t *state, const void *data, size_t len);
+ uint64_t xxh64_digest(const xxh64_state_t *state);
+ uint64_t xxh64(const void *data, size_t len, uint64_t seed);
+
+ #endif